@@ -19,85 +19,540 @@
  */
 
 #include "mod_random.h"
+#include "http_core.h"
 #include "http_log.h"
 #include "http_protocol.h"
 #include "http_request.h"
+#include "mod_status.h"
+#include "ap_expr.h"
+#include "apr_atomic.h"
+#include "apr_hash.h"
 
 /* Forward declaration */
 extern module AP_MODULE_DECLARE_DATA random_module;
 
-/* Request hook - generate and inject random tokens */
-static int random_fixups(request_rec *r)
+/* Access hook - verify a signed token presented by the client (RandomValidateToken) */
+static int random_access_checker(request_rec *r)
 {
     random_config *cfg;
-    char *final_token;
-    int final_length;
-    random_format_t final_format;
-    int final_include_timestamp;
-    int final_ttl;
-    random_token_spec *spec;
+    random_verify_result_t result;
+    random_mac_alg_t alg;
+    const char *prefix, *suffix;
+    int min_mac_len;
 
     if (r->main) {
         return DECLINED;
     }
 
     cfg = ap_get_module_config(r->per_dir_config, &random_module);
-    if (!cfg) {
+    if (!cfg || cfg->validate != 1) {
         return DECLINED;
     }
 
+    /* Header value is parsed in place; the result name is a static string */
+    alg = (cfg->signing_alg != RANDOM_MAC_ALG_UNSET) ? (random_mac_alg_t)cfg->signing_alg
+                                                     : RANDOM_MAC_HMAC_SHA256;
+    min_mac_len = (cfg->metadata_mac_length > 0) ? cfg->metadata_mac_length
+                                                 : RANDOM_COMPACT_MAC_DEFAULT;
+    prefix = cfg->validate_prefix ? cfg->validate_prefix : cfg->prefix;
+    suffix = cfg->validate_suffix ? cfg->validate_suffix : cfg->suffix;
+    if (cfg->keyring) {
+        result = random_token_verify_keyring(cfg->keyring, alg,
+                                             apr_table_get(r->headers_in, cfg->validate_header),
+                                             prefix, suffix, min_mac_len, r->request_time);
+    } else {
+        result = random_token_verify(cfg->hmac_key, alg,
+                                     apr_table_get(r->headers_in, cfg->validate_header),
+                                     prefix, suffix, min_mac_len, r->request_time);
+    }
+    apr_table_setn(r->subprocess_env, cfg->validate_var, random_verify_result_name(result));
+
+    if (result != RANDOM_VERIFY_VALID && cfg->validate_enforce) {
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r,
+                     "mod_random: Rejecting request with %s token in %s",
+                     random_verify_result_name(result), cfg->validate_header);
+        return HTTP_FORBIDDEN;
+    }
+
+    return DECLINED;
+}
+
+/* Per-dir config that generates tokens for r, or NULL */
+static random_config *random_request_config(request_rec *r)
+{
+    random_server_config *scfg;
+    random_config *cfg;
+
+    if (r->main) {
+        return NULL;
+    }
+
+    /* No RandomAddToken anywhere in this server: skip the per-dir config */
+    scfg = ap_get_module_config(r->server->module_config, &random_module);
+    if (!apr_atomic_read32(&scfg->has_tokens)) {
+        return NULL;
+    }
+
+    cfg = ap_get_module_config(r->per_dir_config, &random_module);
+    if (!cfg) {
+        return NULL;
+    }
+
     /* No tokens configured - nothing to do */
-    if (!cfg->token_specs) {
+    if (!cfg->token_specs || cfg->token_specs->nelts == 0) {
+        return NULL;
+    }
+
+    /* Check URL patterns if configured: literals with memcmp, then one regex */
+    if (cfg->url_pattern && !random_url_matcher_literals(cfg->url_pattern, r->uri)) {
+        if (!cfg->url_pattern->regex ||
+            ap_regexec(cfg->url_pattern->regex, r->uri, 0, NULL, 0) != 0) {
+            return NULL;  /* Pattern doesn't match */
+        }
+    }
+
+    /* Every config reaching a request was compiled by merge or check_config */
+    return cfg;
+}
+
+/* Set a generated token in the tables its output= names
+ * Tokens live in r->pool (or the origin request's, for redirects) and the
+ * names in the config pool, so neither is copied again */
+static void random_emit_token(request_rec *r, const random_token_plan *plan, const char *token)
+{
+    if (plan->output & RANDOM_OUTPUT_ENV) {
+        apr_table_setn(r->subprocess_env, plan->var_name, token);
+    }
+    if (plan->output & RANDOM_OUTPUT_HEADER) {
+        apr_table_setn(r->headers_out, plan->header_name, token);
+    }
+}
+
+/* Read-request hook - RandomEarlyTokens: emit the server's header tokens right away */
+static int random_post_read_request(request_rec *r)
+{
+    random_server_config *scfg = ap_get_module_config(r->server->module_config, &random_module);
+    random_config *cfg;
+    random_request_state *state;
+    char *tokens[RANDOM_MAX_TOKENS];
+    int i;
+
+    if (scfg->early_tokens != 1) {
         return DECLINED;
     }
 
-    /* Apply defaults for token generation */
-    final_length = (cfg->length != RANDOM_LENGTH_UNSET) ? cfg->length : RANDOM_LENGTH_DEFAULT;
-    final_format = (cfg->format != RANDOM_FORMAT_UNSET) ? cfg->format : RANDOM_FORMAT_BASE64;
-    final_include_timestamp = (cfg->include_timestamp != RANDOM_ENABLED_UNSET) ? cfg->include_timestamp : 0;
-    final_ttl = (cfg->ttl_seconds != RANDOM_TTL_UNSET) ? cfg->ttl_seconds : 0;
+    /* Per-dir config is still the server's: <Location> and friends do not apply */
+    cfg = random_request_config(r);
+    if (!cfg || cfg->header_count == 0) {
+        return DECLINED;
+    }
 
-    /* Check URL pattern if configured */
-    if (cfg->url_pattern) {
-        if (ap_regexec(cfg->url_pattern, r->uri, 0, NULL, 0) != 0) {
-            return DECLINED;  /* Pattern doesn't match */
+    random_generate_tokens(r, cfg->plans, cfg->header_count, tokens);
+    for (i = 0; i < cfg->header_count; i++) {
+        if (!tokens[i]) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                         "mod_random: Failed to generate token for %s - skipping",
+                         cfg->plans[i].var_name);
+            continue;
         }
+        random_emit_token(r, &cfg->plans[i], tokens[i]);
     }
 
-    /* Generate all configured tokens */
-    for (spec = cfg->token_specs; spec; spec = spec->next) {
-        final_token = random_generate_token_from_spec(r, cfg, spec,
-                                                      final_length, final_format,
-                                                      final_include_timestamp,
-                                                      cfg->prefix, cfg->suffix,
-                                                      final_ttl,
-                                                      &spec->cached_token, &spec->cache_time,
-                                                      spec->cache_mutex, spec->pool);
+    /* Merged per-dir configs list the server's specs first: fixups skips them */
+    state = random_request_state_get(r, 1);
+    state->early_cfg = cfg;
+    state->early_count = cfg->header_count;
+
+    return DECLINED;
+}
+
+/* Per-dir hook - set up on-demand tokens before anything can reference them */
+static int random_post_perdir_config(request_rec *r)
+{
+    random_config *cfg = random_request_config(r);
+    random_request_state *state;
+    apr_table_t *memo;
+    int i, redirected;
+
+    if (cfg && cfg->eager_count < cfg->plan_count) {
+        state = random_lazy_start(r, cfg);
+
+        /* Expressions must see the values RandomEarlyTokens already sent,
+         * output=header ones included: take them from the memo, not the env */
+        memo = state->early_cfg ? random_request_memo(r, &redirected) : NULL;
+        for (i = 0; memo && i < state->early_count && i < cfg->plan_count; i++) {
+            if (cfg->plans[i].var_name == state->early_cfg->plans[i].var_name) {
+                state->tried[i] = 1;
+                state->tokens[i] = (char *)apr_table_get(memo, cfg->plans[i].var_name);
+            }
+        }
+    }
+    return OK;
+}
+
+/* Request hook - generate and inject random tokens */
+static int random_fixups(request_rec *r)
+{
+    random_config *cfg;
+    random_request_state *state;
+    char *tokens[RANDOM_MAX_TOKENS];  /* plan_count is capped by RandomAddToken and merges */
+    int i, first = 0;
+
+    cfg = random_request_config(r);
+    if (!cfg || cfg->eager_count == 0) {
+        return DECLINED;  /* Lazy tokens wait for their first reference */
+    }
+
+    /* Skip the header tokens RandomEarlyTokens already emitted */
+    state = random_request_state_get(r, 0);
+    if (state && state->early_cfg) {
+        while (first < state->early_count && first < cfg->eager_count &&
+               cfg->plans[first].var_name == state->early_cfg->plans[first].var_name) {
+            first++;
+        }
+    }
+    if (first == cfg->eager_count) {
+        return DECLINED;
+    }
+
+    /* Generate all remaining eager tokens from one random fill */
+    random_generate_tokens(r, cfg->plans + first, cfg->eager_count - first, tokens + first);
+    if (state && !state->cfg) {
+        state = NULL;   /* Not lazy: nothing to memoise */
+    }
+
+    for (i = first; i < cfg->eager_count; i++) {
+        const random_token_plan *plan = &cfg->plans[i];
+
+        /* An expression evaluated before fixups already chose this token */
+        if (state) {
+            if (state->tried[i]) {
+                tokens[i] = state->tokens[i];
+            } else {
+                state->tried[i] = 1;
+                state->tokens[i] = tokens[i];
+            }
+        }
 
         /* Check if token generation failed (CSPRNG error) */
-        if (!final_token) {
+        if (!tokens[i]) {
             ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
                          "mod_random: Failed to generate token for %s - skipping",
-                         spec->var_name);
-            continue; /* Skip this token but try to generate others */
+                         plan->var_name);
+            continue; /* Cached tokens are still emitted */
+        }
+
+        random_emit_token(r, plan, tokens[i]);
+    }
+
+    return DECLINED;
+}
+
+/* Handler hook - give env-reading handlers (RandomLazyTokens On cgi-script ...) every token */
+static int random_lazy_handler(request_rec *r)
+{
+    random_request_state *state;
+
+    if (r->main || !r->handler) {
+        return DECLINED;
+    }
+
+    state = random_lazy_state(r);
+    if (state && random_lazy_handler_wants_env(state->cfg, r->handler)) {
+        random_lazy_export(r, state);
+    }
+    return DECLINED;
+}
+
+/* %{random:NAME} / random('NAME') - token value, generated on first use */
+static const char *random_expr_func(ap_expr_eval_ctx_t *ctx, const void *data, const char *arg)
+{
+    if (!ctx->r || !arg) {
+        return "";
+    }
+    return random_lazy_token(ctx->r, arg);
+}
+
+/* Expression hook - provide the "random" string function */
+static int random_expr_lookup(ap_expr_lookup_parms *parms)
+{
+    if (parms->type == AP_EXPR_FUNC_STRING && strcasecmp(parms->name, "random") == 0) {
+        *parms->func = random_expr_func;
+        *parms->data = NULL;
+        return OK;
+    }
+    return DECLINED;
+}
+
+/* Pre-config hook - reset process-wide settings before (re)reading the config */
+static int random_pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp)
+{
+    random_entropy_set_buffer_size(0);
+    random_merge_set_compile(0);
+    random_cache_registry_reset(pconf);
+    random_spec_registry_reset(pconf);
+    random_prefill_registry_reset(pconf);
+    random_stats_registry_reset(pconf);
+    random_keyring_registry_reset(pconf);
+    random_alloc_trace_set_sample(0);
+    return OK;
+}
+
+/* Log one context's fallbacks (those not already logged for its server's
+ * base config) and its fatal error; section is NULL for the base config */
+static int random_report_context(server_rec *s, const char *section, const random_config *cfg,
+                                 apr_array_header_t *warnings, apr_hash_t *reported)
+{
+    const char *error = random_config_check(cfg, warnings);
+    int i;
+
+    for (i = 0; i < warnings->nelts; i++) {
+        const char *warning = APR_ARRAY_IDX(warnings, i, const char *);
+
+        if (apr_hash_get(reported, warning, APR_HASH_KEY_STRING)) {
+            continue;   /* Inherited from the base config, which said it already */
         }
+        if (section) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "mod_random: %s: %s", section, warning);
+        } else {
+            apr_hash_set(reported, warning, APR_HASH_KEY_STRING, warning);
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "mod_random: %s", warning);
+        }
+    }
+    apr_array_clear(warnings);
 
-        /* Set environment variable */
-        apr_table_set(r->subprocess_env, spec->var_name, final_token);
+    if (error) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, 0, s, "mod_random: %s%s%s",
+                     section ? section : "", section ? ": " : "", error);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    return OK;
+}
 
-        /* Set HTTP header if configured */
-        if (spec->header_name) {
-            apr_table_set(r->headers_out, spec->header_name, final_token);
+/**
+ * Check-config hook - compile the base configs and report every fallback once
+ *
+ * Base server configs are compiled here, once each: the main server's is
+ * never merged, and virtual host merges made while reading the config
+ * leave compiling to this hook (random_merge_set_compile()). Each
+ * <Directory> and <Location> section is then merged over its server's base
+ * config in ptemp and compiled with a warnings array, so the fallbacks that
+ * request-time merges apply silently are reported at startup instead; the
+ * request path never logs a configuration problem. Nested sections and
+ * .htaccess files are merged in other orders at request time and are not
+ * covered.
+ *
+ * @return OK, or an error when a context cannot work (startup fails)
+ */
+static int random_check_config(apr_pool_t *pconf, apr_pool_t *plog,
+                               apr_pool_t *ptemp, server_rec *s)
+{
+    apr_array_header_t *warnings = apr_array_make(ptemp, 4, sizeof(const char *));
+    apr_hash_t *sections_seen = apr_hash_make(ptemp);
+    server_rec *vs;
+    int status = OK;
+
+    for (vs = s; vs; vs = vs->next) {
+        random_config *base = ap_get_module_config(vs->lookup_defaults, &random_module);
+        core_server_config *core = ap_get_core_module_config(vs->module_config);
+        apr_array_header_t *sections[2];
+        apr_hash_t *reported = apr_hash_make(ptemp);
+        random_config **key;
+        int i, j;
+
+        /* A virtual host without mod_random directives shares the main
+         * server's base config, compiled and reported already */
+        if (!base || apr_hash_get(sections_seen, &base, sizeof(base))) {
+            continue;
+        }
+        key = apr_palloc(ptemp, sizeof(*key));
+        *key = base;
+        apr_hash_set(sections_seen, key, sizeof(*key), key);
+
+        random_plan_compile(pconf, base, warnings);
+        if (random_report_context(vs, NULL, base, warnings, reported) != OK) {
+            status = HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        sections[0] = core->sec_dir;
+        sections[1] = core->sec_url;
+        for (i = 0; i < 2; i++) {
+            for (j = 0; sections[i] && j < sections[i]->nelts; j++) {
+                ap_conf_vector_t *section = APR_ARRAY_IDX(sections[i], j, ap_conf_vector_t *);
+                random_config *own = ap_get_module_config(section, &random_module);
+                core_dir_config *dconf = ap_get_core_module_config(section);
+                random_config *merged;
+                const char *name;
+
+                /* Virtual hosts list the main server's sections again */
+                if (!own || apr_hash_get(sections_seen, &own, sizeof(own))) {
+                    continue;
+                }
+                key = apr_palloc(ptemp, sizeof(*key));
+                *key = own;
+                apr_hash_set(sections_seen, key, sizeof(*key), key);
+
+                name = apr_psprintf(ptemp, "<%s %s>", i ? "Location" : "Directory",
+                                    dconf->d ? dconf->d : "");
+                merged = random_config_merge(ptemp, base, own);
+                if (merged == base) {
+                    continue;   /* No mod_random directives: the base config itself */
+                }
+                if (own->token_specs && base->token_specs &&
+                    own->token_specs->nelts + base->token_specs->nelts > RANDOM_MAX_TOKENS) {
+                    APR_ARRAY_PUSH(warnings, const char *) =
+                        apr_psprintf(ptemp, "more than %d tokens with the server's, "
+                                     "the last %d are ignored", RANDOM_MAX_TOKENS,
+                                     own->token_specs->nelts + base->token_specs->nelts -
+                                     RANDOM_MAX_TOKENS);
+                }
+                random_plan_compile(ptemp, merged, warnings);
+                if (random_report_context(vs, name, merged, warnings, reported) != OK) {
+                    status = HTTP_INTERNAL_SERVER_ERROR;
+                }
+            }
         }
     }
 
+    /* Request-time merges (sections, .htaccess) compile their result */
+    random_merge_set_compile(1);
+    return status;
+}
+
+/* Post-config hook - set up shared state before children are forked */
+static int random_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+                              apr_pool_t *ptemp, server_rec *s)
+{
+    apr_status_t rv;
+    int slots = 0;
+    server_rec *vs;
+    random_server_config *main_scfg;
+
+    /* prefill= rings are per child; later (.htaccess) specs generate inline */
+    random_prefill_registry_close();
+    random_spec_registry_close();
+
+    /* Virtual hosts inherit the main server's <Location> tokens and RandomEarlyTokens */
+    main_scfg = ap_get_module_config(s->module_config, &random_module);
+    for (vs = s->next; vs; vs = vs->next) {
+        random_server_config *scfg = ap_get_module_config(vs->module_config, &random_module);
+
+        if (main_scfg->has_tokens) {
+            scfg->has_tokens = 1;
+        }
+        if (scfg->early_tokens == RANDOM_ENABLED_UNSET) {
+            scfg->early_tokens = main_scfg->early_tokens;
+        }
+    }
+
+    /* Statistics rows are labelled with the virtual host defining the token */
+    for (vs = s; vs; vs = vs->next) {
+        random_stats_label(vs, vs->server_hostname);
+    }
+    rv = random_stats_shm_init(pconf, &slots);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "mod_random: Cannot create shared memory for RandomStatistics - statistics disabled");
+    } else if (slots > 0) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                     "mod_random: Statistics table ready (%d slots)", slots);
+    }
+
+    rv = random_cache_shm_init(pconf, &slots);
+    if (rv != APR_SUCCESS) {
+        /* Not fatal: every child keeps its own TTL cache, as with 'local' */
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "mod_random: Cannot create shared memory for RandomCacheBackend shm - "
+                     "falling back to per-process TTL caches");
+    } else if (slots > 0) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                     "mod_random: Shared TTL cache ready (%d slots)", slots);
+    }
+
+    return OK;
+}
+
+/* Key file watcher callback (watcher thread): log reloads and rejected files */
+static void random_keyring_notify(void *data, const char *path, int keys, const char *error)
+{
+    server_rec *s = data;
+
+    if (error) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     "mod_random: RandomSigningKeyFile %s: %s - keeping the current keys",
+                     path, error);
+    } else {
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s,
+                     "mod_random: Reloaded RandomSigningKeyFile %s (%d keys)", path, keys);
+    }
+}
+
+/* Child init hook - per-thread state must be created in each child */
+static void random_child_init(apr_pool_t *pchild, server_rec *s)
+{
+    apr_status_t rv = random_thread_init(pchild);
+    int rings = 0, keyrings = 0;
+
+    if (rv != APR_SUCCESS && random_entropy_get_buffer_size() > 0) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s,
+                     "mod_random: Cannot create per-thread state - RandomEntropyBuffer disabled");
+    }
+
+    /* After fork, so children never hold the same pre-generated tokens */
+    rv = random_prefill_start(pchild, &rings);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "mod_random: Cannot start the prefill thread - prefill= tokens are generated inline");
+    } else if (rings > 0) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                     "mod_random: Prefill thread started (%d rings)", rings);
+    }
+
+    rv = random_keyring_start(pchild, random_keyring_notify, s, &keyrings);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "mod_random: Cannot start the key file watcher - "
+                     "RandomSigningKeyFile changes need a restart");
+    } else if (keyrings > 0) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                     "mod_random: Watching %d RandomSigningKeyFile(s)", keyrings);
+    }
+}
+
+#ifdef RANDOM_ALLOC_TRACE
+/* Log-transaction hook - RandomAllocTrace: histograms, and one request in N */
+static int random_alloc_trace_log(request_rec *r)
+{
+    random_alloc_trace *trace = random_request_alloc_trace(r);
+
+    if (trace && random_alloc_trace_finish(trace)) {
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "mod_random: Allocations for %s: %s",
+                      r->uri, random_alloc_trace_format(r->pool, trace));
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "mod_random: Allocation histograms: %s",
+                      random_alloc_histograms_format(r->pool));
+    }
     return DECLINED;
 }
+#endif
 
 /* Register hooks */
 static void random_register_hooks(apr_pool_t *p)
 {
+    ap_hook_pre_config(random_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_check_config(random_check_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_post_config(random_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(random_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_post_read_request(random_post_read_request, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_post_perdir_config(random_post_perdir_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_access_checker(random_access_checker, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_fixups(random_fixups, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_handler(random_lazy_handler, NULL, NULL, APR_HOOK_REALLY_FIRST);
+    ap_hook_handler(random_status_handler, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_expr_lookup(random_expr_lookup, NULL, NULL, APR_HOOK_MIDDLE);
+#ifdef RANDOM_ALLOC_TRACE
+    ap_hook_log_transaction(random_alloc_trace_log, NULL, NULL, APR_HOOK_MIDDLE);
+#endif
+    APR_OPTIONAL_HOOK(ap, status_hook, random_status_hook, NULL, NULL, APR_HOOK_MIDDLE);
 }
 
 /* Module declaration */
@@ -105,7 +560,7 @@ module AP_MODULE_DECLARE_DATA random_module = {
     STANDARD20_MODULE_STUFF,
     random_create_config,
     random_merge_config,
-    NULL,
+    random_create_server_config,
     NULL,
     random_directives,
     random_register_hooks
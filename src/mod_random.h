@@ -8,6 +8,7 @@
 #include "httpd.h"
 #include "http_config.h"
 #include "apr_pools.h"
+#include "apr_tables.h"
 #include "mod_random_types.h"
 
 /* Module declaration */
@@ -16,6 +17,10 @@ extern module AP_MODULE_DECLARE_DATA random_module;
 /* Configuration functions (mod_random_config.c) */
 void *random_create_config(apr_pool_t *pool, char *dir);
 void *random_merge_config(apr_pool_t *pool, void *base, void *override);
+random_config *random_config_merge(apr_pool_t *pool, random_config *parent,
+                                   const random_config *child);
+void random_merge_set_compile(int compile);
+void *random_create_server_config(apr_pool_t *pool, server_rec *s);
 extern const command_rec random_directives[];
 
 /* Encoding functions (mod_random_encode.c) */
@@ -26,21 +31,190 @@ char *random_encode_custom_alphabet(apr_pool_t *pool, const unsigned char *data,
 char *random_generate_string_ex(apr_pool_t *pool, int length, random_format_t format,
                                 const char *alphabet, int grouping);
 char *random_generate_string(apr_pool_t *pool, int length, random_format_t format);
+apr_size_t random_encode_hex_into(char *out, const unsigned char *data, int length,
+                                  const random_alphabet *alphabet, int grouping);
+apr_size_t random_encode_base64_into(char *out, const unsigned char *data, int length,
+                                     const random_alphabet *alphabet, int grouping);
+apr_size_t random_encode_base64url_into(char *out, const unsigned char *data, int length,
+                                        const random_alphabet *alphabet, int grouping);
+apr_ssize_t random_decode_base64url_into(unsigned char *out, const char *in, apr_size_t len);
+apr_size_t random_encode_custom_pow2_into(char *out, const unsigned char *data, int length,
+                                          const random_alphabet *alphabet, int grouping);
+apr_size_t random_encode_custom_reject_into(char *out, const unsigned char *data, int length,
+                                            const random_alphabet *alphabet, int grouping);
+apr_size_t random_encode_uuid4_into(char *out, const unsigned char *data, int length,
+                                    const random_alphabet *alphabet, int grouping);
+apr_size_t random_encode_uuid7_into(char *out, const unsigned char *data, int length,
+                                    const random_alphabet *alphabet, int grouping);
+apr_size_t random_encode_ulid_into(char *out, const unsigned char *data, int length,
+                                   const random_alphabet *alphabet, int grouping);
+apr_size_t random_encode_uuid7_at(char *out, const unsigned char *data, apr_time_t now);
+apr_size_t random_encode_ulid_at(char *out, const unsigned char *data, apr_time_t now);
+random_alphabet *random_alphabet_compile(apr_pool_t *pool, const char *chars);
+apr_size_t random_alphabet_symbols(const random_alphabet *alphabet, int length);
+apr_size_t random_raw_len(random_format_t format, int length, const random_alphabet *alphabet);
+random_encode_fn random_encoder_for(random_format_t format, const random_alphabet *alphabet);
+random_encode_at_fn random_time_encoder_for(random_format_t format);
+apr_size_t random_encoded_max_len(random_format_t format, int length,
+                                  const random_alphabet *alphabet, int grouping);
+
+/* Vector encoders (mod_random_simd.c) */
+random_encode_fn random_simd_encoder_for(random_format_t format);
+
+/* Compiled token plans (mod_random_plan.c) */
+void random_plan_compile(apr_pool_t *pool, random_config *cfg, apr_array_header_t *warnings);
+const char *random_config_check(const random_config *cfg, apr_array_header_t *warnings);
+const char *random_token_spec_parse(apr_pool_t *pool, const char *args,
+                                    random_token_spec *spec, int *prefill);
+void random_spec_registry_reset(apr_pool_t *pconf);
+void random_spec_registry_close(void);
+random_token_spec *random_spec_intern(apr_pool_t *ptemp, const random_token_spec *spec,
+                                      int prefill, const void *owner, int *created);
+apr_size_t random_plan_assemble_timed(const random_token_plan *plan, char *out,
+                                      const unsigned char *bytes, apr_time_t now,
+                                      random_stats_counters *stats);
+apr_size_t random_plan_assemble(const random_token_plan *plan, char *out,
+                                const unsigned char *bytes, apr_time_t now);
+
+/* Per-thread state (mod_random_thread.c) */
+apr_status_t random_thread_init(apr_pool_t *pool);
+random_thread_state *random_thread_state_get(void);
+void *random_scratch_acquire(apr_size_t size);
+void random_scratch_release(void *buf, apr_size_t used);
+
+/* Entropy source (mod_random_entropy.c) */
+void random_entropy_set_buffer_size(apr_size_t size);
+apr_size_t random_entropy_get_buffer_size(void);
+apr_status_t random_fill_bytes(unsigned char *buf, apr_size_t length);
+void random_entropy_release(random_thread_state *state);
+
+/* Lock-free TTL cache (mod_random_cache.c) */
+random_token_cache *random_cache_create(apr_pool_t *pool, const char *name);
+char *random_cache_lookup(random_token_cache *cache, apr_pool_t *pool,
+                          apr_time_t now, int ttl, int *refresh);
+void random_cache_store(random_token_cache *cache, const char *token, apr_time_t now);
+void random_cache_abandon(random_token_cache *cache);
+void random_cache_set_backend(random_cache_backend_t backend);
+random_cache_backend_t random_cache_get_backend(void);
+random_token_cache *random_cache_variant(apr_pool_t *pool, random_token_cache *home,
+                                         const char *variant);
+void random_cache_registry_reset(apr_pool_t *pconf);
+apr_status_t random_cache_shm_init(apr_pool_t *pconf, int *slots);
+
+/* Pre-generated token rings (mod_random_prefill.c) */
+random_prefill *random_prefill_create(apr_pool_t *pool, const char *name, int count);
+char *random_prefill_pop(random_prefill *pf, const random_token_plan *plan, apr_pool_t *pool);
+void random_prefill_registry_reset(apr_pool_t *pconf);
+void random_prefill_registry_close(void);
+apr_status_t random_prefill_start(apr_pool_t *pchild, int *rings);
+int random_prefill_count(void);
+void random_prefill_stats_get(int index, random_prefill_stats *stats);
+
+/* Rotating signing keys (mod_random_keyring.c) */
+void random_keyring_registry_reset(apr_pool_t *pconf);
+random_keyring *random_keyring_open(apr_pool_t *pool, const char *path, const char **error);
+int random_keyring_reload(random_keyring *kr, apr_pool_t *scratch, int force, const char **error);
+const random_key_table *random_keyring_acquire(random_keyring *kr);
+void random_keyring_release(random_keyring *kr);
+const char *random_keyring_path(const random_keyring *kr);
+const random_hmac_key *random_key_table_signing(const random_key_table *table, int *id);
+const random_hmac_key *random_key_table_find(const random_key_table *table, int id);
+int random_key_table_count(const random_key_table *table);
+apr_status_t random_keyring_start(apr_pool_t *pchild, random_keyring_notify_fn notify,
+                                  void *notify_data, int *keyrings);
+
+/* Generation statistics (mod_random_stats.c) */
+void random_stats_set_enabled(int enabled);
+int random_stats_get_enabled(void);
+void random_stats_registry_reset(apr_pool_t *pconf);
+int random_stats_register(const char *name, const void *owner);
+void random_stats_label(const void *owner, const char *server);
+apr_status_t random_stats_shm_init(apr_pool_t *pconf, int *slots);
+random_stats_counters *random_stats_thread(void);
+void random_stats_commit(apr_time_t now);
+void random_stats_flush_thread(void);
+void random_stats_release(random_thread_state *state);
+apr_uint64_t random_stats_clock(void);
+int random_stats_count(void);
+void random_stats_get(int index, random_stats_entry *entry);
+
+/* Status reporting (mod_random_status.c) */
+int random_status_hook(request_rec *r, int flags);
+int random_status_handler(request_rec *r);
 
 /* Crypto functions (mod_random_crypto.c) */
 void random_hmac_sha256(apr_pool_t *pool, const char *key, apr_size_t key_len,
                        const char *data, apr_size_t data_len, unsigned char *digest);
 char *random_encode_with_metadata(apr_pool_t *pool, const char *token,
                                   int expiry_seconds, const char *signing_key);
+random_hmac_key *random_hmac_key_create(apr_pool_t *pool, const char *key, apr_size_t key_len);
+void random_hmac_release(random_thread_state *state);
+int random_hmac_key_supports(const random_hmac_key *hkey, random_mac_alg_t alg);
+apr_size_t random_hmac_key_mac(const random_hmac_key *hkey, random_mac_alg_t alg,
+                               const char *data, apr_size_t data_len, unsigned char *digest);
+const char *random_mac_alg_name(random_mac_alg_t alg);
+apr_size_t random_mac_len(random_mac_alg_t alg);
+apr_size_t random_sign_into(char *out, const random_hmac_key *key, random_mac_alg_t alg,
+                            const char *payload, apr_size_t payload_len);
+
+/* Signed token verification (mod_random_validate.c) */
+random_verify_result_t random_token_verify(const random_hmac_key *key, random_mac_alg_t alg,
+                                           const char *token,
+                                           const char *prefix, const char *suffix,
+                                           int min_mac_len, apr_time_t now);
+random_verify_result_t random_token_verify_keyring(random_keyring *keyring, random_mac_alg_t alg,
+                                                   const char *token,
+                                                   const char *prefix, const char *suffix,
+                                                   int min_mac_len, apr_time_t now);
+const char *random_verify_result_name(random_verify_result_t result);
+
+/* Literal URL patterns (mod_random_match.c) */
+int random_url_literal_parse(apr_pool_t *pool, const char *pattern, random_url_literal *lit);
+int random_url_literal_match(const random_url_literal *lit, const char *uri, apr_size_t uri_len);
+int random_url_matcher_literals(const random_url_matcher *m, const char *uri);
+int random_pattern_has_backref(const char *pattern);
+
+/* Per-request state (mod_random_request.c) */
+random_request_state *random_request_state_get(request_rec *r, int create);
+apr_table_t *random_request_memo(request_rec *r, int *redirected);
+random_alloc_trace *random_request_alloc_trace(request_rec *r);
+
+/* Allocation tracing (mod_random_alloc.c) */
+void random_alloc_trace_set_sample(int every);
+int random_alloc_trace_get_sample(void);
+void random_alloc_record(random_alloc_trace *trace, const char *name,
+                         apr_size_t bytes, unsigned int allocs);
+void random_alloc_share(random_alloc_trace *trace, const char *name, apr_size_t bytes);
+void *random_alloc_palloc(random_alloc_trace *trace, const char *name,
+                          apr_pool_t *pool, apr_size_t size);
+int random_alloc_trace_finish(const random_alloc_trace *trace);
+const char *random_alloc_trace_format(apr_pool_t *pool, const random_alloc_trace *trace);
+const char *random_alloc_histograms_format(apr_pool_t *pool);
+
+/* Request-path allocations: traced in -DRANDOM_ALLOC_TRACE builds, plain
+ * apr_palloc() (and no bookkeeping at all) otherwise */
+#ifdef RANDOM_ALLOC_TRACE
+#define RANDOM_ALLOC_TRACE_OF(r)            random_request_alloc_trace(r)
+#define RANDOM_PALLOC(trace, name, pool, n) random_alloc_palloc((trace), (name), (pool), (n))
+#define RANDOM_ALLOC_RECORD(trace, name, n) random_alloc_record((trace), (name), (n), 1)
+#define RANDOM_ALLOC_SHARE(trace, name, n)  random_alloc_share((trace), (name), (n))
+#else
+#define RANDOM_ALLOC_TRACE_OF(r)            NULL
+#define RANDOM_PALLOC(trace, name, pool, n) ((void)(trace), apr_palloc((pool), (n)))
+#define RANDOM_ALLOC_RECORD(trace, name, n) ((void)(trace))
+#define RANDOM_ALLOC_SHARE(trace, name, n)  ((void)(trace))
+#endif
+
+/* Lazy generation (mod_random_lazy.c) */
+random_request_state *random_lazy_start(request_rec *r, const random_config *cfg);
+random_request_state *random_lazy_state(request_rec *r);
+const char *random_lazy_token(request_rec *r, const char *name);
+void random_lazy_export(request_rec *r, random_request_state *state);
+int random_lazy_handler_wants_env(const random_config *cfg, const char *handler);
 
 /* Token generation (mod_random_token.c) */
-char *random_generate_token_from_spec(request_rec *r, const random_config *cfg,
-                                      const random_token_spec *spec,
-                                      int default_length, random_format_t default_format,
-                                      int default_timestamp,
-                                      const char *default_prefix, const char *default_suffix,
-                                      int default_ttl,
-                                      char **cached_token, apr_time_t *cache_time,
-                                      apr_thread_mutex_t *cache_mutex, apr_pool_t *cache_pool);
+char *random_generate_token(request_rec *r, const random_token_plan *plan);
+apr_status_t random_generate_tokens(request_rec *r, const random_token_plan *plans,
+                                    int count, char **tokens);
 
 #endif /* MOD_RANDOM_H */
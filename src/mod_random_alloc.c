@@ -0,0 +1,175 @@
+/*
+ * mod_random_alloc.c - r->pool allocation tracing (RandomAllocTrace)
+ *
+ * Only a module built with -DRANDOM_ALLOC_TRACE records anything: the
+ * request path allocates through RANDOM_PALLOC() and RANDOM_ALLOC_*(),
+ * which compile to plain apr_palloc() and nothing otherwise, so normal
+ * builds carry no tracing code at all.
+ *
+ * With RandomAllocTrace N, each client request that mod_random allocates
+ * for gets a random_alloc_trace next to its memo: the bytes and number of
+ * allocations mod_random took from r->pool, in total and per token. The
+ * batch slices of random_generate_tokens() are one allocation shared by
+ * several tokens, so each token is charged its own bytes of the slice but
+ * no allocation; a token's allocation count only covers the copies made
+ * for it alone (TTL cache hits, prefill pops).
+ *
+ * Finished requests are added to two per-process histograms (bytes and
+ * allocations per request) with atomic increments; every Nth one is
+ * logged with its per-token breakdown and the histograms so far.
+ */
+
+#include "mod_random.h"
+#include "apr_atomic.h"
+#include "apr_strings.h"
+
+/* Histograms of this process, since the child started */
+static int alloc_sample = 0;
+static apr_uint32_t alloc_requests = 0;
+static apr_uint32_t alloc_bytes_hist[RANDOM_ALLOC_HIST_BUCKETS];
+static apr_uint32_t alloc_count_hist[RANDOM_ALLOC_HIST_BUCKETS];
+
+/* RandomAllocTrace: log one traced request in every (0 = tracing off) */
+void random_alloc_trace_set_sample(int every)
+{
+    alloc_sample = every;
+}
+
+int random_alloc_trace_get_sample(void)
+{
+    return alloc_sample;
+}
+
+/* Bucket b > 0 holds [2^(b-1), 2^b), the last one everything above */
+static int alloc_bucket(apr_size_t value)
+{
+    int b = 0;
+
+    while (value && b < RANDOM_ALLOC_HIST_BUCKETS - 1) {
+        value >>= 1;
+        b++;
+    }
+    return b;
+}
+
+/* Entry of name in the trace, added on first use (NULL = table full) */
+static random_alloc_count *alloc_token_entry(random_alloc_trace *trace, const char *name)
+{
+    int i;
+
+    /* Plans keep the spec's var_name pointer: identity is enough */
+    for (i = 0; i < trace->count; i++) {
+        if (trace->names[i] == name) {
+            return &trace->tokens[i];
+        }
+    }
+    if (trace->count == RANDOM_MAX_TOKENS) {
+        return NULL;
+    }
+    trace->names[trace->count] = name;
+    return &trace->tokens[trace->count++];
+}
+
+/**
+ * Record allocations made for a request
+ *
+ * @param trace   Request trace (NULL = not traced, nothing recorded)
+ * @param name    Token the allocations were made for alone, or NULL
+ * @param bytes   Bytes allocated
+ * @param allocs  Number of allocations
+ */
+void random_alloc_record(random_alloc_trace *trace, const char *name,
+                         apr_size_t bytes, unsigned int allocs)
+{
+    random_alloc_count *entry;
+
+    if (!trace) {
+        return;
+    }
+    trace->total.bytes += bytes;
+    trace->total.allocs += allocs;
+    if (name && (entry = alloc_token_entry(trace, name)) != NULL) {
+        entry->bytes += bytes;
+        entry->allocs += allocs;
+    }
+}
+
+/* Charge a token its share of an allocation already recorded for several */
+void random_alloc_share(random_alloc_trace *trace, const char *name, apr_size_t bytes)
+{
+    random_alloc_count *entry;
+
+    if (trace && (entry = alloc_token_entry(trace, name)) != NULL) {
+        entry->bytes += bytes;
+    }
+}
+
+/* apr_palloc() recorded in trace */
+void *random_alloc_palloc(random_alloc_trace *trace, const char *name,
+                          apr_pool_t *pool, apr_size_t size)
+{
+    random_alloc_record(trace, name, size, 1);
+    return apr_palloc(pool, size);
+}
+
+/**
+ * Add a finished request to the histograms
+ *
+ * @return 1 when this request is the sampled one and should be logged
+ */
+int random_alloc_trace_finish(const random_alloc_trace *trace)
+{
+    apr_uint32_t n;
+
+    apr_atomic_inc32(&alloc_bytes_hist[alloc_bucket(trace->total.bytes)]);
+    apr_atomic_inc32(&alloc_count_hist[alloc_bucket(trace->total.allocs)]);
+    n = apr_atomic_inc32(&alloc_requests) + 1;
+    return alloc_sample > 0 && n % (apr_uint32_t)alloc_sample == 0;
+}
+
+/* "<total> bytes in <n> allocations; NAME <bytes>/<allocs> ..." */
+const char *random_alloc_trace_format(apr_pool_t *pool, const random_alloc_trace *trace)
+{
+    const char *line;
+    int i;
+
+    line = apr_psprintf(pool, "%" APR_SIZE_T_FMT " bytes in %u allocations;",
+                        trace->total.bytes, trace->total.allocs);
+    for (i = 0; i < trace->count; i++) {
+        line = apr_psprintf(pool, "%s %s %" APR_SIZE_T_FMT "/%u", line, trace->names[i],
+                            trace->tokens[i].bytes, trace->tokens[i].allocs);
+    }
+    return line;
+}
+
+/* Non-empty buckets as "<upper bound>:<requests>", the last one ">=<lower bound>" */
+static const char *alloc_histogram_format(apr_pool_t *pool, apr_uint32_t *hist)
+{
+    const char *text = "";
+    int b;
+
+    for (b = 0; b < RANDOM_ALLOC_HIST_BUCKETS; b++) {
+        apr_uint32_t n = apr_atomic_read32(&hist[b]);
+
+        if (n == 0) {
+            continue;
+        }
+        if (b == 0) {
+            text = apr_psprintf(pool, "%s 0:%u", text, n);
+        } else if (b < RANDOM_ALLOC_HIST_BUCKETS - 1) {
+            text = apr_psprintf(pool, "%s <%lu:%u", text, 1UL << b, n);
+        } else {
+            text = apr_psprintf(pool, "%s >=%lu:%u", text, 1UL << (b - 1), n);
+        }
+    }
+    return *text ? text + 1 : "empty";
+}
+
+/* Both histograms of this process, for the sampled log line */
+const char *random_alloc_histograms_format(apr_pool_t *pool)
+{
+    return apr_psprintf(pool, "%u requests; bytes %s; allocations %s",
+                        apr_atomic_read32(&alloc_requests),
+                        alloc_histogram_format(pool, alloc_bytes_hist),
+                        alloc_histogram_format(pool, alloc_count_hist));
+}
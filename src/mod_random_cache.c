@@ -0,0 +1,456 @@
+/*
+ * mod_random_cache.c - Lock-free TTL cache shared by all threads of a child
+ *
+ * Readers never take a lock: the cached token lives in an immutable entry
+ * that is published with an atomic pointer swap. Replaced entries are put
+ * on a retired list and freed once no reader can still be copying them.
+ *
+ * Reclamation rule: a reader registers in cache->readers BEFORE loading
+ * cache->current and unregisters after copying. An entry retired at time T
+ * can therefore only be held by readers registered before T, so observing
+ * readers == 0 at any moment after T makes it safe to free. Both the
+ * refreshing thread and the last reader out perform that check.
+ *
+ * Only one thread regenerates an expired token (cache->refreshing claim);
+ * the others keep serving the previous value until the new one is published.
+ *
+ * With RandomCacheBackend shm, every cache created while reading the config
+ * gets a slot in a table shared by all children. Slots are read with a
+ * seqlock (no process lock): readers retry if the sequence number changed
+ * or was odd while they copied. A refresh claim timestamp in the slot
+ * elects one refresher across all processes; a claim older than
+ * RANDOM_SHM_CLAIM_TIMEOUT seconds is considered abandoned (child died).
+ *
+ * A cache holds assembled tokens, so it may only serve plans that assemble
+ * identical ones. A spec merged into contexts with other defaults (prefix,
+ * format, signing...) gets one cache per resolved variant from
+ * random_cache_variant(); the table is built while reading the config, so
+ * every child agrees on it, and is read-only afterwards.
+ */
+
+#include "mod_random.h"
+#include "apr_atomic.h"
+#include "apr_strings.h"
+#include "apr_hash.h"
+#include "apr_shm.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define RANDOM_SHM_READ_RETRIES  8   /* Seqlock retries before giving up on a slot */
+#define RANDOM_SHM_CLAIM_TIMEOUT 2   /* Seconds before a refresh claim is stolen */
+
+/* Orders slot payload reads against the sequence number reads */
+#if defined(__GNUC__)
+#define RANDOM_ACQUIRE_FENCE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#else
+#define RANDOM_ACQUIRE_FENCE() apr_atomic_read32(&random_fence_dummy)
+static volatile apr_uint32_t random_fence_dummy;
+#endif
+
+/* One slot per cache in the shared table */
+typedef struct {
+    volatile apr_uint32_t seq;         /* Seqlock: odd while the slot is being written */
+    volatile apr_uint32_t claim;       /* apr_time_sec() of the refresh claim, 0 = none */
+    apr_uint32_t len;                  /* Token length (0 = empty) */
+    apr_time_t cache_time;             /* When the token was generated */
+    char name[RANDOM_SHM_NAME_MAX];    /* Token name (diagnostics) */
+    char token[RANDOM_SHM_TOKEN_MAX];
+} random_shm_slot;
+
+/* Process-wide state, set while reading the config (before fork) */
+static random_cache_backend_t cache_backend = RANDOM_CACHE_BACKEND_LOCAL;
+static apr_array_header_t *cache_registry = NULL;  /* Caches eligible for a slot */
+static apr_hash_t *cache_variants = NULL;          /* "<home> <plan settings>" -> cache */
+static random_shm_slot *shm_slots = NULL;
+static int shm_slot_count = 0;
+
+/* Immutable once published */
+struct random_cache_entry {
+    random_cache_entry *next_retired;  /* Retired list link (written before retiring) */
+    apr_time_t cache_time;             /* When the token was generated */
+    apr_size_t len;                    /* strlen(token) */
+    char token[];
+};
+
+/* Free a chain of retired entries */
+static void free_entries(random_cache_entry *entry)
+{
+    while (entry) {
+        random_cache_entry *next = entry->next_retired;
+        free(entry);
+        entry = next;
+    }
+}
+
+/* Push a chain (head..tail) onto the retired list - lock-free stack push */
+static void push_retired(random_token_cache *cache, random_cache_entry *head,
+                         random_cache_entry *tail)
+{
+    void *old;
+
+    do {
+        old = (void *)cache->retired;
+        tail->next_retired = (random_cache_entry *)old;
+    } while (apr_atomic_casptr(&cache->retired, head, old) != old);
+}
+
+/* Free retired entries if no reader can still reference them */
+static void try_reclaim(random_token_cache *cache)
+{
+    random_cache_entry *chain, *tail;
+
+    /* Take the whole list first: every entry in it was retired before now */
+    chain = (random_cache_entry *)apr_atomic_xchgptr(&cache->retired, NULL);
+    if (!chain) {
+        return;
+    }
+
+    if (apr_atomic_read32(&cache->readers) == 0) {
+        free_entries(chain);
+        return;
+    }
+
+    /* Readers still active - put the chain back for a later attempt */
+    for (tail = chain; tail->next_retired; tail = tail->next_retired)
+        ;
+    push_retired(cache, chain, tail);
+}
+
+static apr_status_t cache_cleanup(void *data)
+{
+    random_token_cache *cache = (random_token_cache *)data;
+
+    /* Pool teardown: no request threads are running any more */
+    free_entries((random_cache_entry *)cache->retired);
+    free((void *)cache->current);
+    cache->retired = NULL;
+    cache->current = NULL;
+    return APR_SUCCESS;
+}
+
+/* Create an empty cache whose entries are released with pool */
+random_token_cache *random_cache_create(apr_pool_t *pool, const char *name)
+{
+    random_token_cache *cache = apr_pcalloc(pool, sizeof(random_token_cache));
+
+    cache->current = NULL;
+    cache->retired = NULL;
+    cache->readers = 0;
+    cache->refreshing = 0;
+    cache->name = name;
+    cache->slot = -1;
+    cache->config_time = 0;
+    cache->claimed = 0;
+    apr_pool_cleanup_register(pool, cache, cache_cleanup, apr_pool_cleanup_null);
+
+    /* Only caches created while reading the main config can be shared;
+     * .htaccess specs are parsed per request after the table exists */
+    if (cache_registry) {
+        cache->config_time = 1;
+        cache->slot = cache_registry->nelts;
+        APR_ARRAY_PUSH(cache_registry, random_token_cache *) = cache;
+    }
+
+    return cache;
+}
+
+void random_cache_set_backend(random_cache_backend_t backend)
+{
+    cache_backend = backend;
+}
+
+random_cache_backend_t random_cache_get_backend(void)
+{
+    return cache_backend;
+}
+
+/**
+ * Cache of a spec for one resolved plan (plan compilation)
+ *
+ * The first variant compiled claims the spec's own cache; every other one
+ * gets a cache of its own while the config is read. After post_config the
+ * table only answers: a variant first seen at request time (nested
+ * sections, .htaccess over a main config spec) is served uncached.
+ *
+ * @param pool     Scratch pool for the lookup key
+ * @param home     Cache created by the RandomAddToken line
+ * @param variant  Every plan setting that changes the assembled token
+ *
+ * @return The cache to use, or NULL to generate without caching
+ */
+random_token_cache *random_cache_variant(apr_pool_t *pool, random_token_cache *home,
+                                         const char *variant)
+{
+    random_token_cache *cache;
+    apr_pool_t *pconf;
+    const char *key;
+
+    if (!home->config_time) {
+        return home;   /* Created at request time (.htaccess): used by that request only */
+    }
+    if (!cache_variants) {
+        return NULL;
+    }
+
+    key = apr_psprintf(pool, "%pp %s", (void *)home, variant);
+    cache = apr_hash_get(cache_variants, key, APR_HASH_KEY_STRING);
+    if (cache || !cache_registry) {
+        return cache;
+    }
+
+    pconf = cache_registry->pool;
+    cache = home->claimed ? random_cache_create(pconf, home->name) : home;
+    home->claimed = 1;
+    apr_hash_set(cache_variants, apr_pstrdup(pconf, key), APR_HASH_KEY_STRING, cache);
+    return cache;
+}
+
+/* Start a new config generation (pre_config) */
+void random_cache_registry_reset(apr_pool_t *pconf)
+{
+    cache_backend = RANDOM_CACHE_BACKEND_LOCAL;
+    cache_registry = apr_array_make(pconf, 16, sizeof(random_token_cache *));
+    cache_variants = apr_hash_make(pconf);
+    shm_slots = NULL;
+    shm_slot_count = 0;
+}
+
+static apr_status_t shm_table_cleanup(void *data)
+{
+    shm_slots = NULL;
+    shm_slot_count = 0;
+    return APR_SUCCESS;
+}
+
+/**
+ * Create the shared slot table (post_config, before children are forked)
+ *
+ * Closes the registry: caches created afterwards stay process-local.
+ *
+ * @param pconf  Config pool - the table lives until the next restart
+ * @param slots  Receives the number of shared slots (0 if not using shm)
+ */
+apr_status_t random_cache_shm_init(apr_pool_t *pconf, int *slots)
+{
+    apr_array_header_t *registry = cache_registry;
+    apr_shm_t *shm;
+    apr_status_t rv;
+    int i;
+
+    *slots = 0;
+    cache_registry = NULL;
+
+    if (cache_backend != RANDOM_CACHE_BACKEND_SHM || !registry || registry->nelts == 0) {
+        return APR_SUCCESS;
+    }
+
+    /* Anonymous shm: inherited by every child forked from this process */
+    rv = apr_shm_create(&shm, sizeof(random_shm_slot) * registry->nelts, NULL, pconf);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    shm_slots = (random_shm_slot *)apr_shm_baseaddr_get(shm);
+    memset(shm_slots, 0, sizeof(random_shm_slot) * registry->nelts);
+    for (i = 0; i < registry->nelts; i++) {
+        random_token_cache *cache = APR_ARRAY_IDX(registry, i, random_token_cache *);
+        apr_cpystrn(shm_slots[i].name, cache->name ? cache->name : "", RANDOM_SHM_NAME_MAX);
+    }
+    shm_slot_count = registry->nelts;
+    apr_pool_cleanup_register(pconf, NULL, shm_table_cleanup, apr_pool_cleanup_null);
+
+    *slots = shm_slot_count;
+    return APR_SUCCESS;
+}
+
+/* Shared slot for this cache, or NULL to use the process-local cache */
+static random_shm_slot *cache_shm_slot(const random_token_cache *cache)
+{
+    if (shm_slots && cache->slot >= 0 && cache->slot < shm_slot_count) {
+        return &shm_slots[cache->slot];
+    }
+    return NULL;
+}
+
+/* Seqlock read of a shared slot - NULL if empty or unstable */
+static char *shm_slot_read(random_shm_slot *slot, apr_pool_t *pool, apr_time_t *cache_time)
+{
+    int tries;
+
+    for (tries = 0; tries < RANDOM_SHM_READ_RETRIES; tries++) {
+        apr_uint32_t seq = slot->seq;
+        apr_uint32_t len;
+        char *copy = NULL;
+
+        RANDOM_ACQUIRE_FENCE();
+        if (seq & 1) {
+            continue;  /* Writer active */
+        }
+
+        len = slot->len;
+        *cache_time = slot->cache_time;
+        if (len > 0 && len < RANDOM_SHM_TOKEN_MAX) {
+            copy = apr_palloc(pool, len + 1);
+            memcpy(copy, slot->token, len);
+            copy[len] = '\0';
+        }
+
+        RANDOM_ACQUIRE_FENCE();
+        if (slot->seq == seq) {
+            return copy;
+        }
+    }
+
+    return NULL;
+}
+
+/* Elect one refresher across all processes */
+static int shm_slot_claim(random_shm_slot *slot, apr_time_t now)
+{
+    apr_uint32_t now_sec = (apr_uint32_t)apr_time_sec(now);
+    apr_uint32_t claim = slot->claim;
+
+    if (now_sec == 0) {
+        now_sec = 1;  /* 0 means unclaimed */
+    }
+
+    if (claim == 0) {
+        return apr_atomic_cas32(&slot->claim, now_sec, 0) == 0;
+    }
+
+    /* Holder probably died while refreshing - take over */
+    if (now_sec - claim > RANDOM_SHM_CLAIM_TIMEOUT) {
+        return apr_atomic_cas32(&slot->claim, now_sec, claim) == claim;
+    }
+
+    return 0;
+}
+
+/* Publish into a shared slot - caller holds the claim */
+static void shm_slot_write(random_shm_slot *slot, const char *token, apr_size_t len, apr_time_t now)
+{
+    apr_atomic_inc32(&slot->seq);      /* Odd: readers retry */
+    memcpy(slot->token, token, len);
+    slot->len = (apr_uint32_t)len;
+    slot->cache_time = now;
+    apr_atomic_inc32(&slot->seq);      /* Even again: slot is consistent */
+}
+
+/**
+ * Look up the cached token without taking any lock
+ *
+ * @param cache    Shared cache
+ * @param pool     Pool receiving the copy (typically r->pool)
+ * @param now      Current time
+ * @param ttl      Time-to-live in seconds (> 0)
+ * @param refresh  Set to 1 when the caller won the right to regenerate the
+ *                 token; it must then call random_cache_store() or
+ *                 random_cache_abandon(). Set to 0 otherwise.
+ *
+ * @return Fresh token copy; the previous token while another thread is
+ *         refreshing it; or NULL when the caller has to generate a token
+ *         (either because it owns the refresh, or nothing is cached yet).
+ */
+char *random_cache_lookup(random_token_cache *cache, apr_pool_t *pool,
+                          apr_time_t now, int ttl, int *refresh)
+{
+    random_cache_entry *entry;
+    random_shm_slot *slot = cache_shm_slot(cache);
+    char *copy = NULL;
+    apr_time_t cache_time = 0;
+
+    *refresh = 0;
+
+    if (slot) {
+        copy = shm_slot_read(slot, pool, &cache_time);
+        if (copy) {
+            apr_time_t elapsed = now - cache_time;
+            if (elapsed >= 0 && elapsed < apr_time_from_sec(ttl)) {
+                return copy;
+            }
+        }
+        if (shm_slot_claim(slot, now)) {
+            *refresh = 1;
+            return NULL;
+        }
+        return copy;
+    }
+
+    apr_atomic_inc32(&cache->readers);
+    entry = (random_cache_entry *)cache->current;
+    if (entry) {
+        copy = apr_pstrmemdup(pool, entry->token, entry->len);
+        cache_time = entry->cache_time;
+    }
+    if (apr_atomic_dec32(&cache->readers) == 0 && cache->retired) {
+        try_reclaim(cache);
+    }
+
+    if (copy) {
+        /* Negative elapsed time means the clock went backwards: treat as expired */
+        apr_time_t elapsed = now - cache_time;
+        if (elapsed >= 0 && elapsed < apr_time_from_sec(ttl)) {
+            return copy;
+        }
+    }
+
+    /* Expired or empty: exactly one thread regenerates */
+    if (apr_atomic_cas32(&cache->refreshing, 1, 0) == 0) {
+        *refresh = 1;
+        return NULL;
+    }
+
+    /* Someone else is refreshing - keep serving the old value if there is one */
+    return copy;
+}
+
+/* Publish a new token and release the refresh claim */
+void random_cache_store(random_token_cache *cache, const char *token, apr_time_t now)
+{
+    random_shm_slot *slot = cache_shm_slot(cache);
+    apr_size_t len = strlen(token);
+    random_cache_entry *entry;
+    random_cache_entry *old;
+
+    if (slot) {
+        if (len < RANDOM_SHM_TOKEN_MAX) {
+            shm_slot_write(slot, token, len, now);
+            apr_atomic_set32(&slot->claim, 0);
+            return;
+        }
+        /* Too long for a slot: this process falls back to its local cache */
+        apr_atomic_set32(&slot->claim, 0);
+        cache->slot = -1;
+        if (apr_atomic_cas32(&cache->refreshing, 1, 0) != 0) {
+            return;  /* Another local thread is already refreshing */
+        }
+    }
+
+    entry = malloc(sizeof(random_cache_entry) + len + 1);
+    if (entry) {
+        entry->next_retired = NULL;
+        entry->cache_time = now;
+        entry->len = len;
+        memcpy(entry->token, token, len + 1);
+
+        old = (random_cache_entry *)apr_atomic_xchgptr(&cache->current, entry);
+        if (old) {
+            push_retired(cache, old, old);
+            try_reclaim(cache);
+        }
+    }
+
+    apr_atomic_set32(&cache->refreshing, 0);
+}
+
+/* Release the refresh claim without publishing (generation failed) */
+void random_cache_abandon(random_token_cache *cache)
+{
+    random_shm_slot *slot = cache_shm_slot(cache);
+
+    if (slot) {
+        apr_atomic_set32(&slot->claim, 0);
+        return;
+    }
+    apr_atomic_set32(&cache->refreshing, 0);
+}
@@ -4,39 +4,13 @@
 
 #include "mod_random.h"
 #include "apr_strings.h"
-#include "apr_thread_mutex.h"
+#include "apr_atomic.h"
 #include "ap_regex.h"
+#include <openssl/opensslv.h>
+#include <stdlib.h>
 #include <strings.h>
 #include <string.h>
 
-/* Helper function to copy a token spec to a new pool */
-static random_token_spec *copy_token_spec(apr_pool_t *pool, random_token_spec *src)
-{
-    random_token_spec *new_spec = apr_pcalloc(pool, sizeof(random_token_spec));
-
-    new_spec->var_name = src->var_name;
-    new_spec->length = src->length;
-    new_spec->format = src->format;
-    new_spec->header_name = src->header_name;
-    new_spec->include_timestamp = src->include_timestamp;
-    new_spec->prefix = src->prefix;
-    new_spec->suffix = src->suffix;
-    new_spec->ttl_seconds = src->ttl_seconds;
-    new_spec->cached_token = NULL;  /* Don't inherit cache */
-    new_spec->cache_time = 0;
-    new_spec->pool = pool;
-    new_spec->next = NULL;
-
-    /* Thread-safe cache requires mutex - verify creation succeeded */
-    if (apr_thread_mutex_create(&new_spec->cache_mutex,
-                                APR_THREAD_MUTEX_DEFAULT, pool) != APR_SUCCESS) {
-        /* Mutex creation failed - disable caching for this token */
-        new_spec->cache_mutex = NULL;
-    }
-
-    return new_spec;
-}
-
 /* Create per-directory configuration */
 void *random_create_config(apr_pool_t *pool, char *dir)
 {
@@ -54,26 +28,88 @@ void *random_create_config(apr_pool_t *pool, char *dir)
     cfg->url_pattern = NULL;
     cfg->pool = pool;
     cfg->token_specs = NULL;
+    cfg->lazy = RANDOM_ENABLED_UNSET;
+    cfg->lazy_handlers = NULL;
 
     /* Custom alphabet settings */
     cfg->custom_alphabet = NULL;
+    cfg->alphabet = NULL;
     cfg->alphabet_grouping = RANDOM_GROUPING_UNSET;
 
     /* Metadata encoding settings */
     cfg->expiry_seconds = RANDOM_EXPIRY_UNSET;
     cfg->encode_metadata = RANDOM_ENABLED_UNSET;
     cfg->signing_key = NULL;
+    cfg->hmac_key = NULL;
+    cfg->keyring = NULL;
+    cfg->signing_alg = RANDOM_MAC_ALG_UNSET;
+    cfg->metadata_format = RANDOM_METADATA_FORMAT_UNSET;
+    cfg->metadata_mac_length = 0;
+
+    /* Token validation settings */
+    cfg->validate = RANDOM_ENABLED_UNSET;
+    cfg->validate_header = NULL;
+    cfg->validate_var = NULL;
+    cfg->validate_prefix = NULL;
+    cfg->validate_suffix = NULL;
+    cfg->validate_enforce = 0;
 
     return cfg;
 }
 
-/* Merge configurations (parent < child) */
-void *random_merge_config(apr_pool_t *pool, void *base, void *override)
+/* Create per-server configuration (vhosts inherit from the main server in post_config) */
+void *random_create_server_config(apr_pool_t *pool, server_rec *s)
 {
-    random_config *parent = (random_config *)base;
-    random_config *child = (random_config *)override;
-    random_config *merged = apr_pcalloc(pool, sizeof(random_config));
-    random_token_spec *spec, *new_spec, *last_spec = NULL;
+    random_server_config *scfg = apr_pcalloc(pool, sizeof(random_server_config));
+
+    scfg->has_tokens = 0;
+    scfg->early_tokens = RANDOM_ENABLED_UNSET;
+
+    return scfg;
+}
+
+/* Whether a context sets nothing of its own (every field as created) */
+static int random_config_is_empty(const random_config *cfg)
+{
+    return cfg->length == RANDOM_LENGTH_UNSET && cfg->format == RANDOM_FORMAT_UNSET &&
+           cfg->include_timestamp == RANDOM_ENABLED_UNSET && !cfg->prefix && !cfg->suffix &&
+           cfg->ttl_seconds == RANDOM_TTL_UNSET && !cfg->url_pattern &&
+           cfg->lazy == RANDOM_ENABLED_UNSET && !cfg->custom_alphabet &&
+           cfg->alphabet_grouping == RANDOM_GROUPING_UNSET &&
+           cfg->expiry_seconds == RANDOM_EXPIRY_UNSET &&
+           cfg->encode_metadata == RANDOM_ENABLED_UNSET && !cfg->signing_key && !cfg->keyring &&
+           cfg->signing_alg == RANDOM_MAC_ALG_UNSET &&
+           cfg->metadata_format == RANDOM_METADATA_FORMAT_UNSET &&
+           cfg->validate == RANDOM_ENABLED_UNSET &&
+           (!cfg->token_specs || cfg->token_specs->nelts == 0);
+}
+
+/* Merges made while reading the config (virtual hosts) leave their plans to
+ * check_config, which compiles every base config once, with warnings */
+static int merge_compiles = 1;
+
+void random_merge_set_compile(int compile)
+{
+    merge_compiles = compile;
+}
+
+/**
+ * Merge two configurations (parent < child) without compiling the result
+ *
+ * @return The merged config, or parent itself when child sets nothing
+ */
+random_config *random_config_merge(apr_pool_t *pool, random_config *parent,
+                                   const random_config *child)
+{
+    random_config *merged;
+
+    /* Configs are never modified once merged, so a context without mod_random
+     * directives (most virtual hosts and sections) shares its parent's config
+     * and plans instead of copying and recompiling them */
+    if (random_config_is_empty(child)) {
+        return parent;
+    }
+    merged = apr_pcalloc(pool, sizeof(random_config));
 
     /* Child settings take precedence if explicitly set, otherwise inherit from parent */
     merged->length = (child->length != RANDOM_LENGTH_UNSET) ? child->length : parent->length;
@@ -86,56 +122,95 @@ void *random_merge_config(apr_pool_t *pool, void *base, void *override)
     /* Global settings */
     merged->url_pattern = child->url_pattern ? child->url_pattern : parent->url_pattern;
     merged->pool = pool;
+    if (child->lazy != RANDOM_ENABLED_UNSET) {
+        merged->lazy = child->lazy;
+        merged->lazy_handlers = child->lazy_handlers;
+    } else {
+        merged->lazy = parent->lazy;
+        merged->lazy_handlers = parent->lazy_handlers;
+    }
 
     /* Custom alphabet settings */
     merged->custom_alphabet = child->custom_alphabet ? child->custom_alphabet : parent->custom_alphabet;
+    merged->alphabet = child->custom_alphabet ? child->alphabet : parent->alphabet;
     merged->alphabet_grouping = (child->alphabet_grouping != RANDOM_GROUPING_UNSET) ? child->alphabet_grouping : parent->alphabet_grouping;
 
     /* Metadata encoding settings */
     merged->expiry_seconds = (child->expiry_seconds != RANDOM_EXPIRY_UNSET) ? child->expiry_seconds : parent->expiry_seconds;
     merged->encode_metadata = (child->encode_metadata != RANDOM_ENABLED_UNSET) ? child->encode_metadata : parent->encode_metadata;
-    merged->signing_key = child->signing_key ? child->signing_key : parent->signing_key;
+    if (child->signing_key || child->keyring) {
+        /* RandomSigningKey and RandomSigningKeyFile replace each other */
+        merged->signing_key = child->signing_key;
+        merged->hmac_key = child->hmac_key;
+        merged->keyring = child->keyring;
+    } else {
+        merged->signing_key = parent->signing_key;
+        merged->hmac_key = parent->hmac_key;
+        merged->keyring = parent->keyring;
+    }
+    merged->signing_alg = (child->signing_alg != RANDOM_MAC_ALG_UNSET) ? child->signing_alg : parent->signing_alg;
+    if (child->metadata_format != RANDOM_METADATA_FORMAT_UNSET) {
+        merged->metadata_format = child->metadata_format;
+        merged->metadata_mac_length = child->metadata_mac_length;
+    } else {
+        merged->metadata_format = parent->metadata_format;
+        merged->metadata_mac_length = parent->metadata_mac_length;
+    }
+
+    /* Token validation settings: one RandomValidateToken line is one unit */
+    if (child->validate != RANDOM_ENABLED_UNSET) {
+        merged->validate = child->validate;
+        merged->validate_header = child->validate_header;
+        merged->validate_var = child->validate_var;
+        merged->validate_prefix = child->validate_prefix;
+        merged->validate_suffix = child->validate_suffix;
+        merged->validate_enforce = child->validate_enforce;
+    } else {
+        merged->validate = parent->validate;
+        merged->validate_header = parent->validate_header;
+        merged->validate_var = parent->validate_var;
+        merged->validate_prefix = parent->validate_prefix;
+        merged->validate_suffix = parent->validate_suffix;
+        merged->validate_enforce = parent->validate_enforce;
+    }
 
-    /* Merge token specs: inherit parent's tokens, then add child's tokens */
-    merged->token_specs = NULL;
-    int token_count = 0;
+    /* Token specs: parent's tokens, then child's. Spec arrays are never
+     * modified once read, so a side without tokens is shared, not copied */
+    if (!child->token_specs || child->token_specs->nelts == 0) {
+        merged->token_specs = parent->token_specs;
+    } else if (!parent->token_specs || parent->token_specs->nelts == 0) {
+        merged->token_specs = child->token_specs;
+    } else {
+        int parent_count = parent->token_specs->nelts;
+        int child_count = child->token_specs->nelts;
 
-    /* Copy parent's token specs */
-    for (spec = parent->token_specs; spec; spec = spec->next) {
         /* Enforce RANDOM_MAX_TOKENS limit to prevent DoS via config merge */
-        if (token_count >= RANDOM_MAX_TOKENS) {
-            break;  /* Silently skip excess tokens - logged at server startup */
+        if (parent_count + child_count > RANDOM_MAX_TOKENS) {
+            child_count = RANDOM_MAX_TOKENS - parent_count;  /* Silently skip excess tokens */
         }
 
-        new_spec = copy_token_spec(pool, spec);
-
-        if (!merged->token_specs) {
-            merged->token_specs = new_spec;
-        } else {
-            last_spec->next = new_spec;
-        }
-        last_spec = new_spec;
-        token_count++;
+        merged->token_specs = apr_array_make(pool, parent_count + child_count,
+                                             sizeof(random_token_spec));
+        memcpy(merged->token_specs->elts, parent->token_specs->elts,
+               parent_count * sizeof(random_token_spec));
+        memcpy(merged->token_specs->elts + parent_count * sizeof(random_token_spec),
+               child->token_specs->elts, child_count * sizeof(random_token_spec));
+        merged->token_specs->nelts = parent_count + child_count;
     }
 
-    /* Append child's token specs */
-    for (spec = child->token_specs; spec; spec = spec->next) {
-        /* Enforce RANDOM_MAX_TOKENS limit to prevent DoS via config merge */
-        if (token_count >= RANDOM_MAX_TOKENS) {
-            break;  /* Silently skip excess tokens - logged at server startup */
-        }
+    return merged;
+}
 
-        new_spec = copy_token_spec(pool, spec);
+/* Merge configurations (httpd callback) */
+void *random_merge_config(apr_pool_t *pool, void *base, void *override)
+{
+    random_config *parent = (random_config *)base;
+    random_config *merged = random_config_merge(pool, parent, (random_config *)override);
 
-        if (!merged->token_specs) {
-            merged->token_specs = new_spec;
-        } else {
-            last_spec->next = new_spec;
-        }
-        last_spec = new_spec;
-        token_count++;
+    /* Resolve defaults now instead of on every request */
+    if (merged != parent && merge_compiles) {
+        random_plan_compile(pool, merged, NULL);
     }
-
     return merged;
 }
 
@@ -167,8 +242,14 @@ static const char *set_random_format(cmd_parms *cmd, void *cfg, const char *arg)
         config->format = RANDOM_FORMAT_BASE64URL;
     } else if (strcasecmp(arg, "custom") == 0) {
         config->format = RANDOM_FORMAT_CUSTOM;
+    } else if (strcasecmp(arg, "uuid4") == 0) {
+        config->format = RANDOM_FORMAT_UUID4;
+    } else if (strcasecmp(arg, "uuid7") == 0) {
+        config->format = RANDOM_FORMAT_UUID7;
+    } else if (strcasecmp(arg, "ulid") == 0) {
+        config->format = RANDOM_FORMAT_ULID;
     } else {
-        return "RandomFormat must be one of: base64, hex, base64url, custom";
+        return "RandomFormat must be one of: base64, hex, base64url, custom, uuid4, uuid7, ulid";
     }
 
     return NULL;
@@ -198,12 +279,58 @@ static const char *set_random_suffix(cmd_parms *cmd, void *cfg, const char *arg)
 static const char *set_random_pattern(cmd_parms *cmd, void *cfg, const char *arg)
 {
     random_config *config = (random_config *)cfg;
-    config->url_pattern = ap_pregcomp(cmd->pool, arg, AP_REG_EXTENDED);
+    random_url_matcher *m;
+    random_url_literal lit;
+    const char *combined;
+    int i;
 
+    /* The patterns of one context form a new matcher; merges share it by reference */
     if (!config->url_pattern) {
+        config->url_pattern = apr_pcalloc(cmd->pool, sizeof(random_url_matcher));
+    }
+    m = config->url_pattern;
+
+    if (random_url_literal_parse(cmd->pool, arg, &lit)) {
+        if (!m->literals) {
+            m->literals = apr_array_make(cmd->pool, 2, sizeof(random_url_literal));
+        }
+        APR_ARRAY_PUSH(m->literals, random_url_literal) = lit;
+        return NULL;
+    }
+
+    /* Report errors against the pattern itself, not the alternation */
+    if (!ap_pregcomp(cmd->temp_pool, arg, AP_REG_EXTENDED)) {
         return apr_psprintf(cmd->pool, "RandomOnlyFor: Invalid regex pattern '%s'", arg);
     }
 
+    if (!m->sources) {
+        m->sources = apr_array_make(cmd->pool, 2, sizeof(const char *));
+    }
+    for (i = 0; i < m->sources->nelts; i++) {
+        if (random_pattern_has_backref(APR_ARRAY_IDX(m->sources, i, const char *))) {
+            break;
+        }
+    }
+    if (m->sources->nelts > 0 && (i < m->sources->nelts || random_pattern_has_backref(arg))) {
+        return "RandomOnlyFor: a pattern with back-references must be the only regex of its context";
+    }
+    APR_ARRAY_PUSH(m->sources, const char *) = apr_pstrdup(cmd->pool, arg);
+
+    /* All regex patterns of the context run as one alternation */
+    if (m->sources->nelts == 1) {
+        combined = arg;
+    } else {
+        combined = "";
+        for (i = 0; i < m->sources->nelts; i++) {
+            combined = apr_pstrcat(cmd->temp_pool, combined, i ? "|" : "", "(?:",
+                                   APR_ARRAY_IDX(m->sources, i, const char *), ")", NULL);
+        }
+    }
+    m->regex = ap_pregcomp(cmd->pool, combined, AP_REG_EXTENDED);
+    if (!m->regex) {
+        return apr_psprintf(cmd->pool, "RandomOnlyFor: Cannot combine regex pattern '%s'", arg);
+    }
+
     return NULL;
 }
 
@@ -251,6 +378,7 @@ static const char *set_random_alphabet(cmd_parms *cmd, void *cfg, const char *ar
     }
 
     config->custom_alphabet = apr_pstrdup(cmd->pool, arg);
+    config->alphabet = random_alphabet_compile(cmd->pool, config->custom_alphabet);
     return NULL;
 }
 
@@ -298,127 +426,341 @@ static const char *set_signing_key(cmd_parms *cmd, void *cfg, const char *arg)
     }
 
     config->signing_key = apr_pstrdup(cmd->pool, arg);
+    config->keyring = NULL;
+
+    /* Key schedule computed once here, never per signature */
+    config->hmac_key = random_hmac_key_create(cmd->pool, config->signing_key,
+                                              strlen(config->signing_key));
+    if (!config->hmac_key) {
+        return "RandomSigningKey: cannot initialise HMAC-SHA256 (OpenSSL error)";
+    }
     return NULL;
 }
 
-static const char *add_random_token(cmd_parms *cmd, void *cfg, const char *args)
+static const char *set_signing_key_file(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    random_config *config = (random_config *)cfg;
+    const char *path = ap_server_root_relative(cmd->pool, arg);
+    const char *error = NULL;
+
+    if (!path) {
+        return apr_psprintf(cmd->pool, "RandomSigningKeyFile: invalid path '%s'", arg);
+    }
+
+    /* Every key is scheduled now; the file is then watched by each child */
+    config->keyring = random_keyring_open(cmd->pool, path, &error);
+    if (!config->keyring) {
+        return apr_psprintf(cmd->pool, "RandomSigningKeyFile %s: %s", path, error);
+    }
+    config->signing_key = NULL;
+    config->hmac_key = NULL;
+    return NULL;
+}
+
+static const char *set_signing_algorithm(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    random_config *config = (random_config *)cfg;
+
+    if (strcasecmp(arg, "hmac-sha256") == 0) {
+        config->signing_alg = RANDOM_MAC_HMAC_SHA256;
+    } else if (strcasecmp(arg, "blake2s") == 0) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        config->signing_alg = RANDOM_MAC_BLAKE2S;
+#else
+        return "RandomSigningAlgorithm: blake2s requires OpenSSL 3.0 or later";
+#endif
+    } else if (strcasecmp(arg, "aes-cmac") == 0) {
+        config->signing_alg = RANDOM_MAC_AES_CMAC;
+    } else {
+        return "RandomSigningAlgorithm must be one of: hmac-sha256, blake2s, aes-cmac";
+    }
+
+    return NULL;
+}
+
+static const char *set_metadata_format(cmd_parms *cmd, void *cfg, const char *arg1,
+                                       const char *arg2)
 {
     random_config *config = (random_config *)cfg;
-    random_token_spec *spec, *last_spec;
-    char *token, *key, *value, *args_copy, *var_name;
     char *endptr;
-    long num_val;
-    int token_count = 0;
+    long mac_len = RANDOM_COMPACT_MAC_DEFAULT;
 
-    if (!args || !*args) {
-        return "RandomAddToken: variable name is required";
+    if (strcasecmp(arg1, "text") == 0) {
+        if (arg2) {
+            return "RandomMetadataFormat: mac= only applies to the compact format";
+        }
+        config->metadata_format = RANDOM_METADATA_TEXT;
+        config->metadata_mac_length = 0;
+        return NULL;
     }
 
-    /* Count existing tokens to enforce limit */
-    for (spec = config->token_specs; spec; spec = spec->next) {
-        token_count++;
+    if (strcasecmp(arg1, "compact") != 0) {
+        return "RandomMetadataFormat must be one of: text, compact";
     }
 
-    if (token_count >= RANDOM_MAX_TOKENS) {
-        return apr_psprintf(cmd->pool,
-            "RandomAddToken: maximum number of tokens (%d) exceeded", RANDOM_MAX_TOKENS);
+    if (arg2) {
+        if (strncasecmp(arg2, "mac=", 4) != 0) {
+            return apr_psprintf(cmd->pool, "RandomMetadataFormat: unknown parameter '%s'", arg2);
+        }
+        mac_len = strtol(arg2 + 4, &endptr, 10);
+        if (*endptr != '\0' || mac_len < RANDOM_COMPACT_MAC_MIN || mac_len > RANDOM_HMAC_DIGEST_LEN) {
+            return apr_psprintf(cmd->pool, "RandomMetadataFormat: mac must be between %d and %d bytes",
+                               RANDOM_COMPACT_MAC_MIN, RANDOM_HMAC_DIGEST_LEN);
+        }
     }
 
-    /* Parse arguments: first token is variable name, rest are key=value pairs */
+    config->metadata_format = RANDOM_METADATA_COMPACT;
+    config->metadata_mac_length = (int)mac_len;
+    return NULL;
+}
+
+static const char *set_entropy_buffer(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    char *endptr;
+    long size;
+
+    if (err) {
+        return err;
+    }
+
+    size = strtol(arg, &endptr, 10);
+    if (*endptr != '\0' || (size != 0 &&
+        (size < RANDOM_ENTROPY_BUFFER_MIN || size > RANDOM_ENTROPY_BUFFER_MAX))) {
+        return apr_psprintf(cmd->pool, "RandomEntropyBuffer must be 0 (disabled) or between %d and %d bytes",
+                           RANDOM_ENTROPY_BUFFER_MIN, RANDOM_ENTROPY_BUFFER_MAX);
+    }
+
+    random_entropy_set_buffer_size((apr_size_t)size);
+    return NULL;
+}
+
+static const char *set_cache_backend(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err) {
+        return err;
+    }
+
+    if (strcasecmp(arg, "local") == 0) {
+        random_cache_set_backend(RANDOM_CACHE_BACKEND_LOCAL);
+    } else if (strcasecmp(arg, "shm") == 0) {
+        random_cache_set_backend(RANDOM_CACHE_BACKEND_SHM);
+    } else {
+        return "RandomCacheBackend must be one of: local, shm";
+    }
+
+    return NULL;
+}
+
+static const char *set_statistics(cmd_parms *cmd, void *cfg, int flag)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err) {
+        return err;
+    }
+
+    random_stats_set_enabled(flag);
+    return NULL;
+}
+
+static const char *set_alloc_trace(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    char *endptr;
+    long every;
+
+    if (err) {
+        return err;
+    }
+
+    if (strcasecmp(arg, "off") == 0) {
+        every = 0;
+    } else {
+        every = strtol(arg, &endptr, 10);
+        if (*endptr != '\0' || every < 1 || every > RANDOM_ALLOC_SAMPLE_MAX) {
+            return apr_psprintf(cmd->pool, "RandomAllocTrace must be Off or between 1 and %d "
+                                "(log one traced request in N)", RANDOM_ALLOC_SAMPLE_MAX);
+        }
+    }
+#ifndef RANDOM_ALLOC_TRACE
+    if (every > 0) {
+        return "RandomAllocTrace requires mod_random built with -DRANDOM_ALLOC_TRACE";
+    }
+#endif
+
+    random_alloc_trace_set_sample((int)every);
+    return NULL;
+}
+
+static const char *set_early_tokens(cmd_parms *cmd, void *cfg, int flag)
+{
+    random_server_config *scfg = ap_get_module_config(cmd->server->module_config, &random_module);
+
+    scfg->early_tokens = flag;
+    return NULL;
+}
+
+static const char *set_lazy_tokens(cmd_parms *cmd, void *cfg, const char *args)
+{
+    random_config *config = (random_config *)cfg;
+    char *args_copy, *mode, *handler;
+
+    args_copy = apr_pstrdup(cmd->pool, args ? args : "");
+    mode = apr_strtok(args_copy, " \t", &args_copy);
+
+    if (!mode || (strcasecmp(mode, "on") != 0 && strcasecmp(mode, "off") != 0)) {
+        return "RandomLazyTokens: first argument must be On or Off";
+    }
+
+    config->lazy = (strcasecmp(mode, "on") == 0);
+    config->lazy_handlers = NULL;
+
+    /* Remaining arguments: handlers that read tokens from their environment */
+    handler = apr_strtok(NULL, " \t", &args_copy);
+    if (handler && !config->lazy) {
+        return "RandomLazyTokens: handlers can only be listed with On";
+    }
+    while (handler) {
+        if (!config->lazy_handlers) {
+            config->lazy_handlers = apr_array_make(cmd->pool, 4, sizeof(const char *));
+        }
+        APR_ARRAY_PUSH(config->lazy_handlers, const char *) = apr_pstrdup(cmd->pool, handler);
+        handler = apr_strtok(NULL, " \t", &args_copy);
+    }
+
+    return NULL;
+}
+
+static const char *set_validate_token(cmd_parms *cmd, void *cfg, const char *args)
+{
+    random_config *config = (random_config *)cfg;
+    char *token, *key, *value, *args_copy, *header;
+
+    if (!args || !*args) {
+        return "RandomValidateToken: header name (or Off) is required";
+    }
+
+    /* First token is the request header (or Off), rest are key=value pairs */
     args_copy = apr_pstrdup(cmd->pool, args);
-    var_name = apr_strtok(args_copy, " \t", &args_copy);
-
-    if (!var_name || !*var_name) {
-        return "RandomAddToken: variable name is required";
-    }
-
-    /* Create new token spec with defaults */
-    spec = apr_pcalloc(cmd->pool, sizeof(random_token_spec));
-    spec->var_name = apr_pstrdup(cmd->pool, var_name);
-    spec->length = RANDOM_LENGTH_UNSET;
-    spec->format = RANDOM_FORMAT_UNSET;
-    spec->header_name = NULL;
-    spec->include_timestamp = RANDOM_ENABLED_UNSET;
-    spec->prefix = NULL;
-    spec->suffix = NULL;
-    spec->ttl_seconds = RANDOM_TTL_UNSET;
-    spec->cached_token = NULL;
-    spec->cache_time = 0;
-    spec->pool = cmd->pool;
-    spec->next = NULL;
-
-    /* Create mutex for this token's cache protection (thread-safe) */
-    if (apr_thread_mutex_create(&spec->cache_mutex, APR_THREAD_MUTEX_DEFAULT, cmd->pool) != APR_SUCCESS) {
-            /* Mutex creation failed - disable caching for this token */
-            spec->cache_mutex = NULL;
+    header = apr_strtok(args_copy, " \t", &args_copy);
+
+    if (!header || !*header) {
+        return "RandomValidateToken: header name (or Off) is required";
+    }
+
+    if (strcasecmp(header, "off") == 0) {
+        if (apr_strtok(NULL, " \t", &args_copy)) {
+            return "RandomValidateToken: Off takes no parameters";
         }
+        config->validate = 0;
+        config->validate_header = NULL;
+        config->validate_var = NULL;
+        config->validate_prefix = NULL;
+        config->validate_suffix = NULL;
+        config->validate_enforce = 0;
+        return NULL;
+    }
+
+    config->validate = 1;
+    config->validate_header = apr_pstrdup(cmd->pool, header);
+    config->validate_var = RANDOM_VALIDATE_VAR_DEFAULT;
+    config->validate_prefix = NULL;
+    config->validate_suffix = NULL;
+    config->validate_enforce = 0;
 
-    /* Parse optional key=value arguments */
     token = apr_strtok(NULL, " \t", &args_copy);
     while (token) {
         key = token;
         value = strchr(token, '=');
         if (!value) {
-            return apr_psprintf(cmd->pool, "RandomAddToken: invalid argument '%s' (expected key=value)", token);
+            return apr_psprintf(cmd->pool, "RandomValidateToken: invalid argument '%s' (expected key=value)", token);
         }
         *value++ = '\0';
 
-        if (strcasecmp(key, "length") == 0) {
-            num_val = strtol(value, &endptr, 10);
-            if (*endptr != '\0' || num_val < RANDOM_LENGTH_MIN || num_val > RANDOM_LENGTH_MAX) {
-                return apr_psprintf(cmd->pool, "RandomAddToken: invalid length %ld (must be %d-%d)",
-                                    num_val, RANDOM_LENGTH_MIN, RANDOM_LENGTH_MAX);
+        if (strcasecmp(key, "var") == 0) {
+            if (!*value) {
+                return "RandomValidateToken: var cannot be empty";
             }
-            spec->length = (int)num_val;
-        } else if (strcasecmp(key, "format") == 0) {
-            if (strcasecmp(value, "base64") == 0) {
-                spec->format = RANDOM_FORMAT_BASE64;
-            } else if (strcasecmp(value, "hex") == 0) {
-                spec->format = RANDOM_FORMAT_HEX;
-            } else if (strcasecmp(value, "base64url") == 0) {
-                spec->format = RANDOM_FORMAT_BASE64URL;
-            } else if (strcasecmp(value, "custom") == 0) {
-                spec->format = RANDOM_FORMAT_CUSTOM;
-            } else {
-                return apr_psprintf(cmd->pool, "RandomAddToken: invalid format '%s' (must be base64, hex, base64url, or custom)", value);
-            }
-        } else if (strcasecmp(key, "header") == 0) {
-            spec->header_name = apr_pstrdup(cmd->pool, value);
-        } else if (strcasecmp(key, "timestamp") == 0) {
+            config->validate_var = apr_pstrdup(cmd->pool, value);
+        } else if (strcasecmp(key, "prefix") == 0) {
+            /* Tokens minted with RandomAddToken prefix=; empty for none */
+            config->validate_prefix = apr_pstrdup(cmd->pool, value);
+        } else if (strcasecmp(key, "suffix") == 0) {
+            config->validate_suffix = apr_pstrdup(cmd->pool, value);
+        } else if (strcasecmp(key, "enforce") == 0) {
             if (strcasecmp(value, "on") == 0 || strcasecmp(value, "1") == 0) {
-                spec->include_timestamp = 1;
+                config->validate_enforce = 1;
             } else if (strcasecmp(value, "off") == 0 || strcasecmp(value, "0") == 0) {
-                spec->include_timestamp = 0;
+                config->validate_enforce = 0;
             } else {
-                return apr_psprintf(cmd->pool, "RandomAddToken: invalid timestamp value '%s' (must be on/off)", value);
-            }
-        } else if (strcasecmp(key, "prefix") == 0) {
-            spec->prefix = apr_pstrdup(cmd->pool, value);
-        } else if (strcasecmp(key, "suffix") == 0) {
-            spec->suffix = apr_pstrdup(cmd->pool, value);
-        } else if (strcasecmp(key, "ttl") == 0) {
-            num_val = strtol(value, &endptr, 10);
-            if (*endptr != '\0' || num_val < 0 || num_val > RANDOM_TTL_MAX_SECONDS) {
-                return apr_psprintf(cmd->pool, "RandomAddToken: invalid ttl %ld (must be 0-%d)",
-                                   num_val, RANDOM_TTL_MAX_SECONDS);
+                return apr_psprintf(cmd->pool, "RandomValidateToken: invalid enforce value '%s' (must be on/off)", value);
             }
-            spec->ttl_seconds = (int)num_val;
         } else {
-            return apr_psprintf(cmd->pool, "RandomAddToken: unknown parameter '%s'", key);
+            return apr_psprintf(cmd->pool, "RandomValidateToken: unknown parameter '%s'", key);
         }
 
         token = apr_strtok(NULL, " \t", &args_copy);
     }
 
-    /* Add to end of linked list */
-    if (!config->token_specs) {
-        config->token_specs = spec;
+    return NULL;
+}
+
+static const char *add_random_token(cmd_parms *cmd, void *cfg, const char *args)
+{
+    random_config *config = (random_config *)cfg;
+    random_server_config *scfg;
+    random_token_spec new_spec, *spec = &new_spec, *shared;
+    const char *error;
+    int prefill = 0, created;
+
+    if (config->token_specs && config->token_specs->nelts >= RANDOM_MAX_TOKENS) {
+        return apr_psprintf(cmd->pool,
+            "RandomAddToken: maximum number of tokens (%d) exceeded", RANDOM_MAX_TOKENS);
+    }
+
+    error = random_token_spec_parse(cmd->pool, args, spec, &prefill);
+    if (error) {
+        return error;
+    }
+
+    /* The same line read again for this server reuses the first one's fields
+     * and TTL cache; random_cache_variant() still splits that cache between
+     * sections whose defaults resolve to different tokens */
+    shared = random_spec_intern(cmd->temp_pool, spec, prefill, cmd->server, &created);
+    if (shared && !created) {
+        new_spec = *shared;
     } else {
-        last_spec = config->token_specs;
-        while (last_spec->next) {
-            last_spec = last_spec->next;
+        /* Cache is shared by every merged copy of this spec */
+        spec->cache = random_cache_create(cmd->pool, spec->var_name);
+        if (shared) {
+            *shared = new_spec;
         }
-        last_spec->next = spec;
+    }
+
+    /* Statistics slot and ring stay per line: a ring binds to the first plan
+     * it serves, and each line reports in its own row */
+    spec->stats_slot = random_stats_register(spec->var_name, cmd->server);
+
+    /* The ring is filled by a per-child thread started after the config is
+     * read, so .htaccess specs get none and generate inline */
+    if (prefill > 0) {
+        spec->prefill = random_prefill_create(cmd->pool, spec->var_name, prefill);
+    }
+
+    /* Append to the context's specs (contiguous, in directive order) */
+    if (!config->token_specs) {
+        config->token_specs = apr_array_make(cmd->pool, 4, sizeof(random_token_spec));
+    }
+    *(random_token_spec *)apr_array_push(config->token_specs) = new_spec;
+
+    /* Lets random_fixups() skip servers without tokens. An .htaccess sets it
+     * at request time, before that request reaches fixups; it never resets. */
+    scfg = ap_get_module_config(cmd->server->module_config, &random_module);
+    if (!apr_atomic_read32(&scfg->has_tokens)) {
+        apr_atomic_set32(&scfg->has_tokens, 1);
     }
 
     return NULL;
@@ -429,15 +771,15 @@ const command_rec random_directives[] = {
     AP_INIT_TAKE1("RandomLength", set_random_length, NULL, OR_ALL,
                   "Default token length in bytes for RandomAddToken (default: 16)"),
     AP_INIT_TAKE1("RandomFormat", set_random_format, NULL, OR_ALL,
-                  "Default output format for RandomAddToken: base64, hex, base64url, custom (default: base64)"),
+                  "Default output format for RandomAddToken: base64, hex, base64url, custom, uuid4, uuid7, ulid (default: base64)"),
     AP_INIT_FLAG("RandomIncludeTimestamp", set_random_timestamp, NULL, OR_ALL,
                  "Default timestamp inclusion for RandomAddToken (default: Off)"),
     AP_INIT_TAKE1("RandomPrefix", set_random_prefix, NULL, OR_ALL,
                   "Default prefix for all tokens (optional)"),
     AP_INIT_TAKE1("RandomSuffix", set_random_suffix, NULL, OR_ALL,
                   "Default suffix for all tokens (optional)"),
-    AP_INIT_TAKE1("RandomOnlyFor", set_random_pattern, NULL, OR_ALL,
-                  "Regex pattern to match URLs for conditional token generation (optional)"),
+    AP_INIT_ITERATE("RandomOnlyFor", set_random_pattern, NULL, OR_ALL,
+                    "Regex patterns to match URLs for conditional token generation (optional, any may match)"),
     AP_INIT_TAKE1("RandomTTL", set_random_ttl, NULL, OR_ALL,
                   "Default cache TTL for RandomAddToken in seconds (0-86400, default: 0 = no cache)"),
     AP_INIT_TAKE1("RandomAlphabet", set_random_alphabet, NULL, OR_ALL,
@@ -450,7 +792,27 @@ const command_rec random_directives[] = {
                  "Encode expiry metadata into token (requires RandomExpiry > 0)"),
     AP_INIT_TAKE1("RandomSigningKey", set_signing_key, NULL, OR_ALL,
                   "Set HMAC-SHA256 signing key for token validation (optional, for metadata mode)"),
+    AP_INIT_TAKE1("RandomSigningKeyFile", set_signing_key_file, NULL, RSRC_CONF | ACCESS_CONF,
+                  "File of '<id> <key>' lines: the last key signs, all verify; reloaded when it changes"),
+    AP_INIT_TAKE1("RandomSigningAlgorithm", set_signing_algorithm, NULL, OR_ALL,
+                  "MAC for signed metadata: hmac-sha256 (default), blake2s, aes-cmac"),
+    AP_INIT_TAKE12("RandomMetadataFormat", set_metadata_format, NULL, OR_ALL,
+                   "Signed token layout: text (expiry:token:signature, default) or compact [mac=8-32] (base64url binary, truncated MAC)"),
+    AP_INIT_TAKE1("RandomEntropyBuffer", set_entropy_buffer, NULL, RSRC_CONF,
+                  "Per-thread CSPRNG buffer size in bytes (0 = disabled, 1024-1048576, default: 0)"),
+    AP_INIT_TAKE1("RandomCacheBackend", set_cache_backend, NULL, RSRC_CONF,
+                  "Where TTL-cached tokens are kept: local (per child) or shm (shared by all children, default: local)"),
+    AP_INIT_FLAG("RandomStatistics", set_statistics, NULL, RSRC_CONF,
+                 "Count generated tokens, cache hits and generation time in shared memory (default: Off)"),
+    AP_INIT_TAKE1("RandomAllocTrace", set_alloc_trace, NULL, RSRC_CONF,
+                  "Trace r->pool allocations and log one request in N with histograms (Off or 1-1000000, -DRANDOM_ALLOC_TRACE builds)"),
+    AP_INIT_FLAG("RandomEarlyTokens", set_early_tokens, NULL, RSRC_CONF,
+                 "Generate this server's header= tokens as soon as the request is read (default: Off)"),
     AP_INIT_RAW_ARGS("RandomAddToken", add_random_token, NULL, OR_ALL,
                      "Add a token with custom configuration: RandomAddToken VAR_NAME [key=value ...]"),
+    AP_INIT_RAW_ARGS("RandomLazyTokens", set_lazy_tokens, NULL, OR_ALL,
+                     "Generate tokens on first use (%{random:NAME}): RandomLazyTokens On|Off [handler ...]"),
+    AP_INIT_RAW_ARGS("RandomValidateToken", set_validate_token, NULL, OR_ALL,
+                     "Verify a signed token from a request header: RandomValidateToken HEADER|Off [var=NAME] [prefix=P] [suffix=S] [enforce=on|off]"),
     {NULL}
 };
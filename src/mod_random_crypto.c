@@ -1,14 +1,333 @@
 /*
- * mod_random_crypto.c - HMAC-SHA256 and metadata encoding functions
+ * mod_random_crypto.c - Keyed MACs and metadata encoding functions
+ *
+ * RandomSigningKey is loaded once into one keyed context per supported
+ * algorithm (random_hmac_key). Each thread keeps its own copy of the
+ * context it last used, so a signature only processes the payload: the key
+ * schedule (HMAC ipad/opad, AES round keys, BLAKE2s key block) is never
+ * recomputed on the request path.
+ *
+ * RandomSigningAlgorithm selects one of (ids are carried in signed tokens):
+ *   - hmac-sha256: HMAC-SHA256 with the key itself (default)
+ *   - blake2s:     keyed BLAKE2s-256 (OpenSSL 3 only)
+ *   - aes-cmac:    AES-256-CMAC, using AES-NI where the CPU has it
+ * blake2s and aes-cmac are keyed with 32-byte subkeys HMAC-SHA256(key,
+ * label), so one RandomSigningKey never keys two different MACs directly.
  */
 
 #include "mod_random.h"
 #include "apr_strings.h"
+#include "apr_atomic.h"
 #include <openssl/hmac.h>
 #include <openssl/evp.h>
+#include <openssl/crypto.h>
 #include <string.h>
 
-#define HMAC_SHA256_DIGESTSIZE 32
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#define RANDOM_MAC_EVP_MAC 1    /* HMAC_CTX/CMAC_CTX are deprecated in OpenSSL 3 */
+#else
+#include <openssl/cmac.h>
+#endif
+
+#define HMAC_SHA256_DIGESTSIZE RANDOM_HMAC_DIGEST_LEN
+#define MAC_SUBKEY_LEN 32
+
+static const char *const mac_alg_names[RANDOM_MAC_ALG_COUNT] = {
+    "hmac-sha256",               /* RANDOM_MAC_HMAC_SHA256 */
+    "blake2s",                   /* RANDOM_MAC_BLAKE2S */
+    "aes-cmac"                   /* RANDOM_MAC_AES_CMAC */
+};
+
+static const apr_size_t mac_alg_lens[RANDOM_MAC_ALG_COUNT] = {
+    32, 32, 16
+};
+
+/* One algorithm keyed once: copied, never updated itself */
+typedef struct {
+    apr_uint32_t id;             /* Unique, never reused by a reload (0 = unavailable) */
+#ifdef RANDOM_MAC_EVP_MAC
+    EVP_MAC *mac;
+#endif
+    void *ctx;                   /* EVP_MAC_CTX, or HMAC_CTX / CMAC_CTX on OpenSSL 1.1 */
+} random_mac_template;
+
+/* A signing key loaded for every algorithm, owned by the config pool */
+struct random_hmac_key {
+    random_mac_template algs[RANDOM_MAC_ALG_COUNT];
+};
+
+/* Template ids start at 1; 0 marks an empty per-thread slot */
+static volatile apr_uint32_t mac_template_ids = 0;
+
+const char *random_mac_alg_name(random_mac_alg_t alg)
+{
+    return ((unsigned int)alg < RANDOM_MAC_ALG_COUNT) ? mac_alg_names[alg] : "unknown";
+}
+
+/* MAC output length in bytes (0 for an unknown id) */
+apr_size_t random_mac_len(random_mac_alg_t alg)
+{
+    return ((unsigned int)alg < RANDOM_MAC_ALG_COUNT) ? mac_alg_lens[alg] : 0;
+}
+
+/* Whether key could be loaded for alg (blake2s needs OpenSSL 3) */
+int random_hmac_key_supports(const random_hmac_key *hkey, random_mac_alg_t alg)
+{
+    return hkey && (unsigned int)alg < RANDOM_MAC_ALG_COUNT && hkey->algs[alg].id != 0;
+}
+
+/* OpenSSL primitives per version: free, copy, restart + update + final */
+#ifdef RANDOM_MAC_EVP_MAC
+
+static void mac_ctx_free(void *ctx, random_mac_alg_t alg)
+{
+    EVP_MAC_CTX_free((EVP_MAC_CTX *)ctx);
+}
+
+static void *mac_ctx_dup(const random_mac_template *t, random_mac_alg_t alg)
+{
+    return EVP_MAC_CTX_dup((EVP_MAC_CTX *)t->ctx);
+}
+
+static apr_size_t mac_ctx_run(void *ctx, random_mac_alg_t alg, const char *data,
+                              apr_size_t data_len, unsigned char *out)
+{
+    size_t out_len = 0;
+
+    /* Init without a key restarts from the stored key schedule */
+    if (EVP_MAC_init(ctx, NULL, 0, NULL) &&
+        EVP_MAC_update(ctx, (const unsigned char *)data, data_len) &&
+        EVP_MAC_final(ctx, out, &out_len, RANDOM_HMAC_DIGEST_LEN)) {
+        return out_len;
+    }
+    return 0;
+}
+
+static int mac_template_init(random_mac_template *t, random_mac_alg_t alg,
+                             const unsigned char *key, apr_size_t key_len)
+{
+    static const char *const fetch_names[RANDOM_MAC_ALG_COUNT] = {
+        "HMAC", "BLAKE2SMAC", "CMAC"
+    };
+    OSSL_PARAM params[2];
+
+    if (alg == RANDOM_MAC_HMAC_SHA256) {
+        params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+    } else if (alg == RANDOM_MAC_AES_CMAC) {
+        params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_CIPHER, "AES-256-CBC", 0);
+    } else {
+        params[0] = OSSL_PARAM_construct_end();
+    }
+    params[1] = OSSL_PARAM_construct_end();
+
+    t->mac = EVP_MAC_fetch(NULL, fetch_names[alg], NULL);
+    t->ctx = t->mac ? EVP_MAC_CTX_new(t->mac) : NULL;
+    return t->ctx && EVP_MAC_init(t->ctx, key, key_len, params);
+}
+
+#else /* OpenSSL 1.1: HMAC_CTX and CMAC_CTX, no keyed BLAKE2s */
+
+static void mac_ctx_free(void *ctx, random_mac_alg_t alg)
+{
+    if (alg == RANDOM_MAC_AES_CMAC) {
+        CMAC_CTX_free((CMAC_CTX *)ctx);
+    } else {
+        HMAC_CTX_free((HMAC_CTX *)ctx);
+    }
+}
+
+static void *mac_ctx_dup(const random_mac_template *t, random_mac_alg_t alg)
+{
+    void *ctx;
+    int ok;
+
+    if (alg == RANDOM_MAC_AES_CMAC) {
+        ctx = CMAC_CTX_new();
+        ok = ctx && CMAC_CTX_copy(ctx, t->ctx);
+    } else {
+        ctx = HMAC_CTX_new();
+        ok = ctx && HMAC_CTX_copy(ctx, t->ctx);
+    }
+    if (!ok && ctx) {
+        mac_ctx_free(ctx, alg);
+        ctx = NULL;
+    }
+    return ctx;
+}
+
+static apr_size_t mac_ctx_run(void *ctx, random_mac_alg_t alg, const char *data,
+                              apr_size_t data_len, unsigned char *out)
+{
+    /* Init without a key restarts from the stored key schedule */
+    if (alg == RANDOM_MAC_AES_CMAC) {
+        size_t out_len = 0;
+
+        if (CMAC_Init(ctx, NULL, 0, NULL, NULL) &&
+            CMAC_Update(ctx, data, data_len) &&
+            CMAC_Final(ctx, out, &out_len)) {
+            return out_len;
+        }
+    } else {
+        unsigned int out_len = 0;
+
+        if (HMAC_Init_ex(ctx, NULL, 0, NULL, NULL) &&
+            HMAC_Update(ctx, (const unsigned char *)data, data_len) &&
+            HMAC_Final(ctx, out, &out_len)) {
+            return out_len;
+        }
+    }
+    return 0;
+}
+
+static int mac_template_init(random_mac_template *t, random_mac_alg_t alg,
+                             const unsigned char *key, apr_size_t key_len)
+{
+    if (alg == RANDOM_MAC_AES_CMAC) {
+        t->ctx = CMAC_CTX_new();
+        return t->ctx && CMAC_Init(t->ctx, key, key_len, EVP_aes_256_cbc(), NULL);
+    }
+    if (alg == RANDOM_MAC_HMAC_SHA256) {
+        t->ctx = HMAC_CTX_new();
+        return t->ctx && HMAC_Init_ex(t->ctx, key, (int)key_len, EVP_sha256(), NULL);
+    }
+    return 0;   /* BLAKE2s has no keyed mode before OpenSSL 3 */
+}
+
+#endif
+
+static void mac_template_free(random_mac_template *t, random_mac_alg_t alg)
+{
+    if (t->ctx) {
+        mac_ctx_free(t->ctx, alg);
+        t->ctx = NULL;
+    }
+#ifdef RANDOM_MAC_EVP_MAC
+    EVP_MAC_free(t->mac);
+    t->mac = NULL;
+#endif
+    t->id = 0;
+}
+
+/* Free the templates with the config they belong to */
+static apr_status_t random_hmac_key_cleanup(void *data)
+{
+    random_hmac_key *hkey = (random_hmac_key *)data;
+    int alg;
+
+    for (alg = 0; alg < RANDOM_MAC_ALG_COUNT; alg++) {
+        mac_template_free(&hkey->algs[alg], (random_mac_alg_t)alg);
+    }
+    return APR_SUCCESS;
+}
+
+/**
+ * Load a signing key for every supported MAC algorithm (config time)
+ *
+ * @return Key object, or NULL if OpenSSL could not create even the
+ *         HMAC-SHA256 context; other algorithms may be unavailable, see
+ *         random_hmac_key_supports()
+ */
+random_hmac_key *random_hmac_key_create(apr_pool_t *pool, const char *key, apr_size_t key_len)
+{
+    random_hmac_key *hkey = apr_pcalloc(pool, sizeof(random_hmac_key));
+    unsigned char subkey[MAC_SUBKEY_LEN];
+    int alg;
+
+    for (alg = 0; alg < RANDOM_MAC_ALG_COUNT; alg++) {
+        random_mac_template *t = &hkey->algs[alg];
+        int ok;
+
+        if (alg == RANDOM_MAC_HMAC_SHA256) {
+            /* Unchanged tokens: the configured key is the HMAC key */
+            ok = mac_template_init(t, RANDOM_MAC_HMAC_SHA256,
+                                   (const unsigned char *)key, key_len);
+        } else {
+            const char *label = apr_pstrcat(pool, "mod_random ", mac_alg_names[alg], NULL);
+
+            random_hmac_sha256(pool, key, key_len, label, strlen(label), subkey);
+            ok = mac_template_init(t, (random_mac_alg_t)alg, subkey, MAC_SUBKEY_LEN);
+            OPENSSL_cleanse(subkey, sizeof(subkey));
+        }
+
+        if (ok) {
+            t->id = apr_atomic_inc32(&mac_template_ids) + 1;
+        } else {
+            mac_template_free(t, (random_mac_alg_t)alg);
+        }
+    }
+
+    if (!random_hmac_key_supports(hkey, RANDOM_MAC_HMAC_SHA256)) {
+        random_hmac_key_cleanup(hkey);
+        return NULL;
+    }
+
+    apr_pool_cleanup_register(pool, hkey, random_hmac_key_cleanup, apr_pool_cleanup_null);
+    return hkey;
+}
+
+/* Free a thread's context copy (thread exit) */
+void random_hmac_release(random_thread_state *state)
+{
+    if (state && state->mac_ctx) {
+        mac_ctx_free(state->mac_ctx, (random_mac_alg_t)state->mac_ctx_alg);
+        state->mac_ctx = NULL;
+        state->mac_ctx_id = 0;
+    }
+}
+
+/* The calling thread's copy of a template, made on first use */
+static void *random_mac_thread_ctx(random_thread_state *state, const random_mac_template *t,
+                                   random_mac_alg_t alg)
+{
+    if (state->mac_ctx && state->mac_ctx_id == t->id) {
+        return state->mac_ctx;
+    }
+
+    /* Different key or algorithm (other vhost, reloaded config): copy */
+    random_hmac_release(state);
+    state->mac_ctx = mac_ctx_dup(t, alg);
+    if (state->mac_ctx) {
+        state->mac_ctx_id = t->id;
+        state->mac_ctx_alg = alg;
+    }
+    return state->mac_ctx;
+}
+
+/**
+ * MAC of data with a loaded key
+ *
+ * @param digest  At least random_mac_len(alg) bytes
+ *
+ * @return random_mac_len(alg), or 0 if alg is unavailable or OpenSSL failed
+ */
+apr_size_t random_hmac_key_mac(const random_hmac_key *hkey, random_mac_alg_t alg,
+                               const char *data, apr_size_t data_len, unsigned char *digest)
+{
+    const random_mac_template *t;
+    random_thread_state *state;
+    apr_size_t len;
+    void *ctx;
+
+    if (!random_hmac_key_supports(hkey, alg)) {
+        return 0;
+    }
+    t = &hkey->algs[alg];
+
+    state = random_thread_state_get();
+    if (state && (ctx = random_mac_thread_ctx(state, t, alg)) != NULL) {
+        return mac_ctx_run(ctx, alg, data, data_len, digest);
+    }
+
+    /* No per-thread state: a private copy for this call only */
+    ctx = mac_ctx_dup(t, alg);
+    if (!ctx) {
+        return 0;
+    }
+    len = mac_ctx_run(ctx, alg, data, data_len, digest);
+    mac_ctx_free(ctx, alg);
+    return len;
+}
 
 /* HMAC-SHA256 implementation using OpenSSL */
 void random_hmac_sha256(apr_pool_t *pool, const char *key, apr_size_t key_len,
@@ -23,38 +342,70 @@ void random_hmac_sha256(apr_pool_t *pool, const char *key, apr_size_t key_len,
          digest, &digest_len);
 }
 
-/* Encode token with metadata (expiry timestamp) and optional HMAC-SHA256 signature */
+/* Encode token with metadata (expiry timestamp) and optional HMAC-SHA256 signature
+ * The signed payload "expiry:token" is the start of the result, so the MAC
+ * is computed over it in place and only the final string is allocated */
 char *random_encode_with_metadata(apr_pool_t *pool, const char *token,
                                   int expiry_seconds, const char *signing_key)
 {
     apr_time_t now;
     time_t now_sec, expiry_time;
-    char *payload, *final_token;
+    char *final_token;
     unsigned char hmac_digest[HMAC_SHA256_DIGESTSIZE];
-    char *hmac_hex;
+    apr_size_t token_len, payload_len;
 
     now = apr_time_now();
     now_sec = apr_time_sec(now);
     expiry_time = now_sec + expiry_seconds;
 
-    if (signing_key && *signing_key) {
-        /* Format: expiry:token:signature */
-        /* Create payload for signing */
-        payload = apr_psprintf(pool, "%ld:%s", (long)expiry_time, token);
+    if (!signing_key || !*signing_key) {
+        /* Format: expiry:token (no signature) */
+        return apr_psprintf(pool, "%ld:%s", (long)expiry_time, token);
+    }
 
-        /* Generate HMAC-SHA256 signature */
-        random_hmac_sha256(pool, signing_key, strlen(signing_key),
-                          payload, strlen(payload), hmac_digest);
+    /* Format: expiry:token:signature */
+    token_len = strlen(token);
+    final_token = apr_palloc(pool, RANDOM_TIME_DIGITS_MAX + 1 + token_len + 1 +
+                                   2 * HMAC_SHA256_DIGESTSIZE + 1);
+    payload_len = (apr_size_t)apr_snprintf(final_token, RANDOM_TIME_DIGITS_MAX + 2, "%ld:",
+                                           (long)expiry_time);
+    memcpy(final_token + payload_len, token, token_len);
+    payload_len += token_len;
 
-        /* Convert HMAC to hex */
-        hmac_hex = random_encode_hex(pool, hmac_digest, HMAC_SHA256_DIGESTSIZE);
+    random_hmac_sha256(pool, signing_key, strlen(signing_key),
+                       final_token, payload_len, hmac_digest);
 
-        /* Final token with signature */
-        final_token = apr_psprintf(pool, "%ld:%s:%s", (long)expiry_time, token, hmac_hex);
-    } else {
-        /* Format: expiry:token (no signature) */
-        final_token = apr_psprintf(pool, "%ld:%s", (long)expiry_time, token);
+    final_token[payload_len] = ':';
+    final_token[payload_len + 1 + random_encode_hex_into(final_token + payload_len + 1, hmac_digest,
+                                                         HMAC_SHA256_DIGESTSIZE, NULL, 0)] = '\0';
+    OPENSSL_cleanse(hmac_digest, sizeof(hmac_digest));
+    return final_token;
+}
+
+/**
+ * Write the signature of payload into out (at most RANDOM_SIGNATURE_MAX
+ * characters, no NUL) - payload may be part of the buffer being assembled
+ *
+ * HMAC-SHA256 signatures are plain hex, as random_encode_with_metadata()
+ * writes them; other algorithms prefix the hex with "<id>.".
+ *
+ * @return Number of characters written, or 0 if OpenSSL could not compute
+ *         the MAC (nothing is written: the caller must drop the token)
+ */
+apr_size_t random_sign_into(char *out, const random_hmac_key *key, random_mac_alg_t alg,
+                            const char *payload, apr_size_t payload_len)
+{
+    unsigned char digest[RANDOM_HMAC_DIGEST_LEN];
+    apr_size_t len = random_mac_len(alg), n = 0;
+
+    if (!len || random_hmac_key_mac(key, alg, payload, payload_len, digest) != len) {
+        OPENSSL_cleanse(digest, sizeof(digest));
+        return 0;
     }
 
-    return final_token;
+    if (alg != RANDOM_MAC_HMAC_SHA256) {
+        out[n++] = (char)('0' + alg);
+        out[n++] = '.';
+    }
+    return n + random_encode_hex_into(out + n, digest, (int)len, NULL, 0);
 }
@@ -1,178 +1,682 @@
 /*
- * mod_random_encode.c - Encoding functions (hex, base64, base64url, custom alphabet)
+ * mod_random_encode.c - Encoding functions (hex, base64, base64url, custom alphabet,
+ *                       uuid4, uuid7, ulid)
  */
 
 #include "mod_random.h"
-#include "apr_base64.h"
 #include "apr_strings.h"
+#include <openssl/crypto.h>
 #include <string.h>
 
-/* Encode binary data to hexadecimal string */
-char *random_encode_hex(apr_pool_t *pool, const unsigned char *data, int length)
+static const char hex_chars[] = "0123456789abcdef";
+static const char base64_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char base64url_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+static const char crockford_chars[] = "0123456789ABCDEFGHJKMNPQRSTVWXYZ";
+
+/*
+ * "Into" encoders write into a caller buffer of at least
+ * random_encoded_max_len() bytes and return the number of characters
+ * written. They do not NUL-terminate, so token assembly can place the next
+ * part right after the encoded data.
+ */
+
+/* Encode binary data to lowercase hex */
+apr_size_t random_encode_hex_into(char *out, const unsigned char *data, int length,
+                                  const random_alphabet *alphabet, int grouping)
 {
-    static const char hex_chars[] = "0123456789abcdef";
-    char *hex_string;
     int i;
 
-    hex_string = apr_palloc(pool, length * 2 + 1);
     for (i = 0; i < length; i++) {
-        hex_string[i * 2] = hex_chars[(data[i] >> 4) & 0x0F];
-        hex_string[i * 2 + 1] = hex_chars[data[i] & 0x0F];
+        out[i * 2] = hex_chars[(data[i] >> 4) & 0x0F];
+        out[i * 2 + 1] = hex_chars[data[i] & 0x0F];
     }
-    hex_string[length * 2] = '\0';
 
-    return hex_string;
+    return (apr_size_t)length * 2;
 }
 
-/* Encode to base64url (URL-safe base64 without padding) */
-char *random_encode_base64url(apr_pool_t *pool, const char *data, int length)
+/* Shared base64 core: table selects the alphabet, pad adds '=' */
+static apr_size_t base64_encode_into(char *out, const unsigned char *data, int length,
+                                     const char *table, int pad)
 {
-    char *base64_string;
-    char *p;
-    int encoded_len;
-
-    encoded_len = apr_base64_encode_len(length);
-    base64_string = apr_palloc(pool, encoded_len);
-    apr_base64_encode(base64_string, data, length);
-
-    /* Convert to base64url: replace + with -, / with _, remove = padding */
-    for (p = base64_string; *p; p++) {
-        if (*p == '+') *p = '-';
-        else if (*p == '/') *p = '_';
-        else if (*p == '=') {
-            *p = '\0';
-            break;
+    char *p = out;
+    int i;
+
+    for (i = 0; i + 2 < length; i += 3) {
+        *p++ = table[data[i] >> 2];
+        *p++ = table[((data[i] & 0x03) << 4) | (data[i + 1] >> 4)];
+        *p++ = table[((data[i + 1] & 0x0F) << 2) | (data[i + 2] >> 6)];
+        *p++ = table[data[i + 2] & 0x3F];
+    }
+
+    if (i < length) {
+        *p++ = table[data[i] >> 2];
+        if (i + 1 == length) {
+            *p++ = table[(data[i] & 0x03) << 4];
+            if (pad) {
+                *p++ = '=';
+            }
+        } else {
+            *p++ = table[((data[i] & 0x03) << 4) | (data[i + 1] >> 4)];
+            *p++ = table[(data[i + 1] & 0x0F) << 2];
+        }
+        if (pad) {
+            *p++ = '=';
         }
     }
 
-    return base64_string;
+    return (apr_size_t)(p - out);
 }
 
-/* Encode using custom alphabet with optional grouping */
-char *random_encode_custom_alphabet(apr_pool_t *pool, const unsigned char *data, int length,
-                                    const char *alphabet, int grouping)
+/* Standard base64 with padding */
+apr_size_t random_encode_base64_into(char *out, const unsigned char *data, int length,
+                                     const random_alphabet *alphabet, int grouping)
+{
+    return base64_encode_into(out, data, length, base64_chars, 1);
+}
+
+/* base64url (URL-safe, no padding) in a single pass */
+apr_size_t random_encode_base64url_into(char *out, const unsigned char *data, int length,
+                                        const random_alphabet *alphabet, int grouping)
+{
+    return base64_encode_into(out, data, length, base64url_chars, 0);
+}
+
+/* base64url symbol value, or -1 */
+static int base64url_value(unsigned char c)
+{
+    if (c >= 'A' && c <= 'Z') {
+        return c - 'A';
+    }
+    if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 26;
+    }
+    if (c >= '0' && c <= '9') {
+        return c - '0' + 52;
+    }
+    if (c == '-') {
+        return 62;
+    }
+    if (c == '_') {
+        return 63;
+    }
+    return -1;
+}
+
+/**
+ * Decode unpadded base64url, as written by random_encode_base64url_into()
+ *
+ * Only the canonical encoding is accepted: no padding, no whitespace and
+ * zero unused bits in the last symbol, so each byte string has exactly one
+ * accepted spelling.
+ *
+ * @param out  At least len * 3 / 4 bytes
+ *
+ * @return Number of bytes written, or -1 if in is not canonical base64url
+ */
+apr_ssize_t random_decode_base64url_into(unsigned char *out, const char *in, apr_size_t len)
 {
-    int alphabet_len, max_output_len, i, pos;
-    char *result, *p, *end;
-    unsigned long long value;  /* Use 64-bit to prevent overflow */
-    int bits_available, bits_needed;
+    unsigned char *p = out;
+    unsigned int acc = 0;
+    int bits = 0, bad = 0;
+    apr_size_t i;
 
-    if (!alphabet || !*alphabet) {
-        /* Fallback to hex if no alphabet */
-        return random_encode_hex(pool, data, length);
+    if (len % 4 == 1) {
+        return -1;   /* A lone symbol carries fewer than 8 bits */
     }
 
-    alphabet_len = strlen(alphabet);
-    if (alphabet_len < 2) {
-        return random_encode_hex(pool, data, length);
+    for (i = 0; i < len; i++) {
+        int v = base64url_value((unsigned char)in[i]);
+
+        bad |= v;
+        acc = (acc << 6) | ((unsigned int)v & 0x3F);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            *p++ = (unsigned char)(acc >> bits);
+        }
     }
 
-    /* Calculate bits per character based on alphabet size */
-    bits_needed = 0;
-    while ((1 << bits_needed) < alphabet_len) {
-        bits_needed++;
+    if (bad < 0 || (acc & ((1u << bits) - 1)) != 0) {
+        return -1;
     }
+    return (apr_ssize_t)(p - out);
+}
 
-    /* Allocate maximum possible output length to prevent overflow */
-    /* Worst case: (bytes * 8 / bits_per_char) + grouping separators + flush + null */
-    max_output_len = ((length * 8) / bits_needed) + (length * 2) + 10;
-    if (grouping > 0) {
-        max_output_len += (max_output_len / grouping) + 10;
+/* log2(n) in 16.16 fixed point, rounded down (no libm on this path) */
+static unsigned int log2_q16(unsigned int n)
+{
+    unsigned int k = 0, bit, result;
+    apr_uint64_t x;
+
+    while ((n >> (k + 1)) != 0) {
+        k++;
     }
-    result = apr_palloc(pool, max_output_len);
-    p = result;
-    end = result + max_output_len - 1;  /* Reserve space for null terminator */
+    result = k << 16;
 
-    /* Encode bytes using custom alphabet */
-    value = 0;
-    bits_available = 0;
-    pos = 0;
+    /* Fractional bits by repeated squaring of n / 2^k in [1, 2) */
+    x = ((apr_uint64_t)n << 16) >> k;
+    for (bit = 1U << 15; bit; bit >>= 1) {
+        x = (x * x) >> 16;
+        if (x >= (2U << 16)) {
+            x >>= 1;
+            result |= bit;
+        }
+    }
 
-    for (i = 0; i < length; i++) {
-        value = (value << 8) | data[i];
-        bits_available += 8;
+    return result;
+}
 
-        while (bits_available >= bits_needed) {
-            unsigned int index;
+/**
+ * Compile a RandomAlphabet once into an encoding descriptor
+ *
+ * Power-of-two alphabets are encoded by bit extraction. Other sizes use
+ * rejection sampling on whole bytes: a byte below threshold (the largest
+ * multiple of size <= 256) maps to lut[byte], anything above is dropped, so
+ * every symbol is exactly uniform.
+ *
+ * @param chars  Validated alphabet (2-256 distinct characters, kept by reference)
+ */
+static void alphabet_init(random_alphabet *alphabet, const char *chars)
+{
+    unsigned int b;
 
-            /* Ensure we don't overflow buffer */
-            if (p >= end - 2) {  /* Reserve space for separator and null */
-                *p = '\0';
-                return result;
-            }
+    alphabet->chars = chars;
+    alphabet->size = (int)strlen(chars);
+    alphabet->log2_q16 = log2_q16((unsigned int)alphabet->size);
+    alphabet->bits = 0;
+    if ((alphabet->size & (alphabet->size - 1)) == 0) {
+        alphabet->bits = (int)(alphabet->log2_q16 >> 16);
+    }
+    alphabet->threshold = 256 - (256 % alphabet->size);
 
-            bits_available -= bits_needed;
-            index = (value >> bits_available) & ((1 << bits_needed) - 1);
+    for (b = 0; b < 256; b++) {
+        alphabet->lut[b] = chars[b % alphabet->size];
+    }
+}
 
-            if (index < (unsigned int)alphabet_len) {
-                *p++ = alphabet[index];
-                pos++;
+random_alphabet *random_alphabet_compile(apr_pool_t *pool, const char *chars)
+{
+    random_alphabet *alphabet = apr_palloc(pool, sizeof(random_alphabet));
 
-                /* Add grouping separator if needed */
-                if (grouping > 0 && pos % grouping == 0 && i < length - 1 && p < end - 1) {
-                    *p++ = '-';
-                }
+    alphabet_init(alphabet, chars);
+    return alphabet;
+}
+
+/* Symbols carrying at least length * 8 bits of entropy */
+apr_size_t random_alphabet_symbols(const random_alphabet *alphabet, int length)
+{
+    apr_uint64_t bits = (apr_uint64_t)length * 8;
+
+    if (alphabet->bits) {
+        return (apr_size_t)((bits + alphabet->bits - 1) / alphabet->bits);
+    }
+    return (apr_size_t)(((bits << 16) + alphabet->log2_q16 - 1) / alphabet->log2_q16);
+}
+
+/**
+ * Random bytes an encoder consumes for length bytes of entropy
+ *
+ * Equal to length except for rejection-sampled alphabets, which draw the
+ * expected need plus a margin - see random_encode_custom_reject_into().
+ */
+apr_size_t random_raw_len(random_format_t format, int length, const random_alphabet *alphabet)
+{
+    apr_size_t n, raw;
+
+    if (RANDOM_FORMAT_IS_ID(format)) {
+        return RANDOM_ID_RAW_LEN;
+    }
+    if (format != RANDOM_FORMAT_CUSTOM || !alphabet || alphabet->bits) {
+        return (apr_size_t)length;
+    }
+
+    n = random_alphabet_symbols(alphabet, length);
+    raw = (n * 256 + alphabet->threshold - 1) / alphabet->threshold + n / 16 + 16;
+    return raw < RANDOM_RAW_MAX ? raw : RANDOM_RAW_MAX;
+}
+
+/* Insert '-' every grouping symbols, working backwards in place */
+static apr_size_t apply_grouping(char *out, apr_size_t n, int grouping)
+{
+    apr_size_t g = (apr_size_t)grouping, k, dst;
+
+    if (grouping <= 0 || n <= g) {
+        return n;
+    }
+
+    dst = n + (n - 1) / g;
+    for (k = n; k-- > 0; ) {
+        out[--dst] = out[k];
+        if (k > 0 && k % g == 0) {
+            out[--dst] = '-';
+        }
+    }
+
+    return n + (n - 1) / g;
+}
+
+/* Power-of-two alphabets: every `bits` input bytes hold exactly 8 symbols */
+apr_size_t random_encode_custom_pow2_into(char *out, const unsigned char *data, int length,
+                                          const random_alphabet *alphabet, int grouping)
+{
+    const int bits = alphabet->bits;
+    const unsigned int mask = (1U << bits) - 1;
+    const char *lut = alphabet->lut;
+    apr_size_t o = 0;
+    apr_uint64_t v;
+    int i = 0, k, avail;
+
+    for (; i + bits <= length; i += bits, o += 8) {
+        v = 0;
+        for (k = 0; k < bits; k++) {
+            v = (v << 8) | data[i + k];
+        }
+        out[o + 0] = lut[(v >> (7 * bits)) & mask];
+        out[o + 1] = lut[(v >> (6 * bits)) & mask];
+        out[o + 2] = lut[(v >> (5 * bits)) & mask];
+        out[o + 3] = lut[(v >> (4 * bits)) & mask];
+        out[o + 4] = lut[(v >> (3 * bits)) & mask];
+        out[o + 5] = lut[(v >> (2 * bits)) & mask];
+        out[o + 6] = lut[(v >> bits) & mask];
+        out[o + 7] = lut[v & mask];
+    }
+
+    /* Tail: fewer than `bits` bytes left, last symbol zero-padded */
+    v = 0;
+    avail = 0;
+    for (; i < length; i++) {
+        v = (v << 8) | data[i];
+        avail += 8;
+        while (avail >= bits) {
+            avail -= bits;
+            out[o++] = lut[(v >> avail) & mask];
+        }
+    }
+    if (avail > 0) {
+        out[o++] = lut[(v << (bits - avail)) & mask];
+    }
+
+    return apply_grouping(out, o, grouping);
+}
+
+/* Other alphabets: unbiased byte-level rejection sampling, fixed output length */
+apr_size_t random_encode_custom_reject_into(char *out, const unsigned char *data, int length,
+                                            const random_alphabet *alphabet, int grouping)
+{
+    const apr_size_t n = random_alphabet_symbols(alphabet, length);
+    const unsigned int threshold = alphabet->threshold;
+    const char *lut = alphabet->lut;
+    apr_size_t raw = random_raw_len(RANDOM_FORMAT_CUSTOM, length, alphabet);
+    apr_size_t i = 0, o = 0;
+    unsigned char extra[64];
+    int rounds = 0;
+
+    while (o < n) {
+        if (i == raw) {
+            /* The margin in random_raw_len() makes this practically
+             * unreachable; top up a bounded number of times, and on CSPRNG
+             * failure return the (shorter) uniform prefix */
+            if (rounds++ == RANDOM_TOPUP_ROUNDS ||
+                random_fill_bytes(extra, sizeof(extra)) != APR_SUCCESS) {
+                break;
             }
+            data = extra;
+            raw = sizeof(extra);
+            i = 0;
         }
+        /* Branch-free: always store, only advance on accepted bytes */
+        out[o] = lut[data[i]];
+        o += (data[i++] < threshold);
     }
 
-    /* Flush remaining bits if any */
-    if (bits_available > 0 && p < end) {
-        unsigned int index = (value << (bits_needed - bits_available)) & ((1 << bits_needed) - 1);
-        if (index < (unsigned int)alphabet_len) {
-            *p++ = alphabet[index];
+    if (rounds) {
+        OPENSSL_cleanse(extra, sizeof(extra));
+    }
+    return apply_grouping(out, o, grouping);
+}
+
+/*
+ * Identifiers: the 16-byte binary form is built on the stack, then
+ * formatted in one pass. uuid7 and ulid take their millisecond from the
+ * caller (the request time) through the _at variants; the random_encode_fn
+ * ones, for the pool API, read the clock.
+ */
+
+/* 16 bytes as 8-4-4-4-12 lowercase hex */
+static apr_size_t uuid_format(char *out, const unsigned char *u)
+{
+    int i, o = 0;
+
+    for (i = 0; i < 16; i++) {
+        if (i == 4 || i == 6 || i == 8 || i == 10) {
+            out[o++] = '-';
         }
+        out[o++] = hex_chars[u[i] >> 4];
+        out[o++] = hex_chars[u[i] & 0x0F];
+    }
+
+    return RANDOM_UUID_LEN;
+}
+
+/* 16 bytes as 26 Crockford base32 symbols (130 bits, the top two zero) */
+static apr_size_t ulid_format(char *out, const unsigned char *u)
+{
+    apr_uint64_t hi = 0, lo = 0;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        hi = (hi << 8) | u[i];
+        lo = (lo << 8) | u[i + 8];
+    }
+    for (i = RANDOM_ULID_LEN - 1; i >= 0; i--) {
+        out[i] = crockford_chars[lo & 0x1F];
+        lo = (lo >> 5) | (hi << 59);
+        hi >>= 5;
+    }
+
+    return RANDOM_ULID_LEN;
+}
+
+/* 48-bit big-endian millisecond at the start of an identifier */
+static void store_ms48(unsigned char *u, apr_uint64_t ms)
+{
+    int i;
+
+    for (i = 5; i >= 0; i--) {
+        u[i] = (unsigned char)ms;
+        ms >>= 8;
+    }
+}
+
+/*
+ * Millisecond and counter of the next time-ordered identifier
+ *
+ * A later millisecond reseeds the counter from random bits (top bit clear,
+ * leaving room to count); the same or an earlier one (clock stepped back)
+ * increments it, and an overflow moves on to the next millisecond. A
+ * thread's uuid7 and ulid values therefore always sort in generation order.
+ * Without thread state (unit tests, random_thread_init() failed) each
+ * identifier is seeded afresh.
+ */
+static apr_uint64_t id_clock(apr_time_t now, unsigned int seed, unsigned int *seq)
+{
+    random_thread_state *state = random_thread_state_get();
+    apr_int64_t ms = (apr_int64_t)apr_time_as_msec(now);
+
+    seed &= (1U << (RANDOM_ID_SEQ_BITS - 1)) - 1;
+    if (!state) {
+        *seq = seed;
+        return (apr_uint64_t)ms;
+    }
+
+    if (ms > state->id_ms) {
+        state->id_ms = ms;
+        state->id_seq = seed;
+    } else if (++state->id_seq >= (1U << RANDOM_ID_SEQ_BITS)) {
+        state->id_ms++;
+        state->id_seq = seed;
     }
+    *seq = state->id_seq;
+    return (apr_uint64_t)state->id_ms;
+}
+
+/* UUIDv4: 122 random bits */
+apr_size_t random_encode_uuid4_into(char *out, const unsigned char *data, int length,
+                                    const random_alphabet *alphabet, int grouping)
+{
+    unsigned char u[16];
+
+    memcpy(u, data, sizeof(u));
+    u[6] = (unsigned char)((u[6] & 0x0F) | 0x40);   /* Version 4 */
+    u[8] = (unsigned char)((u[8] & 0x3F) | 0x80);   /* RFC 9562 variant */
+    uuid_format(out, u);
+
+    OPENSSL_cleanse(u, sizeof(u));
+    return RANDOM_UUID_LEN;
+}
+
+/* UUIDv7: unix_ts_ms, counter in rand_a (RFC 9562 method 1), 62 random bits */
+apr_size_t random_encode_uuid7_at(char *out, const unsigned char *data, apr_time_t now)
+{
+    unsigned char u[16];
+    unsigned int seq;
+
+    store_ms48(u, id_clock(now, ((unsigned int)data[0] << 8) | data[1], &seq));
+    u[6] = (unsigned char)(0x70 | (seq >> 8));       /* Version 7 */
+    u[7] = (unsigned char)seq;
+    memcpy(u + 8, data + 2, 8);
+    u[8] = (unsigned char)((u[8] & 0x3F) | 0x80);
+    uuid_format(out, u);
+
+    OPENSSL_cleanse(u, sizeof(u));
+    return RANDOM_UUID_LEN;
+}
+
+/* ULID: 48-bit milliseconds, then 80 bits: the counter and 68 random bits */
+apr_size_t random_encode_ulid_at(char *out, const unsigned char *data, apr_time_t now)
+{
+    unsigned char u[16];
+    unsigned int seq;
+
+    store_ms48(u, id_clock(now, ((unsigned int)data[0] << 8) | data[1], &seq));
+    u[6] = (unsigned char)(seq >> 4);
+    u[7] = (unsigned char)(((seq & 0x0F) << 4) | (data[2] & 0x0F));
+    memcpy(u + 8, data + 3, 8);
+    ulid_format(out, u);
+
+    OPENSSL_cleanse(u, sizeof(u));
+    return RANDOM_ULID_LEN;
+}
+
+/* random_encode_uuid7_at() at the current time */
+apr_size_t random_encode_uuid7_into(char *out, const unsigned char *data, int length,
+                                    const random_alphabet *alphabet, int grouping)
+{
+    return random_encode_uuid7_at(out, data, apr_time_now());
+}
 
-    *p = '\0';
+/* random_encode_ulid_at() at the current time */
+apr_size_t random_encode_ulid_into(char *out, const unsigned char *data, int length,
+                                   const random_alphabet *alphabet, int grouping)
+{
+    return random_encode_ulid_at(out, data, apr_time_now());
+}
+
+/* Run an "into" encoder into a fresh pool string */
+static char *encode_to_pool(apr_pool_t *pool, random_format_t format, random_encode_fn encode,
+                            const unsigned char *data, int length,
+                            const random_alphabet *alphabet, int grouping)
+{
+    char *result = apr_palloc(pool, random_encoded_max_len(format, length, alphabet, grouping) + 1);
+    result[encode(result, data, length, alphabet, grouping)] = '\0';
     return result;
 }
 
-/* Generate random string with specified format (extended version) */
+/* Compile a string alphabet for the pool-based API into the caller's
+ * descriptor, which only lives for the call (NULL = none / invalid) */
+static const random_alphabet *compile_if_valid(random_alphabet *out, const char *alphabet)
+{
+    apr_size_t len;
+
+    if (!alphabet) {
+        return NULL;
+    }
+    len = strlen(alphabet);
+    if (len < RANDOM_ALPHABET_MIN_SIZE || len > RANDOM_ALPHABET_MAX_SIZE) {
+        return NULL;
+    }
+    alphabet_init(out, alphabet);
+    return out;
+}
+
+/* Encode binary data to hexadecimal string */
+char *random_encode_hex(apr_pool_t *pool, const unsigned char *data, int length)
+{
+    return encode_to_pool(pool, RANDOM_FORMAT_HEX, random_encoder_for(RANDOM_FORMAT_HEX, NULL),
+                          data, length, NULL, 0);
+}
+
+/* Encode to base64url (URL-safe base64 without padding) */
+char *random_encode_base64url(apr_pool_t *pool, const char *data, int length)
+{
+    return encode_to_pool(pool, RANDOM_FORMAT_BASE64URL, random_encoder_for(RANDOM_FORMAT_BASE64URL, NULL),
+                          (const unsigned char *)data, length, NULL, 0);
+}
+
+/* Transient input bytes: the thread's scratch buffer, else the pool */
+static unsigned char *scratch_or_pool(apr_pool_t *pool, apr_size_t size)
+{
+    unsigned char *buf = random_scratch_acquire(size);
+
+    return buf ? buf : apr_palloc(pool, size);
+}
+
+/* Encode using custom alphabet with optional grouping
+ * Rejection-sampled alphabets may need more than length bytes: data seeds
+ * the input and the CSPRNG supplies the rest */
+char *random_encode_custom_alphabet(apr_pool_t *pool, const unsigned char *data, int length,
+                                    const char *alphabet, int grouping)
+{
+    random_alphabet descriptor;
+    const random_alphabet *compiled = compile_if_valid(&descriptor, alphabet);
+    apr_size_t raw = random_raw_len(RANDOM_FORMAT_CUSTOM, length, compiled);
+    unsigned char *input;
+    char *result;
+
+    if (raw <= (apr_size_t)length) {
+        return encode_to_pool(pool, RANDOM_FORMAT_CUSTOM, random_encoder_for(RANDOM_FORMAT_CUSTOM, compiled),
+                              data, length, compiled, grouping);
+    }
+
+    input = scratch_or_pool(pool, raw);
+    memcpy(input, data, length);
+    result = NULL;
+    if (random_fill_bytes(input + length, raw - length) == APR_SUCCESS) {
+        result = encode_to_pool(pool, RANDOM_FORMAT_CUSTOM, random_encoder_for(RANDOM_FORMAT_CUSTOM, compiled),
+                                input, length, compiled, grouping);
+    }
+    random_scratch_release(input, raw);
+    return result;
+}
+
+/* Generate random string with specified format (extended version)
+ * Only the encoded string is allocated from pool */
 char *random_generate_string_ex(apr_pool_t *pool, int length, random_format_t format,
                                 const char *alphabet, int grouping)
 {
+    random_alphabet descriptor;
+    const random_alphabet *compiled = NULL;
     unsigned char *random_bytes;
-    char *result;
-    int encoded_len;
+    apr_size_t raw;
     apr_status_t rv;
+    char *result;
 
-    random_bytes = apr_palloc(pool, length);
+    if (format == RANDOM_FORMAT_CUSTOM) {
+        compiled = compile_if_valid(&descriptor, alphabet);
+    }
+    raw = random_raw_len(format, length, compiled);
+    random_bytes = scratch_or_pool(pool, raw);
 
     /* CRITICAL: Verify CSPRNG succeeded - security depends on this */
-    rv = apr_generate_random_bytes(random_bytes, length);
+    rv = random_fill_bytes(random_bytes, raw);
     if (rv != APR_SUCCESS) {
         /* CSPRNG failed - this is a critical system error
          * Return NULL to signal failure - caller must handle this */
+        random_scratch_release(random_bytes, raw);
         return NULL;
     }
 
-    switch (format) {
-        case RANDOM_FORMAT_HEX:
-            result = random_encode_hex(pool, random_bytes, length);
-            break;
+    result = encode_to_pool(pool, format, random_encoder_for(format, compiled),
+                            random_bytes, length, compiled, grouping);
+    random_scratch_release(random_bytes, raw);
+    return result;
+}
 
-        case RANDOM_FORMAT_BASE64URL:
-            result = random_encode_base64url(pool, (char *)random_bytes, length);
-            break;
+/* Generate random string with specified format (simple version) */
+char *random_generate_string(apr_pool_t *pool, int length, random_format_t format)
+{
+    return random_generate_string_ex(pool, length, format, NULL, 0);
+}
 
-        case RANDOM_FORMAT_CUSTOM:
-            result = random_encode_custom_alphabet(pool, random_bytes, length, alphabet, grouping);
-            break;
+/* Select the encoder for a format once, at config time
+ * Vector kernels (mod_random_simd.c) win when the CPU has them; CUSTOM
+ * without an alphabet falls back to hex */
+random_encode_fn random_encoder_for(random_format_t format, const random_alphabet *alphabet)
+{
+    random_encode_fn simd;
 
+    if (format == RANDOM_FORMAT_CUSTOM) {
+        if (!alphabet) {
+            format = RANDOM_FORMAT_HEX;
+        } else {
+            return alphabet->bits ? random_encode_custom_pow2_into
+                                  : random_encode_custom_reject_into;
+        }
+    }
+
+    simd = random_simd_encoder_for(format);
+    if (simd) {
+        return simd;
+    }
+
+    switch (format) {
+        case RANDOM_FORMAT_HEX:
+            return random_encode_hex_into;
+        case RANDOM_FORMAT_BASE64URL:
+            return random_encode_base64url_into;
+        case RANDOM_FORMAT_UUID4:
+            return random_encode_uuid4_into;
+        case RANDOM_FORMAT_UUID7:
+            return random_encode_uuid7_into;
+        case RANDOM_FORMAT_ULID:
+            return random_encode_ulid_into;
         case RANDOM_FORMAT_BASE64:
         default:
-            encoded_len = apr_base64_encode_len(length);
-            result = apr_palloc(pool, encoded_len);
-            apr_base64_encode(result, (char *)random_bytes, length);
-            break;
+            return random_encode_base64_into;
     }
+}
 
-    return result;
+/* Encoder taking the request time, for the time-ordered formats (else NULL) */
+random_encode_at_fn random_time_encoder_for(random_format_t format)
+{
+    switch (format) {
+        case RANDOM_FORMAT_UUID7:
+            return random_encode_uuid7_at;
+        case RANDOM_FORMAT_ULID:
+            return random_encode_ulid_at;
+        default:
+            return NULL;
+    }
 }
 
-/* Generate random string with specified format (simple version) */
-char *random_generate_string(apr_pool_t *pool, int length, random_format_t format)
+/* Upper bound of the encoded length of length bytes, without the NUL */
+apr_size_t random_encoded_max_len(random_format_t format, int length,
+                                  const random_alphabet *alphabet, int grouping)
 {
-    return random_generate_string_ex(pool, length, format, NULL, 0);
+    apr_size_t n = (apr_size_t)length;
+    apr_size_t chars;
+
+    switch (format) {
+        case RANDOM_FORMAT_HEX:
+            return n * 2;
+        case RANDOM_FORMAT_BASE64URL:
+            return (n * 8 + 5) / 6;
+        case RANDOM_FORMAT_UUID4:
+        case RANDOM_FORMAT_UUID7:
+            return RANDOM_UUID_LEN;
+        case RANDOM_FORMAT_ULID:
+            return RANDOM_ULID_LEN;
+        case RANDOM_FORMAT_CUSTOM:
+            if (!alphabet) {
+                return n * 2;   /* Hex fallback */
+            }
+            /* Fixed symbol count, plus one separator between groups */
+            chars = random_alphabet_symbols(alphabet, length);
+            return (grouping > 0 && chars > 0) ? chars + (chars - 1) / grouping : chars;
+        case RANDOM_FORMAT_BASE64:
+        default:
+            return (n + 2) / 3 * 4;
+    }
 }
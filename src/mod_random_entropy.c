@@ -0,0 +1,181 @@
+/*
+ * mod_random_entropy.c - Buffered per-thread CSPRNG output (RandomEntropyBuffer)
+ *
+ * Without a buffer every token costs one apr_generate_random_bytes() call,
+ * i.e. one getrandom()/dev/urandom syscall. With RandomEntropyBuffer set,
+ * each thread refills a private buffer in large chunks and hands out bytes
+ * from it without any lock.
+ *
+ * Security properties:
+ *   - Buffers are per thread and never shared (see mod_random_thread.c)
+ *   - Bytes are wiped as soon as they are handed out, so a later memory
+ *     disclosure cannot reveal tokens that were already issued
+ *   - Buffers are mapped MADV_WIPEONFORK where available, so a forked
+ *     child sees an empty buffer; otherwise the owning pid is checked
+ */
+
+#include "mod_random.h"
+#include <openssl/crypto.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+
+/* Buffer header and data share one anonymous mapping */
+struct random_entropy_pool {
+    apr_size_t size;                   /* Valid bytes in data[] (0 = empty) */
+    apr_size_t pos;                    /* Next unread byte */
+    pid_t pid;                         /* Owner process (only checked without WIPEONFORK) */
+    int wipe_on_fork;                  /* Kernel zeroes this mapping in forked children */
+    unsigned char data[];
+};
+
+/* Process-wide setting, 0 = disabled (one CSPRNG call per token) */
+static apr_size_t entropy_buffer_size = 0;
+
+void random_entropy_set_buffer_size(apr_size_t size)
+{
+    entropy_buffer_size = size;
+}
+
+apr_size_t random_entropy_get_buffer_size(void)
+{
+    return entropy_buffer_size;
+}
+
+/* Map a fresh buffer for the calling thread */
+static random_entropy_pool *random_entropy_pool_create(random_thread_state *state, apr_size_t size)
+{
+    random_entropy_pool *pool;
+    apr_size_t map_size = sizeof(random_entropy_pool) + size;
+    void *mem;
+
+    mem = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return NULL;
+    }
+
+    pool = (random_entropy_pool *)mem;
+#ifdef MADV_WIPEONFORK
+    pool->wipe_on_fork = (madvise(mem, map_size, MADV_WIPEONFORK) == 0);
+#else
+    pool->wipe_on_fork = 0;
+#endif
+
+    /* A non-zero pid marks the header as live; see random_fill_bytes() */
+    pool->pid = getpid();
+    state->entropy_map_size = map_size;
+    return pool;
+}
+
+/* Wipe and unmap a thread's buffer (thread exit or buffer resize) */
+void random_entropy_release(random_thread_state *state)
+{
+    random_entropy_pool *pool;
+
+    if (!state || !state->entropy) {
+        return;
+    }
+
+    pool = state->entropy;
+    state->entropy = NULL;
+
+    OPENSSL_cleanse(pool->data, pool->size);
+    munmap(pool, state->entropy_map_size);
+    state->entropy_map_size = 0;
+}
+
+/* Refill the whole buffer with one CSPRNG call */
+static apr_status_t random_entropy_refill(random_entropy_pool *pool, apr_size_t size)
+{
+    apr_status_t rv;
+
+    rv = apr_generate_random_bytes(pool->data, size);
+    if (rv != APR_SUCCESS) {
+        /* Never hand out a partially filled buffer */
+        pool->size = 0;
+        pool->pos = 0;
+        return rv;
+    }
+
+    pool->size = size;
+    pool->pos = 0;
+    pool->pid = getpid();
+    return APR_SUCCESS;
+}
+
+/**
+ * Fill buf with length cryptographically secure random bytes
+ *
+ * Uses the calling thread's buffer when RandomEntropyBuffer is enabled, and
+ * falls back to a direct apr_generate_random_bytes() call when buffering is
+ * disabled, unavailable (no per-thread state), or the request is larger
+ * than the buffer itself.
+ *
+ * @return APR_SUCCESS, or the CSPRNG error - buf must not be used on failure
+ */
+apr_status_t random_fill_bytes(unsigned char *buf, apr_size_t length)
+{
+    apr_size_t size = entropy_buffer_size;
+    random_thread_state *state;
+    random_entropy_pool *pool;
+    apr_status_t rv;
+
+    if (size == 0 || length > size) {
+        return apr_generate_random_bytes(buf, length);
+    }
+
+    state = random_thread_state_get();
+    if (!state) {
+        return apr_generate_random_bytes(buf, length);
+    }
+
+    /* Buffer size changed by a graceful restart - start over */
+    if (state->entropy && state->entropy_map_size != sizeof(random_entropy_pool) + size) {
+        random_entropy_release(state);
+    }
+
+    if (!state->entropy) {
+        state->entropy = random_entropy_pool_create(state, size);
+        if (!state->entropy) {
+            return apr_generate_random_bytes(buf, length);
+        }
+    }
+    pool = state->entropy;
+
+    if (pool->pid == 0) {
+        /* The kernel wiped the mapping in this forked child: the header
+         * reads back as zeroes, so the buffer is simply empty */
+        pool->wipe_on_fork = 1;
+        pool->pid = getpid();
+    } else if (!pool->wipe_on_fork && pool->pid != getpid()) {
+        /* Without WIPEONFORK a forked child would inherit our unread bytes */
+        OPENSSL_cleanse(pool->data, pool->size);
+        pool->size = 0;
+        pool->pos = 0;
+    }
+
+    while (length > 0) {
+        apr_size_t chunk;
+
+        if (pool->pos >= pool->size) {
+            rv = random_entropy_refill(pool, size);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+        }
+
+        chunk = pool->size - pool->pos;
+        if (chunk > length) {
+            chunk = length;
+        }
+
+        memcpy(buf, pool->data + pool->pos, chunk);
+        OPENSSL_cleanse(pool->data + pool->pos, chunk);
+        pool->pos += chunk;
+        buf += chunk;
+        length -= chunk;
+    }
+
+    return APR_SUCCESS;
+}
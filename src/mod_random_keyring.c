@@ -0,0 +1,489 @@
+/*
+ * mod_random_keyring.c - Rotating signing keys (RandomSigningKeyFile)
+ *
+ * A key file lists signing keys with a numeric id (0-255), one per line:
+ *
+ *     # id  key
+ *     1     first-secret
+ *     2     second-secret
+ *
+ * The last key listed signs new tokens; every key listed verifies. Signed
+ * tokens carry the id of their key, so rotating is: append a key, then
+ * remove the old one once the tokens it signed have expired. No restart,
+ * TTL caches and in-flight tokens are kept.
+ *
+ * The file is read while reading the config (errors are config errors)
+ * and then watched, in every child, by one background thread that re-reads
+ * it when its mtime or size change. A reload builds a whole new key table,
+ * every key scheduled into its MAC contexts as RandomSigningKey is, and
+ * publishes it with an atomic pointer swap: requests never wait for a
+ * reload, and a file that fails to parse leaves the current table in use.
+ *
+ * Replaced tables are reclaimed as cache entries are (mod_random_cache.c):
+ * readers register in keyring->readers BEFORE loading keyring->current and
+ * unregister when done, so observing readers == 0 after a table was retired
+ * makes it safe to free. Only the watcher thread frees tables.
+ */
+
+#include "mod_random.h"
+#include "apr_atomic.h"
+#include "apr_strings.h"
+#include "apr_file_io.h"
+#include "apr_file_info.h"
+#include "apr_thread_proc.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
+#include <openssl/crypto.h>
+#include <ctype.h>
+#include <string.h>
+
+typedef struct {
+    int id;
+    random_hmac_key *key;
+} keyring_entry;
+
+/* One generation of a key file, immutable once published */
+struct random_key_table {
+    apr_pool_t *pool;                  /* Owns the table and the MAC contexts */
+    random_key_table *next_retired;    /* Retired list link (written before retiring) */
+    int count;
+    keyring_entry keys[RANDOM_KEYRING_KEYS_MAX];      /* In file order: the last one signs */
+    signed char index[RANDOM_KEY_ID_MAX + 1];         /* Key id -> keys[] index, -1 = none */
+};
+
+struct random_keyring {
+    const char *path;
+    volatile void *current;            /* random_key_table, published by atomic swap */
+    volatile void *retired;            /* Replaced tables awaiting reclamation */
+    volatile apr_uint32_t readers;     /* Threads currently using a table */
+    apr_time_t mtime;                  /* File state of the last load attempt */
+    apr_off_t size;
+};
+
+/* Process-wide state: the registry is filled while reading the config */
+static apr_array_header_t *keyring_registry = NULL;
+static apr_pool_t *keyring_pool = NULL;
+
+/* Watcher thread of this child */
+static apr_thread_t *keyring_thread = NULL;
+static apr_thread_mutex_t *keyring_mutex = NULL;
+static apr_thread_cond_t *keyring_cond = NULL;
+static volatile apr_uint32_t keyring_stopping = 0;
+static random_keyring_notify_fn keyring_notify = NULL;
+static void *keyring_notify_data = NULL;
+
+/* Parse key file contents into table (keys are scheduled into table->pool) */
+static const char *keyring_parse(apr_pool_t *scratch, random_key_table *table,
+                                 char *buf, apr_size_t len)
+{
+    char *line = buf, *end = buf + len;
+    int lineno = 0;
+
+    memset(table->index, -1, sizeof(table->index));
+
+    while (line < end) {
+        char *eol = memchr(line, '\n', (apr_size_t)(end - line));
+        char *p = line, *key, *key_end;
+        long id = 0;
+        int digits = 0;
+
+        if (!eol) {
+            eol = end;
+        }
+        line = eol + 1;
+        lineno++;
+
+        while (p < eol && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        if (p == eol || *p == '#' || *p == '\r') {
+            continue;
+        }
+
+        for (; p < eol && *p >= '0' && *p <= '9' && digits < 4; p++, digits++) {
+            id = id * 10 + (*p - '0');
+        }
+        if (digits == 0 || id > RANDOM_KEY_ID_MAX || p == eol || (*p != ' ' && *p != '\t')) {
+            return apr_psprintf(scratch, "line %d: expected \"<id 0-%d> <key>\"",
+                                lineno, RANDOM_KEY_ID_MAX);
+        }
+
+        key = p;
+        while (key < eol && (*key == ' ' || *key == '\t')) {
+            key++;
+        }
+        key_end = eol;
+        while (key_end > key && isspace((unsigned char)key_end[-1])) {
+            key_end--;
+        }
+        if (key_end == key) {
+            return apr_psprintf(scratch, "line %d: key %ld is empty", lineno, id);
+        }
+        if (table->index[id] >= 0) {
+            return apr_psprintf(scratch, "line %d: duplicate key id %ld", lineno, id);
+        }
+        if (table->count == RANDOM_KEYRING_KEYS_MAX) {
+            return apr_psprintf(scratch, "more than %d keys", RANDOM_KEYRING_KEYS_MAX);
+        }
+
+        table->keys[table->count].id = (int)id;
+        table->keys[table->count].key = random_hmac_key_create(table->pool, key,
+                                                               (apr_size_t)(key_end - key));
+        if (!table->keys[table->count].key) {
+            return apr_psprintf(scratch, "line %d: cannot initialise HMAC-SHA256 (OpenSSL error)",
+                                lineno);
+        }
+        table->index[id] = (signed char)table->count;
+        table->count++;
+    }
+
+    return table->count ? NULL : "no keys";
+}
+
+/* Read path into a new table (which owns its own root pool), or return an error */
+static const char *keyring_load(apr_pool_t *scratch, const char *path,
+                                const apr_finfo_t *finfo, random_key_table **out)
+{
+    random_key_table *table;
+    apr_pool_t *pool;
+    apr_file_t *f;
+    apr_size_t len = (apr_size_t)finfo->size, got = 0;
+    apr_status_t rv;
+    const char *error;
+    char *buf;
+
+    *out = NULL;
+    if (finfo->size > RANDOM_KEYRING_FILE_MAX) {
+        return apr_psprintf(scratch, "larger than %d bytes", RANDOM_KEYRING_FILE_MAX);
+    }
+
+    rv = apr_file_open(&f, path, APR_FOPEN_READ | APR_FOPEN_BINARY, APR_OS_DEFAULT, scratch);
+    if (rv != APR_SUCCESS) {
+        char msg[120];
+
+        return apr_psprintf(scratch, "cannot open: %s", apr_strerror(rv, msg, sizeof(msg)));
+    }
+    buf = apr_palloc(scratch, len + 1);
+    rv = apr_file_read_full(f, buf, len, &got);
+    apr_file_close(f);
+    if (rv != APR_SUCCESS && rv != APR_EOF) {
+        OPENSSL_cleanse(buf, len);
+        return "read error";
+    }
+
+    /* Own root pool: the watcher frees tables while the config pool lives on */
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS) {
+        OPENSSL_cleanse(buf, len);
+        return "out of memory";
+    }
+    table = apr_pcalloc(pool, sizeof(random_key_table));
+    table->pool = pool;
+
+    error = keyring_parse(scratch, table, buf, got);
+    OPENSSL_cleanse(buf, len);
+    if (error) {
+        apr_pool_destroy(pool);
+        return error;
+    }
+
+    *out = table;
+    return NULL;
+}
+
+/* Free a chain of retired tables */
+static void free_tables(random_key_table *table)
+{
+    while (table) {
+        random_key_table *next = table->next_retired;
+
+        apr_pool_destroy(table->pool);
+        table = next;
+    }
+}
+
+/* Free retired tables if no reader can still be using them (watcher only) */
+static void keyring_reclaim(random_keyring *kr)
+{
+    if (kr->retired && apr_atomic_read32(&kr->readers) == 0) {
+        free_tables((random_key_table *)apr_atomic_xchgptr(&kr->retired, NULL));
+    }
+}
+
+/* Config pool teardown: no request or watcher thread is running any more */
+static apr_status_t keyring_registry_cleanup(void *data)
+{
+    apr_array_header_t *registry = data;
+    int i;
+
+    for (i = 0; i < registry->nelts; i++) {
+        random_keyring *kr = APR_ARRAY_IDX(registry, i, random_keyring *);
+
+        free_tables((random_key_table *)kr->retired);
+        free_tables((random_key_table *)kr->current);
+        kr->retired = NULL;
+        kr->current = NULL;
+    }
+    if (keyring_registry == registry) {
+        keyring_registry = NULL;
+        keyring_pool = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+/* Pre-config: forget the key files of the previous generation */
+void random_keyring_registry_reset(apr_pool_t *pconf)
+{
+    keyring_registry = apr_array_make(pconf, 2, sizeof(random_keyring *));
+    keyring_pool = pconf;
+    apr_pool_cleanup_register(pconf, keyring_registry, keyring_registry_cleanup,
+                              apr_pool_cleanup_null);
+}
+
+/**
+ * Load a key file (directive time)
+ *
+ * Contexts naming the same file share one keyring and one watcher entry.
+ *
+ * @param path   Absolute path of the key file
+ * @param error  Receives the reason when NULL is returned
+ *
+ * @return Keyring whose current table holds every key of the file
+ */
+random_keyring *random_keyring_open(apr_pool_t *pool, const char *path, const char **error)
+{
+    random_keyring *kr;
+    random_key_table *table;
+    apr_finfo_t finfo;
+    apr_status_t rv;
+    int i;
+
+    if (!keyring_registry) {
+        *error = "key files can only be set in the server configuration";
+        return NULL;
+    }
+
+    for (i = 0; i < keyring_registry->nelts; i++) {
+        kr = APR_ARRAY_IDX(keyring_registry, i, random_keyring *);
+        if (strcmp(kr->path, path) == 0) {
+            return kr;
+        }
+    }
+
+    rv = apr_stat(&finfo, path, APR_FINFO_MTIME | APR_FINFO_SIZE, pool);
+    if (rv != APR_SUCCESS) {
+        char msg[120];
+
+        *error = apr_psprintf(pool, "cannot stat: %s", apr_strerror(rv, msg, sizeof(msg)));
+        return NULL;
+    }
+    *error = keyring_load(pool, path, &finfo, &table);
+    if (*error) {
+        return NULL;
+    }
+
+    kr = apr_pcalloc(keyring_pool, sizeof(random_keyring));
+    kr->path = apr_pstrdup(keyring_pool, path);
+    kr->current = table;
+    kr->mtime = finfo.mtime;
+    kr->size = finfo.size;
+    APR_ARRAY_PUSH(keyring_registry, random_keyring *) = kr;
+    return kr;
+}
+
+/**
+ * Re-read the key file if it changed, and publish the new table
+ *
+ * Called by the watcher thread; never from the request path. A table that
+ * fails to load is discarded and the current one stays in use.
+ *
+ * @param scratch  Pool for the file contents and the error message
+ * @param force    Reload even if mtime and size are unchanged
+ * @param error    Receives the reason when -1 is returned
+ *
+ * @return 1 if a new table was published, 0 if the file is unchanged, -1 on error
+ */
+int random_keyring_reload(random_keyring *kr, apr_pool_t *scratch, int force, const char **error)
+{
+    random_key_table *table, *old;
+    apr_finfo_t finfo;
+    apr_status_t rv;
+
+    *error = NULL;
+    rv = apr_stat(&finfo, kr->path, APR_FINFO_MTIME | APR_FINFO_SIZE, scratch);
+    if (rv != APR_SUCCESS) {
+        char msg[120];
+
+        if (kr->size != -1) {
+            kr->size = -1;   /* Report a missing file once, until it comes back */
+            *error = apr_psprintf(scratch, "cannot stat: %s", apr_strerror(rv, msg, sizeof(msg)));
+            return -1;
+        }
+        return 0;
+    }
+    if (!force && finfo.mtime == kr->mtime && finfo.size == kr->size) {
+        return 0;
+    }
+
+    /* Remembered even on failure: a broken file is reported once, not every poll */
+    kr->mtime = finfo.mtime;
+    kr->size = finfo.size;
+
+    *error = keyring_load(scratch, kr->path, &finfo, &table);
+    if (*error) {
+        return -1;
+    }
+
+    old = (random_key_table *)apr_atomic_xchgptr(&kr->current, table);
+    if (old) {
+        void *head;
+
+        do {
+            head = (void *)kr->retired;
+            old->next_retired = (random_key_table *)head;
+        } while (apr_atomic_casptr(&kr->retired, old, head) != head);
+    }
+    keyring_reclaim(kr);
+    return 1;
+}
+
+/**
+ * Current key table, lock-free; pair with random_keyring_release()
+ *
+ * @return Table valid until the release (never NULL for an opened keyring)
+ */
+const random_key_table *random_keyring_acquire(random_keyring *kr)
+{
+    apr_atomic_inc32(&kr->readers);   /* Full barrier: registered before the load */
+    return (const random_key_table *)kr->current;
+}
+
+void random_keyring_release(random_keyring *kr)
+{
+    apr_atomic_dec32(&kr->readers);
+}
+
+const char *random_keyring_path(const random_keyring *kr)
+{
+    return kr->path;
+}
+
+/* Key that signs new tokens (the last one in the file) and its id */
+const random_hmac_key *random_key_table_signing(const random_key_table *table, int *id)
+{
+    if (!table || table->count == 0) {
+        *id = 0;
+        return NULL;
+    }
+    *id = table->keys[table->count - 1].id;
+    return table->keys[table->count - 1].key;
+}
+
+/* Key with id, or NULL if the file no longer lists it */
+const random_hmac_key *random_key_table_find(const random_key_table *table, int id)
+{
+    if (!table || id < 0 || id > RANDOM_KEY_ID_MAX || table->index[id] < 0) {
+        return NULL;
+    }
+    return table->keys[(int)table->index[id]].key;
+}
+
+int random_key_table_count(const random_key_table *table)
+{
+    return table ? table->count : 0;
+}
+
+static void *APR_THREAD_FUNC keyring_thread_main(apr_thread_t *thd, void *data)
+{
+    apr_array_header_t *registry = data;
+    apr_pool_t *scratch = NULL;
+    int i;
+
+    apr_pool_create(&scratch, NULL);
+    while (scratch && !apr_atomic_read32(&keyring_stopping)) {
+        for (i = 0; i < registry->nelts; i++) {
+            random_keyring *kr = APR_ARRAY_IDX(registry, i, random_keyring *);
+            const char *error;
+            int rc = random_keyring_reload(kr, scratch, 0, &error);
+
+            if (rc != 0 && keyring_notify) {
+                const random_key_table *table = random_keyring_acquire(kr);
+
+                keyring_notify(keyring_notify_data, kr->path, random_key_table_count(table), error);
+                random_keyring_release(kr);
+            }
+            keyring_reclaim(kr);
+            apr_pool_clear(scratch);
+        }
+
+        apr_thread_mutex_lock(keyring_mutex);
+        if (!keyring_stopping) {
+            apr_thread_cond_timedwait(keyring_cond, keyring_mutex, RANDOM_KEYRING_POLL_INTERVAL);
+        }
+        apr_thread_mutex_unlock(keyring_mutex);
+    }
+
+    if (scratch) {
+        apr_pool_destroy(scratch);
+    }
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+/* Child exit: stop the watcher before the tables go away with the config pool */
+static apr_status_t keyring_stop(void *data)
+{
+    apr_status_t rv;
+
+    if (keyring_thread) {
+        apr_thread_mutex_lock(keyring_mutex);
+        apr_atomic_set32(&keyring_stopping, 1);
+        apr_thread_cond_signal(keyring_cond);
+        apr_thread_mutex_unlock(keyring_mutex);
+        apr_thread_join(&rv, keyring_thread);
+        keyring_thread = NULL;
+    }
+    keyring_cond = NULL;
+    keyring_mutex = NULL;
+    return APR_SUCCESS;
+}
+
+/**
+ * Start the watcher thread of this child (child_init)
+ *
+ * The first check runs at once: a child forked after the file changed
+ * does not sign with the config-time table for a whole poll interval.
+ *
+ * @param pchild    Child pool; the thread is stopped when it is destroyed
+ * @param notify    Called from the watcher after each reload or failure (may be NULL)
+ * @param keyrings  Receives the number of key files (0 = no thread started)
+ */
+apr_status_t random_keyring_start(apr_pool_t *pchild, random_keyring_notify_fn notify,
+                                  void *notify_data, int *keyrings)
+{
+    apr_threadattr_t *attr;
+    apr_status_t rv;
+
+    *keyrings = keyring_registry ? keyring_registry->nelts : 0;
+    if (*keyrings == 0 || keyring_thread) {
+        return APR_SUCCESS;
+    }
+
+    keyring_stopping = 0;
+    keyring_notify = notify;
+    keyring_notify_data = notify_data;
+    if ((rv = apr_thread_mutex_create(&keyring_mutex, APR_THREAD_MUTEX_DEFAULT, pchild)) != APR_SUCCESS ||
+        (rv = apr_thread_cond_create(&keyring_cond, pchild)) != APR_SUCCESS ||
+        (rv = apr_threadattr_create(&attr, pchild)) != APR_SUCCESS) {
+        keyring_cond = NULL;
+        keyring_mutex = NULL;
+        return rv;
+    }
+
+    apr_pool_pre_cleanup_register(pchild, NULL, keyring_stop);
+
+    rv = apr_thread_create(&keyring_thread, attr, keyring_thread_main, keyring_registry, pchild);
+    if (rv != APR_SUCCESS) {
+        keyring_thread = NULL;   /* Keys stay as read at startup */
+    }
+    return rv;
+}
@@ -0,0 +1,141 @@
+/*
+ * mod_random_lazy.c - Generate tokens on first use (RandomLazyTokens)
+ *
+ * With RandomLazyTokens On, random_fixups() only generates the eager plans
+ * (header= or eager=on), which random_plan_compile() places first. The
+ * others are generated the first time the request references them:
+ *   - %{random:NAME} or random('NAME') in any ap_expr (Header, RequestHeader,
+ *     SetEnvIfExpr, <If>, RewriteCond expr=, ...)
+ *   - just before one of the handlers listed after On runs, so CGI, FastCGI
+ *     and proxied backends still find every token in their environment
+ *
+ * A generated token is memoised in the request state and exported to
+ * subprocess_env, so every later consumer of the request sees the same value.
+ */
+
+#include "mod_random.h"
+#include "http_log.h"
+#include "http_config.h"
+#include <string.h>
+
+extern module AP_MODULE_DECLARE_DATA random_module;
+
+/* Lazy state of the main request, or NULL outside lazy mode */
+random_request_state *random_lazy_state(request_rec *r)
+{
+    random_request_state *state = random_request_state_get(r, 0);
+
+    return (state && state->cfg) ? state : NULL;
+}
+
+/* Start lazy mode for r, once its per-dir config is known */
+random_request_state *random_lazy_start(request_rec *r, const random_config *cfg)
+{
+    random_request_state *state = random_request_state_get(r, 1);
+
+    state->cfg = cfg;
+    return state;
+}
+
+/* Generate plan i of the state unless that was already attempted */
+static const char *lazy_generate(request_rec *r, random_request_state *state, int i)
+{
+    const random_token_plan *plan = &state->cfg->plans[i];
+
+    if (!state->tried[i]) {
+        state->tried[i] = 1;
+        state->tokens[i] = random_generate_token(r, plan);
+        if (state->tokens[i]) {
+            apr_table_setn(r->subprocess_env, plan->var_name, state->tokens[i]);
+        } else {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                         "mod_random: Failed to generate token for %s", plan->var_name);
+        }
+    }
+    return state->tokens[i];
+}
+
+/**
+ * Value of a token for an expression, generated on first reference
+ *
+ * @param r     Request (or subrequest) evaluating the expression
+ * @param name  Token variable name (RandomAddToken VAR)
+ *
+ * @return The token, or "" if the name is unknown or generation failed
+ */
+const char *random_lazy_token(request_rec *r, const char *name)
+{
+    random_request_state *state;
+    const char *value;
+    int i, redirected;
+
+    while (r->main) {
+        r = r->main;
+    }
+
+    state = random_lazy_state(r);
+    if (!state) {
+        /* Not in lazy mode: eager tokens are already in the memo, even output=header ones */
+        value = apr_table_get(random_request_memo(r, &redirected), name);
+        return value ? value : "";
+    }
+
+    for (i = 0; i < state->cfg->plan_count; i++) {
+        if (strcmp(state->cfg->plans[i].var_name, name) == 0) {
+            value = lazy_generate(r, state, i);
+            return value ? value : "";
+        }
+    }
+
+    return "";
+}
+
+/* Generate every token not referenced so far (before an env-reading handler) */
+void random_lazy_export(request_rec *r, random_request_state *state)
+{
+    const random_config *cfg = state->cfg;
+    int first = cfg->eager_count, i, untouched = 1;
+
+    for (i = first; i < cfg->plan_count; i++) {
+        untouched &= !state->tried[i];
+    }
+
+    if (!untouched) {
+        for (i = first; i < cfg->plan_count; i++) {
+            lazy_generate(r, state, i);
+        }
+        return;
+    }
+
+    /* Nothing was referenced yet: one random fill for the whole tail */
+    random_generate_tokens(r, cfg->plans + first, cfg->plan_count - first, state->tokens + first);
+    for (i = first; i < cfg->plan_count; i++) {
+        state->tried[i] = 1;
+        if (state->tokens[i]) {
+            apr_table_setn(r->subprocess_env, cfg->plans[i].var_name, state->tokens[i]);
+        } else {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                         "mod_random: Failed to generate token for %s", cfg->plans[i].var_name);
+        }
+    }
+}
+
+/* Whether handler is listed in RandomLazyTokens ("proxy" also matches "proxy:fcgi://...") */
+int random_lazy_handler_wants_env(const random_config *cfg, const char *handler)
+{
+    int i;
+
+    if (!cfg->lazy_handlers || !handler) {
+        return 0;
+    }
+
+    for (i = 0; i < cfg->lazy_handlers->nelts; i++) {
+        const char *name = APR_ARRAY_IDX(cfg->lazy_handlers, i, const char *);
+        apr_size_t len = strlen(name);
+
+        if (strncasecmp(handler, name, len) == 0 && (handler[len] == '\0' || handler[len] == ':')) {
+            return 1;
+        }
+    }
+    return 0;
+}
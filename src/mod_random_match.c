@@ -0,0 +1,147 @@
+/*
+ * mod_random_match.c - Literal RandomOnlyFor patterns
+ *
+ * Most RandomOnlyFor patterns are anchored literals such as "^/api/". They
+ * are recognised at config time and matched with memcmp instead of running
+ * the regex engine on every request:
+ *
+ *     ^lit$  exact       ^lit  prefix       lit$  suffix       lit  substring
+ *
+ * A literal may escape punctuation ("^/v1\.0/"); any other operator, class
+ * or escape sequence leaves the pattern to the regex engine. Like PCRE's
+ * '$', the end anchor also matches before a final newline.
+ */
+
+#include "mod_random.h"
+#include "apr_lib.h"
+#include <string.h>
+
+/* Characters with a meaning in extended regular expressions */
+static int is_regex_operator(char c)
+{
+    return c != '\0' && strchr(".[]()*+?{}|^$\\", c) != NULL;
+}
+
+/**
+ * Recognise a literal pattern
+ *
+ * @param pool     Pool for the unescaped literal
+ * @param pattern  RandomOnlyFor argument
+ * @param lit      Receives the literal when the pattern is one
+ *
+ * @return 1 if pattern is a literal with optional anchors, 0 if it needs a regex
+ */
+int random_url_literal_parse(apr_pool_t *pool, const char *pattern, random_url_literal *lit)
+{
+    const char *p = pattern, *end;
+    char *text, *out;
+    int anchored_start = 0, anchored_end = 0;
+
+    if (*p == '^') {
+        anchored_start = 1;
+        p++;
+    }
+
+    end = p + strlen(p);
+    if (end > p && end[-1] == '$') {
+        const char *q = end - 1;
+        int backslashes = 0;
+
+        while (q > p && q[-1] == '\\') {
+            backslashes++;
+            q--;
+        }
+        if (backslashes % 2 == 0) {
+            anchored_end = 1;   /* Unescaped '$' */
+            end--;
+        }
+    }
+
+    out = text = apr_palloc(pool, (apr_size_t)(end - p) + 1);
+    for (; p < end; p++) {
+        if (*p == '\\') {
+            /* \. \/ \- ... are literals; \d \w \b \1 ... are not */
+            if (p + 1 >= end || apr_isalnum(p[1])) {
+                return 0;
+            }
+            *out++ = *++p;
+        } else if (is_regex_operator(*p)) {
+            return 0;
+        } else {
+            *out++ = *p;
+        }
+    }
+    *out = '\0';
+
+    lit->text = text;
+    lit->len = (apr_size_t)(out - text);
+    lit->kind = anchored_start ? (anchored_end ? RANDOM_MATCH_EXACT : RANDOM_MATCH_PREFIX)
+                               : (anchored_end ? RANDOM_MATCH_SUFFIX : RANDOM_MATCH_CONTAINS);
+    return 1;
+}
+
+/* Whether a regex refers to one of its groups (\1 ... \9) */
+int random_pattern_has_backref(const char *pattern)
+{
+    const char *p;
+
+    for (p = pattern; *p; p++) {
+        if (*p == '\\') {
+            if (p[1] >= '1' && p[1] <= '9') {
+                return 1;
+            }
+            if (p[1]) {
+                p++;
+            }
+        }
+    }
+    return 0;
+}
+
+/* lit at the end of uri, optionally followed by one newline ('$' semantics) */
+static int literal_at_end(const random_url_literal *lit, const char *uri, apr_size_t uri_len)
+{
+    if (uri_len > 0 && uri[uri_len - 1] == '\n' && uri_len - 1 >= lit->len &&
+        memcmp(uri + uri_len - 1 - lit->len, lit->text, lit->len) == 0) {
+        return 1;
+    }
+    return uri_len >= lit->len && memcmp(uri + uri_len - lit->len, lit->text, lit->len) == 0;
+}
+
+/* Whether uri matches one literal pattern */
+int random_url_literal_match(const random_url_literal *lit, const char *uri, apr_size_t uri_len)
+{
+    switch (lit->kind) {
+    case RANDOM_MATCH_PREFIX:
+        return uri_len >= lit->len && memcmp(uri, lit->text, lit->len) == 0;
+    case RANDOM_MATCH_SUFFIX:
+        return literal_at_end(lit, uri, uri_len);
+    case RANDOM_MATCH_EXACT:
+        return (uri_len == lit->len || (uri_len == lit->len + 1 && uri[lit->len] == '\n')) &&
+               memcmp(uri, lit->text, lit->len) == 0;
+    case RANDOM_MATCH_CONTAINS:
+    default:
+        return strstr(uri, lit->text) != NULL;
+    }
+}
+
+/* Whether uri matches any literal pattern of m (regex patterns are checked by the caller) */
+int random_url_matcher_literals(const random_url_matcher *m, const char *uri)
+{
+    const random_url_literal *lits;
+    apr_size_t uri_len;
+    int i;
+
+    if (!m->literals || m->literals->nelts == 0) {
+        return 0;
+    }
+
+    uri_len = strlen(uri);
+    lits = (const random_url_literal *)m->literals->elts;
+    for (i = 0; i < m->literals->nelts; i++) {
+        if (random_url_literal_match(&lits[i], uri, uri_len)) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,721 @@
+/*
+ * mod_random_plan.c - Compile token specs into per-config generation plans
+ *
+ * A random_token_spec only records what its RandomAddToken line said; every
+ * unset field falls back to the RandomLength/RandomFormat/... defaults of
+ * the enclosing context. Resolving and validating that on each request is
+ * wasted work, so each configuration compiles its specs once into an array
+ * of random_token_plan entries:
+ *   - at merge time for <Directory>/<Location>/<VirtualHost> configs
+ *   - in check_config for each server's base config, which is never merged
+ *
+ * Every fallback a plan applies is chosen here, so generating a token never
+ * validates or logs anything. check_config also compiles each section over
+ * its server's defaults with a warnings array, which reports the fallbacks
+ * merges apply silently once at startup; random_config_check() covers the
+ * context settings that have no plan to carry a fallback.
+ *
+ * random_token_spec_parse() reads the RandomAddToken line itself, without
+ * httpd, so tests/fuzz can drive the parser and the compiler together.
+ * random_spec_intern() then maps identical lines of one server to a single
+ * spec, so repeated definitions share their fields and TTL cache.
+ *
+ * Plans generated in fixups come first (all of them unless RandomLazyTokens
+ * is on, else those with header= or eager=on), so the eager batch is one
+ * contiguous range: plans[0..eager_count). Header plans lead that range,
+ * plans[0..header_count), for RandomEarlyTokens.
+ */
+
+#include "mod_random.h"
+#include "apr_strings.h"
+#include "apr_hash.h"
+#include <openssl/crypto.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <string.h>
+
+/* Record a config-time fallback when the caller collects them
+ * (merges pass NULL and apply the same fallback silently) */
+#define PLAN_WARN(w, ...) do { \
+    if (w) { \
+        APR_ARRAY_PUSH(w, const char *) = apr_psprintf((w)->pool, __VA_ARGS__); \
+    } \
+} while (0)
+
+/* Signed metadata, with RandomSigningKey or RandomSigningKeyFile */
+#define PLAN_SIGNED(plan) ((plan)->hmac_key != NULL || (plan)->keyring != NULL)
+
+/* Whether the plan's key can compute alg (for a key file: its signing key) */
+static int plan_supports(const random_token_plan *plan, random_mac_alg_t alg)
+{
+    const random_key_table *table;
+    int id, ok;
+
+    if (!plan->keyring) {
+        return random_hmac_key_supports(plan->hmac_key, alg);
+    }
+    table = random_keyring_acquire(plan->keyring);
+    ok = random_hmac_key_supports(random_key_table_signing(table, &id), alg);
+    random_keyring_release(plan->keyring);
+    return ok;
+}
+
+/* Resolve one spec against the config defaults */
+static void random_plan_resolve(random_token_plan *plan, const random_config *cfg,
+                                const random_token_spec *spec, apr_array_header_t *warnings)
+{
+    int grouping, expiry, encode_metadata;
+
+    plan->var_name = spec->var_name;
+    plan->header_name = spec->header_name;
+    plan->output = (spec->output != RANDOM_OUTPUT_UNSET) ? spec->output :
+                   spec->header_name ? RANDOM_OUTPUT_BOTH : RANDOM_OUTPUT_ENV;
+    if (!plan->header_name) {
+        plan->output &= ~RANDOM_OUTPUT_HEADER;   /* RandomAddToken enforces it */
+    }
+    plan->stats_slot = spec->stats_slot;
+
+    /* Spec value, else config default, else module default */
+    plan->length = (spec->length != RANDOM_LENGTH_UNSET) ? spec->length :
+                   (cfg->length != RANDOM_LENGTH_UNSET) ? cfg->length : RANDOM_LENGTH_DEFAULT;
+    plan->format = (spec->format != RANDOM_FORMAT_UNSET) ? spec->format :
+                   (cfg->format != RANDOM_FORMAT_UNSET) ? cfg->format : RANDOM_FORMAT_BASE64;
+    plan->include_timestamp = (spec->include_timestamp != RANDOM_ENABLED_UNSET) ? spec->include_timestamp :
+                              (cfg->include_timestamp != RANDOM_ENABLED_UNSET) ? cfg->include_timestamp : 0;
+    plan->prefix = spec->prefix ? spec->prefix : cfg->prefix;
+    plan->suffix = spec->suffix ? spec->suffix : cfg->suffix;
+    plan->prefix_len = plan->prefix ? strlen(plan->prefix) : 0;
+    plan->suffix_len = plan->suffix ? strlen(plan->suffix) : 0;
+    plan->ttl_seconds = (spec->ttl_seconds != RANDOM_TTL_UNSET) ? spec->ttl_seconds :
+                        (cfg->ttl_seconds != RANDOM_TTL_UNSET) ? cfg->ttl_seconds : 0;
+
+    /* Directive handlers already enforce these ranges - clamp defensively */
+    if (plan->length < RANDOM_LENGTH_MIN || plan->length > RANDOM_LENGTH_MAX) {
+        PLAN_WARN(warnings, "%s: invalid token length %d, using default %d",
+                  plan->var_name, plan->length, RANDOM_LENGTH_DEFAULT);
+        plan->length = RANDOM_LENGTH_DEFAULT;
+    }
+    if (plan->format < RANDOM_FORMAT_BASE64 || plan->format > RANDOM_FORMAT_ULID) {
+        PLAN_WARN(warnings, "%s: invalid format %d, using BASE64",
+                  plan->var_name, (int)plan->format);
+        plan->format = RANDOM_FORMAT_BASE64;
+    }
+    if (plan->ttl_seconds < 0) {
+        plan->ttl_seconds = 0;
+    } else if (plan->ttl_seconds > RANDOM_TTL_MAX_SECONDS) {
+        plan->ttl_seconds = RANDOM_TTL_MAX_SECONDS;
+    }
+    plan->cache = plan->ttl_seconds > 0 ? spec->cache : NULL;
+
+    /* Custom alphabet */
+    grouping = (cfg->alphabet_grouping != RANDOM_GROUPING_UNSET) ? cfg->alphabet_grouping : 0;
+    if (grouping < 0) {
+        grouping = 0;
+    } else if (grouping > RANDOM_GROUPING_MAX) {
+        grouping = RANDOM_GROUPING_MAX;
+    }
+    if (plan->format == RANDOM_FORMAT_CUSTOM && !cfg->alphabet) {
+        PLAN_WARN(warnings, "%s: CUSTOM format requires RandomAlphabet, falling back to BASE64",
+                  plan->var_name);
+        plan->format = RANDOM_FORMAT_BASE64;
+    }
+    plan->alphabet = (plan->format == RANDOM_FORMAT_CUSTOM) ? cfg->alphabet : NULL;
+    plan->grouping = (plan->format == RANDOM_FORMAT_CUSTOM) ? grouping : 0;
+    plan->encode = random_encoder_for(plan->format, plan->alphabet);
+    plan->encode_at = random_time_encoder_for(plan->format);
+    plan->raw_length = random_raw_len(plan->format, plan->length, plan->alphabet);
+    plan->encoded_max = random_encoded_max_len(plan->format, plan->length,
+                                               plan->alphabet, plan->grouping);
+
+    /* Signed metadata: needs an expiry and a key */
+    expiry = (cfg->expiry_seconds != RANDOM_EXPIRY_UNSET) ? cfg->expiry_seconds : 0;
+    encode_metadata = (cfg->encode_metadata != RANDOM_ENABLED_UNSET) ? cfg->encode_metadata : 0;
+    if (expiry < 0) {
+        expiry = 0;
+    } else if (expiry > RANDOM_EXPIRY_MAX_SECONDS) {
+        expiry = RANDOM_EXPIRY_MAX_SECONDS;
+    }
+    if (encode_metadata && expiry > 0 && !cfg->hmac_key && !cfg->keyring) {
+        PLAN_WARN(warnings, "%s: metadata encoding requested but no RandomSigningKey configured - skipping",
+                  plan->var_name);
+    }
+    plan->hmac_key = NULL;
+    plan->keyring = NULL;
+    plan->expiry_seconds = 0;
+    if (encode_metadata && expiry > 0 && (cfg->hmac_key || cfg->keyring)) {
+        plan->expiry_seconds = expiry;
+        if (cfg->keyring) {
+            plan->keyring = cfg->keyring;   /* Key looked up per token: the file may rotate */
+        } else {
+            plan->hmac_key = cfg->hmac_key;
+        }
+    }
+
+    plan->mac_alg = (cfg->signing_alg != RANDOM_MAC_ALG_UNSET) ? (random_mac_alg_t)cfg->signing_alg
+                                                               : RANDOM_MAC_HMAC_SHA256;
+    if (PLAN_SIGNED(plan) && !plan_supports(plan, plan->mac_alg)) {
+        PLAN_WARN(warnings, "%s: RandomSigningAlgorithm %s is not available in this OpenSSL build, using hmac-sha256",
+                  plan->var_name, random_mac_alg_name(plan->mac_alg));
+        plan->mac_alg = RANDOM_MAC_HMAC_SHA256;
+    }
+
+    /* Pre-generated tokens must not depend on the time they are served at */
+    plan->prefill = NULL;
+    if (spec->prefill) {
+        if (plan->include_timestamp || plan->encode_at || PLAN_SIGNED(plan) || plan->cache) {
+            PLAN_WARN(warnings, "%s: prefill= is ignored for timestamped, uuid7, ulid, signed or ttl= tokens",
+                      plan->var_name);
+        } else {
+            plan->prefill = spec->prefill;
+        }
+    }
+
+    /* Compact signed format: the raw bytes go into the blob, whatever the format */
+    plan->compact_mac_len = 0;
+    if (PLAN_SIGNED(plan) && cfg->metadata_format == RANDOM_METADATA_COMPACT) {
+        apr_size_t blob_len;
+
+        if (plan->include_timestamp) {
+            PLAN_WARN(warnings, "%s: timestamp=on is not encoded in the compact metadata format",
+                      plan->var_name);
+            plan->include_timestamp = 0;
+        }
+        plan->compact_mac_len = (cfg->metadata_mac_length > 0) ? cfg->metadata_mac_length
+                                                               : RANDOM_COMPACT_MAC_DEFAULT;
+        if ((apr_size_t)plan->compact_mac_len > random_mac_len(plan->mac_alg)) {
+            PLAN_WARN(warnings, "%s: %s produces %d-byte MACs, truncating to that instead of %d",
+                      plan->var_name, random_mac_alg_name(plan->mac_alg),
+                      (int)random_mac_len(plan->mac_alg), plan->compact_mac_len);
+            plan->compact_mac_len = (int)random_mac_len(plan->mac_alg);
+        }
+        blob_len = (plan->keyring ? RANDOM_COMPACT_KEYED_HEADER_LEN : RANDOM_COMPACT_HEADER_LEN) +
+                   plan->length + plan->compact_mac_len;
+        plan->encode = random_encoder_for(RANDOM_FORMAT_BASE64URL, NULL);
+        plan->encode_at = NULL;
+        plan->raw_length = plan->length;
+        plan->encoded_max = random_encoded_max_len(RANDOM_FORMAT_BASE64URL, (int)blob_len, NULL, 0);
+        plan->token_max = plan->prefix_len + plan->encoded_max + plan->suffix_len + 1;
+        return;
+    }
+
+    /* [prefix][expiry:][timestamp-]<encoded>[:signature][suffix] NUL */
+    plan->token_max = plan->prefix_len + plan->encoded_max + plan->suffix_len + 1;
+    if (plan->include_timestamp) {
+        plan->token_max += RANDOM_TIME_DIGITS_MAX + 1;
+    }
+    if (PLAN_SIGNED(plan)) {
+        plan->token_max += RANDOM_TIME_DIGITS_MAX + 1 + 1 + RANDOM_SIGNATURE_MAX;
+    }
+    if (plan->keyring) {
+        plan->token_max += RANDOM_KEY_TAG_LEN;
+    }
+}
+
+/* Every setting a cached token depends on: plans that differ in any of them
+ * (a section overriding RandomPrefix, say) must not share a TTL cache.
+ * Keys are compared by identity - inherited settings share the pointer */
+static const char *plan_cache_variant(apr_pool_t *pool, const random_token_plan *plan)
+{
+    int alphabet_len = plan->alphabet ? (int)plan->alphabet->size : -1;
+
+#define VARIANT_STR(s) (s) ? (int)strlen(s) : -1, (s) ? (s) : ""
+    return apr_psprintf(pool, "%d %d %d %d %d %d %d %pp %pp %d:%s %d:%s %d:%.*s",
+                        (int)plan->format, plan->length, plan->grouping, plan->include_timestamp,
+                        plan->expiry_seconds, (int)plan->mac_alg, plan->compact_mac_len,
+                        (const void *)plan->hmac_key, (void *)plan->keyring,
+                        VARIANT_STR(plan->prefix), VARIANT_STR(plan->suffix), alphabet_len,
+                        alphabet_len > 0 ? alphabet_len : 0,
+                        plan->alphabet ? plan->alphabet->chars : "");
+#undef VARIANT_STR
+}
+
+/**
+ * Compile cfg->token_specs into cfg->plans
+ *
+ * @param pool  Pool the plans live in (the config's own pool)
+ * @param cfg   Configuration to compile (plans replaced)
+ * @param warnings  Array of const char * receiving config-time fallbacks,
+ *                  or NULL to apply them silently
+ */
+void random_plan_compile(apr_pool_t *pool, random_config *cfg, apr_array_header_t *warnings)
+{
+    const random_token_spec *specs;
+    int count, i = 0, j, pass;
+    int lazy = (cfg->lazy == 1);
+
+    count = cfg->token_specs ? cfg->token_specs->nelts : 0;
+
+    cfg->plan_count = count;
+    cfg->header_count = 0;
+    cfg->eager_count = 0;
+    cfg->plans = NULL;
+    if (count == 0) {
+        return;
+    }
+
+    /* Header plans, other eager plans, lazy plans - each in directive order */
+    cfg->plans = apr_pcalloc(pool, count * sizeof(random_token_plan));
+    specs = (const random_token_spec *)cfg->token_specs->elts;
+    for (pass = 0; pass < 3; pass++) {
+        for (j = 0; j < count; j++) {
+            const random_token_spec *spec = &specs[j];
+            int group = spec->header_name ? 0 : (!lazy || spec->eager == 1) ? 1 : 2;
+
+            if (group == pass) {
+                random_token_plan *plan = &cfg->plans[i++];
+
+                random_plan_resolve(plan, cfg, spec, warnings);
+                if (plan->cache) {
+                    plan->cache = random_cache_variant(pool, plan->cache,
+                                                       plan_cache_variant(pool, plan));
+                }
+            }
+        }
+        if (pass == 0) {
+            cfg->header_count = i;
+        } else if (pass == 1) {
+            cfg->eager_count = i;
+        }
+    }
+}
+
+/**
+ * Check the settings of a context that are not per token, and how its
+ * tokens fit them (plans compiled)
+ *
+ * @param cfg       Configuration, as merged for its section
+ * @param warnings  Array of const char * receiving fallbacks, or NULL
+ *
+ * @return Why the context cannot work as configured (startup fails), or NULL
+ */
+const char *random_config_check(const random_config *cfg, apr_array_header_t *warnings)
+{
+    int i;
+
+    /* RandomValidateToken without a key reports every token as invalid */
+    if (cfg->validate == 1 && !cfg->hmac_key && !cfg->keyring) {
+        if (cfg->validate_enforce) {
+            return "RandomValidateToken enforce=on requires RandomSigningKey or "
+                   "RandomSigningKeyFile (every request would be rejected)";
+        }
+        PLAN_WARN(warnings, "RandomValidateToken requires RandomSigningKey or "
+                  "RandomSigningKeyFile - %s will be 'invalid' for every token",
+                  cfg->validate_var);
+    }
+
+    /* The verifier strips one prefix and suffix: a signed token with its
+     * own prefix=/suffix= would never verify in this context */
+    if (cfg->validate == 1) {
+        const char *prefix = cfg->validate_prefix ? cfg->validate_prefix : cfg->prefix;
+        const char *suffix = cfg->validate_suffix ? cfg->validate_suffix : cfg->suffix;
+
+        for (i = 0; i < cfg->plan_count; i++) {
+            const random_token_plan *plan = &cfg->plans[i];
+
+            if (PLAN_SIGNED(plan) &&
+                (strcmp(plan->prefix ? plan->prefix : "", prefix ? prefix : "") != 0 ||
+                 strcmp(plan->suffix ? plan->suffix : "", suffix ? suffix : "") != 0)) {
+                PLAN_WARN(warnings, "%s: prefix/suffix differ from those RandomValidateToken "
+                          "strips - %s will be 'invalid' for these tokens (set prefix=/suffix= "
+                          "on RandomValidateToken)", plan->var_name, cfg->validate_var);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Parse the arguments of a RandomAddToken line into spec
+ *
+ * Only the line itself is read: cache, statistics slot and prefill ring are
+ * left to the directive handler, so the parser runs without a server (unit
+ * tests, tests/fuzz).
+ *
+ * @param pool     Pool the spec's strings are copied to
+ * @param args     "<variable> [key=value ...]"
+ * @param spec     Spec to fill (fields not given on the line are unset)
+ * @param prefill  Receives prefill= (0 when absent)
+ *
+ * @return Error message for the directive, or NULL
+ */
+const char *random_token_spec_parse(apr_pool_t *pool, const char *args,
+                                    random_token_spec *spec, int *prefill)
+{
+    char *token, *key, *value, *args_copy, *var_name;
+    char *endptr;
+    long num_val;
+
+    *prefill = 0;
+    if (!args || !*args) {
+        return "RandomAddToken: variable name is required";
+    }
+
+    /* Parse arguments: first token is variable name, rest are key=value pairs */
+    args_copy = apr_pstrdup(pool, args);
+    var_name = apr_strtok(args_copy, " \t", &args_copy);
+
+    if (!var_name || !*var_name) {
+        return "RandomAddToken: variable name is required";
+    }
+
+    /* Create new token spec with defaults */
+    memset(spec, 0, sizeof(*spec));
+    spec->var_name = apr_pstrdup(pool, var_name);
+    spec->length = RANDOM_LENGTH_UNSET;
+    spec->format = RANDOM_FORMAT_UNSET;
+    spec->header_name = NULL;
+    spec->output = RANDOM_OUTPUT_UNSET;
+    spec->include_timestamp = RANDOM_ENABLED_UNSET;
+    spec->prefix = NULL;
+    spec->suffix = NULL;
+    spec->ttl_seconds = RANDOM_TTL_UNSET;
+    spec->eager = RANDOM_ENABLED_UNSET;
+
+    /* Parse optional key=value arguments */
+    token = apr_strtok(NULL, " \t", &args_copy);
+    while (token) {
+        key = token;
+        value = strchr(token, '=');
+        if (!value) {
+            return apr_psprintf(pool, "RandomAddToken: invalid argument '%s' (expected key=value)", token);
+        }
+        *value++ = '\0';
+
+        if (strcasecmp(key, "length") == 0) {
+            num_val = strtol(value, &endptr, 10);
+            if (*endptr != '\0' || num_val < RANDOM_LENGTH_MIN || num_val > RANDOM_LENGTH_MAX) {
+                return apr_psprintf(pool, "RandomAddToken: invalid length %ld (must be %d-%d)",
+                                    num_val, RANDOM_LENGTH_MIN, RANDOM_LENGTH_MAX);
+            }
+            spec->length = (int)num_val;
+        } else if (strcasecmp(key, "format") == 0) {
+            if (strcasecmp(value, "base64") == 0) {
+                spec->format = RANDOM_FORMAT_BASE64;
+            } else if (strcasecmp(value, "hex") == 0) {
+                spec->format = RANDOM_FORMAT_HEX;
+            } else if (strcasecmp(value, "base64url") == 0) {
+                spec->format = RANDOM_FORMAT_BASE64URL;
+            } else if (strcasecmp(value, "custom") == 0) {
+                spec->format = RANDOM_FORMAT_CUSTOM;
+            } else if (strcasecmp(value, "uuid4") == 0) {
+                spec->format = RANDOM_FORMAT_UUID4;
+            } else if (strcasecmp(value, "uuid7") == 0) {
+                spec->format = RANDOM_FORMAT_UUID7;
+            } else if (strcasecmp(value, "ulid") == 0) {
+                spec->format = RANDOM_FORMAT_ULID;
+            } else {
+                return apr_psprintf(pool, "RandomAddToken: invalid format '%s' (must be base64, hex, base64url, custom, uuid4, uuid7 or ulid)", value);
+            }
+        } else if (strcasecmp(key, "header") == 0) {
+            spec->header_name = apr_pstrdup(pool, value);
+        } else if (strcasecmp(key, "timestamp") == 0) {
+            if (strcasecmp(value, "on") == 0 || strcasecmp(value, "1") == 0) {
+                spec->include_timestamp = 1;
+            } else if (strcasecmp(value, "off") == 0 || strcasecmp(value, "0") == 0) {
+                spec->include_timestamp = 0;
+            } else {
+                return apr_psprintf(pool, "RandomAddToken: invalid timestamp value '%s' (must be on/off)", value);
+            }
+        } else if (strcasecmp(key, "prefix") == 0) {
+            spec->prefix = apr_pstrdup(pool, value);
+        } else if (strcasecmp(key, "suffix") == 0) {
+            spec->suffix = apr_pstrdup(pool, value);
+        } else if (strcasecmp(key, "ttl") == 0) {
+            num_val = strtol(value, &endptr, 10);
+            if (*endptr != '\0' || num_val < 0 || num_val > RANDOM_TTL_MAX_SECONDS) {
+                return apr_psprintf(pool, "RandomAddToken: invalid ttl %ld (must be 0-%d)",
+                                   num_val, RANDOM_TTL_MAX_SECONDS);
+            }
+            spec->ttl_seconds = (int)num_val;
+        } else if (strcasecmp(key, "eager") == 0) {
+            if (strcasecmp(value, "on") == 0 || strcasecmp(value, "1") == 0) {
+                spec->eager = 1;
+            } else if (strcasecmp(value, "off") == 0 || strcasecmp(value, "0") == 0) {
+                spec->eager = 0;
+            } else {
+                return apr_psprintf(pool, "RandomAddToken: invalid eager value '%s' (must be on/off)", value);
+            }
+        } else if (strcasecmp(key, "output") == 0) {
+            if (strcasecmp(value, "env") == 0) {
+                spec->output = RANDOM_OUTPUT_ENV;
+            } else if (strcasecmp(value, "header") == 0) {
+                spec->output = RANDOM_OUTPUT_HEADER;
+            } else if (strcasecmp(value, "both") == 0) {
+                spec->output = RANDOM_OUTPUT_BOTH;
+            } else {
+                return apr_psprintf(pool, "RandomAddToken: invalid output '%s' (must be env, header or both)", value);
+            }
+        } else if (strcasecmp(key, "prefill") == 0) {
+            num_val = strtol(value, &endptr, 10);
+            if (*endptr != '\0' || num_val < 0 || num_val > RANDOM_PREFILL_MAX) {
+                return apr_psprintf(pool, "RandomAddToken: invalid prefill %ld (must be 0-%d)",
+                                   num_val, RANDOM_PREFILL_MAX);
+            }
+            *prefill = (int)num_val;
+        } else {
+            return apr_psprintf(pool, "RandomAddToken: unknown parameter '%s'", key);
+        }
+
+        token = apr_strtok(NULL, " \t", &args_copy);
+    }
+
+    /* header= decides where the token is generated (header plans lead), so
+     * output= cannot contradict it */
+    if (spec->output == RANDOM_OUTPUT_ENV && spec->header_name) {
+        return "RandomAddToken: output=env conflicts with header=";
+    }
+    if (spec->output != RANDOM_OUTPUT_UNSET && (spec->output & RANDOM_OUTPUT_HEADER) && !spec->header_name) {
+        return "RandomAddToken: output=header and output=both require header=";
+    }
+
+    return NULL;
+}
+
+/* Registry of the specs read from the main config, by definition and server */
+static apr_hash_t *spec_registry = NULL;
+static apr_pool_t *spec_registry_pool = NULL;
+
+/* Pre-config: forget the specs of the previous generation */
+void random_spec_registry_reset(apr_pool_t *pconf)
+{
+    spec_registry = apr_hash_make(pconf);
+    spec_registry_pool = pconf;
+}
+
+/* Post-config: .htaccess specs are parsed per request and never shared */
+void random_spec_registry_close(void)
+{
+    spec_registry = NULL;
+    spec_registry_pool = NULL;
+}
+
+/* Registry key: every parsed field, strings length-prefixed so none can run
+ * into the next */
+static const char *spec_key(apr_pool_t *pool, const random_token_spec *spec,
+                            int prefill, const void *owner)
+{
+#define SPEC_KEY_STR(s) (s) ? (int)strlen(s) : -1, (s) ? (s) : ""
+    return apr_psprintf(pool, "%pp %d %d %d %d %d %d %d %d:%s %d:%s %d:%s %d:%s",
+                        owner, spec->length, (int)spec->format, spec->output,
+                        spec->include_timestamp, spec->ttl_seconds, spec->eager, prefill,
+                        SPEC_KEY_STR(spec->var_name), SPEC_KEY_STR(spec->header_name),
+                        SPEC_KEY_STR(spec->prefix), SPEC_KEY_STR(spec->suffix));
+#undef SPEC_KEY_STR
+}
+
+/**
+ * Find the registered spec of a parsed RandomAddToken line (directive time)
+ *
+ * Identical lines of one server - the same Include in many <Location>
+ * sections, say - resolve to one spec, so they share its parsed fields and
+ * TTL cache instead of each creating its own. Sections whose defaults make
+ * the token differ still get separate caches (random_cache_variant()).
+ * Servers never share: a cached token stays within its virtual host.
+ *
+ * @param ptemp    Scratch pool for the lookup key
+ * @param spec     Parsed spec (cache unset)
+ * @param prefill  prefill= count of the line
+ * @param owner    Server the line belongs to
+ * @param created  Set to 1 when the returned spec is new: the caller
+ *                 completes its cache
+ *
+ * @return The registered spec, or NULL once the config is read
+ */
+random_token_spec *random_spec_intern(apr_pool_t *ptemp, const random_token_spec *spec,
+                                      int prefill, const void *owner, int *created)
+{
+    random_token_spec *shared;
+    const char *key;
+
+    *created = 0;
+    if (!spec_registry) {
+        return NULL;
+    }
+
+    key = spec_key(ptemp, spec, prefill, owner);
+    shared = apr_hash_get(spec_registry, key, APR_HASH_KEY_STRING);
+    if (!shared) {
+        shared = apr_pmemdup(spec_registry_pool, spec, sizeof(random_token_spec));
+        apr_hash_set(spec_registry, apr_pstrdup(spec_registry_pool, key), APR_HASH_KEY_STRING, shared);
+        *created = 1;
+    }
+    return shared;
+}
+
+/* Text token body: [expiry:][timestamp-]<encoded>[:signature]
+ * (0 if the signature could not be computed) */
+static apr_size_t random_plan_assemble_text(const random_token_plan *plan, char *out,
+                                            const unsigned char *bytes, apr_time_t now,
+                                            random_stats_counters *stats)
+{
+    char *p = out;
+    apr_uint64_t t0 = 0, t1;
+    apr_size_t n;
+
+    if (PLAN_SIGNED(plan)) {
+        p += apr_snprintf(p, RANDOM_TIME_DIGITS_MAX + 2, "%ld:",
+                          (long)(apr_time_sec(now) + plan->expiry_seconds));
+    }
+
+    if (plan->include_timestamp) {
+        p += apr_snprintf(p, RANDOM_TIME_DIGITS_MAX + 2, "%ld-", (long)apr_time_sec(now));
+    }
+
+    if (plan->encode_at) {
+        p += plan->encode_at(p, bytes, now);
+    } else {
+        p += plan->encode(p, bytes, plan->length, plan->alphabet, plan->grouping);
+    }
+
+    if (PLAN_SIGNED(plan)) {
+        apr_size_t signed_len = p - out;
+
+        if (stats) {
+            t0 = random_stats_clock();
+        }
+        *p++ = ':';
+        n = 0;
+        if (plan->keyring) {
+            const random_key_table *table = random_keyring_acquire(plan->keyring);
+            const random_hmac_key *key;
+            unsigned char kid;
+            int id;
+
+            /* "k<id>." then the signature, as random_token_verify_keyring() expects */
+            key = random_key_table_signing(table, &id);
+            kid = (unsigned char)id;
+            *p++ = 'k';
+            p += random_encode_hex_into(p, &kid, 1, NULL, 0);
+            *p++ = '.';
+            n = random_sign_into(p, key, plan->mac_alg, out, signed_len);
+            random_keyring_release(plan->keyring);
+        } else {
+            n = random_sign_into(p, plan->hmac_key, plan->mac_alg, out, signed_len);
+        }
+        if (stats) {
+            t1 = random_stats_clock();
+            stats->hmac_ns += t1 - t0;
+            stats->encode_ns -= t1 - t0;   /* The caller times the whole assembly */
+        }
+        if (n == 0) {
+            return 0;
+        }
+        p += n;
+    }
+
+    return p - out;
+}
+
+/* Compact signed token, base64url of
+ * [version][algorithm << 6 | MAC length][expiry, 4 bytes big-endian][random bytes][truncated MAC]
+ * with the MAC computed over everything before it; version 2 (key file)
+ * has the key id byte after the algorithm byte (0 if the MAC could not be
+ * computed) */
+static apr_size_t random_plan_assemble_compact(const random_token_plan *plan, char *out,
+                                               const unsigned char *bytes, apr_time_t now,
+                                               random_stats_counters *stats)
+{
+    apr_uint64_t t0 = 0, t1;
+    unsigned char blob[RANDOM_COMPACT_MAX], digest[RANDOM_HMAC_DIGEST_LEN];
+    apr_uint32_t expiry = (apr_uint32_t)(apr_time_sec(now) + plan->expiry_seconds);
+    const random_key_table *table = NULL;
+    const random_hmac_key *key = plan->hmac_key;
+    apr_size_t h = 1, n, len = 0;
+    int id, signed_ok;
+
+    blob[0] = RANDOM_COMPACT_VERSION;
+    blob[h++] = (unsigned char)((plan->mac_alg << 6) | plan->compact_mac_len);
+    if (plan->keyring) {
+        table = random_keyring_acquire(plan->keyring);
+        key = random_key_table_signing(table, &id);
+        blob[0] = RANDOM_COMPACT_VERSION_KEYED;
+        blob[h++] = (unsigned char)id;
+    }
+    blob[h++] = (unsigned char)(expiry >> 24);
+    blob[h++] = (unsigned char)(expiry >> 16);
+    blob[h++] = (unsigned char)(expiry >> 8);
+    blob[h++] = (unsigned char)expiry;
+    memcpy(blob + h, bytes, plan->length);
+    n = h + (apr_size_t)plan->length;
+
+    if (stats) {
+        t0 = random_stats_clock();
+    }
+    signed_ok = random_hmac_key_mac(key, plan->mac_alg, (const char *)blob, n, digest) != 0;
+    if (table) {
+        random_keyring_release(plan->keyring);
+    }
+    if (stats) {
+        t1 = random_stats_clock();
+        stats->hmac_ns += t1 - t0;
+        stats->encode_ns -= t1 - t0;
+    }
+    if (signed_ok) {
+        memcpy(blob + n, digest, plan->compact_mac_len);
+        n += plan->compact_mac_len;
+        len = plan->encode(out, blob, (int)n, NULL, 0);
+    }
+
+    /* The blob holds the raw random bytes */
+    OPENSSL_cleanse(blob, n);
+    OPENSSL_cleanse(digest, sizeof(digest));
+    return len;
+}
+
+/**
+ * Write a complete token into out (plan->token_max bytes)
+ *
+ * Layout: [prefix][expiry:][timestamp-]<encoded>[:signature][suffix] NUL.
+ * The signature is the HMAC of "expiry:[timestamp-]encoded", computed over
+ * the bytes already in out, as random_encode_with_metadata() signs it.
+ * With RandomMetadataFormat compact: [prefix]<base64url blob>[suffix] NUL.
+ *
+ * @param bytes  plan->raw_length random bytes
+ * @param now    Request-time clock for the timestamp and expiry
+ *
+ * @return Token length, without the NUL, or 0 if OpenSSL failed to sign it
+ *         (out is then empty and the token must not be served or cached)
+ */
+apr_size_t random_plan_assemble(const random_token_plan *plan, char *out,
+                                const unsigned char *bytes, apr_time_t now)
+{
+    return random_plan_assemble_timed(plan, out, bytes, now, NULL);
+}
+
+/* random_plan_assemble(), adding its encode and HMAC time to stats (if not NULL) */
+apr_size_t random_plan_assemble_timed(const random_token_plan *plan, char *out,
+                                      const unsigned char *bytes, apr_time_t now,
+                                      random_stats_counters *stats)
+{
+    char *p = out;
+    apr_uint64_t t0 = stats ? random_stats_clock() : 0;
+    apr_size_t body;
+
+    if (plan->prefix_len) {
+        memcpy(p, plan->prefix, plan->prefix_len);
+        p += plan->prefix_len;
+    }
+
+    if (plan->compact_mac_len) {
+        body = random_plan_assemble_compact(plan, p, bytes, now, stats);
+    } else {
+        body = random_plan_assemble_text(plan, p, bytes, now, stats);
+    }
+    if (body == 0) {
+        OPENSSL_cleanse(out, plan->token_max);   /* The unsigned body is never served */
+        return 0;
+    }
+    p += body;
+
+    if (plan->suffix_len) {
+        memcpy(p, plan->suffix, plan->suffix_len);
+        p += plan->suffix_len;
+    }
+    *p = '\0';
+
+    if (stats) {
+        stats->encode_ns += random_stats_clock() - t0;
+    }
+
+    return p - out;
+}
@@ -0,0 +1,456 @@
+/*
+ * mod_random_prefill.c - Rings of pre-generated tokens (RandomAddToken prefill=N)
+ *
+ * Each prefill= spec owns a ring of fully assembled tokens. One background
+ * thread per child keeps every ring full; request threads pop a token with
+ * a single CAS and copy it into r->pool, falling back to inline generation
+ * when the ring is empty.
+ *
+ * The ring is a bounded MPMC queue (D. Vyukov): every cell carries a
+ * sequence number telling whether it holds a token for the current lap
+ * (seq == pos + 1) or is free for the producer (seq == pos). Producer and
+ * consumers only meet on the cell they both touch, and the enqueue and
+ * dequeue positions live on separate cache lines.
+ *
+ * A ring is bound to the first plan that pops from it, after fork: the
+ * ring copies the plan (and the prefix, suffix and alphabet it points to,
+ * which may live in a request pool) and only serves requests whose plan
+ * produces the same tokens. Cells are sized to the plan and the ring is
+ * capped at RANDOM_PREFILL_RING_BYTES so it stays in L2. Served cells are
+ * wiped; nothing is generated before the child forks, so children never
+ * share tokens.
+ */
+
+#include "mod_random.h"
+#include "apr_atomic.h"
+#include "apr_general.h"
+#include "apr_thread_proc.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
+#include <openssl/crypto.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PREFILL_CACHE_LINE 64
+#define PREFILL_IDLE_WAIT  apr_time_from_sec(1)   /* Safety net for a missed wakeup */
+
+/* Cell sequence numbers: acquire loads pair with release stores */
+#if defined(__GNUC__)
+#define PREFILL_LOAD_ACQUIRE(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define PREFILL_STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#else
+#define PREFILL_LOAD_ACQUIRE(p)     apr_atomic_add32((p), 0)     /* Full barrier */
+#define PREFILL_STORE_RELEASE(p, v) apr_atomic_xchg32((p), (v))  /* Full barrier */
+#endif
+
+/* Ring states */
+#define PREFILL_UNBOUND 0   /* No plan yet */
+#define PREFILL_BINDING 1   /* One request thread is allocating the ring */
+#define PREFILL_READY   2   /* Cells allocated, the producer fills them */
+#define PREFILL_FAILED  3   /* Allocation failed: always generate inline */
+
+/* Cell header; the token follows, up to plan.token_max bytes with its NUL */
+typedef struct {
+    volatile apr_uint32_t seq;
+    apr_uint32_t len;
+} prefill_cell;
+
+struct random_prefill {
+    const char *name;                  /* Token variable name */
+    apr_uint32_t requested;            /* prefill= count */
+    volatile apr_uint32_t state;       /* PREFILL_* */
+
+    /* Written once while binding, read-only afterwards */
+    random_token_plan plan;            /* Copy pointing at the strings below */
+    random_alphabet alphabet;
+    char *strings;                     /* malloc: prefix, suffix, alphabet symbols */
+    unsigned char *cells;              /* malloc: capacity cells of cell_size bytes */
+    apr_size_t cell_size;
+    apr_uint32_t mask;                 /* capacity - 1 */
+
+    volatile apr_uint32_t empty;       /* Pops that found no token */
+    volatile apr_uint32_t mismatched;  /* Pops from another plan */
+
+    char pad1[PREFILL_CACHE_LINE];
+    volatile apr_uint32_t enqueue_pos; /* Written by the producer only */
+    char pad2[PREFILL_CACHE_LINE];
+    volatile apr_uint32_t dequeue_pos; /* Claimed by consumers with CAS */
+    char pad3[PREFILL_CACHE_LINE];
+};
+
+/* Process-wide state: the registry is filled while reading the config */
+static apr_array_header_t *prefill_registry = NULL;
+static int prefill_open = 0;
+
+/* Producer thread of this child */
+static apr_thread_t *prefill_thread = NULL;
+static apr_thread_mutex_t *prefill_mutex = NULL;
+static apr_thread_cond_t *prefill_cond = NULL;
+static volatile apr_uint32_t prefill_wake_pending = 0;
+static volatile apr_uint32_t prefill_stopping = 0;
+
+static prefill_cell *prefill_cell_at(const random_prefill *pf, apr_uint32_t pos)
+{
+    return (prefill_cell *)(pf->cells + (apr_size_t)(pos & pf->mask) * pf->cell_size);
+}
+
+/* Pre-config: forget the rings of the previous generation */
+void random_prefill_registry_reset(apr_pool_t *pconf)
+{
+    prefill_registry = apr_array_make(pconf, 4, sizeof(random_prefill *));
+    prefill_open = 1;
+}
+
+/* Post-config: rings can only be created while reading the main config */
+void random_prefill_registry_close(void)
+{
+    prefill_open = 0;
+}
+
+/**
+ * Create the ring of a prefill= spec (directive time)
+ *
+ * @param pool   Config pool
+ * @param name   Token variable name (stats)
+ * @param count  Tokens to keep ready (clamped to RANDOM_PREFILL_RING_BYTES)
+ *
+ * @return The ring, or NULL once the config is read (.htaccess specs
+ *         cannot prefill: the producer thread is already running)
+ */
+random_prefill *random_prefill_create(apr_pool_t *pool, const char *name, int count)
+{
+    random_prefill *pf;
+
+    if (!prefill_open || !prefill_registry) {
+        return NULL;
+    }
+
+    pf = apr_pcalloc(pool, sizeof(random_prefill));
+    pf->name = name;
+    pf->requested = (apr_uint32_t)count;
+    pf->state = PREFILL_UNBOUND;
+    APR_ARRAY_PUSH(prefill_registry, random_prefill *) = pf;
+
+    return pf;
+}
+
+/* Whether two plans produce interchangeable tokens */
+static int prefill_plan_matches(const random_token_plan *a, const random_token_plan *b)
+{
+    if (a->length != b->length || a->format != b->format || a->encode != b->encode ||
+        a->grouping != b->grouping || a->include_timestamp != b->include_timestamp ||
+        a->prefix_len != b->prefix_len || a->suffix_len != b->suffix_len ||
+        !a->alphabet != !b->alphabet) {
+        return 0;
+    }
+    if (a->prefix_len && a->prefix != b->prefix && memcmp(a->prefix, b->prefix, a->prefix_len) != 0) {
+        return 0;
+    }
+    if (a->suffix_len && a->suffix != b->suffix && memcmp(a->suffix, b->suffix, a->suffix_len) != 0) {
+        return 0;
+    }
+    return !a->alphabet || a->alphabet == b->alphabet ||
+           (a->alphabet->size == b->alphabet->size &&
+            memcmp(a->alphabet->lut, b->alphabet->lut, sizeof(a->alphabet->lut)) == 0);
+}
+
+/* Allocate the cells for plan and copy what it points to (winner of the BINDING CAS) */
+static apr_status_t prefill_bind(random_prefill *pf, const random_token_plan *plan)
+{
+    apr_size_t strings_len, cell_size;
+    apr_uint32_t capacity = 2, i;
+    char *p;
+
+    cell_size = APR_ALIGN(sizeof(prefill_cell) + plan->token_max, PREFILL_CACHE_LINE);
+    while (capacity < pf->requested && capacity * 2 * cell_size <= RANDOM_PREFILL_RING_BYTES) {
+        capacity <<= 1;
+    }
+
+    strings_len = plan->prefix_len + 1 + plan->suffix_len + 1 +
+                  (plan->alphabet ? (apr_size_t)plan->alphabet->size + 1 : 0);
+    pf->strings = malloc(strings_len);
+    pf->cells = malloc((apr_size_t)capacity * cell_size);
+    if (!pf->strings || !pf->cells) {
+        free(pf->strings);
+        free(pf->cells);
+        pf->strings = NULL;
+        pf->cells = NULL;
+        return APR_ENOMEM;
+    }
+
+    pf->plan = *plan;
+    pf->plan.var_name = pf->name;
+    pf->plan.header_name = NULL;
+
+    p = pf->strings;
+    memcpy(p, plan->prefix ? plan->prefix : "", plan->prefix_len + 1);
+    pf->plan.prefix = plan->prefix ? p : NULL;
+    p += plan->prefix_len + 1;
+    memcpy(p, plan->suffix ? plan->suffix : "", plan->suffix_len + 1);
+    pf->plan.suffix = plan->suffix ? p : NULL;
+    p += plan->suffix_len + 1;
+    if (plan->alphabet) {
+        pf->alphabet = *plan->alphabet;
+        memcpy(p, plan->alphabet->chars, (apr_size_t)plan->alphabet->size);
+        p[plan->alphabet->size] = '\0';
+        pf->alphabet.chars = p;
+        pf->plan.alphabet = &pf->alphabet;
+    }
+
+    pf->cell_size = cell_size;
+    pf->mask = capacity - 1;
+    for (i = 0; i < capacity; i++) {
+        prefill_cell_at(pf, i)->seq = i;
+    }
+    pf->enqueue_pos = 0;
+    pf->dequeue_pos = 0;
+
+    return APR_SUCCESS;
+}
+
+/* Ask the producer to refill (cheap when a wakeup is already pending) */
+static void prefill_wake(void)
+{
+    if (!prefill_cond || apr_atomic_read32(&prefill_wake_pending)) {
+        return;
+    }
+    apr_thread_mutex_lock(prefill_mutex);
+    apr_atomic_set32(&prefill_wake_pending, 1);
+    apr_thread_cond_signal(prefill_cond);
+    apr_thread_mutex_unlock(prefill_mutex);
+}
+
+/**
+ * Take a pre-generated token
+ *
+ * @param pf    Ring of the spec (plan->prefill)
+ * @param plan  Plan of the calling request; the first one binds the ring
+ * @param pool  Pool the token is copied into
+ *
+ * @return The token, or NULL if the caller must generate it inline
+ */
+char *random_prefill_pop(random_prefill *pf, const random_token_plan *plan, apr_pool_t *pool)
+{
+    apr_uint32_t state, pos, seq, level;
+    prefill_cell *cell;
+    char *token;
+
+    state = PREFILL_LOAD_ACQUIRE(&pf->state);
+    if (state != PREFILL_READY) {
+        if (state == PREFILL_UNBOUND &&
+            apr_atomic_cas32(&pf->state, PREFILL_BINDING, PREFILL_UNBOUND) == PREFILL_UNBOUND) {
+            if (prefill_bind(pf, plan) == APR_SUCCESS) {
+                PREFILL_STORE_RELEASE(&pf->state, PREFILL_READY);
+                prefill_wake();
+            } else {
+                apr_atomic_set32(&pf->state, PREFILL_FAILED);
+            }
+        }
+        return NULL;
+    }
+
+    if (!prefill_plan_matches(&pf->plan, plan)) {
+        apr_atomic_inc32(&pf->mismatched);
+        return NULL;
+    }
+
+    pos = apr_atomic_read32(&pf->dequeue_pos);
+    for (;;) {
+        apr_uint32_t seen;
+
+        cell = prefill_cell_at(pf, pos);
+        seq = PREFILL_LOAD_ACQUIRE(&cell->seq);
+        if (seq == pos + 1) {
+            seen = apr_atomic_cas32(&pf->dequeue_pos, pos + 1, pos);
+            if (seen == pos) {
+                break;
+            }
+            pos = seen;      /* Another consumer took it */
+        } else if ((apr_int32_t)(seq - (pos + 1)) < 0) {
+            apr_atomic_inc32(&pf->empty);
+            prefill_wake();
+            return NULL;     /* Producer has not refilled this cell yet */
+        } else {
+            pos = apr_atomic_read32(&pf->dequeue_pos);
+        }
+    }
+
+    token = apr_palloc(pool, cell->len + 1);
+    memcpy(token, (char *)(cell + 1), cell->len + 1);
+    OPENSSL_cleanse((char *)(cell + 1), cell->len);
+    PREFILL_STORE_RELEASE(&cell->seq, pos + pf->mask + 1);
+
+    /* Refill once half the ring is consumed */
+    level = apr_atomic_read32(&pf->enqueue_pos) - (pos + 1);
+    if (level <= (pf->mask + 1) / 2) {
+        prefill_wake();
+    }
+
+    return token;
+}
+
+/* Fill every free cell of a ready ring; returns the number of tokens produced */
+static apr_uint32_t prefill_refill(random_prefill *pf, unsigned char *raw)
+{
+    const random_token_plan *plan = &pf->plan;
+    apr_uint32_t batch_max, produced = 0, pos, k, j;
+    apr_time_t now;
+
+    if (PREFILL_LOAD_ACQUIRE(&pf->state) != PREFILL_READY) {
+        return 0;
+    }
+
+    batch_max = (apr_uint32_t)(RANDOM_PREFILL_BATCH_BYTES / plan->raw_length);
+    pos = pf->enqueue_pos;
+
+    while (!apr_atomic_read32(&prefill_stopping)) {
+        /* Free cells ahead of the producer: seq == pos */
+        for (k = 0; k < batch_max && k <= pf->mask; k++) {
+            if (PREFILL_LOAD_ACQUIRE(&prefill_cell_at(pf, pos + k)->seq) != pos + k) {
+                break;
+            }
+        }
+        if (k == 0 || random_fill_bytes(raw, (apr_size_t)k * plan->raw_length) != APR_SUCCESS) {
+            break;
+        }
+
+        now = apr_time_now();
+        for (j = 0; j < k; j++) {
+            prefill_cell *cell = prefill_cell_at(pf, pos + j);
+
+            cell->len = (apr_uint32_t)random_plan_assemble(plan, (char *)(cell + 1),
+                                                           raw + (apr_size_t)j * plan->raw_length, now);
+            PREFILL_STORE_RELEASE(&cell->seq, pos + j + 1);
+        }
+        OPENSSL_cleanse(raw, (apr_size_t)k * plan->raw_length);
+
+        pos += k;
+        produced += k;
+        apr_atomic_set32(&pf->enqueue_pos, pos);
+    }
+
+    return produced;
+}
+
+static void *APR_THREAD_FUNC prefill_thread_main(apr_thread_t *thd, void *data)
+{
+    apr_array_header_t *registry = data;
+    unsigned char *raw = malloc(RANDOM_PREFILL_BATCH_BYTES);
+    int i;
+
+    while (raw && !apr_atomic_read32(&prefill_stopping)) {
+        for (i = 0; i < registry->nelts; i++) {
+            prefill_refill(APR_ARRAY_IDX(registry, i, random_prefill *), raw);
+        }
+
+        /* Every ring is full: sleep until a consumer drains one */
+        apr_thread_mutex_lock(prefill_mutex);
+        if (!prefill_wake_pending && !prefill_stopping) {
+            apr_thread_cond_timedwait(prefill_cond, prefill_mutex, PREFILL_IDLE_WAIT);
+        }
+        apr_atomic_set32(&prefill_wake_pending, 0);
+        apr_thread_mutex_unlock(prefill_mutex);
+    }
+
+    free(raw);
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+/* Child exit: stop the producer, then wipe and free the rings */
+static apr_status_t prefill_stop(void *data)
+{
+    apr_array_header_t *registry = data;
+    apr_status_t rv;
+    int i;
+
+    if (prefill_thread) {
+        apr_thread_mutex_lock(prefill_mutex);
+        apr_atomic_set32(&prefill_stopping, 1);
+        apr_thread_cond_signal(prefill_cond);
+        apr_thread_mutex_unlock(prefill_mutex);
+        apr_thread_join(&rv, prefill_thread);
+        prefill_thread = NULL;
+    }
+    prefill_cond = NULL;
+    prefill_mutex = NULL;
+
+    for (i = 0; i < registry->nelts; i++) {
+        random_prefill *pf = APR_ARRAY_IDX(registry, i, random_prefill *);
+
+        if (pf->cells) {
+            OPENSSL_cleanse(pf->cells, (apr_size_t)(pf->mask + 1) * pf->cell_size);
+            free(pf->cells);
+            free(pf->strings);
+            pf->cells = NULL;
+            pf->strings = NULL;
+        }
+        pf->state = PREFILL_UNBOUND;
+    }
+
+    return APR_SUCCESS;
+}
+
+/**
+ * Start the producer thread of this child (child_init)
+ *
+ * @param pchild  Child pool; the thread is stopped when it is destroyed
+ * @param rings   Receives the number of prefill= rings (0 = no thread started)
+ */
+apr_status_t random_prefill_start(apr_pool_t *pchild, int *rings)
+{
+    apr_threadattr_t *attr;
+    apr_status_t rv;
+
+    *rings = prefill_registry ? prefill_registry->nelts : 0;
+    if (*rings == 0 || prefill_thread) {
+        return APR_SUCCESS;
+    }
+
+    prefill_stopping = 0;
+    prefill_wake_pending = 0;
+    if ((rv = apr_thread_mutex_create(&prefill_mutex, APR_THREAD_MUTEX_DEFAULT, pchild)) != APR_SUCCESS ||
+        (rv = apr_thread_cond_create(&prefill_cond, pchild)) != APR_SUCCESS ||
+        (rv = apr_threadattr_create(&attr, pchild)) != APR_SUCCESS) {
+        prefill_cond = NULL;
+        prefill_mutex = NULL;
+        return rv;
+    }
+
+    /* Before subpools go away: the thread must not outlive the cells */
+    apr_pool_pre_cleanup_register(pchild, prefill_registry, prefill_stop);
+
+    rv = apr_thread_create(&prefill_thread, attr, prefill_thread_main, prefill_registry, pchild);
+    if (rv != APR_SUCCESS) {
+        prefill_thread = NULL;
+        prefill_cond = NULL;   /* Rings still bind, but stay empty: requests generate inline */
+    }
+    return rv;
+}
+
+/* Number of rings, for random_prefill_stats_get() */
+int random_prefill_count(void)
+{
+    return prefill_registry ? prefill_registry->nelts : 0;
+}
+
+/* Counters of ring index (0 <= index < random_prefill_count()) */
+void random_prefill_stats_get(int index, random_prefill_stats *stats)
+{
+    random_prefill *pf = APR_ARRAY_IDX(prefill_registry, index, random_prefill *);
+    int ready = (PREFILL_LOAD_ACQUIRE(&pf->state) == PREFILL_READY);
+
+    memset(stats, 0, sizeof(*stats));
+    stats->name = pf->name;
+    stats->empty = apr_atomic_read32(&pf->empty);
+    stats->mismatched = apr_atomic_read32(&pf->mismatched);
+    if (ready) {
+        stats->capacity = pf->mask + 1;
+        stats->served = apr_atomic_read32(&pf->dequeue_pos);
+        stats->produced = apr_atomic_read32(&pf->enqueue_pos);
+        stats->level = stats->produced - stats->served;
+        if (stats->level > stats->capacity) {
+            stats->level = 0;   /* Positions read at different times */
+        }
+    }
+}
@@ -0,0 +1,109 @@
+/*
+ * mod_random_request.c - Per-request state
+ *
+ * Subrequests share the state of their main request. Internal redirects
+ * (ErrorDocument, DirectoryIndex, mod_rewrite [PT], ...) get a new
+ * request_rec, but their tokens come from the memo of the origin request
+ * - the one the client sent - so a client request generates each token
+ * once and every hop logs and sends the same value.
+ *
+ * The origin's state also holds the RandomAllocTrace record, which every
+ * hop of the chain adds to (-DRANDOM_ALLOC_TRACE builds only).
+ */
+
+#include "mod_random.h"
+#include "http_config.h"
+
+extern module AP_MODULE_DECLARE_DATA random_module;
+
+/* Client request r belongs to: up through main requests and internal redirects */
+static request_rec *random_request_origin(request_rec *r, int *redirected)
+{
+    *redirected = 0;
+    for (;;) {
+        if (r->main) {
+            r = r->main;
+        } else if (r->prev) {
+            r = r->prev;
+            *redirected = 1;
+        } else {
+            return r;
+        }
+    }
+}
+
+#ifdef RANDOM_ALLOC_TRACE
+/* Start the origin's trace, or charge it a redirect's new state */
+static void random_request_trace_state(request_rec *r, random_request_state *state)
+{
+    random_request_state *origin_state;
+    request_rec *origin;
+    int redirected;
+
+    if (random_alloc_trace_get_sample() == 0) {
+        return;
+    }
+    origin = random_request_origin(r, &redirected);
+    if (origin == r) {
+        /* The record itself is tracing overhead, not counted */
+        state->alloc_trace = apr_pcalloc(r->pool, sizeof(random_alloc_trace));
+        origin_state = state;
+    } else {
+        origin_state = random_request_state_get(origin, 1);
+    }
+    random_alloc_record(origin_state->alloc_trace, NULL, sizeof(random_request_state), 1);
+}
+#endif
+
+/* State of the main request, created on demand if create is set */
+random_request_state *random_request_state_get(request_rec *r, int create)
+{
+    random_request_state *state;
+
+    while (r->main) {
+        r = r->main;  /* Subrequests share the tokens of their main request */
+    }
+
+    state = ap_get_module_config(r->request_config, &random_module);
+    if (!state && create) {
+        state = apr_pcalloc(r->pool, sizeof(random_request_state));
+        ap_set_module_config(r->request_config, &random_module, state);
+#ifdef RANDOM_ALLOC_TRACE
+        random_request_trace_state(r, state);
+#endif
+    }
+    return state;
+}
+
+/**
+ * Tokens already generated for the client request r belongs to
+ *
+ * @param r           Any request of the chain (main, subrequest or redirect)
+ * @param redirected  Set to 1 if r is an internal redirect, so the memo may
+ *                    hold tokens worth reusing; 0 for the origin itself
+ *
+ * @return The origin's var_name -> token table (never NULL)
+ */
+apr_table_t *random_request_memo(request_rec *r, int *redirected)
+{
+    random_request_state *state;
+
+    r = random_request_origin(r, redirected);
+    state = random_request_state_get(r, 1);
+    if (!state->issued) {
+        state->issued = apr_table_make(r->pool, 4);
+        /* The entry array; APR's table header is opaque */
+        RANDOM_ALLOC_RECORD(state->alloc_trace, NULL, 4 * sizeof(apr_table_entry_t));
+    }
+    return state->issued;
+}
+
+/* RandomAllocTrace record of the client request r belongs to, if it is traced */
+random_alloc_trace *random_request_alloc_trace(request_rec *r)
+{
+    random_request_state *state;
+    int redirected;
+
+    state = random_request_state_get(random_request_origin(r, &redirected), 0);
+    return state ? state->alloc_trace : NULL;
+}
@@ -0,0 +1,297 @@
+/*
+ * mod_random_simd.c - Vectorised hex and base64/base64url encoders
+ *
+ * Selected once at config time by random_encoder_for() (see
+ * mod_random_encode.c) through runtime CPU detection:
+ *   - x86: AVX2, else SSSE3 (pshufb), via GCC/clang target attributes so the
+ *     module builds without -mavx2 and still runs on older CPUs
+ *   - AArch64: NEON (always present)
+ * Each kernel handles whole blocks and hands the tail to the scalar "into"
+ * encoder, which therefore stays the reference for every length.
+ *
+ * Build with -DRANDOM_NO_SIMD to use the scalar encoders only.
+ */
+
+#include "mod_random.h"
+
+#if !defined(RANDOM_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RANDOM_SIMD_X86 1
+#include <immintrin.h>
+#elif !defined(RANDOM_NO_SIMD) && defined(__aarch64__)
+#define RANDOM_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* Last two base64 symbols: the only difference between the alphabets */
+#define B64_STD_62  '+'
+#define B64_STD_63  '/'
+#define B64_URL_62  '-'
+#define B64_URL_63  '_'
+
+#ifdef RANDOM_SIMD_X86
+
+/* --- SSSE3 --------------------------------------------------------------- */
+
+__attribute__((target("ssse3")))
+static apr_size_t hex_ssse3(char *out, const unsigned char *data, int length,
+                            const random_alphabet *alphabet, int grouping)
+{
+    const __m128i lut = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+                                      '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    int i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+        __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(v, mask));
+
+        _mm_storeu_si128((__m128i *)(out + i * 2), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *)(out + i * 2 + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+
+    return i * 2 + random_encode_hex_into(out + i * 2, data + i, length - i, NULL, 0);
+}
+
+/* 12 input bytes (in the low 12 of 16) -> 16 six-bit indices, one per byte */
+__attribute__((target("ssse3")))
+static __m128i b64_split_ssse3(__m128i v)
+{
+    __m128i in = _mm_shuffle_epi8(v, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4,
+                                                   7, 6, 8, 7, 10, 9, 11, 10));
+    __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+
+    return _mm_or_si128(t1, t3);
+}
+
+/* Indices -> ASCII: classify into 0-25, 26-51, 52-61, 62, 63 and add an offset */
+__attribute__((target("ssse3")))
+static __m128i b64_translate_ssse3(__m128i idx, __m128i shift_lut)
+{
+    __m128i cls = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+    __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+
+    cls = _mm_or_si128(cls, _mm_and_si128(less, _mm_set1_epi8(13)));
+    return _mm_add_epi8(idx, _mm_shuffle_epi8(shift_lut, cls));
+}
+
+__attribute__((target("ssse3")))
+static apr_size_t b64_ssse3(char *out, const unsigned char *data, int length, char c62, char c63)
+{
+    const __m128i shift_lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+                                            '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                            '0' - 52, '0' - 52, '0' - 52, c62 - 62,
+                                            c63 - 63, 'A', 0, 0);
+    apr_size_t o = 0;
+    int i = 0;
+
+    /* Each step reads 16 bytes and consumes 12 */
+    for (; i + 16 <= length; i += 12, o += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        _mm_storeu_si128((__m128i *)(out + o), b64_translate_ssse3(b64_split_ssse3(v), shift_lut));
+    }
+
+    return o + (c62 == B64_STD_62 ? random_encode_base64_into : random_encode_base64url_into)
+                   (out + o, data + i, length - i, NULL, 0);
+}
+
+static apr_size_t b64std_ssse3(char *out, const unsigned char *data, int length,
+                               const random_alphabet *alphabet, int grouping)
+{
+    return b64_ssse3(out, data, length, B64_STD_62, B64_STD_63);
+}
+
+static apr_size_t b64url_ssse3(char *out, const unsigned char *data, int length,
+                               const random_alphabet *alphabet, int grouping)
+{
+    return b64_ssse3(out, data, length, B64_URL_62, B64_URL_63);
+}
+
+/* --- AVX2 ---------------------------------------------------------------- */
+
+__attribute__((target("avx2")))
+static apr_size_t hex_avx2(char *out, const unsigned char *data, int length,
+                           const random_alphabet *alphabet, int grouping)
+{
+    const __m256i lut = _mm256_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+                                         '8', '9', 'a', 'b', 'c', 'd', 'e', 'f',
+                                         '0', '1', '2', '3', '4', '5', '6', '7',
+                                         '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    int i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+        __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, mask));
+        /* Unpacks work per 128-bit lane: a = bytes 0-7 | 16-23, b = 8-15 | 24-31 */
+        __m256i a = _mm256_unpacklo_epi8(hi, lo);
+        __m256i b = _mm256_unpackhi_epi8(hi, lo);
+
+        _mm256_storeu_si256((__m256i *)(out + i * 2), _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i *)(out + i * 2 + 32), _mm256_permute2x128_si256(a, b, 0x31));
+    }
+
+    return i * 2 + hex_ssse3(out + i * 2, data + i, length - i, NULL, 0);
+}
+
+__attribute__((target("avx2")))
+static apr_size_t b64_avx2(char *out, const unsigned char *data, int length, char c62, char c63)
+{
+    const __m256i split = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+                                           1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const __m256i shift_lut = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+                                               '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                               '0' - 52, '0' - 52, '0' - 52, c62 - 62,
+                                               c63 - 63, 'A', 0, 0,
+                                               'a' - 26, '0' - 52, '0' - 52, '0' - 52,
+                                               '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                               '0' - 52, '0' - 52, '0' - 52, c62 - 62,
+                                               c63 - 63, 'A', 0, 0);
+    apr_size_t o = 0;
+    int i = 0;
+
+    /* Each step reads 16 bytes at +0 and +12 and consumes 24 */
+    for (; i + 28 <= length; i += 24, o += 32) {
+        __m256i v = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(data + i))),
+            _mm_loadu_si128((const __m128i *)(data + i + 12)), 1);
+        __m256i in = _mm256_shuffle_epi8(v, split);
+        __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+        __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+        __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        __m256i idx = _mm256_or_si256(t1, t3);
+        __m256i cls = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+        __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx);
+
+        cls = _mm256_or_si256(cls, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+        _mm256_storeu_si256((__m256i *)(out + o),
+                            _mm256_add_epi8(idx, _mm256_shuffle_epi8(shift_lut, cls)));
+    }
+
+    return o + b64_ssse3(out + o, data + i, length - i, c62, c63);
+}
+
+static apr_size_t b64std_avx2(char *out, const unsigned char *data, int length,
+                              const random_alphabet *alphabet, int grouping)
+{
+    return b64_avx2(out, data, length, B64_STD_62, B64_STD_63);
+}
+
+static apr_size_t b64url_avx2(char *out, const unsigned char *data, int length,
+                              const random_alphabet *alphabet, int grouping)
+{
+    return b64_avx2(out, data, length, B64_URL_62, B64_URL_63);
+}
+
+#endif /* RANDOM_SIMD_X86 */
+
+#ifdef RANDOM_SIMD_NEON
+
+static apr_size_t hex_neon(char *out, const unsigned char *data, int length,
+                           const random_alphabet *alphabet, int grouping)
+{
+    static const unsigned char hex_lut[16] = "0123456789abcdef";
+    const uint8x16_t lut = vld1q_u8(hex_lut);
+    int i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        uint8x16_t v = vld1q_u8(data + i);
+        uint8x16x2_t pair;
+
+        pair.val[0] = vqtbl1q_u8(lut, vshrq_n_u8(v, 4));
+        pair.val[1] = vqtbl1q_u8(lut, vandq_u8(v, vdupq_n_u8(0x0F)));
+        vst2q_u8((uint8_t *)out + i * 2, pair);   /* Interleaves hi/lo */
+    }
+
+    return i * 2 + random_encode_hex_into(out + i * 2, data + i, length - i, NULL, 0);
+}
+
+static apr_size_t b64_neon(char *out, const unsigned char *data, int length, const char *table)
+{
+    const uint8x16x4_t lut = {{ vld1q_u8((const uint8_t *)table),
+                                vld1q_u8((const uint8_t *)table + 16),
+                                vld1q_u8((const uint8_t *)table + 32),
+                                vld1q_u8((const uint8_t *)table + 48) }};
+    const uint8x16_t m6 = vdupq_n_u8(0x3F);
+    apr_size_t o = 0;
+    int i = 0;
+
+    /* 48 bytes -> 64 characters, deinterleaved by vld3 / interleaved by vst4 */
+    for (; i + 48 <= length; i += 48, o += 64) {
+        uint8x16x3_t in = vld3q_u8(data + i);
+        uint8x16x4_t idx;
+
+        idx.val[0] = vshrq_n_u8(in.val[0], 2);
+        idx.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[0], 4), vshrq_n_u8(in.val[1], 4)), m6);
+        idx.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[1], 2), vshrq_n_u8(in.val[2], 6)), m6);
+        idx.val[3] = vandq_u8(in.val[2], m6);
+
+        idx.val[0] = vqtbl4q_u8(lut, idx.val[0]);
+        idx.val[1] = vqtbl4q_u8(lut, idx.val[1]);
+        idx.val[2] = vqtbl4q_u8(lut, idx.val[2]);
+        idx.val[3] = vqtbl4q_u8(lut, idx.val[3]);
+        vst4q_u8((uint8_t *)out + o, idx);
+    }
+
+    return o + (table[62] == B64_STD_62 ? random_encode_base64_into : random_encode_base64url_into)
+                   (out + o, data + i, length - i, NULL, 0);
+}
+
+static apr_size_t b64std_neon(char *out, const unsigned char *data, int length,
+                              const random_alphabet *alphabet, int grouping)
+{
+    return b64_neon(out, data, length,
+                    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/");
+}
+
+static apr_size_t b64url_neon(char *out, const unsigned char *data, int length,
+                              const random_alphabet *alphabet, int grouping)
+{
+    return b64_neon(out, data, length,
+                    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_");
+}
+
+#endif /* RANDOM_SIMD_NEON */
+
+/**
+ * Return the fastest vector encoder for format on this CPU
+ *
+ * @return Encoder, or NULL when format has no vector kernel or the CPU
+ *         lacks the required instructions (caller uses the scalar one)
+ */
+random_encode_fn random_simd_encoder_for(random_format_t format)
+{
+#if defined(RANDOM_SIMD_X86)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        switch (format) {
+            case RANDOM_FORMAT_HEX:       return hex_avx2;
+            case RANDOM_FORMAT_BASE64:    return b64std_avx2;
+            case RANDOM_FORMAT_BASE64URL: return b64url_avx2;
+            default:                      return NULL;
+        }
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        switch (format) {
+            case RANDOM_FORMAT_HEX:       return hex_ssse3;
+            case RANDOM_FORMAT_BASE64:    return b64std_ssse3;
+            case RANDOM_FORMAT_BASE64URL: return b64url_ssse3;
+            default:                      return NULL;
+        }
+    }
+#elif defined(RANDOM_SIMD_NEON)
+    switch (format) {
+        case RANDOM_FORMAT_HEX:       return hex_neon;
+        case RANDOM_FORMAT_BASE64:    return b64std_neon;
+        case RANDOM_FORMAT_BASE64URL: return b64url_neon;
+        default:                      return NULL;
+    }
+#endif
+    return NULL;
+}
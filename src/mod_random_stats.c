@@ -0,0 +1,293 @@
+/*
+ * mod_random_stats.c - Generation statistics shared by all children (RandomStatistics)
+ *
+ * Every RandomAddToken read from the main config gets a slot in a table of
+ * counters allocated in anonymous shared memory in post_config, so all
+ * children add to the same totals. Slot 0 collects the tokens that have no
+ * slot of their own (.htaccess specs, parsed after the table exists).
+ *
+ * The request path never touches the shared table directly: each thread
+ * adds to private counters in its random_thread_state and publishes them
+ * with relaxed atomic adds at most every RANDOM_STATS_FLUSH_INTERVAL, and
+ * when it exits. Readers therefore see totals that lag by up to that
+ * interval per active thread; counters of an idle thread are published on
+ * its next token (or by random_stats_flush_thread() from that thread).
+ *
+ * With RandomStatistics Off (the default) no table is created and the
+ * request path only tests a NULL pointer.
+ */
+
+#include "mod_random.h"
+#include "apr_atomic.h"
+#include "apr_strings.h"
+#include "apr_shm.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RANDOM_STATS_FIELDS (sizeof(random_stats_counters) / sizeof(apr_uint64_t))
+
+/* Counters are independent totals: no ordering needed, only atomicity */
+#if defined(__GNUC__)
+#define STATS_ADD64(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define STATS_LOAD64(p)   __atomic_load_n((p), __ATOMIC_RELAXED)
+#else
+#define STATS_ADD64(p, v) apr_atomic_add64((p), (v))
+#define STATS_LOAD64(p)   apr_atomic_read64(p)
+#endif
+
+/* One slot per token spec in the shared table */
+typedef struct {
+    volatile apr_uint64_t counters[RANDOM_STATS_FIELDS];
+    char name[RANDOM_SHM_NAME_MAX];
+    char server[RANDOM_SHM_NAME_MAX];
+} random_stats_slot;
+
+/* Registered spec, until the table is created */
+typedef struct {
+    const char *name;
+    const void *owner;                 /* server_rec of the defining context */
+    const char *server;                /* Set by random_stats_label() */
+} stats_registration;
+
+/* Process-wide state, set while reading the config (before fork) */
+static int stats_enabled = 0;
+static apr_array_header_t *stats_registry = NULL;
+static random_stats_slot *stats_slots = NULL;
+static int stats_slot_count = 0;
+
+void random_stats_set_enabled(int enabled)
+{
+    stats_enabled = enabled;
+}
+
+int random_stats_get_enabled(void)
+{
+    return stats_enabled;
+}
+
+/* Start a new config generation (pre_config) */
+void random_stats_registry_reset(apr_pool_t *pconf)
+{
+    stats_enabled = 0;
+    stats_registry = apr_array_make(pconf, 16, sizeof(stats_registration));
+    stats_slots = NULL;
+    stats_slot_count = 0;
+}
+
+/**
+ * Reserve a slot for a token spec (directive time)
+ *
+ * @param name   Token variable name
+ * @param owner  Server the spec belongs to, labelled by random_stats_label()
+ *
+ * @return Slot index, or 0 (the shared "other" slot) once the table exists
+ */
+int random_stats_register(const char *name, const void *owner)
+{
+    stats_registration *reg;
+
+    if (!stats_registry) {
+        return 0;
+    }
+
+    reg = apr_array_push(stats_registry);
+    reg->name = name;
+    reg->owner = owner;
+    reg->server = NULL;
+    return stats_registry->nelts;   /* Slot 0 is "other" */
+}
+
+/* Name the server of every slot registered by owner (post_config) */
+void random_stats_label(const void *owner, const char *server)
+{
+    stats_registration *regs;
+    int i;
+
+    if (!stats_registry) {
+        return;
+    }
+
+    regs = (stats_registration *)stats_registry->elts;
+    for (i = 0; i < stats_registry->nelts; i++) {
+        if (regs[i].owner == owner) {
+            regs[i].server = server;
+        }
+    }
+}
+
+static apr_status_t stats_table_cleanup(void *data)
+{
+    stats_slots = NULL;
+    stats_slot_count = 0;
+    return APR_SUCCESS;
+}
+
+/**
+ * Create the shared counter table (post_config, before children are forked)
+ *
+ * Closes the registry: specs read afterwards count in slot 0.
+ *
+ * @param pconf  Config pool - counters live until the next restart
+ * @param slots  Receives the number of slots, "other" included (0 if disabled)
+ */
+apr_status_t random_stats_shm_init(apr_pool_t *pconf, int *slots)
+{
+    apr_array_header_t *registry = stats_registry;
+    const stats_registration *regs;
+    apr_size_t size;
+    apr_shm_t *shm;
+    apr_status_t rv;
+    int i, count;
+
+    *slots = 0;
+    stats_registry = NULL;
+
+    if (!stats_enabled || !registry) {
+        return APR_SUCCESS;
+    }
+
+    /* Anonymous shm: inherited by every child forked from this process */
+    count = registry->nelts + 1;
+    size = sizeof(random_stats_slot) * (apr_size_t)count;
+    rv = apr_shm_create(&shm, size, NULL, pconf);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    stats_slots = (random_stats_slot *)apr_shm_baseaddr_get(shm);
+    memset(stats_slots, 0, size);
+    apr_cpystrn(stats_slots[0].name, "(other)", RANDOM_SHM_NAME_MAX);
+    regs = (const stats_registration *)registry->elts;
+    for (i = 1; i < count; i++) {
+        apr_cpystrn(stats_slots[i].name, regs[i - 1].name ? regs[i - 1].name : "", RANDOM_SHM_NAME_MAX);
+        apr_cpystrn(stats_slots[i].server, regs[i - 1].server ? regs[i - 1].server : "", RANDOM_SHM_NAME_MAX);
+    }
+    stats_slot_count = count;
+    apr_pool_cleanup_register(pconf, NULL, stats_table_cleanup, apr_pool_cleanup_null);
+
+    *slots = count;
+    return APR_SUCCESS;
+}
+
+/**
+ * Private counters of the calling thread, indexed by plan->stats_slot
+ *
+ * @return Counters to add to, or NULL when statistics are off (or the
+ *         thread has no state) - callers skip all accounting then
+ */
+random_stats_counters *random_stats_thread(void)
+{
+    random_thread_state *state;
+
+    if (!stats_slots) {
+        return NULL;
+    }
+
+    state = random_thread_state_get();
+    if (!state) {
+        return NULL;
+    }
+
+    if (state->stats && state->stats_slots != stats_slot_count) {
+        free(state->stats);   /* Table of an older generation */
+        state->stats = NULL;
+    }
+    if (!state->stats) {
+        state->stats = calloc((apr_size_t)stats_slot_count, sizeof(random_stats_counters));
+        if (!state->stats) {
+            return NULL;
+        }
+        state->stats_slots = stats_slot_count;
+        state->stats_flushed = 0;   /* A thread's first tokens are published at once */
+    }
+
+    return state->stats;
+}
+
+/* Add the thread's counters to the shared table and clear them */
+static void random_stats_flush(random_thread_state *state)
+{
+    random_stats_slot *table = stats_slots;
+    int i;
+    apr_size_t f;
+
+    if (!state->stats || !table || state->stats_slots != stats_slot_count) {
+        return;
+    }
+
+    for (i = 0; i < state->stats_slots; i++) {
+        apr_uint64_t *local = (apr_uint64_t *)&state->stats[i];
+
+        for (f = 0; f < RANDOM_STATS_FIELDS; f++) {
+            if (local[f]) {
+                STATS_ADD64(&table[i].counters[f], local[f]);
+                local[f] = 0;
+            }
+        }
+    }
+}
+
+/* End of a generation batch: publish the thread's counters if they are due */
+void random_stats_commit(apr_time_t now)
+{
+    random_thread_state *state = random_thread_state_get();
+
+    if (state && state->stats && now - state->stats_flushed >= RANDOM_STATS_FLUSH_INTERVAL) {
+        random_stats_flush(state);
+        state->stats_flushed = now;
+    }
+}
+
+/* Publish the calling thread's counters now (before reading the table) */
+void random_stats_flush_thread(void)
+{
+    random_thread_state *state = random_thread_state_get();
+
+    if (state && state->stats) {
+        random_stats_flush(state);
+        state->stats_flushed = apr_time_now();
+    }
+}
+
+/* Thread exit: publish what is left */
+void random_stats_release(random_thread_state *state)
+{
+    random_stats_flush(state);
+    free(state->stats);
+    state->stats = NULL;
+    state->stats_slots = 0;
+}
+
+/* Monotonic clock in nanoseconds, for the timing counters */
+apr_uint64_t random_stats_clock(void)
+{
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+        return (apr_uint64_t)ts.tv_sec * 1000000000u + (apr_uint64_t)ts.tv_nsec;
+    }
+#endif
+    return (apr_uint64_t)apr_time_now() * 1000u;
+}
+
+/* Number of slots in the shared table, "other" included (0 = disabled) */
+int random_stats_count(void)
+{
+    return stats_slot_count;
+}
+
+/* Read slot index (0 <= index < random_stats_count()) */
+void random_stats_get(int index, random_stats_entry *entry)
+{
+    const random_stats_slot *slot = &stats_slots[index];
+    apr_uint64_t *out = (apr_uint64_t *)&entry->counters;
+    apr_size_t f;
+
+    entry->name = slot->name;
+    entry->server = slot->server;
+    for (f = 0; f < RANDOM_STATS_FIELDS; f++) {
+        out[f] = STATS_LOAD64(&slot->counters[f]);
+    }
+}
@@ -0,0 +1,261 @@
+/*
+ * mod_random_status.c - Report generation statistics (RandomStatistics)
+ *
+ *   - mod_status: a table on /server-status, totals with ?auto
+ *   - SetHandler random-status: JSON, or Prometheus text with ?format=prometheus
+ *
+ * Token counters come from the shared table (every child, since the last
+ * restart). Prefill rings are per child, so their levels describe the
+ * child that answered.
+ */
+
+#include "mod_random.h"
+#include "http_protocol.h"
+#include "mod_status.h"
+#include "apr_strings.h"
+#include <string.h>
+#include <unistd.h>
+
+#define RANDOM_STATUS_HANDLER "random-status"
+
+/* Columns of random_stats_counters, in field order */
+typedef struct {
+    const char *key;                   /* JSON key, mod_status label */
+    const char *metric;                /* Prometheus metric name */
+    const char *help;
+    int nanoseconds;                   /* Exported to Prometheus in seconds */
+} status_field;
+
+static const status_field status_fields[] = {
+    {"generated", "mod_random_tokens_generated_total", "Tokens generated on the request path", 0},
+    {"cache_hits", "mod_random_cache_hits_total", "ttl= tokens served from the cache", 0},
+    {"cache_misses", "mod_random_cache_misses_total", "ttl= lookups that generated a token", 0},
+    {"prefill_hits", "mod_random_prefill_hits_total", "Tokens taken from a prefill= ring", 0},
+    {"csprng_failures", "mod_random_csprng_failures_total", "Tokens not generated because the CSPRNG failed", 0},
+    {"sign_failures", "mod_random_sign_failures_total", "Signed tokens not served because signing failed", 0},
+    {"entropy_bytes", "mod_random_entropy_bytes_total", "Random bytes drawn for generated tokens", 0},
+    {"csprng_ns", "mod_random_csprng_seconds_total", "Time spent in the CSPRNG", 1},
+    {"encode_ns", "mod_random_encode_seconds_total", "Time spent encoding and assembling tokens", 1},
+    {"hmac_ns", "mod_random_hmac_seconds_total", "Time spent signing tokens", 1}
+};
+
+#define STATUS_FIELD_COUNT (sizeof(status_fields) / sizeof(status_fields[0]))
+
+/* Fails to compile if a counter is added without its column */
+typedef char status_fields_complete[(STATUS_FIELD_COUNT ==
+                                     sizeof(random_stats_counters) / sizeof(apr_uint64_t)) ? 1 : -1];
+
+/* Escape a JSON string or Prometheus label value (same rules for both: \\, \", \n) */
+static const char *status_escape(apr_pool_t *pool, const char *s)
+{
+    apr_size_t extra = 0;
+    const char *p;
+    char *out, *q;
+
+    for (p = s; *p; p++) {
+        if (*p == '\\' || *p == '"' || *p == '\n') {
+            extra++;
+        } else if ((unsigned char)*p < 0x20) {
+            extra += 5;
+        }
+    }
+    if (!extra) {
+        return s;
+    }
+
+    out = q = apr_palloc(pool, strlen(s) + extra + 1);
+    for (p = s; *p; p++) {
+        if (*p == '\\' || *p == '"') {
+            *q++ = '\\';
+            *q++ = *p;
+        } else if (*p == '\n') {
+            *q++ = '\\';
+            *q++ = 'n';
+        } else if ((unsigned char)*p < 0x20) {
+            q += apr_snprintf(q, 7, "\\u%04x", (unsigned char)*p);
+        } else {
+            *q++ = *p;
+        }
+    }
+    *q = '\0';
+    return out;
+}
+
+/* Whether the query string asks for format=name */
+static int status_format_is(const request_rec *r, const char *name)
+{
+    const char *p = r->args;
+    apr_size_t len = strlen(name);
+
+    while (p && *p) {
+        if (strncmp(p, "format=", 7) == 0 && strncasecmp(p + 7, name, len) == 0 &&
+            (p[7 + len] == '\0' || p[7 + len] == '&')) {
+            return 1;
+        }
+        p = strchr(p, '&');
+        if (p) {
+            p++;
+        }
+    }
+    return 0;
+}
+
+static void status_json(request_rec *r)
+{
+    random_stats_entry e;
+    random_prefill_stats ps;
+    int i, n = random_stats_count();
+    apr_size_t f;
+
+    ap_set_content_type(r, "application/json");
+    ap_rprintf(r, "{\"enabled\":%s,\"flush_interval_ms\":%d,\"tokens\":[",
+               n > 0 ? "true" : "false", (int)apr_time_msec(RANDOM_STATS_FLUSH_INTERVAL));
+    for (i = 0; i < n; i++) {
+        const apr_uint64_t *v = (const apr_uint64_t *)&e.counters;
+
+        random_stats_get(i, &e);
+        ap_rprintf(r, "%s{\"name\":\"%s\",\"server\":\"%s\"", i ? "," : "",
+                   status_escape(r->pool, e.name), status_escape(r->pool, e.server));
+        for (f = 0; f < STATUS_FIELD_COUNT; f++) {
+            ap_rprintf(r, ",\"%s\":%" APR_UINT64_T_FMT, status_fields[f].key, v[f]);
+        }
+        ap_rputs("}", r);
+    }
+
+    ap_rprintf(r, "],\"prefill\":{\"pid\":%ld,\"rings\":[", (long)getpid());
+    for (i = 0; i < random_prefill_count(); i++) {
+        random_prefill_stats_get(i, &ps);
+        ap_rprintf(r, "%s{\"name\":\"%s\",\"capacity\":%u,\"level\":%u,\"served\":%u,"
+                   "\"produced\":%u,\"empty\":%u,\"mismatched\":%u}", i ? "," : "",
+                   status_escape(r->pool, ps.name), ps.capacity, ps.level, ps.served,
+                   ps.produced, ps.empty, ps.mismatched);
+    }
+    ap_rputs("]}}\n", r);
+}
+
+static void status_prometheus(request_rec *r)
+{
+    random_stats_entry e;
+    random_prefill_stats ps;
+    int i, n = random_stats_count(), rings = random_prefill_count();
+    long pid = (long)getpid();
+    apr_size_t f;
+
+    ap_set_content_type(r, "text/plain; version=0.0.4");
+    for (f = 0; f < STATUS_FIELD_COUNT; f++) {
+        ap_rprintf(r, "# HELP %s %s\n# TYPE %s counter\n",
+                   status_fields[f].metric, status_fields[f].help, status_fields[f].metric);
+        for (i = 0; i < n; i++) {
+            apr_uint64_t v;
+
+            random_stats_get(i, &e);
+            v = ((const apr_uint64_t *)&e.counters)[f];
+            /* slot keeps series unique when two contexts reuse a name */
+            ap_rprintf(r, "%s{token=\"%s\",server=\"%s\",slot=\"%d\"} ", status_fields[f].metric,
+                       status_escape(r->pool, e.name), status_escape(r->pool, e.server), i);
+            if (status_fields[f].nanoseconds) {
+                ap_rprintf(r, "%.9f\n", (double)v / 1e9);
+            } else {
+                ap_rprintf(r, "%" APR_UINT64_T_FMT "\n", v);
+            }
+        }
+    }
+
+    if (rings == 0) {
+        return;
+    }
+    ap_rputs("# HELP mod_random_prefill_level Tokens ready in a prefill= ring of this child\n"
+             "# TYPE mod_random_prefill_level gauge\n", r);
+    for (i = 0; i < rings; i++) {
+        random_prefill_stats_get(i, &ps);
+        ap_rprintf(r, "mod_random_prefill_level{token=\"%s\",pid=\"%ld\"} %u\n",
+                   status_escape(r->pool, ps.name), pid, ps.level);
+    }
+    ap_rputs("# HELP mod_random_prefill_empty_total Requests that found a prefill= ring empty\n"
+             "# TYPE mod_random_prefill_empty_total counter\n", r);
+    for (i = 0; i < rings; i++) {
+        random_prefill_stats_get(i, &ps);
+        ap_rprintf(r, "mod_random_prefill_empty_total{token=\"%s\",pid=\"%ld\"} %u\n",
+                   status_escape(r->pool, ps.name), pid, ps.empty);
+    }
+}
+
+/**
+ * Handler for SetHandler random-status
+ *
+ * @return OK, or DECLINED for other handlers and non-GET requests
+ */
+int random_status_handler(request_rec *r)
+{
+    if (!r->handler || strcmp(r->handler, RANDOM_STATUS_HANDLER) != 0) {
+        return DECLINED;
+    }
+
+    r->allowed |= (AP_METHOD_BIT << M_GET);
+    if (r->method_number != M_GET) {
+        return DECLINED;
+    }
+
+    random_stats_flush_thread();
+    if (r->header_only) {
+        ap_set_content_type(r, status_format_is(r, "prometheus") ? "text/plain; version=0.0.4"
+                                                                  : "application/json");
+        return OK;
+    }
+
+    if (status_format_is(r, "prometheus")) {
+        status_prometheus(r);
+    } else {
+        status_json(r);
+    }
+    return OK;
+}
+
+/* mod_status hook: one row per token, or totals for ?auto */
+int random_status_hook(request_rec *r, int flags)
+{
+    random_stats_entry e;
+    apr_uint64_t totals[STATUS_FIELD_COUNT];
+    int i, n = random_stats_count();
+    apr_size_t f;
+
+    if (n == 0) {
+        return OK;
+    }
+    random_stats_flush_thread();
+
+    if (flags & AP_STATUS_SHORT) {
+        memset(totals, 0, sizeof(totals));
+        for (i = 0; i < n; i++) {
+            const apr_uint64_t *v = (const apr_uint64_t *)&e.counters;
+
+            random_stats_get(i, &e);
+            for (f = 0; f < STATUS_FIELD_COUNT; f++) {
+                totals[f] += v[f];
+            }
+        }
+        for (f = 0; f < STATUS_FIELD_COUNT; f++) {
+            ap_rprintf(r, "RandomTokens_%s: %" APR_UINT64_T_FMT "\n", status_fields[f].key, totals[f]);
+        }
+        return OK;
+    }
+
+    ap_rputs("<hr />\n<h2>mod_random token statistics</h2>\n<table border=\"0\"><tr><th>Token</th><th>Server</th>", r);
+    for (f = 0; f < STATUS_FIELD_COUNT; f++) {
+        ap_rprintf(r, "<th>%s</th>", status_fields[f].key);
+    }
+    ap_rputs("</tr>\n", r);
+    for (i = 0; i < n; i++) {
+        const apr_uint64_t *v = (const apr_uint64_t *)&e.counters;
+
+        random_stats_get(i, &e);
+        ap_rprintf(r, "<tr><td>%s</td><td>%s</td>", ap_escape_html(r->pool, e.name),
+                   ap_escape_html(r->pool, e.server));
+        for (f = 0; f < STATUS_FIELD_COUNT; f++) {
+            ap_rprintf(r, "<td>%" APR_UINT64_T_FMT "</td>", v[f]);
+        }
+        ap_rputs("</tr>\n", r);
+    }
+    ap_rputs("</table>\n", r);
+    return OK;
+}
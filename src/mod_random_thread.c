@@ -0,0 +1,142 @@
+/*
+ * mod_random_thread.c - Per-thread state for lock-free hot paths
+ */
+
+#include "mod_random.h"
+#include "apr_portable.h"
+#include "apr_thread_proc.h"
+#include <openssl/crypto.h>
+#include <stdlib.h>
+
+/* Key is created per child process in child_init; NULL means no per-thread state */
+static apr_threadkey_t *thread_key = NULL;
+
+/* Thread exit destructor - releases everything the thread owned */
+static void random_thread_state_destroy(void *data)
+{
+    random_thread_state *state = (random_thread_state *)data;
+
+    if (!state) {
+        return;
+    }
+
+    random_entropy_release(state);
+    random_hmac_release(state);
+    random_stats_release(state);
+    free(state->scratch);   /* Wiped by every release */
+    free(state);
+}
+
+/* Delete the key with the child pool so no destructor outlives the module */
+static apr_status_t random_thread_key_cleanup(void *data)
+{
+    if (thread_key) {
+        apr_threadkey_private_delete(thread_key);
+        thread_key = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+/**
+ * Create the thread key used to find each thread's state
+ *
+ * Must be called from child_init: state created in one process is never
+ * visible to another, so buffered entropy cannot leak across fork().
+ */
+apr_status_t random_thread_init(apr_pool_t *pool)
+{
+    apr_status_t rv;
+
+    rv = apr_threadkey_private_create(&thread_key, random_thread_state_destroy, pool);
+    if (rv != APR_SUCCESS) {
+        thread_key = NULL;
+        return rv;
+    }
+
+    apr_pool_cleanup_register(pool, NULL, random_thread_key_cleanup, apr_pool_cleanup_null);
+    return APR_SUCCESS;
+}
+
+/**
+ * Return the calling thread's state, creating it on first use
+ *
+ * @return Thread state, or NULL if random_thread_init() was not called
+ *         (e.g. unit tests) or allocation failed - callers must fall back
+ *         to the unbuffered path in that case.
+ */
+random_thread_state *random_thread_state_get(void)
+{
+    void *data = NULL;
+    random_thread_state *state;
+
+    if (!thread_key) {
+        return NULL;
+    }
+
+    if (apr_threadkey_private_get(&data, thread_key) == APR_SUCCESS && data) {
+        return (random_thread_state *)data;
+    }
+
+    /* malloc, not a pool: the state lives exactly as long as the thread */
+    state = calloc(1, sizeof(random_thread_state));
+    if (!state) {
+        return NULL;
+    }
+
+    if (apr_threadkey_private_set(state, thread_key) != APR_SUCCESS) {
+        free(state);
+        return NULL;
+    }
+
+    return state;
+}
+
+/**
+ * Borrow the calling thread's scratch buffer for a transient value
+ *
+ * Raw random bytes and other intermediate data only live until the token
+ * is encoded; taking them from r->pool would grow the pool for the rest of
+ * the request, on every request of a keep-alive connection. The buffer is
+ * malloc'd on first use and grown as needed up to RANDOM_SCRATCH_MAX.
+ *
+ * @param size  Bytes needed
+ *
+ * @return At least size bytes, to be given back with random_scratch_release(),
+ *         or NULL (no thread state, buffer already lent, size above the cap):
+ *         the caller then allocates from its pool
+ */
+void *random_scratch_acquire(apr_size_t size)
+{
+    random_thread_state *state = random_thread_state_get();
+    unsigned char *grown;
+    apr_size_t want;
+
+    if (!state || state->scratch_busy || size > RANDOM_SCRATCH_MAX) {
+        return NULL;
+    }
+
+    if (size > state->scratch_size) {
+        want = (size + RANDOM_SCRATCH_ALIGN - 1) & ~(apr_size_t)(RANDOM_SCRATCH_ALIGN - 1);
+        grown = realloc(state->scratch, want);   /* Previous content is wiped */
+        if (!grown) {
+            return NULL;
+        }
+        state->scratch = grown;
+        state->scratch_size = want;
+    }
+
+    state->scratch_busy = 1;
+    return state->scratch;
+}
+
+/* Wipe the used part of buf and give it back if it is the thread's scratch buffer
+ * (pool fallbacks are only wiped, so callers release either kind) */
+void random_scratch_release(void *buf, apr_size_t used)
+{
+    random_thread_state *state = random_thread_state_get();
+
+    OPENSSL_cleanse(buf, used);
+    if (state && buf == state->scratch) {
+        state->scratch_busy = 0;
+    }
+}
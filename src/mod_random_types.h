@@ -6,6 +6,7 @@
 #define MOD_RANDOM_TYPES_H
 
 #include "apr_time.h"
+#include "apr_tables.h"
 #include "apr_thread_mutex.h"
 #include "ap_regex.h"
 
@@ -21,6 +22,9 @@
 #define RANDOM_GROUPING_UNSET  -1    /* Sentinel: grouping not configured */
 #define RANDOM_EXPIRY_UNSET    -1    /* Sentinel: expiry not configured */
 #define RANDOM_TTL_UNSET       -1    /* Sentinel: TTL not configured */
+#define RANDOM_METADATA_FORMAT_UNSET -1 /* Sentinel: metadata format not configured */
+#define RANDOM_MAC_ALG_UNSET   -1    /* Sentinel: signing algorithm not configured */
+#define RANDOM_OUTPUT_UNSET    -1    /* Sentinel: output= not configured */
 
 /* Limits to prevent DoS */
 #define RANDOM_MAX_TOKENS          50      /* Maximum tokens per context */
@@ -29,32 +33,310 @@
 #define RANDOM_ALPHABET_MAX_SIZE   256     /* Maximum alphabet size */
 #define RANDOM_ALPHABET_MIN_SIZE   2       /* Minimum alphabet size */
 #define RANDOM_GROUPING_MAX        128     /* Maximum grouping size */
+#define RANDOM_RAW_MAX             (8 * RANDOM_LENGTH_MAX) /* Random bytes drawn per token */
+#define RANDOM_TOPUP_ROUNDS        64      /* Extra 64-byte draws for rejection sampling */
+
+/* In-place token assembly (see mod_random_token.c) */
+#define RANDOM_TIME_DIGITS_MAX     20      /* Decimal digits of a signed 64-bit time */
+#define RANDOM_SIGNATURE_HEX_LEN   64      /* Hex HMAC-SHA256 */
+#define RANDOM_HMAC_DIGEST_LEN     32      /* Raw HMAC-SHA256, the longest MAC */
+#define RANDOM_SIGNATURE_MAX       (2 + RANDOM_SIGNATURE_HEX_LEN) /* "<id>." + hex */
+
+/* Identifier formats (uuid4, uuid7, ulid), formatted on the stack
+ * uuid7 and ulid sort by generation time; within one millisecond a
+ * per-thread counter, reseeded every millisecond, keeps them in order */
+#define RANDOM_ID_RAW_LEN          16      /* Random bytes drawn per identifier */
+#define RANDOM_UUID_LEN            36      /* 8-4-4-4-12 hex */
+#define RANDOM_ULID_LEN            26      /* Crockford base32 */
+#define RANDOM_ID_SEQ_BITS         12      /* Counter: uuid7 rand_a, first ULID random bits */
+
+/* Compact signed tokens (RandomMetadataFormat compact), before base64url:
+ * [version][algorithm << 6 | MAC length][expiry, 4 bytes big-endian][random bytes][truncated MAC]
+ * Tokens signed from a RandomSigningKeyFile use version 2, with the key id
+ * byte between the algorithm byte and the expiry */
+#define RANDOM_COMPACT_VERSION     1
+#define RANDOM_COMPACT_HEADER_LEN  6
+#define RANDOM_COMPACT_VERSION_KEYED    2
+#define RANDOM_COMPACT_KEYED_HEADER_LEN 7
+#define RANDOM_COMPACT_MAC_DEFAULT 16      /* 128-bit truncated HMAC-SHA256 */
+#define RANDOM_COMPACT_MAC_MIN     8
+#define RANDOM_COMPACT_MAX         (RANDOM_COMPACT_KEYED_HEADER_LEN + RANDOM_LENGTH_MAX + RANDOM_HMAC_DIGEST_LEN)
+
+/* Rotating signing keys (RandomSigningKeyFile)
+ * Text tokens carry the key id as "k<2 hex digits>." before the signature */
+#define RANDOM_KEY_ID_MAX          255
+#define RANDOM_KEY_TAG_LEN         4       /* "k" + 2 hex digits + "." */
+#define RANDOM_KEYRING_KEYS_MAX    32      /* Keys per file */
+#define RANDOM_KEYRING_FILE_MAX    65536   /* Larger key files are rejected */
+#define RANDOM_KEYRING_POLL_INTERVAL apr_time_from_sec(2)  /* mtime checks by the watcher thread */
+
+/* Token validation (RandomValidateToken) */
+#define RANDOM_VALIDATE_VAR_DEFAULT "RANDOM_TOKEN_STATUS"
+
+/* Shared-memory TTL cache (RandomCacheBackend shm) */
+#define RANDOM_SHM_TOKEN_MAX       2048    /* Longer tokens stay in the local cache */
+#define RANDOM_SHM_NAME_MAX        64      /* Token name kept for diagnostics */
+
+/* Per-thread entropy buffer (RandomEntropyBuffer) */
+#define RANDOM_ENTROPY_BUFFER_MIN  1024    /* Smallest useful refill size */
+#define RANDOM_ENTROPY_BUFFER_MAX  1048576 /* 1 MB per thread */
+
+/* Per-thread scratch buffer for intermediate token data */
+#define RANDOM_SCRATCH_MAX         65536   /* Larger requests use the caller's pool */
+#define RANDOM_SCRATCH_ALIGN       1024    /* Growth granularity */
+
+/* Pre-generated token rings (RandomAddToken prefill=N) */
+#define RANDOM_PREFILL_MAX         65536   /* Largest prefill= count */
+#define RANDOM_PREFILL_RING_BYTES  262144  /* Ring memory cap, to stay in L2 */
+#define RANDOM_PREFILL_BATCH_BYTES 16384   /* Random bytes drawn per refill batch */
+
+/* Generation statistics (RandomStatistics) */
+#define RANDOM_STATS_FLUSH_INTERVAL apr_time_from_msec(250)  /* Thread counters published at most this often */
+
+/* Allocation tracing (RandomAllocTrace, -DRANDOM_ALLOC_TRACE builds) */
+#define RANDOM_ALLOC_SAMPLE_MAX    1000000 /* Largest RandomAllocTrace N */
+#define RANDOM_ALLOC_HIST_BUCKETS  16      /* Power-of-two buckets: 0, <2, <4, ... >=16384 */
 
 /* Output format types */
 typedef enum {
     RANDOM_FORMAT_BASE64 = 0,
     RANDOM_FORMAT_HEX = 1,
     RANDOM_FORMAT_BASE64URL = 2,
-    RANDOM_FORMAT_CUSTOM = 3
+    RANDOM_FORMAT_CUSTOM = 3,
+    RANDOM_FORMAT_UUID4 = 4,           /* RFC 9562 version 4, 8-4-4-4-12 hex */
+    RANDOM_FORMAT_UUID7 = 5,           /* RFC 9562 version 7: Unix milliseconds, counter, random */
+    RANDOM_FORMAT_ULID = 6             /* 26 Crockford base32 symbols: milliseconds, counter, random */
 } random_format_t;
 
+/* Fixed-size identifiers: length= does not apply */
+#define RANDOM_FORMAT_IS_ID(format) ((format) >= RANDOM_FORMAT_UUID4)
+
+/* Where a token is emitted (RandomAddToken output=), as flags
+ * Default: the environment, plus the response header when header= is set */
+typedef enum {
+    RANDOM_OUTPUT_ENV = 1,             /* r->subprocess_env (CGI, SSI, logs, %{ENV:...}) */
+    RANDOM_OUTPUT_HEADER = 2,          /* r->headers_out, header= name */
+    RANDOM_OUTPUT_BOTH = 3
+} random_output_t;
+
+/* Layout of signed metadata tokens (RandomMetadataFormat) */
+typedef enum {
+    RANDOM_METADATA_TEXT = 0,          /* expiry:token:hex HMAC (default) */
+    RANDOM_METADATA_COMPACT = 1        /* One base64url binary blob, truncated MAC */
+} random_metadata_format_t;
+
+/* Keyed MAC for signed metadata (RandomSigningAlgorithm)
+ * The value is the algorithm id carried in signed tokens */
+typedef enum {
+    RANDOM_MAC_HMAC_SHA256 = 0,        /* Default */
+    RANDOM_MAC_BLAKE2S = 1,            /* Keyed BLAKE2s-256 (OpenSSL 3) */
+    RANDOM_MAC_AES_CMAC = 2            /* AES-256-CMAC, 16-byte MAC */
+} random_mac_alg_t;
+
+#define RANDOM_MAC_ALG_COUNT 3
+
+/* Where TTL-cached tokens live */
+typedef enum {
+    RANDOM_CACHE_BACKEND_LOCAL = 0,    /* Per child process (default) */
+    RANDOM_CACHE_BACKEND_SHM = 1       /* Shared by all children via apr_shm */
+} random_cache_backend_t;
+
+/* Outcome of random_token_verify(), exported as RandomValidateToken's variable
+ * Only VALID is authenticated: EXPIRED is decided before the HMAC is checked */
+typedef enum {
+    RANDOM_VERIFY_VALID = 0,           /* Signature matches and expiry not reached */
+    RANDOM_VERIFY_EXPIRED = 1,         /* Well-formed, expiry in the past */
+    RANDOM_VERIFY_INVALID = 2,         /* Malformed or bad signature */
+    RANDOM_VERIFY_MISSING = 3          /* No token in the request */
+} random_verify_result_t;
+
+/* Immutable cached token (see mod_random_cache.c) */
+typedef struct random_cache_entry random_cache_entry;
+
+/* Ring of ready-to-serve tokens filled by a background thread (see mod_random_prefill.c) */
+typedef struct random_prefill random_prefill;
+
+/* TTL cache state, one per distinct RandomAddToken line of a server
+ * Merged specs reference it instead of copying it, so the cache survives
+ * per-directory merges performed at request time. Reads are lock-free. */
+typedef struct {
+    volatile void *current;            /* random_cache_entry, published by atomic swap */
+    volatile void *retired;            /* Replaced entries awaiting reclamation */
+    volatile apr_uint32_t readers;     /* Threads currently copying an entry */
+    volatile apr_uint32_t refreshing;  /* 1 while one thread regenerates the token */
+    const char *name;                  /* Token variable name */
+    int slot;                          /* Shared-memory slot index (assigned at config time) */
+    int config_time;                   /* Created while reading the config (may serve several contexts) */
+    int claimed;                       /* A plan variant uses it (see random_cache_variant()) */
+} random_token_cache;
+
 /* Individual token specification */
-typedef struct random_token_spec {
+typedef struct {
     char *var_name;                    /* Environment variable name (required) */
     int length;                        /* Bytes of random data */
     random_format_t format;            /* Output format */
     char *header_name;                 /* Optional HTTP header */
+    int output;                        /* random_output_t, or RANDOM_OUTPUT_UNSET */
     int include_timestamp;             /* Include timestamp prefix */
     char *prefix;                      /* Optional prefix */
     char *suffix;                      /* Optional suffix */
     int ttl_seconds;                   /* Cache TTL */
-    char *cached_token;                /* Cached token value */
-    apr_time_t cache_time;             /* Cache timestamp */
-    apr_thread_mutex_t *cache_mutex;   /* Mutex to protect this token's cache */
-    apr_pool_t *pool;                  /* Pool for cache allocation */
-    struct random_token_spec *next;    /* Linked list next */
+    random_token_cache *cache;         /* Shared TTL cache (owned by the original spec) */
+    int eager;                         /* Generate up front even with RandomLazyTokens */
+    random_prefill *prefill;           /* prefill= ring (owned by the original spec, NULL = none) */
+    int stats_slot;                    /* Statistics slot (0 = shared "other" slot) */
 } random_token_spec;
 
+/* Custom alphabet compiled once by RandomAlphabet (see random_alphabet_compile()) */
+typedef struct {
+    const char *chars;                 /* Symbols, in RandomAlphabet order */
+    int size;                          /* Number of symbols (2-256) */
+    int bits;                          /* log2(size) for power-of-two sizes, else 0 */
+    unsigned int log2_q16;             /* log2(size) in 16.16 fixed point, rounded down */
+    unsigned int threshold;            /* Bytes >= threshold are rejected (non power of two) */
+    char lut[256];                     /* Random byte -> symbol */
+} random_alphabet;
+
+/* RandomSigningKey loaded into a keyed HMAC context (see mod_random_crypto.c) */
+typedef struct random_hmac_key random_hmac_key;
+
+/* RandomSigningKeyFile and the key table currently published (see mod_random_keyring.c) */
+typedef struct random_keyring random_keyring;
+typedef struct random_key_table random_key_table;
+
+/* Watcher report after a reload (error NULL) or a failed one (current keys kept) */
+typedef void (*random_keyring_notify_fn)(void *data, const char *path, int keys, const char *error);
+
+/* Encoder selected at config time (see random_encoder_for())
+ * Writes into out without a NUL and returns the number of characters */
+typedef apr_size_t (*random_encode_fn)(char *out, const unsigned char *data, int length,
+                                       const random_alphabet *alphabet, int grouping);
+
+/* Time-ordered identifier encoder (see random_time_encoder_for())
+ * Takes the millisecond from now, the request time, and RANDOM_ID_RAW_LEN bytes */
+typedef apr_size_t (*random_encode_at_fn)(char *out, const unsigned char *data, apr_time_t now);
+
+/* Compiled token: a spec with every default resolved and validated
+ * Built once per configuration (merge or post_config) so the request path
+ * only generates, encodes and emits. See mod_random_plan.c. */
+typedef struct {
+    const char *var_name;              /* Environment variable name (config pool, emitted by reference) */
+    const char *header_name;           /* HTTP header (NULL = none, config pool as var_name) */
+    int output;                        /* random_output_t: tables the token is set in */
+    int length;                        /* Bytes of entropy */
+    apr_size_t raw_length;             /* Random bytes consumed by encode() */
+    random_format_t format;            /* Output format (CUSTOM only with an alphabet) */
+    random_encode_fn encode;           /* Encoder for format */
+    random_encode_at_fn encode_at;     /* Replaces encode for uuid7 and ulid, else NULL */
+    const random_alphabet *alphabet;   /* Custom alphabet (CUSTOM only) */
+    int grouping;                      /* Custom alphabet grouping (0 = none) */
+    int include_timestamp;             /* Prepend "<unix time>-" */
+    const char *prefix;                /* NULL = none */
+    const char *suffix;                /* NULL = none */
+    apr_size_t prefix_len;
+    apr_size_t suffix_len;
+    int ttl_seconds;                   /* 0 = no cache */
+    random_token_cache *cache;         /* Shared TTL cache (NULL when ttl_seconds == 0) */
+    random_prefill *prefill;           /* Pre-generated tokens (NULL = generate inline) */
+    int stats_slot;                    /* Statistics slot of the spec */
+    int expiry_seconds;                /* Signed metadata expiry (0 = no metadata) */
+    const random_hmac_key *hmac_key;   /* Set only when metadata is encoded (single key) */
+    random_keyring *keyring;           /* Set instead when keys come from RandomSigningKeyFile */
+    random_mac_alg_t mac_alg;          /* Signing algorithm (available for hmac_key) */
+    int compact_mac_len;               /* Compact format MAC bytes (0 = text format) */
+    apr_size_t encoded_max;            /* Upper bound of encode() output, without NUL */
+    apr_size_t token_max;              /* Upper bound of the whole token, with NUL */
+} random_token_plan;
+
+/* Generation counters of one token spec (see mod_random_stats.c)
+ * Every field is an apr_uint64_t: random_stats_flush() adds them as an array */
+typedef struct {
+    apr_uint64_t generated;            /* Tokens generated on the request path */
+    apr_uint64_t cache_hits;           /* ttl= tokens served from the cache */
+    apr_uint64_t cache_misses;         /* ttl= lookups that had to generate */
+    apr_uint64_t prefill_hits;         /* Tokens taken from a prefill= ring */
+    apr_uint64_t csprng_failures;      /* Tokens lost to a CSPRNG error */
+    apr_uint64_t sign_failures;        /* Signed tokens lost to an OpenSSL MAC error */
+    apr_uint64_t entropy_bytes;        /* Random bytes drawn for generated tokens */
+    apr_uint64_t csprng_ns;            /* Share of the batched CSPRNG call */
+    apr_uint64_t encode_ns;            /* Encoding, prefix/suffix and timestamp */
+    apr_uint64_t hmac_ns;              /* Signing (signed metadata only) */
+} random_stats_counters;
+
+/* Bytes and allocations taken from r->pool (see mod_random_alloc.c) */
+typedef struct {
+    apr_size_t bytes;
+    unsigned int allocs;
+} random_alloc_count;
+
+/* What mod_random allocated for one client request */
+typedef struct {
+    random_alloc_count total;          /* Everything, request state included */
+    int count;                         /* Entries used below */
+    const char *names[RANDOM_MAX_TOKENS];           /* Token variable names */
+    random_alloc_count tokens[RANDOM_MAX_TOKENS];   /* Per token (shared slices: bytes only) */
+} random_alloc_trace;
+
+/* One row of the statistics table */
+typedef struct {
+    const char *name;                  /* Token variable name ("(other)" for slot 0) */
+    const char *server;                /* Virtual host defining the token */
+    random_stats_counters counters;    /* Totals of every child since the last restart */
+} random_stats_entry;
+
+/* Buffered CSPRNG output owned by a single thread (see mod_random_entropy.c) */
+typedef struct random_entropy_pool random_entropy_pool;
+
+/* Per-thread state, never shared between threads */
+typedef struct {
+    random_entropy_pool *entropy;      /* Buffered random bytes (NULL until first use) */
+    apr_size_t entropy_map_size;       /* Mapping length, kept outside the wiped mapping */
+    void *mac_ctx;                     /* Copy of one random_hmac_key algorithm context */
+    apr_uint32_t mac_ctx_id;           /* Template mac_ctx was copied from (0 = none) */
+    int mac_ctx_alg;                   /* random_mac_alg_t of mac_ctx */
+    random_stats_counters *stats;      /* Counters not yet added to the shared table */
+    int stats_slots;                   /* Entries in stats */
+    apr_time_t stats_flushed;          /* Last random_stats_flush() */
+    apr_int64_t id_ms;                 /* Millisecond of the last uuid7/ulid */
+    unsigned int id_seq;               /* Its counter */
+    unsigned char *scratch;            /* Transient buffers (see random_scratch_acquire()) */
+    apr_size_t scratch_size;           /* Allocated bytes of scratch */
+    int scratch_busy;                  /* Lent out, not released yet */
+} random_thread_state;
+
+/* How a literal RandomOnlyFor pattern is matched against r->uri */
+typedef enum {
+    RANDOM_MATCH_CONTAINS = 0,         /* lit   */
+    RANDOM_MATCH_PREFIX = 1,           /* ^lit  */
+    RANDOM_MATCH_SUFFIX = 2,           /* lit$  */
+    RANDOM_MATCH_EXACT = 3             /* ^lit$ */
+} random_match_kind_t;
+
+/* RandomOnlyFor pattern without regex operators, matched with memcmp */
+typedef struct {
+    random_match_kind_t kind;
+    const char *text;                  /* Unescaped literal */
+    apr_size_t len;
+} random_url_literal;
+
+/* Every RandomOnlyFor pattern of a context; the URI must match one of them */
+typedef struct {
+    apr_array_header_t *literals;      /* random_url_literal, checked first */
+    apr_array_header_t *sources;       /* Remaining patterns (regex source) */
+    ap_regex_t *regex;                 /* sources as one alternation (NULL = none) */
+} random_url_matcher;
+
+/* Counters of one prefill ring, since the child started */
+typedef struct {
+    const char *name;                  /* Token variable name */
+    apr_uint32_t capacity;             /* Ring slots (0 = not bound to a plan yet) */
+    apr_uint32_t level;                /* Tokens ready now */
+    apr_uint32_t served;               /* Tokens handed to requests */
+    apr_uint32_t produced;             /* Tokens generated by the background thread */
+    apr_uint32_t empty;                /* Requests that found the ring empty */
+    apr_uint32_t mismatched;           /* Requests whose plan differs from the ring's */
+} random_prefill_stats;
+
 /* Main configuration structure */
 typedef struct {
     /* Default values for RandomAddToken */
@@ -66,18 +348,63 @@ typedef struct {
     int ttl_seconds;                   /* Default cache TTL */
 
     /* Global settings */
-    ap_regex_t *url_pattern;           /* URL pattern filter (RandomOnlyFor) */
+    random_url_matcher *url_pattern;   /* URL pattern filter (RandomOnlyFor) */
     apr_pool_t *pool;                  /* Pool for this config */
-    random_token_spec *token_specs;    /* Linked list of token specifications */
+    apr_array_header_t *token_specs;   /* random_token_spec in directive order (read-only once
+                                        * read - merges share it by reference) */
+    random_token_plan *plans;          /* token_specs compiled (NULL until compiled) */
+    int plan_count;                    /* Number of entries in plans */
+    int header_count;                  /* plans[0..header_count) have header= */
+    int eager_count;                   /* plans[0..eager_count) are generated in fixups */
+
+    /* Lazy generation (RandomLazyTokens) */
+    int lazy;                          /* Generate non-eager tokens on first use */
+    apr_array_header_t *lazy_handlers; /* Handlers whose env receives pending tokens */
 
     /* Custom alphabet settings (for RANDOM_FORMAT_CUSTOM) */
     char *custom_alphabet;             /* Custom character set */
+    random_alphabet *alphabet;         /* custom_alphabet compiled */
     int alphabet_grouping;             /* Group size (0=no grouping) */
 
     /* Metadata encoding settings */
     int expiry_seconds;                /* Token expiration time (0=no expiry) */
     int encode_metadata;               /* Enable metadata encoding */
     char *signing_key;                 /* HMAC signing key for validation */
+    random_hmac_key *hmac_key;         /* signing_key loaded at config time */
+    random_keyring *keyring;           /* RandomSigningKeyFile (replaces signing_key) */
+    int signing_alg;                   /* random_mac_alg_t, or RANDOM_MAC_ALG_UNSET */
+    int metadata_format;               /* random_metadata_format_t, or RANDOM_METADATA_FORMAT_UNSET */
+    int metadata_mac_length;           /* Compact format MAC bytes */
+
+    /* Token validation settings (RandomValidateToken) */
+    int validate;                      /* Validation enabled (RANDOM_ENABLED_UNSET = inherit) */
+    char *validate_header;             /* Request header carrying the token */
+    char *validate_var;                /* Environment variable receiving the result */
+    char *validate_prefix;             /* prefix= (NULL = the context's RandomPrefix) */
+    char *validate_suffix;             /* suffix= (NULL = the context's RandomSuffix) */
+    int validate_enforce;              /* Reject requests without a valid token */
 } random_config;
 
+/* Server configuration (one per virtual host) */
+typedef struct {
+    apr_uint32_t has_tokens;           /* Some context of this server has RandomAddToken */
+    int early_tokens;                  /* RandomEarlyTokens (RANDOM_ENABLED_UNSET = inherit) */
+} random_server_config;
+
+/* Per-request state, kept in r->request_config (see mod_random_request.c) */
+typedef struct {
+    /* Origin request only */
+    apr_table_t *issued;               /* var_name -> token generated for this client request */
+    random_alloc_trace *alloc_trace;   /* RandomAllocTrace record (NULL = not traced) */
+
+    /* Lazy mode */
+    const random_config *cfg;          /* Config the plans belong to (NULL = not lazy) */
+    char *tokens[RANDOM_MAX_TOKENS];   /* One per plan, NULL until generated */
+    char tried[RANDOM_MAX_TOKENS];     /* Generation attempted (failures are not retried) */
+
+    /* RandomEarlyTokens */
+    const random_config *early_cfg;    /* Server config whose header plans already ran */
+    int early_count;                   /* Number of those plans */
+} random_request_state;
+
 #endif /* MOD_RANDOM_TYPES_H */
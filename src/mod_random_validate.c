@@ -0,0 +1,256 @@
+/*
+ * mod_random_validate.c - Verify signed tokens (RandomValidateToken)
+ *
+ * Checks tokens minted with RandomEncodeMetadata and RandomSigningKey:
+ *
+ *     text:    [prefix]<expiry>:<payload>:[k<key id>.][<alg id>.]<hex MAC>[suffix]
+ *     compact: [prefix]<base64url blob>[suffix]
+ *
+ * The key id (two hex digits, version 2 byte in compact blobs) is present
+ * exactly when the context signs from a RandomSigningKeyFile; it selects
+ * the key in the keyring's current table, and ids the file no longer lists
+ * are invalid.
+ *
+ * The text MAC covers "<expiry>:<payload>"; the signature field has a fixed
+ * length per algorithm, so payloads may contain ':' (custom alphabets). The
+ * compact blob layout is in mod_random_types.h; base64url has no ':', which
+ * tells the two formats apart. The header is parsed in place and compact
+ * blobs are decoded on the stack: no allocation either way.
+ *
+ * Order of checks, cheapest first:
+ *   1. Shape: prefix/suffix, decimal expiry, separators, hex signature
+ *   2. Expiry against the request time - expired tokens never reach HMAC
+ *   3. MAC with the keyed per-thread context, compared in constant time
+ */
+
+#include "mod_random.h"
+#include <openssl/crypto.h>
+#include <string.h>
+
+/* Decimal digits accepted for the expiry: fits apr_int64_t without overflow */
+#define VERIFY_EXPIRY_DIGITS_MAX 18
+
+static const char *const verify_result_names[] = {
+    "valid",     /* RANDOM_VERIFY_VALID */
+    "expired",   /* RANDOM_VERIFY_EXPIRED */
+    "invalid",   /* RANDOM_VERIFY_INVALID */
+    "missing"    /* RANDOM_VERIFY_MISSING */
+};
+
+/* Value exported in the RandomValidateToken variable (static string) */
+const char *random_verify_result_name(random_verify_result_t result)
+{
+    if ((unsigned int)result > RANDOM_VERIFY_MISSING) {
+        result = RANDOM_VERIFY_INVALID;
+    }
+    return verify_result_names[result];
+}
+
+/* Hex digit value (either case), or -1 */
+static int hex_value(unsigned char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/* Big-endian 32-bit read */
+static apr_uint32_t load_be32(const unsigned char *p)
+{
+    return ((apr_uint32_t)p[0] << 24) | ((apr_uint32_t)p[1] << 16) |
+           ((apr_uint32_t)p[2] << 8) | (apr_uint32_t)p[3];
+}
+
+/* Compact blob between p and end (prefix and suffix already removed) */
+static random_verify_result_t random_token_verify_compact(const random_hmac_key *key,
+                                                          const random_key_table *table,
+                                                          random_mac_alg_t alg,
+                                                          const char *p, const char *end,
+                                                          int min_mac_len, apr_time_t now)
+{
+    unsigned char blob[RANDOM_COMPACT_MAX], expected[RANDOM_HMAC_DIGEST_LEN];
+    unsigned char version = table ? RANDOM_COMPACT_VERSION_KEYED : RANDOM_COMPACT_VERSION;
+    apr_size_t header = table ? RANDOM_COMPACT_KEYED_HEADER_LEN : RANDOM_COMPACT_HEADER_LEN;
+    apr_ssize_t n;
+    apr_size_t mac_len, signed_len;
+    int match;
+
+    if ((apr_size_t)(end - p) > random_encoded_max_len(RANDOM_FORMAT_BASE64URL,
+                                                       RANDOM_COMPACT_MAX, NULL, 0)) {
+        return RANDOM_VERIFY_INVALID;
+    }
+    n = random_decode_base64url_into(blob, p, (apr_size_t)(end - p));
+    if (n < (apr_ssize_t)header + 1 || blob[0] != version) {
+        return RANDOM_VERIFY_INVALID;
+    }
+
+    /* Another algorithm or a shorter MAC than this context expects would be a downgrade */
+    mac_len = blob[1] & 0x3F;
+    if ((apr_size_t)min_mac_len > random_mac_len(alg)) {
+        min_mac_len = (int)random_mac_len(alg);   /* As random_plan_compile() truncates */
+    }
+    if ((random_mac_alg_t)(blob[1] >> 6) != alg ||
+        mac_len < (apr_size_t)min_mac_len || mac_len > random_mac_len(alg) ||
+        (apr_size_t)n < header + 1 + mac_len) {
+        return RANDOM_VERIFY_INVALID;
+    }
+
+    if ((apr_int64_t)load_be32(blob + header - 4) < (apr_int64_t)apr_time_sec(now)) {
+        return RANDOM_VERIFY_EXPIRED;
+    }
+    if (table && (key = random_key_table_find(table, blob[2])) == NULL) {
+        return RANDOM_VERIFY_INVALID;   /* Key removed from the file */
+    }
+
+    signed_len = (apr_size_t)n - mac_len;
+    match = random_hmac_key_mac(key, alg, (const char *)blob, signed_len, expected) != 0 &&
+            CRYPTO_memcmp(expected, blob + signed_len, mac_len) == 0;
+
+    OPENSSL_cleanse(expected, sizeof(expected));
+    return match ? RANDOM_VERIFY_VALID : RANDOM_VERIFY_INVALID;
+}
+
+/* Verify with a single key, or with the key table of a key file (key id in the token) */
+static random_verify_result_t token_verify(const random_hmac_key *key, const random_key_table *table,
+                                           random_mac_alg_t alg, const char *token,
+                                           const char *prefix, const char *suffix,
+                                           int min_mac_len, apr_time_t now)
+{
+    unsigned char expected[RANDOM_HMAC_DIGEST_LEN], presented[RANDOM_HMAC_DIGEST_LEN];
+    const char *p, *end, *signed_part, *field, *sig;
+    apr_size_t affix_len, mac_len, kid_len, tag_len, field_len;
+    apr_int64_t expiry = 0;
+    int digits = 0, bad = 0, kid = 0, i, match;
+
+    if (!token || !*token) {
+        return RANDOM_VERIFY_MISSING;
+    }
+    if (!key && !table) {
+        return RANDOM_VERIFY_INVALID;
+    }
+
+    p = token;
+    end = token + strlen(token);
+
+    if (prefix && *prefix) {
+        affix_len = strlen(prefix);
+        if ((apr_size_t)(end - p) < affix_len || memcmp(p, prefix, affix_len) != 0) {
+            return RANDOM_VERIFY_INVALID;
+        }
+        p += affix_len;
+    }
+    if (suffix && *suffix) {
+        affix_len = strlen(suffix);
+        if ((apr_size_t)(end - p) < affix_len || memcmp(end - affix_len, suffix, affix_len) != 0) {
+            return RANDOM_VERIFY_INVALID;
+        }
+        end -= affix_len;
+    }
+
+    /* Text signature: hex, after "k<key id>." with a key file and "<id>." unless HMAC-SHA256 */
+    mac_len = random_mac_len(alg);
+    kid_len = table ? RANDOM_KEY_TAG_LEN : 0;
+    tag_len = (alg != RANDOM_MAC_HMAC_SHA256) ? 2 : 0;
+    field_len = kid_len + tag_len + 2 * mac_len;
+
+    /* Shortest text token: "0:x:" + signature */
+    if (mac_len == 0 || (apr_size_t)(end - p) < 4 + field_len || end[-(apr_ssize_t)field_len - 1] != ':') {
+        return random_token_verify_compact(key, table, alg, p, end, min_mac_len, now);
+    }
+    field = end - field_len;
+    sig = field + kid_len + tag_len;
+    if (kid_len) {
+        int hi = hex_value((unsigned char)field[1]);
+        int lo = hex_value((unsigned char)field[2]);
+
+        if (field[0] != 'k' || field[3] != '.' || (hi | lo) < 0) {
+            return RANDOM_VERIFY_INVALID;
+        }
+        kid = (hi << 4) | lo;
+    }
+    if (tag_len && (field[kid_len] != (char)('0' + alg) || field[kid_len + 1] != '.')) {
+        return RANDOM_VERIFY_INVALID;
+    }
+
+    /* Expiry: decimal digits up to the first ':' */
+    signed_part = p;
+    for (; *p != ':'; p++) {
+        if (*p < '0' || *p > '9' || ++digits > VERIFY_EXPIRY_DIGITS_MAX) {
+            return RANDOM_VERIFY_INVALID;
+        }
+        expiry = expiry * 10 + (*p - '0');
+    }
+    if (digits == 0 || p + 1 >= field - 1) {
+        return RANDOM_VERIFY_INVALID;   /* No expiry or empty payload */
+    }
+
+    for (i = 0; i < (int)mac_len; i++) {
+        int hi = hex_value((unsigned char)sig[2 * i]);
+        int lo = hex_value((unsigned char)sig[2 * i + 1]);
+
+        bad |= hi | lo;
+        presented[i] = (unsigned char)(((unsigned int)hi << 4) | (unsigned int)lo);
+    }
+    if (bad < 0) {
+        return RANDOM_VERIFY_INVALID;
+    }
+
+    if (expiry < (apr_int64_t)apr_time_sec(now)) {
+        return RANDOM_VERIFY_EXPIRED;
+    }
+    if (table && (key = random_key_table_find(table, kid)) == NULL) {
+        return RANDOM_VERIFY_INVALID;   /* Key removed from the file */
+    }
+
+    match = random_hmac_key_mac(key, alg, signed_part, (apr_size_t)(field - 1 - signed_part),
+                                expected) == mac_len &&
+            CRYPTO_memcmp(expected, presented, mac_len) == 0;
+
+    /* expected is a valid signature for attacker-chosen input */
+    OPENSSL_cleanse(expected, sizeof(expected));
+
+    return match ? RANDOM_VERIFY_VALID : RANDOM_VERIFY_INVALID;
+}
+
+/**
+ * Verify a signed token
+ *
+ * @param key     Loaded RandomSigningKey (NULL = nothing can be valid)
+ * @param alg     RandomSigningAlgorithm: tokens signed with another one are invalid
+ * @param token   NUL-terminated token, or NULL when the request has none
+ * @param prefix  RandomPrefix the token must start with (NULL = none)
+ * @param suffix  RandomSuffix the token must end with (NULL = none)
+ * @param min_mac_len  Shortest truncated MAC accepted in compact tokens
+ * @param now     Request time
+ *
+ * @return RANDOM_VERIFY_VALID only for an unexpired token signed with key
+ */
+random_verify_result_t random_token_verify(const random_hmac_key *key, random_mac_alg_t alg,
+                                           const char *token, const char *prefix, const char *suffix,
+                                           int min_mac_len, apr_time_t now)
+{
+    return token_verify(key, NULL, alg, token, prefix, suffix, min_mac_len, now);
+}
+
+/* random_token_verify() for RandomSigningKeyFile: any key of the current table, by key id */
+random_verify_result_t random_token_verify_keyring(random_keyring *keyring, random_mac_alg_t alg,
+                                                   const char *token,
+                                                   const char *prefix, const char *suffix,
+                                                   int min_mac_len, apr_time_t now)
+{
+    random_verify_result_t result;
+
+    if (!token || !*token) {
+        return RANDOM_VERIFY_MISSING;
+    }
+
+    result = token_verify(NULL, random_keyring_acquire(keyring), alg, token,
+                          prefix, suffix, min_mac_len, now);
+    random_keyring_release(keyring);
+    return result;
+}
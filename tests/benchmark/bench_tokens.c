@@ -0,0 +1,478 @@
+/*
+ * bench_tokens.c - Per-token cost of the encoders, generator, TTL cache and signing path
+ *
+ * Every case reports ns/token, bytes/s (random bytes turned into tokens per
+ * second) and allocations/token, split into pool allocations (apr_palloc()
+ * and friends called by the module) and heap allocations (malloc() by the
+ * module plus every OpenSSL allocation). Pool allocations are counted by
+ * linking with -Wl,--wrap (see Makefile); build with -DBENCH_NO_ALLOC_COUNT
+ * on linkers without --wrap.
+ *
+ * Build and run: make bench_tokens && ./bench_tokens [--json] [--iterations N] [--threads N]
+ *
+ * --json prints one JSON object per case (JSON Lines) for compare_bench.py.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "apr_pools.h"
+#include "apr_strings.h"
+#include "apr_thread_proc.h"
+#include <openssl/crypto.h>
+
+#include "httpd.h"
+#include "http_config.h"
+
+#include "../../src/mod_random_types.h"
+
+extern apr_status_t random_thread_init(apr_pool_t *pool);
+extern void random_entropy_set_buffer_size(apr_size_t size);
+extern apr_status_t random_fill_bytes(unsigned char *buf, apr_size_t length);
+extern char *random_encode_hex(apr_pool_t *pool, const unsigned char *data, int length);
+extern char *random_encode_base64url(apr_pool_t *pool, const char *data, int length);
+extern char *random_encode_custom_alphabet(apr_pool_t *pool, const unsigned char *data,
+                                           int length, const char *alphabet, int grouping);
+extern char *random_generate_string_ex(apr_pool_t *pool, int length, random_format_t format,
+                                       const char *alphabet, int grouping);
+extern char *random_encode_with_metadata(apr_pool_t *pool, const char *token,
+                                         int expiry_seconds, const char *signing_key);
+extern random_hmac_key *random_hmac_key_create(apr_pool_t *pool, const char *key, apr_size_t key_len);
+extern void random_plan_compile(apr_pool_t *pool, random_config *cfg, apr_array_header_t *warnings);
+extern apr_size_t random_plan_assemble(const random_token_plan *plan, char *out,
+                                       const unsigned char *bytes, apr_time_t now);
+extern random_token_cache *random_cache_create(apr_pool_t *pool, const char *name);
+extern char *random_cache_lookup(random_token_cache *cache, apr_pool_t *pool,
+                                 apr_time_t now, int ttl, int *refresh);
+extern void random_cache_store(random_token_cache *cache, const char *token, apr_time_t now);
+
+#define BENCH_KEY        "bench-signing-key-0123456789abcdef"
+#define BENCH_ALPHABET32 "0123456789ABCDEFGHJKMNPQRSTVWXYZ"       /* Crockford: bit extraction */
+#define BENCH_ALPHABET36 "0123456789abcdefghijklmnopqrstuvwxyz"   /* Rejection sampling */
+#define BENCH_CLEAR_EVERY 1024  /* Tokens per pool clear, roughly one request's worth of pool */
+#define BENCH_MAX_THREADS 64
+
+static const int bench_lengths[] = {1, 16, 32, 64, 128, 256, 512, 1024};
+#define BENCH_LENGTH_COUNT (sizeof(bench_lengths) / sizeof(bench_lengths[0]))
+
+/* Keeps results observable so the loops are not optimised away */
+static volatile unsigned char sink;
+
+static int json_output = 0;
+
+/* ------------------------------------------------------------------ */
+/* Allocation counters (per thread, so contended cases do not share a line) */
+
+typedef struct {
+    unsigned long pool;
+    unsigned long heap;
+} alloc_count;
+
+static __thread alloc_count allocs;
+
+#ifndef BENCH_NO_ALLOC_COUNT
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__real_apr_palloc(apr_pool_t *p, apr_size_t size);
+void *__real_apr_pcalloc(apr_pool_t *p, apr_size_t size);
+char *__real_apr_pstrdup(apr_pool_t *p, const char *s);
+char *__real_apr_pstrmemdup(apr_pool_t *p, const char *s, apr_size_t n);
+void *__real_apr_pmemdup(apr_pool_t *p, const void *m, apr_size_t n);
+
+void *__wrap_malloc(size_t size) { allocs.heap++; return __real_malloc(size); }
+void *__wrap_calloc(size_t n, size_t size) { allocs.heap++; return __real_calloc(n, size); }
+void *__wrap_realloc(void *ptr, size_t size) { allocs.heap++; return __real_realloc(ptr, size); }
+void *__wrap_apr_palloc(apr_pool_t *p, apr_size_t size) { allocs.pool++; return __real_apr_palloc(p, size); }
+void *__wrap_apr_pcalloc(apr_pool_t *p, apr_size_t size) { allocs.pool++; return __real_apr_pcalloc(p, size); }
+char *__wrap_apr_pstrdup(apr_pool_t *p, const char *s) { allocs.pool++; return __real_apr_pstrdup(p, s); }
+char *__wrap_apr_pstrmemdup(apr_pool_t *p, const char *s, apr_size_t n) { allocs.pool++; return __real_apr_pstrmemdup(p, s, n); }
+void *__wrap_apr_pmemdup(apr_pool_t *p, const void *m, apr_size_t n) { allocs.pool++; return __real_apr_pmemdup(p, m, n); }
+
+/* apr_psprintf() cannot forward its arguments: count it and format with apr_pvsprintf() */
+char *__wrap_apr_psprintf(apr_pool_t *p, const char *fmt, ...)
+{
+    va_list ap;
+    char *res;
+
+    allocs.pool++;
+    va_start(ap, fmt);
+    res = apr_pvsprintf(p, fmt, ap);
+    va_end(ap);
+    return res;
+}
+
+#define BENCH_MALLOC(n)     __real_malloc(n)
+#define BENCH_REALLOC(p, n) __real_realloc((p), (n))
+#else
+#define BENCH_MALLOC(n)     malloc(n)
+#define BENCH_REALLOC(p, n) realloc((p), (n))
+#endif
+
+/* OpenSSL allocates from inside libcrypto, out of --wrap's reach */
+static void *crypto_malloc(size_t n, const char *file, int line)
+{
+    allocs.heap++;
+    return BENCH_MALLOC(n);
+}
+
+static void *crypto_realloc(void *ptr, size_t n, const char *file, int line)
+{
+    allocs.heap++;
+    return BENCH_REALLOC(ptr, n);
+}
+
+static void crypto_free(void *ptr, const char *file, int line)
+{
+    free(ptr);
+}
+
+/* ------------------------------------------------------------------ */
+/* Reporting */
+
+typedef struct {
+    const char *bench;
+    const char *variant;
+    int length;
+    int threads;
+    long tokens;
+    double ns;
+    alloc_count allocs;
+} bench_result;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void report(const bench_result *res)
+{
+    double ns_per_token = res->ns / (double)res->tokens;
+    double bytes_per_sec = (double)res->length * (double)res->tokens * 1e9 / res->ns;
+    double pool_per_token = (double)res->allocs.pool / (double)res->tokens;
+    double heap_per_token = (double)res->allocs.heap / (double)res->tokens;
+
+#ifdef BENCH_NO_ALLOC_COUNT
+    pool_per_token = -1;
+#endif
+
+    if (json_output) {
+        printf("{\"bench\":\"%s\",\"variant\":\"%s\",\"length\":%d,\"threads\":%d,\"tokens\":%ld,"
+               "\"ns_per_token\":%.2f,\"bytes_per_sec\":%.0f,"
+               "\"pool_allocs_per_token\":%.3f,\"heap_allocs_per_token\":%.3f}\n",
+               res->bench, res->variant, res->length, res->threads, res->tokens,
+               ns_per_token, bytes_per_sec, pool_per_token, heap_per_token);
+    } else {
+        printf("%-16s %-14s %5d %3d %10.1f ns %9.1f MB/s %6.2f pool %6.2f heap\n",
+               res->bench, res->variant, res->length, res->threads, ns_per_token,
+               bytes_per_sec / 1e6, pool_per_token, heap_per_token);
+    }
+    fflush(stdout);
+}
+
+/* Iterations for a token length: about the same work per case */
+static long scaled(long iterations, int length)
+{
+    long n = iterations * 16 / (length < 16 ? 16 : length);
+
+    return n < 1000 ? 1000 : n;
+}
+
+/* ------------------------------------------------------------------ */
+/* Single-thread cases */
+
+typedef enum {
+    CASE_HEX, CASE_BASE64URL, CASE_CUSTOM32, CASE_CUSTOM36,
+    CASE_GEN_HEX, CASE_GEN_BASE64, CASE_GEN_BASE64URL, CASE_GEN_CUSTOM,
+    CASE_GEN_UUID4, CASE_GEN_UUID7, CASE_GEN_ULID,
+    CASE_METADATA, CASE_PLAN_SIGNED
+} bench_case;
+
+typedef struct {
+    const char *bench;
+    const char *variant;
+} case_name;
+
+static const case_name case_names[] = {
+    {"encode", "hex"}, {"encode", "base64url"}, {"encode", "custom32"}, {"encode", "custom36"},
+    {"generate", "hex"}, {"generate", "base64"}, {"generate", "base64url"}, {"generate", "custom32"},
+    {"generate", "uuid4"}, {"generate", "uuid7"}, {"generate", "ulid"},
+    {"hmac", "one-shot"}, {"hmac", "keyed-plan"}
+};
+
+static void run_case(apr_pool_t *parent, bench_case c, const char *variant, int length,
+                     long iterations, const unsigned char *data, const char *token,
+                     const random_token_plan *plan)
+{
+    apr_pool_t *pool;
+    bench_result res;
+    char *out = plan ? apr_palloc(parent, plan->token_max) : NULL;
+    apr_time_t t = apr_time_from_sec(1700000000);
+    double start;
+    long i;
+
+    apr_pool_create(&pool, parent);
+    memset(&res, 0, sizeof(res));
+    res.bench = case_names[c].bench;
+    res.variant = variant ? variant : case_names[c].variant;
+    res.length = length;
+    res.threads = 1;
+    res.tokens = iterations;
+
+    allocs.pool = allocs.heap = 0;
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        const char *s = NULL;
+
+        switch (c) {
+        case CASE_HEX:
+            s = random_encode_hex(pool, data, length);
+            break;
+        case CASE_BASE64URL:
+            s = random_encode_base64url(pool, (const char *)data, length);
+            break;
+        case CASE_CUSTOM32:
+            s = random_encode_custom_alphabet(pool, data, length, BENCH_ALPHABET32, 0);
+            break;
+        case CASE_CUSTOM36:
+            s = random_encode_custom_alphabet(pool, data, length, BENCH_ALPHABET36, 0);
+            break;
+        case CASE_GEN_HEX:
+            s = random_generate_string_ex(pool, length, RANDOM_FORMAT_HEX, NULL, 0);
+            break;
+        case CASE_GEN_BASE64:
+            s = random_generate_string_ex(pool, length, RANDOM_FORMAT_BASE64, NULL, 0);
+            break;
+        case CASE_GEN_BASE64URL:
+            s = random_generate_string_ex(pool, length, RANDOM_FORMAT_BASE64URL, NULL, 0);
+            break;
+        case CASE_GEN_CUSTOM:
+            s = random_generate_string_ex(pool, length, RANDOM_FORMAT_CUSTOM, BENCH_ALPHABET32, 0);
+            break;
+        case CASE_GEN_UUID4:
+            s = random_generate_string_ex(pool, length, RANDOM_FORMAT_UUID4, NULL, 0);
+            break;
+        case CASE_GEN_UUID7:
+            s = random_generate_string_ex(pool, length, RANDOM_FORMAT_UUID7, NULL, 0);
+            break;
+        case CASE_GEN_ULID:
+            s = random_generate_string_ex(pool, length, RANDOM_FORMAT_ULID, NULL, 0);
+            break;
+        case CASE_METADATA:
+            s = random_encode_with_metadata(pool, token, 600, BENCH_KEY);
+            break;
+        case CASE_PLAN_SIGNED:
+            random_plan_assemble(plan, out, data, t);
+            s = out;
+            break;
+        }
+        if (s) {
+            sink ^= (unsigned char)s[0];
+        }
+        if ((i + 1) % BENCH_CLEAR_EVERY == 0) {
+            apr_pool_clear(pool);
+        }
+    }
+    res.ns = now_ns() - start;
+    res.allocs = allocs;
+
+    apr_pool_destroy(pool);
+    report(&res);
+}
+
+/* ------------------------------------------------------------------ */
+/* TTL cache under contention */
+
+typedef struct {
+    random_token_cache *cache;
+    long iterations;
+    int writer;                        /* Thread 0 republishes the token regularly */
+    double ns;
+    alloc_count allocs;
+} cache_ctx;
+
+static void *APR_THREAD_FUNC cache_thread(apr_thread_t *thd, void *data)
+{
+    cache_ctx *ctx = data;
+    apr_pool_t *pool;
+    apr_time_t now = apr_time_now();
+    double start;
+    long i;
+    int refresh;
+
+    apr_pool_create(&pool, NULL);
+    allocs.pool = allocs.heap = 0;
+    start = now_ns();
+    for (i = 0; i < ctx->iterations; i++) {
+        char *token = random_cache_lookup(ctx->cache, pool, now, 3600, &refresh);
+
+        if (token) {
+            sink ^= (unsigned char)token[0];
+        }
+        if (refresh || (ctx->writer && i % 4096 == 0)) {
+            random_cache_store(ctx->cache, "q83vEjRWeJCrze8SNFZ4kA", now);
+        }
+        if ((i + 1) % BENCH_CLEAR_EVERY == 0) {
+            apr_pool_clear(pool);
+        }
+    }
+    ctx->ns = now_ns() - start;
+    ctx->allocs = allocs;
+    apr_pool_destroy(pool);
+
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+static void run_cache(apr_pool_t *pool, int threads, long iterations)
+{
+    apr_thread_t *thd[BENCH_MAX_THREADS];
+    cache_ctx ctx[BENCH_MAX_THREADS];
+    random_token_cache *cache = random_cache_create(pool, "BENCH_CACHE");
+    bench_result res;
+    apr_status_t rv;
+    int i;
+
+    random_cache_store(cache, "q83vEjRWeJCrze8SNFZ4kA", apr_time_now());
+    for (i = 0; i < threads; i++) {
+        ctx[i].cache = cache;
+        ctx[i].iterations = iterations;
+        ctx[i].writer = (i == 0);
+        apr_thread_create(&thd[i], NULL, cache_thread, &ctx[i], pool);
+    }
+
+    memset(&res, 0, sizeof(res));
+    res.bench = "ttl-cache";
+    res.variant = "hit";
+    res.length = 16;
+    res.threads = threads;
+    for (i = 0; i < threads; i++) {
+        apr_thread_join(&rv, thd[i]);
+        res.ns += ctx[i].ns;           /* Summed: ns/token is the per-thread latency */
+        res.tokens += ctx[i].iterations;
+        res.allocs.pool += ctx[i].allocs.pool;
+        res.allocs.heap += ctx[i].allocs.heap;
+    }
+    report(&res);
+}
+
+int main(int argc, char **argv)
+{
+    long iterations = 200000;
+    int max_threads = 8, i, threads;
+    apr_pool_t *pool;
+    random_config cfg;
+    random_token_spec spec;
+    static unsigned char data[RANDOM_RAW_MAX];
+    apr_size_t l;
+    int c;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            json_output = 1;
+        } else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            max_threads = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--json] [--iterations N] [--threads N]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (iterations <= 0) {
+        iterations = 200000;
+    }
+    if (max_threads < 1 || max_threads > BENCH_MAX_THREADS) {
+        max_threads = 8;
+    }
+
+    /* Must precede the first OpenSSL allocation */
+    if (!CRYPTO_set_mem_functions(crypto_malloc, crypto_realloc, crypto_free)) {
+        fprintf(stderr, "warning: OpenSSL allocations are not counted\n");
+    }
+
+    apr_initialize();
+    apr_pool_create(&pool, NULL);
+    random_thread_init(pool);
+    random_fill_bytes(data, sizeof(data));
+
+    if (!json_output) {
+        printf("%-16s %-14s %5s %3s %13s %14s %11s %11s\n", "bench", "variant", "len", "thr",
+               "time/token", "throughput", "allocs", "allocs");
+    }
+
+    /* Encoders on fixed random bytes */
+    for (c = CASE_HEX; c <= CASE_CUSTOM36; c++) {
+        for (l = 0; l < BENCH_LENGTH_COUNT; l++) {
+            run_case(pool, (bench_case)c, NULL, bench_lengths[l],
+                     scaled(iterations, bench_lengths[l]), data, NULL, NULL);
+        }
+    }
+
+    /* Complete generation: CSPRNG + encoder, unbuffered then with RandomEntropyBuffer */
+    for (c = CASE_GEN_HEX; c <= CASE_GEN_CUSTOM; c++) {
+        for (l = 0; l < BENCH_LENGTH_COUNT; l++) {
+            run_case(pool, (bench_case)c, NULL, bench_lengths[l],
+                     scaled(iterations, bench_lengths[l]), NULL, NULL, NULL);
+        }
+    }
+    /* Fixed-size identifiers: 16 random bytes whatever the length */
+    for (c = CASE_GEN_UUID4; c <= CASE_GEN_ULID; c++) {
+        run_case(pool, (bench_case)c, NULL, RANDOM_ID_RAW_LEN, iterations, NULL, NULL, NULL);
+    }
+    random_entropy_set_buffer_size(65536);
+    for (l = 0; l < BENCH_LENGTH_COUNT; l++) {
+        run_case(pool, CASE_GEN_HEX, "hex+buffer", bench_lengths[l],
+                 scaled(iterations, bench_lengths[l]), NULL, NULL, NULL);
+    }
+    random_entropy_set_buffer_size(0);
+
+    /* Signing: one-shot HMAC on a token string, then the keyed plan path */
+    for (l = 0; l < BENCH_LENGTH_COUNT; l++) {
+        const char *token = random_encode_base64url(pool, (const char *)data, bench_lengths[l]);
+
+        run_case(pool, CASE_METADATA, NULL, bench_lengths[l],
+                 scaled(iterations, bench_lengths[l]), NULL, token, NULL);
+    }
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.length = RANDOM_LENGTH_UNSET;
+    cfg.format = RANDOM_FORMAT_UNSET;
+    cfg.include_timestamp = RANDOM_ENABLED_UNSET;
+    cfg.ttl_seconds = RANDOM_TTL_UNSET;
+    cfg.alphabet_grouping = RANDOM_GROUPING_UNSET;
+    cfg.expiry_seconds = 600;
+    cfg.encode_metadata = 1;
+    cfg.signing_key = BENCH_KEY;
+    cfg.hmac_key = random_hmac_key_create(pool, BENCH_KEY, strlen(BENCH_KEY));
+    cfg.signing_alg = RANDOM_MAC_ALG_UNSET;
+    cfg.metadata_format = RANDOM_METADATA_FORMAT_UNSET;
+    memset(&spec, 0, sizeof(spec));
+    spec.var_name = "BENCH";
+    spec.format = RANDOM_FORMAT_BASE64URL;
+    spec.include_timestamp = RANDOM_ENABLED_UNSET;
+    spec.ttl_seconds = RANDOM_TTL_UNSET;
+    cfg.token_specs = apr_array_make(pool, 1, sizeof(random_token_spec));
+    *(random_token_spec *)apr_array_push(cfg.token_specs) = spec;
+    for (l = 0; l < BENCH_LENGTH_COUNT; l++) {
+        APR_ARRAY_IDX(cfg.token_specs, 0, random_token_spec).length = bench_lengths[l];
+        random_plan_compile(pool, &cfg, NULL);
+        run_case(pool, CASE_PLAN_SIGNED, NULL, bench_lengths[l],
+                 scaled(iterations, bench_lengths[l]), data, NULL, &cfg.plans[0]);
+    }
+
+    /* TTL cache hits with 1, 2, 4 ... max_threads readers */
+    for (threads = 1; threads <= max_threads; threads *= 2) {
+        run_cache(pool, threads, iterations);
+    }
+
+    apr_pool_destroy(pool);
+    apr_terminate();
+    return 0;
+}
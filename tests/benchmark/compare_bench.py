@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+"""
+Compare two bench_tokens --json runs and flag regressions.
+
+    ./bench_tokens --json > baseline.json
+    (change something, rebuild)
+    ./bench_tokens --json > current.json
+    ./compare_bench.py baseline.json current.json [--threshold 10]
+
+A case regresses when its ns/token grows by more than --threshold percent,
+or when it allocates more per token than before. Exits 1 on regression.
+"""
+
+import argparse
+import json
+import sys
+
+
+def load(path):
+    """Results of one run, keyed by (bench, variant, length, threads)"""
+    results = {}
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if not line.startswith('{'):
+                continue
+            r = json.loads(line)
+            results[(r['bench'], r['variant'], r['length'], r['threads'])] = r
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Compare two bench_tokens --json runs')
+    parser.add_argument('baseline')
+    parser.add_argument('current')
+    parser.add_argument('--threshold', type=float, default=10.0,
+                        help='allowed ns/token increase in percent (default: 10)')
+    args = parser.parse_args()
+
+    baseline = load(args.baseline)
+    current = load(args.current)
+    regressions = 0
+
+    print(f"{'case':<42} {'baseline':>10} {'current':>10} {'delta':>8}  allocs")
+    for key in sorted(current):
+        if key not in baseline:
+            continue
+        old, new = baseline[key], current[key]
+        delta = (new['ns_per_token'] - old['ns_per_token']) * 100.0 / old['ns_per_token']
+        old_allocs = old['pool_allocs_per_token'] + old['heap_allocs_per_token']
+        new_allocs = new['pool_allocs_per_token'] + new['heap_allocs_per_token']
+
+        flags = []
+        if delta > args.threshold:
+            flags.append('SLOWER')
+        if new_allocs > old_allocs + 0.01:
+            flags.append('MORE ALLOCS')
+        regressions += bool(flags)
+
+        name = f"{key[0]}/{key[1]}/{key[2]}/t{key[3]}"
+        print(f"{name:<42} {old['ns_per_token']:>8.1f}ns {new['ns_per_token']:>8.1f}ns "
+              f"{delta:>+7.1f}%  {old_allocs:.2f} -> {new_allocs:.2f} {' '.join(flags)}")
+
+    missing = sorted(set(baseline) - set(current))
+    for key in missing:
+        print(f"missing from current run: {key[0]}/{key[1]}/{key[2]}/t{key[3]}")
+
+    print(f"\n{regressions} regression(s), threshold {args.threshold:.0f}%")
+    return 1 if regressions else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
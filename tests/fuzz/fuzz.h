@@ -0,0 +1,99 @@
+/*
+ * fuzz.h - Shared setup and declarations of the mod_random fuzz targets
+ *
+ * Each target defines LLVMFuzzerTestOneInput() and is linked either with
+ * libFuzzer (clang -fsanitize=fuzzer) or with replay.c, which runs it over
+ * corpus files with any compiler.
+ */
+
+#ifndef MOD_RANDOM_FUZZ_H
+#define MOD_RANDOM_FUZZ_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "apr_general.h"
+#include "apr_pools.h"
+#include "apr_strings.h"
+#include "apr_tables.h"
+
+#include "httpd.h"
+#include "http_config.h"
+
+#include "../../src/mod_random_types.h"
+
+/* Module functions under test (mod_random.h needs the whole of httpd) */
+extern apr_status_t random_thread_init(apr_pool_t *pool);
+extern apr_status_t random_fill_bytes(unsigned char *buf, apr_size_t length);
+extern char *random_encode_hex(apr_pool_t *pool, const unsigned char *data, int length);
+extern char *random_encode_base64url(apr_pool_t *pool, const char *data, int length);
+extern char *random_encode_custom_alphabet(apr_pool_t *pool, const unsigned char *data,
+                                           int length, const char *alphabet, int grouping);
+extern apr_size_t random_encode_hex_into(char *out, const unsigned char *data, int length,
+                                         const random_alphabet *alphabet, int grouping);
+extern apr_size_t random_encode_base64_into(char *out, const unsigned char *data, int length,
+                                            const random_alphabet *alphabet, int grouping);
+extern apr_size_t random_encode_base64url_into(char *out, const unsigned char *data, int length,
+                                               const random_alphabet *alphabet, int grouping);
+extern apr_ssize_t random_decode_base64url_into(unsigned char *out, const char *in, apr_size_t len);
+extern apr_size_t random_encode_custom_pow2_into(char *out, const unsigned char *data, int length,
+                                                 const random_alphabet *alphabet, int grouping);
+extern apr_size_t random_encode_custom_reject_into(char *out, const unsigned char *data, int length,
+                                                   const random_alphabet *alphabet, int grouping);
+extern random_alphabet *random_alphabet_compile(apr_pool_t *pool, const char *chars);
+extern apr_size_t random_alphabet_symbols(const random_alphabet *alphabet, int length);
+extern apr_size_t random_raw_len(random_format_t format, int length, const random_alphabet *alphabet);
+extern random_encode_fn random_encoder_for(random_format_t format, const random_alphabet *alphabet);
+extern apr_size_t random_encoded_max_len(random_format_t format, int length,
+                                         const random_alphabet *alphabet, int grouping);
+extern char *random_encode_with_metadata(apr_pool_t *pool, const char *token,
+                                         int expiry_seconds, const char *signing_key);
+extern random_hmac_key *random_hmac_key_create(apr_pool_t *pool, const char *key, apr_size_t key_len);
+extern int random_hmac_key_supports(const random_hmac_key *hkey, random_mac_alg_t alg);
+extern apr_size_t random_mac_len(random_mac_alg_t alg);
+extern random_verify_result_t random_token_verify(const random_hmac_key *key, random_mac_alg_t alg,
+                                                  const char *token,
+                                                  const char *prefix, const char *suffix,
+                                                  int min_mac_len, apr_time_t now);
+extern const char *random_token_spec_parse(apr_pool_t *pool, const char *args,
+                                           random_token_spec *spec, int *prefill);
+extern void random_spec_registry_reset(apr_pool_t *pconf);
+extern void random_spec_registry_close(void);
+extern random_token_spec *random_spec_intern(apr_pool_t *ptemp, const random_token_spec *spec,
+                                             int prefill, const void *owner, int *created);
+extern void random_plan_compile(apr_pool_t *pool, random_config *cfg, apr_array_header_t *warnings);
+extern apr_size_t random_plan_assemble(const random_token_plan *plan, char *out,
+                                       const unsigned char *bytes, apr_time_t now);
+
+/* Signing key of every signed token the targets build */
+#define FUZZ_KEY "fuzz-signing-key-0123456789abcdef"
+
+/* A failed check aborts: libFuzzer keeps the input as a crash file */
+#define FUZZ_CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        abort(); \
+    } \
+} while (0)
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+/* Pool for one input (destroy it at the end); APR and the thread state
+ * are set up on first use */
+static APR_INLINE apr_pool_t *fuzz_pool_create(void)
+{
+    static apr_pool_t *root = NULL;
+    apr_pool_t *pool;
+
+    if (!root) {
+        apr_initialize();
+        apr_pool_create(&root, NULL);
+        random_thread_init(root);
+    }
+    apr_pool_create(&pool, root);
+    return pool;
+}
+
+#endif /* MOD_RANDOM_FUZZ_H */
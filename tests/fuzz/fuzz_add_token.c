@@ -0,0 +1,157 @@
+/*
+ * fuzz_add_token.c - RandomAddToken parsing, plan compilation and assembly
+ *
+ * Input: <context flags> <RandomAddToken arguments>
+ *
+ * The arguments go through random_token_spec_parse(), as in httpd.conf.
+ * A rejected line must come with a directive error; an accepted one must
+ * only hold values the directive allows, intern to one spec when read
+ * twice for a server (another for a second server), compile into a plan
+ * against the context the flags describe (lazy, signed, compact, alphabet,
+ * defaults) and assemble into a NUL-terminated token shorter than
+ * plan->token_max. The token buffer is allocated at exactly token_max, so AddressSanitizer
+ * catches an underestimated bound.
+ */
+
+#include "fuzz.h"
+
+#define FUZZ_NOW apr_time_from_sec(1700000000)
+
+/* Context the spec is compiled in, one flag bit per setting */
+static void fuzz_context(apr_pool_t *pool, random_config *cfg, unsigned int flags)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->length = RANDOM_LENGTH_UNSET;
+    cfg->format = RANDOM_FORMAT_UNSET;
+    cfg->include_timestamp = (flags & 0x40) ? 1 : RANDOM_ENABLED_UNSET;
+    cfg->ttl_seconds = RANDOM_TTL_UNSET;
+    cfg->alphabet_grouping = (flags & 0x80) ? 5 : RANDOM_GROUPING_UNSET;
+    cfg->expiry_seconds = RANDOM_EXPIRY_UNSET;
+    cfg->encode_metadata = RANDOM_ENABLED_UNSET;
+    cfg->signing_alg = RANDOM_MAC_ALG_UNSET;
+    cfg->metadata_format = RANDOM_METADATA_FORMAT_UNSET;
+    cfg->lazy = (flags & 0x01) ? 1 : RANDOM_ENABLED_UNSET;
+
+    if (flags & 0x02) {
+        cfg->expiry_seconds = 60;
+        cfg->encode_metadata = 1;
+        cfg->signing_key = FUZZ_KEY;
+        cfg->hmac_key = random_hmac_key_create(pool, FUZZ_KEY, strlen(FUZZ_KEY));
+        cfg->metadata_format = (flags & 0x04) ? RANDOM_METADATA_COMPACT : RANDOM_METADATA_TEXT;
+    }
+    if (flags & 0x08) {
+        cfg->custom_alphabet = (flags & 0x10) ? "0123456789ABCDEFGHJKMNPQRSTVWXYZ" : "0123456789";
+        cfg->alphabet = random_alphabet_compile(pool, cfg->custom_alphabet);
+    }
+    if (flags & 0x20) {
+        cfg->prefix = "ctx_";
+    }
+}
+
+/* An accepted line only holds what the directive allows */
+static void check_spec(const random_token_spec *spec, int prefill)
+{
+    FUZZ_CHECK(spec->var_name && *spec->var_name);
+    FUZZ_CHECK(!strpbrk(spec->var_name, " \t"));
+    FUZZ_CHECK(spec->length == RANDOM_LENGTH_UNSET ||
+               (spec->length >= RANDOM_LENGTH_MIN && spec->length <= RANDOM_LENGTH_MAX));
+    FUZZ_CHECK((int)spec->format == RANDOM_FORMAT_UNSET ||
+               (spec->format >= RANDOM_FORMAT_BASE64 && spec->format <= RANDOM_FORMAT_ULID));
+    FUZZ_CHECK(spec->ttl_seconds == RANDOM_TTL_UNSET ||
+               (spec->ttl_seconds >= 0 && spec->ttl_seconds <= RANDOM_TTL_MAX_SECONDS));
+    FUZZ_CHECK(prefill >= 0 && prefill <= RANDOM_PREFILL_MAX);
+    FUZZ_CHECK(!(spec->output == RANDOM_OUTPUT_ENV && spec->header_name));
+    FUZZ_CHECK(spec->output == RANDOM_OUTPUT_UNSET ||
+               !(spec->output & RANDOM_OUTPUT_HEADER) || spec->header_name);
+    FUZZ_CHECK(!spec->cache && !spec->prefill);
+}
+
+/* The same line read twice for a server is one registered spec */
+static void check_intern(apr_pool_t *pool, const random_token_spec *spec, int prefill)
+{
+    static int server_a, server_b;
+    random_token_spec *first, *again;
+    int created;
+
+    random_spec_registry_reset(pool);
+    first = random_spec_intern(pool, spec, prefill, &server_a, &created);
+    FUZZ_CHECK(first && created && strcmp(first->var_name, spec->var_name) == 0);
+    again = random_spec_intern(pool, spec, prefill, &server_a, &created);
+    FUZZ_CHECK(again == first && !created);
+    again = random_spec_intern(pool, spec, prefill, &server_b, &created);
+    FUZZ_CHECK(again != first && created);
+    random_spec_registry_close();
+}
+
+/* The compiled plan resolved every fallback */
+static void check_plan(const random_config *cfg, const random_token_plan *plan,
+                       const random_token_spec *spec)
+{
+    FUZZ_CHECK(cfg->plan_count == 1);
+    FUZZ_CHECK(cfg->header_count <= cfg->eager_count && cfg->eager_count <= cfg->plan_count);
+    FUZZ_CHECK(cfg->header_count == (spec->header_name ? 1 : 0));
+    FUZZ_CHECK(plan->length >= RANDOM_LENGTH_MIN && plan->length <= RANDOM_LENGTH_MAX);
+    FUZZ_CHECK(plan->format >= RANDOM_FORMAT_BASE64 && plan->format <= RANDOM_FORMAT_ULID);
+    FUZZ_CHECK((plan->format == RANDOM_FORMAT_CUSTOM) == (plan->alphabet != NULL));
+    FUZZ_CHECK(plan->output != 0 && (!(plan->output & RANDOM_OUTPUT_HEADER) || plan->header_name));
+    FUZZ_CHECK(plan->raw_length <= RANDOM_RAW_MAX);
+    FUZZ_CHECK(plan->encode != NULL);
+    FUZZ_CHECK(plan->token_max > plan->prefix_len + plan->suffix_len + plan->encoded_max);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    apr_pool_t *pool;
+    random_config cfg;
+    random_token_spec spec;
+    const random_token_plan *plan;
+    unsigned char *bytes;
+    const char *line, *error;
+    char *token;
+    apr_size_t len, i;
+    int prefill = -1;
+
+    if (size < 1) {
+        return 0;
+    }
+    pool = fuzz_pool_create();
+    line = apr_pstrmemdup(pool, (const char *)data + 1, size - 1);
+
+    error = random_token_spec_parse(pool, line, &spec, &prefill);
+    if (error) {
+        FUZZ_CHECK(strncmp(error, "RandomAddToken: ", 16) == 0);
+        apr_pool_destroy(pool);
+        return 0;
+    }
+    check_spec(&spec, prefill);
+    check_intern(pool, &spec, prefill);
+
+    fuzz_context(pool, &cfg, data[0]);
+    cfg.token_specs = apr_array_make(pool, 1, sizeof(random_token_spec));
+    *(random_token_spec *)apr_array_push(cfg.token_specs) = spec;
+    random_plan_compile(pool, &cfg, apr_array_make(pool, 4, sizeof(const char *)));
+    plan = &cfg.plans[0];
+    check_plan(&cfg, plan, &spec);
+
+    /* Input bytes (repeated) as the random bytes: assembly is deterministic */
+    bytes = apr_palloc(pool, plan->raw_length);
+    for (i = 0; i < plan->raw_length; i++) {
+        bytes[i] = data[i % size];
+    }
+    token = malloc(plan->token_max);
+    len = random_plan_assemble(plan, token, bytes, FUZZ_NOW);
+    FUZZ_CHECK(len < plan->token_max && strlen(token) == len);
+    FUZZ_CHECK(len >= plan->prefix_len + plan->suffix_len);
+    FUZZ_CHECK(plan->prefix_len == 0 || memcmp(token, plan->prefix, plan->prefix_len) == 0);
+    FUZZ_CHECK(plan->suffix_len == 0 ||
+               memcmp(token + len - plan->suffix_len, plan->suffix, plan->suffix_len) == 0);
+
+    if (plan->hmac_key) {
+        FUZZ_CHECK(random_token_verify(plan->hmac_key, plan->mac_alg, token, plan->prefix, plan->suffix,
+                                       plan->compact_mac_len, FUZZ_NOW) == RANDOM_VERIFY_VALID);
+    }
+
+    free(token);
+    apr_pool_destroy(pool);
+    return 0;
+}
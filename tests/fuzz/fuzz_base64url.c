@@ -0,0 +1,89 @@
+/*
+ * fuzz_base64url.c - base64url decoder against a reference, and round trips
+ *
+ * The input is used twice:
+ *   - as text for random_decode_base64url_into(), which must accept exactly
+ *     the canonical spellings the reference decoder accepts, decode them to
+ *     the same bytes, and re-encode them to the input
+ *   - as bytes for random_encode_base64url_into(), whose output must decode
+ *     back to them
+ */
+
+#include "fuzz.h"
+
+static const char ref_alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+/* Bit-by-bit decoder: -1 for anything that is not canonical unpadded base64url */
+static apr_ssize_t ref_decode(unsigned char *out, const unsigned char *in, apr_size_t len)
+{
+    apr_size_t nbits = len * 6, i, b;
+    const char *p;
+    unsigned int v;
+
+    if (nbits % 8 >= 6) {
+        return -1;   /* A whole symbol that carries no full byte */
+    }
+    memset(out, 0, nbits / 8);
+    for (i = 0; i < len; i++) {
+        p = in[i] ? strchr(ref_alphabet, in[i]) : NULL;
+        if (!p) {
+            return -1;
+        }
+        v = (unsigned int)(p - ref_alphabet);
+        for (b = 0; b < 6; b++) {
+            apr_size_t bit = i * 6 + b;
+
+            if (!((v >> (5 - b)) & 1)) {
+                continue;
+            }
+            if (bit >= nbits / 8 * 8) {
+                return -1;   /* Unused bits of the last symbol must be zero */
+            }
+            out[bit / 8] |= (unsigned char)(0x80 >> (bit % 8));
+        }
+    }
+    return (apr_ssize_t)(nbits / 8);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    unsigned char *decoded, *expected;
+    char *encoded;
+    apr_ssize_t n, ref_n;
+
+    /* Text: decoder verdict and bytes match the reference */
+    decoded = malloc(size * 3 / 4 + 1);
+    expected = malloc(size * 3 / 4 + 1);
+    n = random_decode_base64url_into(decoded, (const char *)data, size);
+    ref_n = ref_decode(expected, data, size);
+    FUZZ_CHECK(n == ref_n);
+    if (n >= 0) {
+        FUZZ_CHECK(memcmp(decoded, expected, (size_t)n) == 0);
+
+        /* Canonical: the one spelling of these bytes is the input */
+        encoded = malloc(size + 1);
+        FUZZ_CHECK(random_encode_base64url_into(encoded, decoded, (int)n, NULL, 0) == size);
+        FUZZ_CHECK(memcmp(encoded, data, size) == 0);
+        free(encoded);
+    }
+    free(expected);
+    free(decoded);
+
+    /* Bytes: encode, then decode back */
+    if (size <= RANDOM_COMPACT_MAX * 4) {
+        apr_size_t max = random_encoded_max_len(RANDOM_FORMAT_BASE64URL, (int)size, NULL, 0);
+        apr_size_t len;
+
+        encoded = malloc(max + 1);
+        decoded = malloc(size + 1);
+        len = random_encode_base64url_into(encoded, data, (int)size, NULL, 0);
+        FUZZ_CHECK(len <= max);
+        FUZZ_CHECK(random_decode_base64url_into(decoded, encoded, len) == (apr_ssize_t)size);
+        FUZZ_CHECK(memcmp(decoded, data, size) == 0);
+        free(decoded);
+        free(encoded);
+    }
+
+    return 0;
+}
@@ -0,0 +1,265 @@
+/*
+ * fuzz_encoders.c - Differential fuzzing of the hex, base64, base64url and
+ *                   custom alphabet encoders
+ *
+ * Input: <alphabet size> <grouping> <alphabet bytes> <payload>
+ *
+ * Every encoder the module can select (scalar, SIMD through
+ * random_encoder_for(), compiled alphabet kernels, pool API) must produce
+ * exactly what a straightforward reference produces, and never more than
+ * random_encoded_max_len() characters: output buffers are allocated at that
+ * size, so AddressSanitizer catches any overrun.
+ */
+
+#include "fuzz.h"
+#include "apr_base64.h"
+
+/* Lowercase hex, one byte at a time */
+static apr_size_t ref_hex(char *out, const unsigned char *data, int length)
+{
+    char pair[3];
+    int i;
+
+    for (i = 0; i < length; i++) {
+        snprintf(pair, sizeof(pair), "%02x", data[i]);
+        memcpy(out + 2 * i, pair, 2);
+    }
+    return (apr_size_t)length * 2;
+}
+
+/* Padded base64, from apr-util */
+static apr_size_t ref_base64(char *out, const unsigned char *data, int length)
+{
+    char *buf = malloc(apr_base64_encode_len(length));
+    apr_size_t n;
+
+    apr_base64_encode_binary(buf, data, length);
+    n = strlen(buf);
+    memcpy(out, buf, n);
+    free(buf);
+    return n;
+}
+
+/* base64url: base64 with '-' and '_', padding removed */
+static apr_size_t ref_base64url(char *out, const unsigned char *data, int length)
+{
+    apr_size_t n = ref_base64(out, data, length), i;
+
+    while (n > 0 && out[n - 1] == '=') {
+        n--;
+    }
+    for (i = 0; i < n; i++) {
+        out[i] = (out[i] == '+') ? '-' : (out[i] == '/') ? '_' : out[i];
+    }
+    return n;
+}
+
+/* Power-of-two alphabet: read bits MSB first, zero-pad the last symbol */
+static apr_size_t ref_pow2(char *out, const unsigned char *data, int length,
+                           const char *chars, int bits)
+{
+    apr_size_t nbits = (apr_size_t)length * 8, pos, b, o = 0;
+    unsigned int v;
+    int k;
+
+    for (pos = 0; pos < nbits; pos += (apr_size_t)bits) {
+        v = 0;
+        for (k = 0; k < bits; k++) {
+            b = pos + (apr_size_t)k;
+            v = (v << 1) | (b < nbits ? (data[b / 8] >> (7 - b % 8)) & 1U : 0U);
+        }
+        out[o++] = chars[v];
+    }
+    return o;
+}
+
+/* Rejection sampling: bytes below threshold in order, up to symbols of them */
+static apr_size_t ref_reject(char *out, const unsigned char *data, apr_size_t length,
+                             const char *chars, unsigned int size, apr_size_t symbols)
+{
+    unsigned int threshold = 256 - 256 % size;
+    apr_size_t i, o = 0;
+
+    for (i = 0; i < length && o < symbols; i++) {
+        if (data[i] < threshold) {
+            out[o++] = chars[data[i] % size];
+        }
+    }
+    return o;
+}
+
+/* '-' before every grouping-th symbol, counted from the start */
+static apr_size_t ref_group(char *out, const char *in, apr_size_t n, int grouping)
+{
+    apr_size_t k, o = 0;
+
+    for (k = 0; k < n; k++) {
+        if (grouping > 0 && k > 0 && k % (apr_size_t)grouping == 0) {
+            out[o++] = '-';
+        }
+        out[o++] = in[k];
+    }
+    return o;
+}
+
+/* Drop the separators ref_group() inserts (by position: '-' may be a symbol) */
+static apr_size_t ungroup(char *out, const char *in, apr_size_t n, int grouping)
+{
+    apr_size_t k, o = 0;
+
+    for (k = 0; k < n; k++) {
+        if (grouping > 0 && (k + 1) % (apr_size_t)(grouping + 1) == 0) {
+            FUZZ_CHECK(in[k] == '-');
+            continue;
+        }
+        out[o++] = in[k];
+    }
+    return o;
+}
+
+/* Output buffer of exactly the bound the module promises (never 0 bytes) */
+static char *bounded(apr_size_t max)
+{
+    return malloc(max ? max : 1);
+}
+
+/* One fixed format: scalar, dispatched (SIMD when available) and pool API */
+static void check_format(random_format_t format, random_encode_fn scalar,
+                         apr_size_t (*ref)(char *, const unsigned char *, int),
+                         const unsigned char *payload, int n, apr_pool_t *pool)
+{
+    apr_size_t max = random_encoded_max_len(format, n, NULL, 0);
+    char *expected = malloc(4 * (apr_size_t)n + 8);
+    char *out = bounded(max);
+    apr_size_t len = ref(expected, payload, n);
+    const char *str;
+
+    FUZZ_CHECK(len <= max);
+    FUZZ_CHECK(scalar(out, payload, n, NULL, 0) == len);
+    FUZZ_CHECK(memcmp(out, expected, len) == 0);
+    FUZZ_CHECK(random_encoder_for(format, NULL)(out, payload, n, NULL, 0) == len);
+    FUZZ_CHECK(memcmp(out, expected, len) == 0);
+
+    str = (format == RANDOM_FORMAT_HEX) ? random_encode_hex(pool, payload, n) :
+          (format == RANDOM_FORMAT_BASE64URL) ? random_encode_base64url(pool, (const char *)payload, n) :
+          NULL;
+    if (str) {
+        FUZZ_CHECK(strlen(str) == len && memcmp(str, expected, len) == 0);
+    }
+
+    free(out);
+    free(expected);
+}
+
+static void check_custom(const char *chars, int grouping, const unsigned char *payload, int n,
+                         apr_pool_t *pool)
+{
+    apr_size_t size = strlen(chars), symbols, raw, max, len, ref_len, i;
+    const random_alphabet *alphabet;
+    unsigned char *input;
+    char *out, *expected, *plain;
+    const char *str;
+
+    /* Invalid alphabets: the pool API falls back to hex */
+    if (size < RANDOM_ALPHABET_MIN_SIZE || size > RANDOM_ALPHABET_MAX_SIZE) {
+        expected = malloc(2 * (apr_size_t)n + 1);
+        len = ref_hex(expected, payload, n);
+        str = random_encode_custom_alphabet(pool, payload, n, chars, grouping);
+        FUZZ_CHECK(str && strlen(str) == len && memcmp(str, expected, len) == 0);
+        free(expected);
+        return;
+    }
+
+    alphabet = random_alphabet_compile(pool, chars);
+    symbols = random_alphabet_symbols(alphabet, n);
+    raw = random_raw_len(RANDOM_FORMAT_CUSTOM, n, alphabet);
+    max = random_encoded_max_len(RANDOM_FORMAT_CUSTOM, n, alphabet, grouping);
+    FUZZ_CHECK(random_encoder_for(RANDOM_FORMAT_CUSTOM, alphabet) ==
+               (alphabet->bits ? random_encode_custom_pow2_into : random_encode_custom_reject_into));
+
+    /* Kernel input: raw bytes, the payload repeated to fill them */
+    input = malloc(raw ? raw : 1);
+    for (i = 0; i < raw; i++) {
+        input[i] = n ? payload[i % (apr_size_t)n] : 0;
+    }
+
+    out = bounded(max);
+    expected = malloc(2 * symbols + 2);
+    plain = malloc(symbols + max + 1);
+
+    if (alphabet->bits) {
+        ref_len = ref_pow2(plain, payload, n, chars, alphabet->bits);
+        FUZZ_CHECK(ref_len == symbols);
+        ref_len = ref_group(expected, plain, ref_len, grouping);
+        FUZZ_CHECK(ref_len <= max);
+
+        len = random_encode_custom_pow2_into(out, payload, n, alphabet, grouping);
+        FUZZ_CHECK(len == ref_len && memcmp(out, expected, len) == 0);
+        str = random_encode_custom_alphabet(pool, payload, n, chars, grouping);
+        FUZZ_CHECK(str && strlen(str) == len && memcmp(str, expected, len) == 0);
+    } else {
+        /* With too few accepted bytes the kernel tops up from the CSPRNG:
+         * only the part decided by the input can be compared */
+        ref_len = ref_reject(expected, input, raw, chars, (unsigned int)size, symbols);
+        len = random_encode_custom_reject_into(out, input, n, alphabet, grouping);
+        FUZZ_CHECK(len <= max);
+        len = ungroup(plain, out, len, grouping);
+        FUZZ_CHECK(len == symbols);
+        FUZZ_CHECK(memcmp(plain, expected, ref_len) == 0);
+
+        /* Pool API: the payload, then CSPRNG bytes */
+        str = random_encode_custom_alphabet(pool, payload, n, chars, grouping);
+        FUZZ_CHECK(str && strlen(str) <= max);
+        len = ungroup(plain, str, strlen(str), grouping);
+        FUZZ_CHECK(len == symbols);
+        ref_len = ref_reject(expected, payload, (apr_size_t)n, chars, (unsigned int)size, symbols);
+        FUZZ_CHECK(memcmp(plain, expected, ref_len) == 0);
+
+        /* The CSPRNG part too: only alphabet symbols */
+        for (i = 0; i < len; i++) {
+            FUZZ_CHECK(memchr(chars, plain[i], size) != NULL);
+        }
+    }
+
+    free(plain);
+    free(expected);
+    free(out);
+    free(input);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    apr_pool_t *pool;
+    char *chars;
+    size_t alphabet_size, i;
+    int grouping, n;
+
+    if (size < 2) {
+        return 0;
+    }
+    pool = fuzz_pool_create();
+
+    /* Alphabet bytes as a C string: NUL cannot be a symbol */
+    alphabet_size = data[0];
+    if (alphabet_size > size - 2) {
+        alphabet_size = size - 2;
+    }
+    grouping = data[1] % (RANDOM_GROUPING_MAX + 1);
+    chars = apr_palloc(pool, alphabet_size + 1);
+    for (i = 0; i < alphabet_size; i++) {
+        chars[i] = data[2 + i] ? (char)data[2 + i] : '\x01';
+    }
+    chars[alphabet_size] = '\0';
+
+    data += 2 + alphabet_size;
+    size -= 2 + alphabet_size;
+    n = (int)(size > RANDOM_LENGTH_MAX ? RANDOM_LENGTH_MAX : size);
+
+    check_format(RANDOM_FORMAT_HEX, random_encode_hex_into, ref_hex, data, n, pool);
+    check_format(RANDOM_FORMAT_BASE64, random_encode_base64_into, ref_base64, data, n, pool);
+    check_format(RANDOM_FORMAT_BASE64URL, random_encode_base64url_into, ref_base64url, data, n, pool);
+    check_custom(chars, grouping, data, n, pool);
+
+    apr_pool_destroy(pool);
+    return 0;
+}
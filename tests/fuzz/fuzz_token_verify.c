@@ -0,0 +1,192 @@
+/*
+ * fuzz_token_verify.c - Signed metadata: encoder, plan assembly and validator
+ *
+ * Input: <algorithm> <flags> <MAC length> <flip position (2 bytes)> <payload>
+ *
+ *   - The whole input, as a token, goes through random_token_verify() for
+ *     every algorithm: any verdict is fine, a crash or overread is not.
+ *   - A token is minted from the payload by a compiled plan (text or compact
+ *     format, per flags): it must verify until its expiry second, expire
+ *     after it, and no longer verify with one character flipped. Text
+ *     HMAC-SHA256 signatures are also recomputed with OpenSSL's HMAC().
+ *   - random_encode_with_metadata() of the payload (as hex) must verify too
+ *     and carry the same reference signature.
+ */
+
+#include "fuzz.h"
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#define FUZZ_NOW    apr_time_from_sec(1700000000)
+#define FUZZ_EXPIRY 300
+
+static const char *const fuzz_formats[] = {
+    "hex", "base64", "base64url", "custom", "uuid4", "ulid"
+};
+
+/* Reference signature of a text HMAC-SHA256 token: "<signed>:<hex>" at the end */
+static void check_reference_hmac(const char *body, apr_size_t len)
+{
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len = 0, i;
+    char hex[2 * EVP_MAX_MD_SIZE + 1];
+    apr_size_t signed_len;
+
+    FUZZ_CHECK(len > RANDOM_SIGNATURE_HEX_LEN + 1);
+    signed_len = len - RANDOM_SIGNATURE_HEX_LEN - 1;
+    FUZZ_CHECK(body[signed_len] == ':');
+
+    HMAC(EVP_sha256(), FUZZ_KEY, (int)strlen(FUZZ_KEY), (const unsigned char *)body, signed_len,
+         digest, &digest_len);
+    FUZZ_CHECK(digest_len * 2 == RANDOM_SIGNATURE_HEX_LEN);
+    for (i = 0; i < digest_len; i++) {
+        snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+    }
+    FUZZ_CHECK(memcmp(body + signed_len + 1, hex, RANDOM_SIGNATURE_HEX_LEN) == 0);
+}
+
+/* Arbitrary input as a token: must not crash (nor read past the NUL) */
+static void check_arbitrary(apr_pool_t *pool, const random_hmac_key *key,
+                            const uint8_t *data, size_t size)
+{
+    const char *token = apr_pstrmemdup(pool, (const char *)data, size);
+    int alg;
+
+    for (alg = 0; alg < RANDOM_MAC_ALG_COUNT; alg++) {
+        random_verify_result_t result;
+
+        if (!random_hmac_key_supports(key, (random_mac_alg_t)alg)) {
+            continue;
+        }
+        result = random_token_verify(key, (random_mac_alg_t)alg, token, NULL, NULL,
+                                     RANDOM_COMPACT_MAC_MIN, FUZZ_NOW);
+        FUZZ_CHECK(result >= RANDOM_VERIFY_VALID && result <= RANDOM_VERIFY_MISSING);
+        result = random_token_verify(key, (random_mac_alg_t)alg, token, "tk_", "_s",
+                                     RANDOM_COMPACT_MAC_MIN, FUZZ_NOW);
+        FUZZ_CHECK(result >= RANDOM_VERIFY_VALID && result <= RANDOM_VERIFY_MISSING);
+    }
+}
+
+/* Token minted by a compiled plan */
+static void check_minted(apr_pool_t *pool, random_hmac_key *key, const uint8_t *data, size_t size)
+{
+    random_mac_alg_t alg = (random_mac_alg_t)(data[0] % RANDOM_MAC_ALG_COUNT);
+    int compact = data[1] & 1, timestamp = (data[1] >> 1) & 1;
+    const char *prefix = (data[1] & 0x04) ? "tk_" : NULL;
+    const char *suffix = (data[1] & 0x08) ? "_s" : NULL;
+    const char *format = fuzz_formats[(data[1] >> 4) % 6];
+    int mac_len = RANDOM_COMPACT_MAC_MIN + data[2] % (RANDOM_HMAC_DIGEST_LEN - RANDOM_COMPACT_MAC_MIN + 1);
+    apr_size_t pos = ((apr_size_t)data[3] << 8) | data[4];
+    const uint8_t *payload = data + 5;
+    size_t payload_len = size - 5, i;
+    random_config cfg;
+    random_token_spec spec;
+    const random_token_plan *plan;
+    const char *error;
+    unsigned char *bytes;
+    char *token, *body;
+    apr_size_t len, body_len;
+    int prefill, length;
+
+    if (!random_hmac_key_supports(key, alg)) {
+        alg = RANDOM_MAC_HMAC_SHA256;
+    }
+    length = payload_len < RANDOM_LENGTH_MIN ? RANDOM_LENGTH_MIN :
+             payload_len > RANDOM_LENGTH_MAX ? RANDOM_LENGTH_MAX : (int)payload_len;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.length = RANDOM_LENGTH_UNSET;
+    cfg.format = RANDOM_FORMAT_UNSET;
+    cfg.include_timestamp = RANDOM_ENABLED_UNSET;
+    cfg.ttl_seconds = RANDOM_TTL_UNSET;
+    cfg.alphabet_grouping = 4;
+    cfg.custom_alphabet = "0123456789";
+    cfg.alphabet = random_alphabet_compile(pool, cfg.custom_alphabet);
+    cfg.expiry_seconds = FUZZ_EXPIRY;
+    cfg.encode_metadata = 1;
+    cfg.signing_key = FUZZ_KEY;
+    cfg.hmac_key = key;
+    cfg.signing_alg = alg;
+    cfg.metadata_format = compact ? RANDOM_METADATA_COMPACT : RANDOM_METADATA_TEXT;
+    cfg.metadata_mac_length = mac_len;
+    cfg.prefix = (char *)prefix;
+    cfg.suffix = (char *)suffix;
+
+    error = random_token_spec_parse(pool, apr_psprintf(pool, "SIGNED length=%d format=%s timestamp=%s",
+                                                       length, format, timestamp ? "on" : "off"),
+                                    &spec, &prefill);
+    FUZZ_CHECK(error == NULL);
+    cfg.token_specs = apr_array_make(pool, 1, sizeof(random_token_spec));
+    *(random_token_spec *)apr_array_push(cfg.token_specs) = spec;
+    random_plan_compile(pool, &cfg, NULL);
+    FUZZ_CHECK(cfg.plan_count == 1);
+    plan = &cfg.plans[0];
+    FUZZ_CHECK(plan->hmac_key == key && plan->mac_alg == alg);
+
+    bytes = apr_palloc(pool, plan->raw_length);
+    for (i = 0; i < plan->raw_length; i++) {
+        bytes[i] = payload_len ? payload[i % payload_len] : 0;
+    }
+    token = apr_palloc(pool, plan->token_max);
+    len = random_plan_assemble(plan, token, bytes, FUZZ_NOW);
+    FUZZ_CHECK(len < plan->token_max && strlen(token) == len);
+
+    FUZZ_CHECK(random_token_verify(key, alg, token, prefix, suffix, mac_len, FUZZ_NOW) ==
+               RANDOM_VERIFY_VALID);
+    FUZZ_CHECK(random_token_verify(key, alg, token, prefix, suffix, mac_len,
+                                   FUZZ_NOW + apr_time_from_sec(FUZZ_EXPIRY)) == RANDOM_VERIFY_VALID);
+    FUZZ_CHECK(random_token_verify(key, alg, token, prefix, suffix, mac_len,
+                                   FUZZ_NOW + apr_time_from_sec(FUZZ_EXPIRY + 1)) == RANDOM_VERIFY_EXPIRED);
+
+    /* Text HMAC-SHA256: the signature is the reference HMAC of what precedes it */
+    body = token + (prefix ? strlen(prefix) : 0);
+    body_len = len - (prefix ? strlen(prefix) : 0) - (suffix ? strlen(suffix) : 0);
+    if (!compact && alg == RANDOM_MAC_HMAC_SHA256) {
+        check_reference_hmac(body, body_len);
+    }
+
+    /* One character flipped (never a case change: hex is case-insensitive) */
+    pos %= len;
+    token[pos] ^= 1;
+    FUZZ_CHECK(random_token_verify(key, alg, token, prefix, suffix, mac_len, FUZZ_NOW) !=
+               RANDOM_VERIFY_VALID);
+}
+
+/* random_encode_with_metadata(): the standalone text encoder */
+static void check_metadata_encoder(apr_pool_t *pool, const random_hmac_key *key,
+                                   const uint8_t *data, size_t size)
+{
+    const char *payload, *token;
+
+    if (size == 0) {
+        return;
+    }
+    payload = random_encode_hex(pool, data, size > RANDOM_LENGTH_MAX ? RANDOM_LENGTH_MAX : (int)size);
+    token = random_encode_with_metadata(pool, payload, FUZZ_EXPIRY, FUZZ_KEY);
+    FUZZ_CHECK(token != NULL);
+    FUZZ_CHECK(random_token_verify(key, RANDOM_MAC_HMAC_SHA256, token, NULL, NULL,
+                                   RANDOM_COMPACT_MAC_MIN, apr_time_now()) == RANDOM_VERIFY_VALID);
+    check_reference_hmac(token, strlen(token));
+
+    /* Without a key: "<expiry>:<payload>", which never verifies */
+    token = random_encode_with_metadata(pool, payload, FUZZ_EXPIRY, NULL);
+    FUZZ_CHECK(strcmp(strchr(token, ':') + 1, payload) == 0);
+    FUZZ_CHECK(random_token_verify(key, RANDOM_MAC_HMAC_SHA256, token, NULL, NULL,
+                                   RANDOM_COMPACT_MAC_MIN, apr_time_now()) != RANDOM_VERIFY_VALID);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    apr_pool_t *pool = fuzz_pool_create();
+    random_hmac_key *key = random_hmac_key_create(pool, FUZZ_KEY, strlen(FUZZ_KEY));
+
+    FUZZ_CHECK(key != NULL);
+    check_arbitrary(pool, key, data, size);
+    if (size >= 5) {
+        check_minted(pool, key, data, size);
+    }
+    check_metadata_encoder(pool, key, data, size);
+
+    apr_pool_destroy(pool);
+    return 0;
+}
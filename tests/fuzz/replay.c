@@ -0,0 +1,88 @@
+/*
+ * replay.c - Run a fuzz target over files, without libFuzzer
+ *
+ * Links with any one fuzz_*.c in place of -fsanitize=fuzzer, so the corpus
+ * and saved crashes replay under gcc, valgrind or a debugger:
+ *
+ *     ./fuzz_encoders_replay crash-1234 seed-input
+ *
+ * "-runs=N" (with an optional "-seed=S") feeds N pseudo-random inputs
+ * instead, a quick smoke run for builds without libFuzzer.
+ */
+
+#include "fuzz.h"
+
+#define REPLAY_MAX_INPUT 4096
+
+/* xorshift32: reproducible inputs for -runs= */
+static uint32_t replay_next(uint32_t *state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static int replay_file(const char *path)
+{
+    static uint8_t buf[1 << 20];
+    FILE *f = fopen(path, "rb");
+    size_t n;
+
+    if (!f) {
+        fprintf(stderr, "replay: cannot open %s\n", path);
+        return 1;
+    }
+    n = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    LLVMFuzzerTestOneInput(buf, n);
+    return 0;
+}
+
+static void replay_random(long runs, uint32_t seed)
+{
+    uint8_t buf[REPLAY_MAX_INPUT];
+    uint32_t state = seed ? seed : 1;
+    long r;
+    size_t n, i;
+
+    for (r = 0; r < runs; r++) {
+        /* Mostly short inputs, where the format boundaries are */
+        n = replay_next(&state) % ((r & 7) ? 64 : sizeof(buf));
+        for (i = 0; i < n; i++) {
+            buf[i] = (uint8_t)replay_next(&state);
+        }
+        LLVMFuzzerTestOneInput(buf, n);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    long runs = 0;
+    uint32_t seed = 1;
+    int i, failed = 0, replayed = 0;
+
+    for (i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "-runs=", 6) == 0) {
+            runs = strtol(argv[i] + 6, NULL, 10);
+        } else if (strncmp(argv[i], "-seed=", 6) == 0) {
+            seed = (uint32_t)strtoul(argv[i] + 6, NULL, 10);
+        } else {
+            if (replay_file(argv[i]) == 0) {
+                replayed++;
+            } else {
+                failed = 1;
+            }
+        }
+    }
+    if (replayed) {
+        printf("%d inputs OK\n", replayed);
+    }
+    if (runs > 0) {
+        replay_random(runs, seed);
+        printf("%ld random inputs OK\n", runs);
+    }
+    return failed;
+}
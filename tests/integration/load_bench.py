@@ -0,0 +1,393 @@
+#!/usr/bin/env python3
+"""
+mod_random Load Benchmark
+
+Boots the integration test httpd under the prefork, worker and event MPMs
+with 1, 10 and 50 tokens per request (plain, ttl=, signed and RandomOnlyFor
+variants), drives it with wrk (or h2load) and records requests/s, p50/p99
+latency and RSS growth. Every MPM also runs once without mod_random loaded:
+the difference is the module's per-request overhead.
+
+Module paths are read from conf/httpd.conf, so configure the tree with
+CMake first. Results are printed as a table; --json also writes one JSON
+object per run.
+
+    ./load_bench.py                        # full matrix (about 40 runs)
+    ./load_bench.py --mpm event --tokens 10 --variants plain,signed
+    ./load_bench.py --duration 30 --connections 64 --json load.json
+"""
+
+import argparse
+import json
+import os
+import re
+import shutil
+import signal
+import subprocess
+import sys
+import time
+import urllib.request
+
+from run_tests import APACHE_BIN, Colors, print_fail, print_info, print_pass
+
+# Configuration
+CONF_FILE = "conf/httpd.conf"
+LOAD_DIR = "logs/load"
+PORT = 8889                            # Apart from run_tests.py's 8888
+BASE_URL = f"http://127.0.0.1:{PORT}"
+LOAD_PATH = "/load/test.html"
+
+MPMS = ["prefork", "worker", "event"]
+TOKEN_COUNTS = [1, 10, 50]
+VARIANTS = ["plain", "ttl", "signed", "onlyfor"]
+
+# Same process/thread budget for every MPM so the runs are comparable
+MPM_SETTINGS = {
+    "prefork": """StartServers 8
+MinSpareServers 8
+MaxSpareServers 64
+ServerLimit 64
+MaxRequestWorkers 64
+MaxConnectionsPerChild 0""",
+    "worker": """StartServers 2
+ServerLimit 4
+ThreadsPerChild 16
+MaxRequestWorkers 64
+MinSpareThreads 32
+MaxSpareThreads 64
+MaxConnectionsPerChild 0""",
+    "event": """StartServers 2
+ServerLimit 4
+ThreadsPerChild 16
+MaxRequestWorkers 64
+MinSpareThreads 32
+MaxSpareThreads 64
+MaxConnectionsPerChild 0""",
+}
+
+
+def read_fixture():
+    """Module directory and mod_random path from the CMake-generated httpd.conf"""
+    if not os.path.exists(CONF_FILE):
+        raise RuntimeError(f"{CONF_FILE} not found: run cmake first")
+    with open(CONF_FILE) as f:
+        conf = f.read()
+    mpm = re.search(r'^LoadModule mpm_\w+_module (\S+)/mod_mpm_\w+\.so', conf, re.M)
+    mod = re.search(r'^LoadModule random_module (\S+)', conf, re.M)
+    if not mpm or not mod:
+        raise RuntimeError(f"{CONF_FILE}: LoadModule lines not found")
+    return mpm.group(1), mod.group(1)
+
+
+def token_directives(count, variant):
+    """Per-directory configuration of one scenario"""
+    lines = []
+    if variant == "signed":
+        lines += ["RandomExpiry 300",
+                  "RandomEncodeMetadata On",
+                  "RandomSigningKey load-bench-signing-key-0123456789"]
+    elif variant == "onlyfor":
+        # Two literal patterns that miss, then a regex that matches
+        lines.append(r'RandomOnlyFor ^/api/ ^/login$ ^/load/.*\.html$')
+
+    for i in range(count):
+        args = f"RandomAddToken LOAD_TOKEN_{i} length=16"
+        if variant == "ttl":
+            args += " ttl=60"
+        if i == 0:
+            args += " header=X-Load-Token"   # Lets run_scenario() see the module at work
+        lines.append(args)
+    return "\n    ".join(lines)
+
+
+def write_config(module_dir, mod_random, mpm, count, variant, workdir):
+    """httpd.conf of one run; variant None leaves mod_random out (baseline)"""
+    root = os.path.abspath(".")
+    random_module = f"LoadModule random_module {mod_random}" if variant else ""
+    location = token_directives(count, variant) if variant else ""
+
+    conf = f"""# Generated by load_bench.py - {mpm}, {count if variant else 0} tokens, {variant or 'baseline'}
+ServerRoot "{root}"
+Listen 127.0.0.1:{PORT}
+
+LoadModule mpm_{mpm}_module {module_dir}/mod_mpm_{mpm}.so
+LoadModule authz_core_module {module_dir}/mod_authz_core.so
+LoadModule alias_module {module_dir}/mod_alias.so
+{random_module}
+
+ServerName localhost
+PidFile {workdir}/httpd.pid
+ErrorLog {workdir}/error.log
+LogLevel warn
+KeepAlive On
+MaxKeepAliveRequests 0
+
+{MPM_SETTINGS[mpm]}
+
+DocumentRoot "htdocs"
+<Directory "htdocs">
+    Require all granted
+</Directory>
+
+Alias /load "{root}/htdocs"
+<Location "/load">
+    {location}
+</Location>
+"""
+    path = os.path.join(workdir, f"httpd-{mpm}.conf")
+    with open(path, "w") as f:
+        f.write(conf)
+    return path
+
+
+class LoadServer:
+    """httpd started from a generated configuration"""
+
+    def __init__(self, conf):
+        self.conf = conf
+        self.process = None
+
+    def start(self):
+        self.process = subprocess.Popen([APACHE_BIN, "-f", self.conf, "-DFOREGROUND"],
+                                        stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+        for _ in range(40):
+            if self.process.poll() is not None:
+                err = self.process.stderr.read().decode(errors="replace").strip()
+                raise RuntimeError(f"httpd exited: {err}")
+            try:
+                with urllib.request.urlopen(BASE_URL + LOAD_PATH, timeout=1) as r:
+                    if r.status == 200:
+                        return r.headers
+            except OSError:
+                time.sleep(0.25)
+        self.stop()
+        raise RuntimeError("httpd did not answer")
+
+    def stop(self):
+        if not self.process:
+            return
+        self.process.send_signal(signal.SIGTERM)
+        try:
+            self.process.wait(timeout=10)
+        except subprocess.TimeoutExpired:
+            self.process.kill()
+            self.process.wait()
+        self.process = None
+
+    def rss_kb(self):
+        """Resident memory of the parent and every child, in KiB"""
+        pids = [self.process.pid] + children_of(self.process.pid)
+        total = 0
+        for pid in pids:
+            try:
+                with open(f"/proc/{pid}/status") as f:
+                    for line in f:
+                        if line.startswith("VmRSS:"):
+                            total += int(line.split()[1])
+            except OSError:
+                pass                   # Child exited meanwhile
+        return total
+
+
+def children_of(ppid):
+    pids = []
+    for entry in os.listdir("/proc"):
+        if not entry.isdigit():
+            continue
+        try:
+            with open(f"/proc/{entry}/stat") as f:
+                # pid (comm) state ppid ... - comm may contain spaces
+                fields = f.read().rsplit(")", 1)[1].split()
+            if int(fields[1]) == ppid:
+                pids.append(int(entry))
+        except (OSError, IndexError, ValueError):
+            pass
+    return pids
+
+
+def to_ms(value, unit):
+    return float(value) * {"us": 0.001, "ms": 1.0, "s": 1000.0}[unit]
+
+
+def run_wrk(duration, connections, threads):
+    out = subprocess.run(["wrk", "--latency", f"-t{threads}", f"-c{connections}",
+                          f"-d{duration}s", BASE_URL + LOAD_PATH],
+                         capture_output=True, text=True, check=True).stdout
+    rps = re.search(r"Requests/sec:\s+([\d.]+)", out)
+    p50 = re.search(r"^\s+50%\s+([\d.]+)(us|ms|s)\b", out, re.M)
+    p99 = re.search(r"^\s+99%\s+([\d.]+)(us|ms|s)\b", out, re.M)
+    errors = re.search(r"Non-2xx or 3xx responses:\s+(\d+)", out)
+    if not rps or not p50 or not p99:
+        raise RuntimeError(f"unexpected wrk output:\n{out}")
+    return {
+        "requests_per_sec": float(rps.group(1)),
+        "p50_ms": to_ms(*p50.groups()),
+        "p99_ms": to_ms(*p99.groups()),
+        "errors": int(errors.group(1)) if errors else 0,
+    }
+
+
+def run_h2load(duration, connections, threads, workdir):
+    """h2load has no percentiles: they are computed from its per-request log"""
+    log = os.path.join(workdir, "h2load.log")
+    out = subprocess.run(["h2load", "--h1", f"-t{threads}", f"-c{connections}",
+                          f"-D{duration}", f"--log-file={log}", BASE_URL + LOAD_PATH],
+                         capture_output=True, text=True, check=True).stdout
+    rps = re.search(r"finished in [\d.]+\w+, ([\d.]+) req/s", out)
+    status = re.search(r"status codes: (\d+) 2xx, (\d+) 3xx, (\d+) 4xx, (\d+) 5xx", out)
+    latencies = []
+    with open(log) as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) >= 3:
+                latencies.append(int(fields[2]) / 1000.0)   # start, status, latency in us
+    if not rps or not latencies:
+        raise RuntimeError(f"unexpected h2load output:\n{out}")
+    latencies.sort()
+    return {
+        "requests_per_sec": float(rps.group(1)),
+        "p50_ms": latencies[len(latencies) // 2],
+        "p99_ms": latencies[min(len(latencies) - 1, len(latencies) * 99 // 100)],
+        "errors": int(status.group(3)) + int(status.group(4)) if status else 0,
+    }
+
+
+def pick_driver(name):
+    for tool in ([name] if name != "auto" else ["wrk", "h2load"]):
+        if shutil.which(tool):
+            return tool
+    return None
+
+
+def run_scenario(args, driver, fixture, mpm, count, variant, workdir):
+    conf = write_config(*fixture, mpm, count, variant, workdir)
+    server = LoadServer(conf)
+    headers = server.start()
+    try:
+        if variant and not headers.get("X-Load-Token"):
+            raise RuntimeError("X-Load-Token missing: mod_random is not generating tokens")
+
+        # Warm-up: fork/spawn every worker, fill caches and entropy buffers
+        if driver == "wrk":
+            run_wrk(args.warmup, args.connections, args.threads)
+        else:
+            run_h2load(args.warmup, args.connections, args.threads, workdir)
+        rss_before = server.rss_kb()
+
+        if driver == "wrk":
+            result = run_wrk(args.duration, args.connections, args.threads)
+        else:
+            result = run_h2load(args.duration, args.connections, args.threads, workdir)
+        result["rss_growth_kb"] = server.rss_kb() - rss_before
+        result["rss_kb"] = server.rss_kb()
+    finally:
+        server.stop()
+
+    result.update({"mpm": mpm, "tokens": count if variant else 0,
+                   "variant": variant or "baseline", "driver": driver,
+                   "connections": args.connections, "duration": args.duration})
+    return result
+
+
+def overhead(result, base):
+    """Per-request cost of the module against the baseline of the same MPM"""
+    if not base:
+        return
+    result["rps_delta_pct"] = (result["requests_per_sec"] - base["requests_per_sec"]) \
+        * 100.0 / base["requests_per_sec"]
+    result["p50_delta_ms"] = result["p50_ms"] - base["p50_ms"]
+    result["p99_delta_ms"] = result["p99_ms"] - base["p99_ms"]
+    # Server time per request is connections / rps with every connection busy
+    result["overhead_us"] = (result["connections"] / result["requests_per_sec"]
+                             - base["connections"] / base["requests_per_sec"]) * 1e6
+
+
+def print_result(r):
+    line = (f"  {r['mpm']:<8} {r['variant']:<9} {r['tokens']:>3} tokens "
+            f"{r['requests_per_sec']:>10.0f} req/s  p50 {r['p50_ms']:>7.3f} ms  "
+            f"p99 {r['p99_ms']:>7.3f} ms  RSS +{r['rss_growth_kb']} KiB")
+    if "rps_delta_pct" in r:
+        line += (f"  {Colors.YELLOW}{r['rps_delta_pct']:+.1f}% req/s, "
+                 f"{r['overhead_us']:+.1f} us/request{Colors.RESET}")
+    if r["errors"]:
+        line += f"  {Colors.RED}{r['errors']} errors{Colors.RESET}"
+    print(line)
+
+
+def csv_list(value, allowed, convert=str):
+    items = [convert(v) for v in value.split(",") if v]
+    bad = [v for v in items if v not in allowed]
+    if bad:
+        raise argparse.ArgumentTypeError(f"unknown value(s): {', '.join(map(str, bad))}")
+    return items
+
+
+def main():
+    parser = argparse.ArgumentParser(description="mod_random load benchmark")
+    parser.add_argument("--mpm", default=",".join(MPMS),
+                        type=lambda v: csv_list(v, MPMS))
+    parser.add_argument("--tokens", default=",".join(map(str, TOKEN_COUNTS)),
+                        type=lambda v: csv_list(v, TOKEN_COUNTS, int))
+    parser.add_argument("--variants", default=",".join(VARIANTS),
+                        type=lambda v: csv_list(v, VARIANTS))
+    parser.add_argument("--duration", type=int, default=10, help="seconds per run (default: 10)")
+    parser.add_argument("--warmup", type=int, default=2, help="seconds before measuring (default: 2)")
+    parser.add_argument("--connections", type=int, default=32)
+    parser.add_argument("--threads", type=int, default=4, help="load generator threads")
+    parser.add_argument("--driver", choices=["auto", "wrk", "h2load"], default="auto")
+    parser.add_argument("--json", metavar="FILE", help="write one JSON object per run")
+    args = parser.parse_args()
+
+    os.chdir(os.path.dirname(os.path.abspath(__file__)))
+    driver = pick_driver(args.driver)
+    if not driver:
+        print_fail("Neither wrk nor h2load found in PATH")
+        return 1
+    try:
+        fixture = read_fixture()
+    except RuntimeError as e:
+        print_fail(str(e))
+        return 1
+    os.makedirs(LOAD_DIR, exist_ok=True)
+    workdir = os.path.abspath(LOAD_DIR)
+
+    print(f"\n{Colors.BOLD}{'='*60}{Colors.RESET}")
+    print(f"{Colors.BOLD}  mod_random Load Benchmark ({driver}, {args.connections} connections, "
+          f"{args.duration}s){Colors.RESET}")
+    print(f"{Colors.BOLD}{'='*60}{Colors.RESET}\n")
+
+    results = []
+    failed = 0
+    for mpm in args.mpm:
+        print(f"{Colors.BLUE}{Colors.BOLD}[{mpm}]{Colors.RESET}")
+        scenarios = [(0, None)] + [(n, v) for n in args.tokens for v in args.variants]
+        base = None
+        for count, variant in scenarios:
+            try:
+                r = run_scenario(args, driver, fixture, mpm, count, variant, workdir)
+            except (RuntimeError, subprocess.CalledProcessError, OSError) as e:
+                print_fail(f"{mpm} {variant or 'baseline'} {count}: {e}")
+                failed += 1
+                continue
+            if variant is None:
+                base = r
+            else:
+                overhead(r, base)
+            results.append(r)
+            print_result(r)
+
+    if args.json:
+        with open(args.json, "w") as f:
+            for r in results:
+                f.write(json.dumps(r) + "\n")
+        print_info(f"Results written to {args.json}")
+
+    if failed:
+        print_fail(f"{failed} run(s) failed, see {LOAD_DIR}/error.log")
+        return 1
+    print_pass(f"{len(results)} runs completed")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
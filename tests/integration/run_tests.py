@@ -329,6 +329,89 @@ def test_cache_stress():
 
     print_pass("Cache stress test completed")
 
+def test_lazy_tokens():
+    """Test 16: Lazy tokens generated on first reference"""
+    print_test("Lazy tokens (%{random:NAME})")
+
+    r = requests.get(f"{BASE_URL}/test16-lazy")
+    assert r.status_code == 200
+    assert r.headers.get('X-Test-Name') == 'test16-lazy'
+
+    lazy = r.headers.get('X-Lazy-Token')
+    assert lazy and len(lazy) == 32, f"Unexpected lazy token: {lazy}"
+    assert r.headers.get('X-Lazy-Again') == lazy, "Token changed between references"
+    print_pass("Lazy token generated once per request")
+
+    # header= tokens are still generated in fixups
+    assert r.headers.get('X-Eager-Token')
+    print_pass("Header token stays eager")
+
+    r2 = requests.get(f"{BASE_URL}/test16-lazy")
+    assert r2.headers.get('X-Lazy-Token') != lazy
+    print_pass("Each request gets a new lazy token")
+
+def test_output_option():
+    """Test 18: output=header emits the header without the environment variable"""
+    print_test("Token output (output=header)")
+
+    r = requests.get(f"{BASE_URL}/test18-output")
+    assert r.status_code == 200
+    assert r.headers.get('X-Test-Name') == 'test18-output'
+
+    token = r.headers.get('X-Header-Only')
+    assert token and len(token) == 32, f"Unexpected header token: {token}"
+    print_pass("Header set")
+
+    assert not r.headers.get('X-Header-Env'), "output=header token leaked into the environment"
+    print_pass("Environment variable not set")
+
+    assert r.headers.get('X-Header-Expr') == token, "%{random:NAME} does not see the header token"
+    print_pass("%{random:NAME} still reads the token")
+
+def test_internal_redirect():
+    """Test 19: ErrorDocument redirect reuses the tokens of the origin request"""
+    print_test("Internal redirect (ErrorDocument)")
+
+    r = requests.get(f"{BASE_URL}/errdoc19/missing")
+    assert r.status_code == 404
+    assert r.headers.get('X-Test-Name') == 'test19-redirect'
+    print_pass("ErrorDocument served by /test19-redirect")
+
+    origin = r.headers.get('X-Errdoc-Origin')
+    assert origin and len(origin) == 32, f"Origin request token missing: {origin}"
+    assert r.headers.get('X-Errdoc-Token') == origin, "Redirect header has a new token"
+    assert r.headers.get('X-Errdoc-Env') == origin, "Redirect environment has a new token"
+    print_pass("Header and environment carry the origin's token")
+
+    r2 = requests.get(f"{BASE_URL}/errdoc19/missing")
+    assert r2.headers.get('X-Errdoc-Token') != origin
+    print_pass("Each client request gets a new token")
+
+def test_statistics():
+    """Test 17: RandomStatistics counters on the random-status handler"""
+    print_test("Statistics (random-status)")
+
+    for _ in range(10):
+        requests.get(f"{BASE_URL}/test1-basic")
+
+    r = requests.get(f"{BASE_URL}/random-status")
+    assert r.status_code == 200
+    assert r.headers.get('Content-Type', '').startswith('application/json')
+    stats = r.json()
+    assert stats['enabled'] is True
+    rows = [t for t in stats['tokens'] if t['name'] == 'CSRF_TOKEN']
+    assert rows, "CSRF_TOKEN has no statistics row"
+    # Other threads publish their counters within flush_interval_ms
+    assert sum(t['generated'] for t in rows) >= 1
+    assert all(t['entropy_bytes'] >= 16 * t['generated'] for t in rows)
+    print_pass("JSON counters reported per token")
+
+    r = requests.get(f"{BASE_URL}/random-status?format=prometheus")
+    assert r.status_code == 200
+    assert 'mod_random_tokens_generated_total{token="CSRF_TOKEN"' in r.text
+    assert '# TYPE mod_random_csprng_seconds_total counter' in r.text
+    print_pass("Prometheus text format")
+
 def test_server_load():
     """Test: Server load - rapid sequential requests"""
     print_test("Server load test (100 rapid requests)")
@@ -384,6 +467,10 @@ def main():
             test_max_length,
             test_config_inheritance,
             test_cache_stress,
+            test_lazy_tokens,
+            test_statistics,
+            test_output_option,
+            test_internal_redirect,
             test_server_load,
         ]
 
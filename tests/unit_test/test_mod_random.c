@@ -8,6 +8,9 @@
 #include <string.h>
 #include <assert.h>
 #include <time.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 /* APR headers */
 #include "apr_pools.h"
@@ -15,6 +18,7 @@
 #include "apr_thread_mutex.h"
 #include "apr_time.h"
 #include "apr_tables.h"
+#include "apr_thread_proc.h"
 
 /* Apache headers */
 #include "httpd.h"
@@ -57,8 +61,119 @@ extern char *random_encode_custom_alphabet(apr_pool_t *pool, const unsigned char
 extern char *random_generate_string_ex(apr_pool_t *pool, int length, random_format_t format,
                                        const char *alphabet, int grouping);
 extern char *random_generate_string(apr_pool_t *pool, int length, random_format_t format);
+extern apr_status_t random_thread_init(apr_pool_t *pool);
+extern void random_entropy_set_buffer_size(apr_size_t size);
+extern apr_status_t random_fill_bytes(unsigned char *buf, apr_size_t length);
+extern random_token_cache *random_cache_create(apr_pool_t *pool, const char *name);
+extern char *random_cache_lookup(random_token_cache *cache, apr_pool_t *pool,
+                                 apr_time_t now, int ttl, int *refresh);
+extern void random_cache_store(random_token_cache *cache, const char *token, apr_time_t now);
+extern void random_cache_abandon(random_token_cache *cache);
+extern void random_cache_set_backend(random_cache_backend_t backend);
+extern random_token_cache *random_cache_variant(apr_pool_t *pool, random_token_cache *home,
+                                                const char *variant);
+extern void random_cache_registry_reset(apr_pool_t *pconf);
+extern apr_status_t random_cache_shm_init(apr_pool_t *pconf, int *slots);
+extern random_encode_fn random_simd_encoder_for(random_format_t format);
+extern apr_size_t random_encode_hex_into(char *out, const unsigned char *data, int length,
+                                         const random_alphabet *alphabet, int grouping);
+extern apr_size_t random_encode_base64_into(char *out, const unsigned char *data, int length,
+                                            const random_alphabet *alphabet, int grouping);
+extern apr_size_t random_encode_base64url_into(char *out, const unsigned char *data, int length,
+                                               const random_alphabet *alphabet, int grouping);
+extern void random_plan_compile(apr_pool_t *pool, random_config *cfg, apr_array_header_t *warnings);
+extern const char *random_config_check(const random_config *cfg, apr_array_header_t *warnings);
+extern random_prefill *random_prefill_create(apr_pool_t *pool, const char *name, int count);
+extern char *random_prefill_pop(random_prefill *pf, const random_token_plan *plan, apr_pool_t *pool);
+extern void random_prefill_registry_reset(apr_pool_t *pconf);
+extern void random_prefill_registry_close(void);
+extern apr_status_t random_prefill_start(apr_pool_t *pchild, int *rings);
+extern int random_prefill_count(void);
+extern void random_prefill_stats_get(int index, random_prefill_stats *stats);
+extern void random_stats_set_enabled(int enabled);
+extern void random_stats_registry_reset(apr_pool_t *pconf);
+extern int random_stats_register(const char *name, const void *owner);
+extern void random_stats_label(const void *owner, const char *server);
+extern apr_status_t random_stats_shm_init(apr_pool_t *pconf, int *slots);
+extern random_stats_counters *random_stats_thread(void);
+extern void random_stats_flush_thread(void);
+extern apr_uint64_t random_stats_clock(void);
+extern int random_stats_count(void);
+extern void random_stats_get(int index, random_stats_entry *entry);
+extern apr_size_t random_plan_assemble(const random_token_plan *plan, char *out,
+                                       const unsigned char *bytes, apr_time_t now);
+extern apr_size_t random_encoded_max_len(random_format_t format, int length,
+                                         const random_alphabet *alphabet, int grouping);
+extern apr_size_t random_encode_custom_pow2_into(char *out, const unsigned char *data, int length,
+                                                 const random_alphabet *alphabet, int grouping);
+extern apr_size_t random_encode_custom_reject_into(char *out, const unsigned char *data, int length,
+                                                   const random_alphabet *alphabet, int grouping);
+extern random_alphabet *random_alphabet_compile(apr_pool_t *pool, const char *chars);
+extern apr_size_t random_alphabet_symbols(const random_alphabet *alphabet, int length);
+extern apr_size_t random_raw_len(random_format_t format, int length, const random_alphabet *alphabet);
+extern random_encode_fn random_encoder_for(random_format_t format, const random_alphabet *alphabet);
+extern apr_size_t random_encode_uuid4_into(char *out, const unsigned char *data, int length,
+                                           const random_alphabet *alphabet, int grouping);
+extern apr_size_t random_encode_uuid7_at(char *out, const unsigned char *data, apr_time_t now);
+extern apr_size_t random_encode_ulid_at(char *out, const unsigned char *data, apr_time_t now);
+extern random_encode_at_fn random_time_encoder_for(random_format_t format);
 extern void random_hmac_sha256(apr_pool_t *pool, const char *key, apr_size_t key_len,
                               const char *data, apr_size_t data_len, unsigned char *digest);
+extern random_hmac_key *random_hmac_key_create(apr_pool_t *pool, const char *key, apr_size_t key_len);
+extern apr_size_t random_sign_into(char *out, const random_hmac_key *key, random_mac_alg_t alg,
+                                   const char *payload, apr_size_t payload_len);
+extern int random_hmac_key_supports(const random_hmac_key *hkey, random_mac_alg_t alg);
+extern random_verify_result_t random_token_verify(const random_hmac_key *key, random_mac_alg_t alg,
+                                                  const char *token, const char *prefix, const char *suffix,
+                                                  int min_mac_len, apr_time_t now);
+extern apr_ssize_t random_decode_base64url_into(unsigned char *out, const char *in, apr_size_t len);
+extern const char *random_verify_result_name(random_verify_result_t result);
+extern random_verify_result_t random_token_verify_keyring(random_keyring *keyring, random_mac_alg_t alg,
+                                                          const char *token,
+                                                          const char *prefix, const char *suffix,
+                                                          int min_mac_len, apr_time_t now);
+extern void random_keyring_registry_reset(apr_pool_t *pconf);
+extern random_keyring *random_keyring_open(apr_pool_t *pool, const char *path, const char **error);
+extern int random_keyring_reload(random_keyring *kr, apr_pool_t *scratch, int force, const char **error);
+extern const random_key_table *random_keyring_acquire(random_keyring *kr);
+extern void random_keyring_release(random_keyring *kr);
+extern const random_hmac_key *random_key_table_signing(const random_key_table *table, int *id);
+extern const random_hmac_key *random_key_table_find(const random_key_table *table, int id);
+extern int random_key_table_count(const random_key_table *table);
+extern int random_url_literal_parse(apr_pool_t *pool, const char *pattern, random_url_literal *lit);
+extern int random_url_matcher_literals(const random_url_matcher *m, const char *uri);
+extern int random_pattern_has_backref(const char *pattern);
+extern void random_alloc_trace_set_sample(int every);
+extern void random_alloc_record(random_alloc_trace *trace, const char *name,
+                                apr_size_t bytes, unsigned int allocs);
+extern void random_alloc_share(random_alloc_trace *trace, const char *name, apr_size_t bytes);
+extern void *random_alloc_palloc(random_alloc_trace *trace, const char *name,
+                                 apr_pool_t *pool, apr_size_t size);
+extern int random_alloc_trace_finish(const random_alloc_trace *trace);
+extern const char *random_alloc_trace_format(apr_pool_t *pool, const random_alloc_trace *trace);
+extern const char *random_alloc_histograms_format(apr_pool_t *pool);
+extern void *random_scratch_acquire(apr_size_t size);
+extern void random_scratch_release(void *buf, apr_size_t used);
+extern const char *random_token_spec_parse(apr_pool_t *pool, const char *args,
+                                           random_token_spec *spec, int *prefill);
+extern void random_spec_registry_reset(apr_pool_t *pconf);
+extern void random_spec_registry_close(void);
+extern random_token_spec *random_spec_intern(apr_pool_t *ptemp, const random_token_spec *spec,
+                                             int prefill, const void *owner, int *created);
+extern char *random_encode_with_metadata(apr_pool_t *pool, const char *token,
+                                         int expiry_seconds, const char *signing_key);
+
+/* View stack specs as the array random_config.token_specs holds (no copy) */
+static apr_array_header_t *spec_array(apr_pool_t *pool, random_token_spec *specs, int count)
+{
+    apr_array_header_t *arr = apr_pcalloc(pool, sizeof(apr_array_header_t));
+
+    arr->pool = pool;
+    arr->elt_size = sizeof(random_token_spec);
+    arr->nelts = arr->nalloc = count;
+    arr->elts = (char *)specs;
+    return arr;
+}
 
 /*
  * Test 1: Hex encoding basic functionality
@@ -463,6 +578,1606 @@ TEST(large_token_generation) {
     ASSERT_TRUE(strlen(token) > 300); /* Base64 expands ~33% */
 }
 
+/*
+ * Test 26: Buffered entropy across several refills
+ */
+TEST(entropy_buffer_refill) {
+    unsigned char chunk[700];
+    unsigned char previous[700];
+    int i;
+
+    ASSERT_EQUAL(random_thread_init(pool), APR_SUCCESS);
+    random_entropy_set_buffer_size(RANDOM_ENTROPY_BUFFER_MIN);
+
+    /* 700-byte reads straddle the 1024-byte buffer boundary */
+    memset(previous, 0, sizeof(previous));
+    for (i = 0; i < 8; i++) {
+        ASSERT_EQUAL(random_fill_bytes(chunk, sizeof(chunk)), APR_SUCCESS);
+        ASSERT_TRUE(memcmp(chunk, previous, sizeof(chunk)) != 0);
+        memcpy(previous, chunk, sizeof(chunk));
+    }
+
+    /* Larger than the buffer - served directly by the CSPRNG */
+    {
+        unsigned char big[RANDOM_ENTROPY_BUFFER_MIN + 1];
+        ASSERT_EQUAL(random_fill_bytes(big, sizeof(big)), APR_SUCCESS);
+    }
+
+    random_entropy_set_buffer_size(0);
+}
+
+/*
+ * Test 27: Tokens from the buffered path are distinct
+ */
+TEST(entropy_buffer_tokens) {
+    #define NUM_BUFFERED_TOKENS 200
+    char *tokens[NUM_BUFFERED_TOKENS];
+
+    random_entropy_set_buffer_size(4096);
+
+    for (int i = 0; i < NUM_BUFFERED_TOKENS; i++) {
+        tokens[i] = random_generate_string(pool, 16, RANDOM_FORMAT_HEX);
+        ASSERT_NOT_NULL(tokens[i]);
+        ASSERT_EQUAL(strlen(tokens[i]), 32);
+    }
+
+    for (int i = 0; i < NUM_BUFFERED_TOKENS - 1; i++) {
+        for (int j = i + 1; j < NUM_BUFFERED_TOKENS; j++) {
+            ASSERT_STR_NOT_EQUAL(tokens[i], tokens[j]);
+        }
+    }
+
+    random_entropy_set_buffer_size(0);
+}
+
+/*
+ * Test 28: TTL cache hit, expiry and single refresher
+ */
+TEST(ttl_cache_refresh) {
+    random_token_cache *cache = random_cache_create(pool, "TEST_TOKEN");
+    apr_time_t now = apr_time_now();
+    int refresh, other_refresh;
+    char *value;
+
+    /* Empty cache: first caller owns the refresh */
+    value = random_cache_lookup(cache, pool, now, 10, &refresh);
+    ASSERT_NULL(value);
+    ASSERT_EQUAL(refresh, 1);
+
+    /* While it is refreshing, nobody else is asked to regenerate */
+    value = random_cache_lookup(cache, pool, now, 10, &other_refresh);
+    ASSERT_NULL(value);
+    ASSERT_EQUAL(other_refresh, 0);
+
+    random_cache_store(cache, "first", now);
+
+    /* Fresh hit */
+    value = random_cache_lookup(cache, pool, now + apr_time_from_sec(5), 10, &refresh);
+    ASSERT_NOT_NULL(value);
+    ASSERT_STR_EQUAL(value, "first");
+    ASSERT_EQUAL(refresh, 0);
+
+    /* Expired: one refresher, the others keep the old value */
+    value = random_cache_lookup(cache, pool, now + apr_time_from_sec(11), 10, &refresh);
+    ASSERT_NULL(value);
+    ASSERT_EQUAL(refresh, 1);
+    value = random_cache_lookup(cache, pool, now + apr_time_from_sec(11), 10, &other_refresh);
+    ASSERT_NOT_NULL(value);
+    ASSERT_STR_EQUAL(value, "first");
+    ASSERT_EQUAL(other_refresh, 0);
+
+    random_cache_store(cache, "second", now + apr_time_from_sec(11));
+    value = random_cache_lookup(cache, pool, now + apr_time_from_sec(12), 10, &refresh);
+    ASSERT_STR_EQUAL(value, "second");
+
+    /* Clock going backwards counts as expired; abandon releases the claim */
+    value = random_cache_lookup(cache, pool, now, 10, &refresh);
+    ASSERT_NULL(value);
+    ASSERT_EQUAL(refresh, 1);
+    random_cache_abandon(cache);
+    value = random_cache_lookup(cache, pool, now, 10, &refresh);
+    ASSERT_EQUAL(refresh, 1);
+    random_cache_abandon(cache);
+}
+
+/*
+ * Test 29: TTL cache under concurrent readers and refreshes
+ */
+typedef struct {
+    random_token_cache *cache;
+    int bad;
+} cache_thread_ctx;
+
+static void *APR_THREAD_FUNC cache_thread(apr_thread_t *thd, void *data)
+{
+    cache_thread_ctx *ctx = (cache_thread_ctx *)data;
+    apr_pool_t *tpool;
+    int i, refresh;
+
+    apr_pool_create(&tpool, NULL);
+    for (i = 0; i < 20000; i++) {
+        /* ttl=1 with a moving clock forces frequent refreshes */
+        apr_time_t now = apr_time_from_sec(i / 100);
+        char *value = random_cache_lookup(ctx->cache, tpool, now, 1, &refresh);
+
+        if (refresh) {
+            random_cache_store(ctx->cache, "tok-0123456789abcdef", now);
+        } else if (value && strcmp(value, "tok-0123456789abcdef") != 0) {
+            ctx->bad++;
+        }
+        if (i % 1000 == 0) {
+            apr_pool_clear(tpool);
+        }
+    }
+    apr_pool_destroy(tpool);
+    return NULL;
+}
+
+TEST(ttl_cache_concurrent) {
+    #define CACHE_THREADS 8
+    apr_thread_t *threads[CACHE_THREADS];
+    cache_thread_ctx ctx[CACHE_THREADS];
+    random_token_cache *cache = random_cache_create(pool, "TEST_TOKEN");
+    apr_status_t rv;
+
+    for (int i = 0; i < CACHE_THREADS; i++) {
+        ctx[i].cache = cache;
+        ctx[i].bad = 0;
+        ASSERT_EQUAL(apr_thread_create(&threads[i], NULL, cache_thread, &ctx[i], pool), APR_SUCCESS);
+    }
+    for (int i = 0; i < CACHE_THREADS; i++) {
+        apr_thread_join(&rv, threads[i]);
+        ASSERT_EQUAL(ctx[i].bad, 0);
+    }
+}
+
+/*
+ * Test 30: Shared-memory cache backend (seqlock slots, single refresher)
+ */
+TEST(ttl_cache_shm_backend) {
+    random_token_cache *cache_a, *cache_b;
+    apr_time_t now = apr_time_now();
+    char long_token[RANDOM_SHM_TOKEN_MAX + 16];
+    int refresh, slots;
+    char *value;
+
+    random_cache_registry_reset(pool);
+    random_cache_set_backend(RANDOM_CACHE_BACKEND_SHM);
+    cache_a = random_cache_create(pool, "SHM_A");
+    cache_b = random_cache_create(pool, "SHM_B");
+    ASSERT_EQUAL(random_cache_shm_init(pool, &slots), APR_SUCCESS);
+    ASSERT_EQUAL(slots, 2);
+    ASSERT_EQUAL(cache_a->slot, 0);
+    ASSERT_EQUAL(cache_b->slot, 1);
+
+    /* Same protocol as the local cache */
+    value = random_cache_lookup(cache_a, pool, now, 10, &refresh);
+    ASSERT_NULL(value);
+    ASSERT_EQUAL(refresh, 1);
+    value = random_cache_lookup(cache_a, pool, now, 10, &refresh);
+    ASSERT_EQUAL(refresh, 0);
+    random_cache_store(cache_a, "shared-a", now);
+
+    value = random_cache_lookup(cache_a, pool, now + apr_time_from_sec(1), 10, &refresh);
+    ASSERT_NOT_NULL(value);
+    ASSERT_STR_EQUAL(value, "shared-a");
+
+    /* Slots are independent */
+    value = random_cache_lookup(cache_b, pool, now, 10, &refresh);
+    ASSERT_NULL(value);
+    ASSERT_EQUAL(refresh, 1);
+
+    /* Token too long for a slot: this cache falls back to local storage */
+    memset(long_token, 'x', sizeof(long_token) - 1);
+    long_token[sizeof(long_token) - 1] = '\0';
+    random_cache_store(cache_b, long_token, now);
+    ASSERT_EQUAL(cache_b->slot, -1);
+    value = random_cache_lookup(cache_b, pool, now, 10, &refresh);
+    ASSERT_NOT_NULL(value);
+    ASSERT_STR_EQUAL(value, long_token);
+
+    /* Caches created after the table exists stay local */
+    ASSERT_EQUAL(random_cache_create(pool, "LATE")->slot, -1);
+
+    random_cache_registry_reset(pool);
+}
+
+/*
+ * Test 31: Token plans resolve spec > config > module defaults once
+ */
+TEST(plan_compile_defaults) {
+    random_config cfg;
+    random_token_spec specs[2];
+    random_token_plan *plan;
+    apr_array_header_t *warnings;
+    unsigned char bytes[64] = {0};
+    char encoded[256];
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.length = RANDOM_LENGTH_UNSET;
+    cfg.format = RANDOM_FORMAT_HEX;
+    cfg.include_timestamp = RANDOM_ENABLED_UNSET;
+    cfg.prefix = "p-";
+    cfg.ttl_seconds = 60;
+    cfg.alphabet_grouping = 4;
+    cfg.expiry_seconds = 300;
+    cfg.encode_metadata = 1;   /* No signing key: metadata stays off */
+
+    memset(specs, 0, sizeof(specs));
+    specs[0].var_name = "A";
+    specs[0].length = RANDOM_LENGTH_UNSET;
+    specs[0].format = RANDOM_FORMAT_UNSET;
+    specs[0].include_timestamp = RANDOM_ENABLED_UNSET;
+    specs[0].ttl_seconds = RANDOM_TTL_UNSET;
+    specs[0].cache = random_cache_create(pool, "A");
+
+    specs[1] = specs[0];
+    specs[1].var_name = "B";
+    specs[1].length = 24;
+    specs[1].format = RANDOM_FORMAT_CUSTOM;   /* No alphabet: falls back */
+    specs[1].suffix = "-s";
+    specs[1].ttl_seconds = 0;
+
+    cfg.token_specs = spec_array(pool, specs, 2);
+    warnings = apr_array_make(pool, 2, sizeof(const char *));
+    random_plan_compile(pool, &cfg, warnings);
+    ASSERT_EQUAL(cfg.plan_count, 2);
+
+    /* Missing signing key (both tokens) and missing alphabet (B) reported once */
+    ASSERT_EQUAL(warnings->nelts, 3);
+
+    plan = &cfg.plans[0];
+    ASSERT_STR_EQUAL(plan->var_name, "A");
+    ASSERT_EQUAL(plan->length, RANDOM_LENGTH_DEFAULT);
+    ASSERT_EQUAL(plan->format, RANDOM_FORMAT_HEX);
+    ASSERT_EQUAL(plan->include_timestamp, 0);
+    ASSERT_STR_EQUAL(plan->prefix, "p-");
+    ASSERT_NULL(plan->suffix);
+    ASSERT_EQUAL(plan->ttl_seconds, 60);
+    ASSERT_TRUE(plan->cache == specs[0].cache);
+    ASSERT_NULL(plan->hmac_key);
+    ASSERT_EQUAL(plan->encoded_max, (apr_size_t)RANDOM_LENGTH_DEFAULT * 2);
+    ASSERT_EQUAL(plan->encode(encoded, bytes, plan->length, plan->alphabet, plan->grouping),
+                 plan->encoded_max);
+
+    plan = &cfg.plans[1];
+    ASSERT_EQUAL(plan->length, 24);
+    ASSERT_EQUAL(plan->format, RANDOM_FORMAT_BASE64);
+    ASSERT_EQUAL(plan->grouping, 0);
+    ASSERT_STR_EQUAL(plan->suffix, "-s");
+    ASSERT_NULL(plan->cache);
+    ASSERT_EQUAL(plan->encode(encoded, bytes, plan->length, plan->alphabet, plan->grouping),
+                 plan->encoded_max);
+
+    /* Bounds hold for every format */
+    ASSERT_EQUAL(random_encoded_max_len(RANDOM_FORMAT_BASE64URL, 16, NULL, 0), 22);
+    ASSERT_TRUE(strlen(random_encode_custom_alphabet(pool, bytes, 33, "0123456789", 4)) <=
+                random_encoded_max_len(RANDOM_FORMAT_CUSTOM, 33,
+                                       random_alphabet_compile(pool, "0123456789"), 4));
+
+    /* Context checks: RandomValidateToken without a key warns, or fails with enforce=on */
+    apr_array_clear(warnings);
+    ASSERT_NULL(random_config_check(&cfg, warnings));
+    ASSERT_EQUAL(warnings->nelts, 0);
+    cfg.validate = 1;
+    cfg.validate_var = RANDOM_VALIDATE_VAR_DEFAULT;
+    ASSERT_NULL(random_config_check(&cfg, warnings));
+    ASSERT_EQUAL(warnings->nelts, 1);
+    cfg.validate_enforce = 1;
+    ASSERT_NOT_NULL(random_config_check(&cfg, NULL));
+}
+
+/*
+ * Test 32: In-place assembly matches the metadata encoder's layout and HMAC
+ */
+TEST(plan_assemble_signed) {
+    random_config cfg;
+    random_token_spec spec;
+    const random_token_plan *plan;
+    unsigned char bytes[8] = {0xde, 0xad, 0xbe, 0xef, 0x00, 0x11, 0x22, 0x33};
+    unsigned char digest[32];
+    apr_time_t now = apr_time_from_sec(1700000000);
+    char *out, *expected_payload;
+    apr_size_t len;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.length = RANDOM_LENGTH_UNSET;
+    cfg.format = RANDOM_FORMAT_UNSET;
+    cfg.include_timestamp = 1;
+    cfg.ttl_seconds = RANDOM_TTL_UNSET;
+    cfg.alphabet_grouping = RANDOM_GROUPING_UNSET;
+    cfg.expiry_seconds = 600;
+    cfg.encode_metadata = 1;
+    cfg.signing_key = "secret";
+    cfg.hmac_key = random_hmac_key_create(pool, "secret", 6);
+
+    memset(&spec, 0, sizeof(spec));
+    spec.var_name = "SIGNED";
+    spec.length = 8;
+    spec.format = RANDOM_FORMAT_HEX;
+    spec.include_timestamp = RANDOM_ENABLED_UNSET;
+    spec.ttl_seconds = RANDOM_TTL_UNSET;
+    spec.prefix = "pre_";
+    spec.suffix = "_suf";
+    cfg.token_specs = spec_array(pool, &spec, 1);
+
+    random_plan_compile(pool, &cfg, NULL);
+    plan = &cfg.plans[0];
+
+    out = apr_palloc(pool, plan->token_max);
+    len = random_plan_assemble(plan, out, bytes, now);
+    ASSERT_EQUAL(len, strlen(out));
+    ASSERT_TRUE(len < plan->token_max);
+
+    /* prefix, expiry:timestamp-random, :hex HMAC of that payload, suffix */
+    expected_payload = "1700000600:1700000000-deadbeef00112233";
+    random_hmac_sha256(pool, "secret", 6, expected_payload, strlen(expected_payload), digest);
+    ASSERT_STR_EQUAL(out, apr_pstrcat(pool, "pre_", expected_payload, ":",
+                                      random_encode_hex(pool, digest, 32), "_suf", NULL));
+}
+
+/*
+ * Test 33: Vector encoders match the scalar encoders for every length
+ */
+TEST(simd_encoders_match_scalar) {
+    static const random_format_t formats[] = {
+        RANDOM_FORMAT_HEX, RANDOM_FORMAT_BASE64, RANDOM_FORMAT_BASE64URL
+    };
+    const random_encode_fn scalar[] = {
+        random_encode_hex_into, random_encode_base64_into, random_encode_base64url_into
+    };
+    unsigned char data[300];
+    char expected[2 * sizeof(data)], actual[2 * sizeof(data)];
+    int f, len;
+
+    ASSERT_EQUAL(apr_generate_random_bytes(data, sizeof(data)), APR_SUCCESS);
+
+    for (f = 0; f < 3; f++) {
+        random_encode_fn simd = random_simd_encoder_for(formats[f]);
+        if (!simd) {
+            continue;   /* No vector kernel on this CPU: scalar path only */
+        }
+        for (len = 0; len <= (int)sizeof(data); len++) {
+            apr_size_t n = scalar[f](expected, data, len, NULL, 0);
+            ASSERT_EQUAL(simd(actual, data, len, NULL, 0), n);
+            ASSERT_TRUE(memcmp(expected, actual, n) == 0);
+        }
+    }
+
+    /* Custom alphabets have no vector kernel */
+    ASSERT_NULL(random_simd_encoder_for(RANDOM_FORMAT_CUSTOM));
+}
+
+/*
+ * Test 34: Compiled alphabets - bit extraction and unbiased rejection sampling
+ */
+TEST(alphabet_compiled_kernels) {
+    const random_alphabet *bin = random_alphabet_compile(pool, "01");
+    const random_alphabet *b32 = random_alphabet_compile(pool, "0123456789ABCDEFGHJKMNPQRSTVWXYZ");
+    const random_alphabet *dec = random_alphabet_compile(pool, "0123456789");
+    unsigned char data[] = {0xA5, 0x0F, 0xFF, 0x00, 0x81};
+    unsigned int counts[10] = {0};
+    char *result;
+    apr_size_t raw, n, i;
+
+    /* Power-of-two: MSB-first bit extraction, same output as before */
+    ASSERT_EQUAL(bin->bits, 1);
+    ASSERT_EQUAL(random_encoder_for(RANDOM_FORMAT_CUSTOM, bin), random_encode_custom_pow2_into);
+    result = random_encode_custom_alphabet(pool, data, 2, "01", 0);
+    ASSERT_STR_EQUAL(result, "1010010100001111");
+    result = random_encode_custom_alphabet(pool, data, 2, "01", 8);
+    ASSERT_STR_EQUAL(result, "10100101-00001111");
+
+    /* Crockford base32: 5 bytes -> exactly 8 symbols */
+    ASSERT_EQUAL(b32->bits, 5);
+    ASSERT_EQUAL(random_encoded_max_len(RANDOM_FORMAT_CUSTOM, 5, b32, 0), 8);
+    result = random_encode_custom_alphabet(pool, data, 5, b32->chars, 0);
+    ASSERT_STR_EQUAL(result, "MM7ZY041");
+
+    /* Non power of two: fixed length carrying at least 8 bits per byte */
+    ASSERT_EQUAL(dec->bits, 0);
+    ASSERT_EQUAL(dec->threshold, 250);
+    ASSERT_EQUAL(random_encoder_for(RANDOM_FORMAT_CUSTOM, dec), random_encode_custom_reject_into);
+    n = random_alphabet_symbols(dec, 16);
+    ASSERT_EQUAL(n, 39);   /* ceil(128 / log2(10)) */
+    raw = random_raw_len(RANDOM_FORMAT_CUSTOM, 16, dec);
+    ASSERT_TRUE(raw > n && raw <= RANDOM_RAW_MAX);
+
+    for (i = 0; i < 200; i++) {
+        result = random_generate_string_ex(pool, 16, RANDOM_FORMAT_CUSTOM, dec->chars, 0);
+        ASSERT_NOT_NULL(result);
+        ASSERT_EQUAL(strlen(result), n);
+        for (apr_size_t k = 0; k < n; k++) {
+            ASSERT_TRUE(result[k] >= '0' && result[k] <= '9');
+            counts[result[k] - '0']++;
+        }
+    }
+
+    /* 7800 symbols: each digit within 15% of the 780 expected (>5 sigma) */
+    for (i = 0; i < 10; i++) {
+        ASSERT_TRUE(counts[i] > 663 && counts[i] < 897);
+    }
+
+    /* Rejected bytes (>= 250) never produce output */
+    memset(data, 0xFF, sizeof(data));
+    ASSERT_EQUAL(strlen(random_encode_custom_alphabet(pool, data, 1, dec->chars, 0)),
+                 random_alphabet_symbols(dec, 1));
+}
+
+/*
+ * Test 35: Keyed per-thread HMAC contexts match one-shot HMAC across keys
+ */
+TEST(hmac_keyed_context) {
+    const char *keys[] = {"secret", "other-key", ""};
+    random_hmac_key *hkeys[3];
+    unsigned char digest[32];
+    char sig[RANDOM_SIGNATURE_HEX_LEN + 1];
+    int i, k;
+
+    ASSERT_EQUAL(random_thread_init(pool), APR_SUCCESS);
+    for (k = 0; k < 3; k++) {
+        hkeys[k] = random_hmac_key_create(pool, keys[k], strlen(keys[k]));
+        ASSERT_NOT_NULL(hkeys[k]);
+    }
+
+    /* Alternating keys forces the thread's context copy to be replaced */
+    for (i = 0; i < 12; i++) {
+        const char *payload = apr_psprintf(pool, "1700000600:payload-%d", i);
+
+        k = i % 3;
+        ASSERT_EQUAL(random_sign_into(sig, hkeys[k], RANDOM_MAC_HMAC_SHA256, payload, strlen(payload)),
+                     (apr_size_t)RANDOM_SIGNATURE_HEX_LEN);
+        sig[RANDOM_SIGNATURE_HEX_LEN] = '\0';
+
+        random_hmac_sha256(pool, keys[k], strlen(keys[k]), payload, strlen(payload), digest);
+        ASSERT_STR_EQUAL(sig, random_encode_hex(pool, digest, 32));
+    }
+
+    /* Repeated signatures with one key reuse the keyed state */
+    random_sign_into(sig, hkeys[0], RANDOM_MAC_HMAC_SHA256, "abc", 3);
+    random_hmac_sha256(pool, "secret", 6, "abc", 3, digest);
+    ASSERT_TRUE(strncmp(sig, random_encode_hex(pool, digest, 32), RANDOM_SIGNATURE_HEX_LEN) == 0);
+}
+
+/*
+ * Test 36: Signed token verification (shape, expiry before HMAC, signature)
+ */
+TEST(token_verify_signed) {
+    const random_mac_alg_t alg = RANDOM_MAC_HMAC_SHA256;
+    random_config cfg;
+    random_token_spec spec;
+    const random_token_plan *plan;
+    random_hmac_key *other;
+    unsigned char bytes[16];
+    apr_time_t now = apr_time_from_sec(1700000000);
+    char *token, *bare, *tampered;
+    apr_size_t len;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.length = RANDOM_LENGTH_UNSET;
+    cfg.format = RANDOM_FORMAT_UNSET;
+    cfg.include_timestamp = RANDOM_ENABLED_UNSET;
+    cfg.ttl_seconds = RANDOM_TTL_UNSET;
+    cfg.alphabet_grouping = RANDOM_GROUPING_UNSET;
+    cfg.expiry_seconds = 300;
+    cfg.encode_metadata = 1;
+    cfg.signing_key = "secret";
+    cfg.hmac_key = random_hmac_key_create(pool, "secret", 6);
+    cfg.prefix = "tk_";
+
+    memset(&spec, 0, sizeof(spec));
+    spec.var_name = "SIGNED";
+    spec.length = 16;
+    spec.format = RANDOM_FORMAT_BASE64URL;
+    spec.include_timestamp = RANDOM_ENABLED_UNSET;
+    spec.ttl_seconds = RANDOM_TTL_UNSET;
+    cfg.token_specs = spec_array(pool, &spec, 1);
+
+    random_plan_compile(pool, &cfg, NULL);
+    plan = &cfg.plans[0];
+    memset(bytes, 0x5a, sizeof(bytes));
+    token = apr_palloc(pool, plan->token_max);
+    len = random_plan_assemble(plan, token, bytes, now);
+
+    /* Valid until the expiry second, expired after */
+    ASSERT_EQUAL(random_token_verify(cfg.hmac_key, alg, token, "tk_", NULL, 16, now), RANDOM_VERIFY_VALID);
+    ASSERT_EQUAL(random_token_verify(cfg.hmac_key, alg, token, "tk_", NULL, 16, now + apr_time_from_sec(300)),
+                 RANDOM_VERIFY_VALID);
+    ASSERT_EQUAL(random_token_verify(cfg.hmac_key, alg, token, "tk_", NULL, 16, now + apr_time_from_sec(301)),
+                 RANDOM_VERIFY_EXPIRED);
+
+    /* Wrong key, missing prefix, missing token */
+    other = random_hmac_key_create(pool, "other", 5);
+    ASSERT_EQUAL(random_token_verify(other, alg, token, "tk_", NULL, 16, now), RANDOM_VERIFY_INVALID);
+    ASSERT_EQUAL(random_token_verify(NULL, alg, token, "tk_", NULL, 16, now), RANDOM_VERIFY_INVALID);
+    ASSERT_EQUAL(random_token_verify(cfg.hmac_key, alg, token + 3, "tk_", NULL, 16, now), RANDOM_VERIFY_INVALID);
+    ASSERT_EQUAL(random_token_verify(cfg.hmac_key, alg, NULL, NULL, NULL, 16, now), RANDOM_VERIFY_MISSING);
+    ASSERT_EQUAL(random_token_verify(cfg.hmac_key, alg, "", NULL, NULL, 16, now), RANDOM_VERIFY_MISSING);
+
+    /* Without a prefix to strip, with a suffix */
+    bare = token + 3;
+    ASSERT_EQUAL(random_token_verify(cfg.hmac_key, alg, bare, NULL, NULL, 16, now), RANDOM_VERIFY_VALID);
+    ASSERT_EQUAL(random_token_verify(cfg.hmac_key, alg, apr_pstrcat(pool, bare, "_s", NULL), NULL, "_s", 16, now),
+                 RANDOM_VERIFY_VALID);
+    ASSERT_EQUAL(random_token_verify(cfg.hmac_key, alg, bare, NULL, "_s", 16, now), RANDOM_VERIFY_INVALID);
+
+    /* Uppercase hex signature is the same signature */
+    tampered = apr_pstrdup(pool, bare);
+    for (char *c = tampered + strlen(tampered) - RANDOM_SIGNATURE_HEX_LEN; *c; c++) {
+        *c = (char)toupper((unsigned char)*c);
+    }
+    ASSERT_EQUAL(random_token_verify(cfg.hmac_key, alg, tampered, NULL, NULL, 16, now), RANDOM_VERIFY_VALID);
+
+    /* Any flipped payload, expiry or signature character breaks the MAC */
+    tampered = apr_pstrdup(pool, bare);
+    tampered[strlen("1700000300:") + 2] ^= 1;
+    ASSERT_EQUAL(random_token_verify(cfg.hmac_key, alg, tampered, NULL, NULL, 16, now), RANDOM_VERIFY_INVALID);
+    tampered = apr_pstrdup(pool, bare);
+    tampered[0] = '9';
+    ASSERT_EQUAL(random_token_verify(cfg.hmac_key, alg, tampered, NULL, NULL, 16, now), RANDOM_VERIFY_INVALID);
+    tampered = apr_pstrdup(pool, bare);
+    tampered[len - 4] = (tampered[len - 4] == '0') ? '1' : '0';
+    ASSERT_EQUAL(random_token_verify(cfg.hmac_key, alg, tampered, NULL, NULL, 16, now), RANDOM_VERIFY_INVALID);
+
+    /* Malformed shapes: never an HMAC, never valid */
+    ASSERT_EQUAL(random_token_verify(cfg.hmac_key, alg, "garbage", NULL, NULL, 16, now), RANDOM_VERIFY_INVALID);
+    ASSERT_EQUAL(random_token_verify(cfg.hmac_key, alg, apr_pstrcat(pool, "x", bare, NULL), NULL, NULL, 16, now),
+                 RANDOM_VERIFY_INVALID);
+    ASSERT_EQUAL(random_token_verify(cfg.hmac_key, alg,
+                 apr_pstrcat(pool, "1700000300::", bare + strlen(bare) - RANDOM_SIGNATURE_HEX_LEN, NULL),
+                 NULL, NULL, 16, now), RANDOM_VERIFY_INVALID);
+    ASSERT_EQUAL(random_token_verify(cfg.hmac_key, alg,
+                 apr_pstrcat(pool, "99999999999999999999:x:", bare + strlen(bare) - RANDOM_SIGNATURE_HEX_LEN, NULL),
+                 NULL, NULL, 16, now), RANDOM_VERIFY_INVALID);
+    tampered = apr_pstrdup(pool, bare);
+    tampered[len - 4] = 'g';
+    ASSERT_EQUAL(random_token_verify(cfg.hmac_key, alg, tampered, NULL, NULL, 16, now), RANDOM_VERIFY_INVALID);
+
+    ASSERT_STR_EQUAL(random_verify_result_name(RANDOM_VERIFY_EXPIRED), "expired");
+    ASSERT_STR_EQUAL(random_verify_result_name(RANDOM_VERIFY_MISSING), "missing");
+}
+
+/*
+ * Test 37: Compact signed tokens (binary blob, truncated MAC, base64url)
+ */
+TEST(token_compact_format) {
+    const random_mac_alg_t alg = RANDOM_MAC_HMAC_SHA256;
+    random_config cfg;
+    random_token_spec spec;
+    const random_token_plan *plan;
+    unsigned char bytes[16], blob[64];
+    apr_time_t now = apr_time_from_sec(1700000000);
+    char *token, *tampered;
+    apr_size_t len;
+    apr_ssize_t n;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.length = RANDOM_LENGTH_UNSET;
+    cfg.format = RANDOM_FORMAT_UNSET;
+    cfg.include_timestamp = RANDOM_ENABLED_UNSET;
+    cfg.ttl_seconds = RANDOM_TTL_UNSET;
+    cfg.alphabet_grouping = RANDOM_GROUPING_UNSET;
+    cfg.expiry_seconds = 300;
+    cfg.encode_metadata = 1;
+    cfg.signing_key = "secret";
+    cfg.hmac_key = random_hmac_key_create(pool, "secret", 6);
+    cfg.metadata_format = RANDOM_METADATA_COMPACT;
+    cfg.metadata_mac_length = RANDOM_COMPACT_MAC_DEFAULT;
+
+    memset(&spec, 0, sizeof(spec));
+    spec.var_name = "COMPACT";
+    spec.length = 16;
+    spec.format = RANDOM_FORMAT_HEX;   /* Ignored: the blob is always base64url */
+    spec.include_timestamp = RANDOM_ENABLED_UNSET;
+    spec.ttl_seconds = RANDOM_TTL_UNSET;
+    cfg.token_specs = spec_array(pool, &spec, 1);
+
+    random_plan_compile(pool, &cfg, NULL);
+    plan = &cfg.plans[0];
+    ASSERT_EQUAL(plan->compact_mac_len, 16);
+    ASSERT_EQUAL(plan->raw_length, (apr_size_t)16);
+
+    memset(bytes, 0xa7, sizeof(bytes));
+    token = apr_palloc(pool, plan->token_max);
+    len = random_plan_assemble(plan, token, bytes, now);
+
+    /* 6 + 16 + 16 bytes = 51 characters, versus 10 + 1 + 32 + 1 + 64 for text */
+    ASSERT_EQUAL(len, (apr_size_t)51);
+    ASSERT_TRUE(len < plan->token_max);
+    ASSERT_NULL(strchr(token, ':'));
+
+    n = random_decode_base64url_into(blob, token, len);
+    ASSERT_EQUAL(n, 38);
+    ASSERT_EQUAL(blob[0], RANDOM_COMPACT_VERSION);
+    ASSERT_EQUAL(blob[1], 16);
+    ASSERT_EQUAL(((apr_uint32_t)blob[2] << 24) | (blob[3] << 16) | (blob[4] << 8) | blob[5],
+                 (apr_uint32_t)1700000300);
+    ASSERT_TRUE(memcmp(blob + 6, bytes, 16) == 0);
+
+    ASSERT_EQUAL(random_token_verify(cfg.hmac_key, alg, token, NULL, NULL, 16, now), RANDOM_VERIFY_VALID);
+    ASSERT_EQUAL(random_token_verify(cfg.hmac_key, alg, token, NULL, NULL, 16, now + apr_time_from_sec(301)),
+                 RANDOM_VERIFY_EXPIRED);
+    ASSERT_EQUAL(random_token_verify(random_hmac_key_create(pool, "other", 5), alg, token, NULL, NULL, 16, now),
+                 RANDOM_VERIFY_INVALID);
+
+    /* A context expecting longer MACs refuses the 16-byte one */
+    ASSERT_EQUAL(random_token_verify(cfg.hmac_key, alg, token, NULL, NULL, 20, now), RANDOM_VERIFY_INVALID);
+
+    /* Flipping a random-part character breaks the MAC */
+    tampered = apr_pstrdup(pool, token);
+    tampered[12] = (tampered[12] == 'A') ? 'B' : 'A';
+    ASSERT_EQUAL(random_token_verify(cfg.hmac_key, alg, tampered, NULL, NULL, 16, now), RANDOM_VERIFY_INVALID);
+
+    /* Non-canonical base64url is rejected by the decoder */
+    ASSERT_EQUAL(random_decode_base64url_into(blob, "QQ", 2), 1);
+    ASSERT_EQUAL(random_decode_base64url_into(blob, "QR", 2), -1);
+    ASSERT_EQUAL(random_decode_base64url_into(blob, "Q", 1), -1);
+    ASSERT_EQUAL(random_decode_base64url_into(blob, "QQ==", 4), -1);
+    ASSERT_EQUAL(random_decode_base64url_into(blob, "-_8", 3), 2);
+    ASSERT_EQUAL(blob[0], 0xfb);
+    ASSERT_EQUAL(blob[1], 0xff);
+
+    /* Shorter truncated MAC, and the text format stays the default */
+    cfg.metadata_mac_length = 8;
+    random_plan_compile(pool, &cfg, NULL);
+    token = apr_palloc(pool, cfg.plans[0].token_max);
+    ASSERT_EQUAL(random_plan_assemble(&cfg.plans[0], token, bytes, now), (apr_size_t)40);
+    ASSERT_EQUAL(random_token_verify(cfg.hmac_key, alg, token, NULL, NULL, 8, now), RANDOM_VERIFY_VALID);
+
+    cfg.metadata_format = RANDOM_METADATA_TEXT;
+    random_plan_compile(pool, &cfg, NULL);
+    ASSERT_EQUAL(cfg.plans[0].compact_mac_len, 0);
+}
+
+/*
+ * Test 38: Alternative signing algorithms (known answers, ids, validation)
+ */
+TEST(signing_algorithms) {
+    random_hmac_key *hkey = random_hmac_key_create(pool, "secret", 6);
+    random_config cfg;
+    random_token_spec spec;
+    unsigned char bytes[16];
+    apr_time_t now = apr_time_from_sec(1700000000);
+    char sig[RANDOM_SIGNATURE_MAX + 1], *token;
+    apr_size_t len;
+    int alg, fmt;
+
+    ASSERT_NOT_NULL(hkey);
+    ASSERT_TRUE(random_hmac_key_supports(hkey, RANDOM_MAC_HMAC_SHA256));
+    ASSERT_TRUE(random_hmac_key_supports(hkey, RANDOM_MAC_AES_CMAC));
+
+    /* AES-256-CMAC keyed with HMAC-SHA256("secret", "mod_random aes-cmac") */
+    len = random_sign_into(sig, hkey, RANDOM_MAC_AES_CMAC, "1700000600:abc", 14);
+    sig[len] = '\0';
+    ASSERT_STR_EQUAL(sig, "2.1bae47f24dc074f2b8bc0a8703432e40");
+
+    /* Keyed BLAKE2s-256 with HMAC-SHA256("secret", "mod_random blake2s") */
+    if (random_hmac_key_supports(hkey, RANDOM_MAC_BLAKE2S)) {
+        len = random_sign_into(sig, hkey, RANDOM_MAC_BLAKE2S, "1700000600:abc", 14);
+        sig[len] = '\0';
+        ASSERT_STR_EQUAL(sig, "1.000b12475f63f5267c5ea8fff1111cbe55f36ae8815b022e3c790e77174b121b");
+    }
+
+    /* Every algorithm and format round-trips, and only under its own id */
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.length = RANDOM_LENGTH_UNSET;
+    cfg.format = RANDOM_FORMAT_UNSET;
+    cfg.include_timestamp = RANDOM_ENABLED_UNSET;
+    cfg.ttl_seconds = RANDOM_TTL_UNSET;
+    cfg.alphabet_grouping = RANDOM_GROUPING_UNSET;
+    cfg.expiry_seconds = 300;
+    cfg.encode_metadata = 1;
+    cfg.signing_key = "secret";
+    cfg.hmac_key = hkey;
+    cfg.metadata_mac_length = RANDOM_COMPACT_MAC_DEFAULT;
+
+    memset(&spec, 0, sizeof(spec));
+    spec.var_name = "ALG";
+    spec.length = 16;
+    spec.format = RANDOM_FORMAT_BASE64URL;
+    spec.include_timestamp = RANDOM_ENABLED_UNSET;
+    spec.ttl_seconds = RANDOM_TTL_UNSET;
+    cfg.token_specs = spec_array(pool, &spec, 1);
+    memset(bytes, 0x3c, sizeof(bytes));
+
+    for (fmt = RANDOM_METADATA_TEXT; fmt <= RANDOM_METADATA_COMPACT; fmt++) {
+        for (alg = 0; alg < RANDOM_MAC_ALG_COUNT; alg++) {
+            int other = (alg + 1) % RANDOM_MAC_ALG_COUNT;
+
+            if (!random_hmac_key_supports(hkey, (random_mac_alg_t)alg)) {
+                continue;
+            }
+            cfg.signing_alg = alg;
+            cfg.metadata_format = fmt;
+            random_plan_compile(pool, &cfg, NULL);
+            ASSERT_EQUAL(cfg.plans[0].mac_alg, (random_mac_alg_t)alg);
+
+            token = apr_palloc(pool, cfg.plans[0].token_max);
+            len = random_plan_assemble(&cfg.plans[0], token, bytes, now);
+            ASSERT_TRUE(len < cfg.plans[0].token_max);
+
+            ASSERT_EQUAL(random_token_verify(hkey, (random_mac_alg_t)alg, token, NULL, NULL, 16, now),
+                         RANDOM_VERIFY_VALID);
+            ASSERT_EQUAL(random_token_verify(hkey, (random_mac_alg_t)other, token, NULL, NULL, 16, now),
+                         RANDOM_VERIFY_INVALID);
+        }
+    }
+
+    /* The default stays HMAC-SHA256 with untagged signatures */
+    cfg.signing_alg = RANDOM_MAC_ALG_UNSET;
+    cfg.metadata_format = RANDOM_METADATA_TEXT;
+    random_plan_compile(pool, &cfg, NULL);
+    ASSERT_EQUAL(cfg.plans[0].mac_alg, RANDOM_MAC_HMAC_SHA256);
+}
+
+/*
+ * Test 39: Plan order - header plans, other eager plans, then lazy ones
+ */
+TEST(plan_compile_lazy_order) {
+    random_config cfg;
+    random_token_spec specs[4];
+    const char *names[] = {"LAZY1", "HDR", "LAZY2", "EAGER"};
+    int i;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.length = RANDOM_LENGTH_UNSET;
+    cfg.format = RANDOM_FORMAT_HEX;
+    cfg.include_timestamp = RANDOM_ENABLED_UNSET;
+
+    memset(specs, 0, sizeof(specs));
+    for (i = 0; i < 4; i++) {
+        specs[i].var_name = (char *)names[i];
+        specs[i].length = RANDOM_LENGTH_UNSET;
+        specs[i].format = RANDOM_FORMAT_UNSET;
+        specs[i].include_timestamp = RANDOM_ENABLED_UNSET;
+        specs[i].ttl_seconds = RANDOM_TTL_UNSET;
+        specs[i].eager = RANDOM_ENABLED_UNSET;
+        specs[i].output = RANDOM_OUTPUT_UNSET;
+    }
+    specs[1].header_name = "X-Hdr";
+    specs[2].eager = 0;
+    specs[3].eager = 1;
+    cfg.token_specs = spec_array(pool, specs, 4);
+
+    /* Lazy off: everything is generated in fixups, header tokens first */
+    cfg.lazy = RANDOM_ENABLED_UNSET;
+    random_plan_compile(pool, &cfg, NULL);
+    ASSERT_EQUAL(cfg.plan_count, 4);
+    ASSERT_EQUAL(cfg.header_count, 1);
+    ASSERT_EQUAL(cfg.eager_count, 4);
+    ASSERT_STR_EQUAL(cfg.plans[0].var_name, "HDR");
+    ASSERT_STR_EQUAL(cfg.plans[1].var_name, "LAZY1");
+    ASSERT_STR_EQUAL(cfg.plans[2].var_name, "LAZY2");
+    ASSERT_STR_EQUAL(cfg.plans[3].var_name, "EAGER");
+
+    /* Header tokens go to both tables by default, the others to the env only */
+    ASSERT_EQUAL(cfg.plans[0].output, RANDOM_OUTPUT_BOTH);
+    ASSERT_EQUAL(cfg.plans[1].output, RANDOM_OUTPUT_ENV);
+
+    /* Lazy on: header and eager=on tokens first, then the rest */
+    cfg.lazy = 1;
+    random_plan_compile(pool, &cfg, NULL);
+    ASSERT_EQUAL(cfg.plan_count, 4);
+    ASSERT_EQUAL(cfg.header_count, 1);
+    ASSERT_EQUAL(cfg.eager_count, 2);
+    ASSERT_STR_EQUAL(cfg.plans[0].var_name, "HDR");
+    ASSERT_STR_EQUAL(cfg.plans[1].var_name, "EAGER");
+    ASSERT_STR_EQUAL(cfg.plans[2].var_name, "LAZY1");
+    ASSERT_STR_EQUAL(cfg.plans[3].var_name, "LAZY2");
+    ASSERT_STR_EQUAL(cfg.plans[0].header_name, "X-Hdr");
+
+    /* output=header skips the environment */
+    specs[1].output = RANDOM_OUTPUT_HEADER;
+    random_plan_compile(pool, &cfg, NULL);
+    ASSERT_EQUAL(cfg.plans[0].output, RANDOM_OUTPUT_HEADER);
+}
+
+/*
+ * Test 40: RandomOnlyFor literals - anchors, escapes, regex fallback, '$' newline
+ */
+TEST(url_literal_patterns) {
+    random_url_matcher m;
+    random_url_literal lit;
+
+    ASSERT_TRUE(random_url_literal_parse(pool, "^/api/", &lit));
+    ASSERT_EQUAL(lit.kind, RANDOM_MATCH_PREFIX);
+    ASSERT_STR_EQUAL(lit.text, "/api/");
+    ASSERT_TRUE(random_url_literal_parse(pool, "^/v1\\.0/health$", &lit));
+    ASSERT_EQUAL(lit.kind, RANDOM_MATCH_EXACT);
+    ASSERT_STR_EQUAL(lit.text, "/v1.0/health");
+    ASSERT_TRUE(random_url_literal_parse(pool, "\\.php$", &lit));
+    ASSERT_EQUAL(lit.kind, RANDOM_MATCH_SUFFIX);
+    ASSERT_TRUE(random_url_literal_parse(pool, "/admin", &lit));
+    ASSERT_EQUAL(lit.kind, RANDOM_MATCH_CONTAINS);
+    ASSERT_TRUE(random_url_literal_parse(pool, "^/price\\$", &lit));
+    ASSERT_EQUAL(lit.kind, RANDOM_MATCH_PREFIX);   /* Escaped '$' is not an anchor */
+    ASSERT_STR_EQUAL(lit.text, "/price$");
+
+    /* Operators and character escapes need the regex engine */
+    ASSERT_TRUE(!random_url_literal_parse(pool, "^/api/v1/(protected|admin)/", &lit));
+    ASSERT_TRUE(!random_url_literal_parse(pool, "^/a.c", &lit));
+    ASSERT_TRUE(!random_url_literal_parse(pool, "^/user/\\d+$", &lit));
+    ASSERT_TRUE(!random_url_literal_parse(pool, "^/a\\", &lit));
+    ASSERT_TRUE(random_pattern_has_backref("^/(a)/\\1$"));
+    ASSERT_TRUE(!random_pattern_has_backref("^/a\\\\1$"));   /* Escaped backslash */
+
+    /* Any literal of the context may match */
+    memset(&m, 0, sizeof(m));
+    m.literals = apr_array_make(pool, 2, sizeof(random_url_literal));
+    random_url_literal_parse(pool, "^/api/", &lit);
+    APR_ARRAY_PUSH(m.literals, random_url_literal) = lit;
+    random_url_literal_parse(pool, "^/login$", &lit);
+    APR_ARRAY_PUSH(m.literals, random_url_literal) = lit;
+    ASSERT_TRUE(random_url_matcher_literals(&m, "/api/users"));
+    ASSERT_TRUE(random_url_matcher_literals(&m, "/login"));
+    ASSERT_TRUE(random_url_matcher_literals(&m, "/login\n"));   /* As PCRE '$' */
+    ASSERT_TRUE(!random_url_matcher_literals(&m, "/login/x"));
+    ASSERT_TRUE(!random_url_matcher_literals(&m, "/ap"));
+    ASSERT_TRUE(!random_url_matcher_literals(&m, "/v2/api/"));
+}
+
+/*
+ * Test 41: Prefill ring - bound by the first pop, filled by the producer thread
+ */
+TEST(prefill_ring) {
+    random_config cfg;
+    random_token_spec spec;
+    random_token_plan other;
+    random_prefill_stats st;
+    apr_pool_t *child;
+    char *tokens[8];
+    int rings, i, j, tries;
+
+    random_prefill_registry_reset(pool);
+    memset(&spec, 0, sizeof(spec));
+    spec.var_name = "PF_TOKEN";
+    spec.length = 16;
+    spec.format = RANDOM_FORMAT_HEX;
+    spec.include_timestamp = RANDOM_ENABLED_UNSET;
+    spec.ttl_seconds = RANDOM_TTL_UNSET;
+    spec.eager = RANDOM_ENABLED_UNSET;
+    spec.prefill = random_prefill_create(pool, spec.var_name, 8);
+    ASSERT_NOT_NULL(spec.prefill);
+    random_prefill_registry_close();
+    ASSERT_NULL(random_prefill_create(pool, "LATE", 8));   /* .htaccess case */
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.length = RANDOM_LENGTH_UNSET;
+    cfg.include_timestamp = RANDOM_ENABLED_UNSET;
+    cfg.token_specs = spec_array(pool, &spec, 1);
+    random_plan_compile(pool, &cfg, NULL);
+    ASSERT_TRUE(cfg.plans[0].prefill == spec.prefill);
+
+    apr_pool_create(&child, pool);
+    ASSERT_EQUAL(random_prefill_start(child, &rings), APR_SUCCESS);
+    ASSERT_EQUAL(rings, 1);
+
+    /* First pop binds the ring and asks for a refill */
+    ASSERT_NULL(random_prefill_pop(spec.prefill, &cfg.plans[0], pool));
+    for (tries = 0; tries < 200; tries++) {
+        random_prefill_stats_get(0, &st);
+        if (st.capacity && st.level == st.capacity) {
+            break;
+        }
+        apr_sleep(apr_time_from_msec(10));
+    }
+    ASSERT_EQUAL(random_prefill_count(), 1);
+    ASSERT_STR_EQUAL(st.name, "PF_TOKEN");
+    ASSERT_EQUAL(st.capacity, 8);
+    ASSERT_EQUAL(st.level, 8);
+
+    for (i = 0; i < 8; i++) {
+        tokens[i] = random_prefill_pop(spec.prefill, &cfg.plans[0], pool);
+        ASSERT_NOT_NULL(tokens[i]);
+        ASSERT_EQUAL(strlen(tokens[i]), 32);
+        for (j = 0; j < i; j++) {
+            ASSERT_STR_NOT_EQUAL(tokens[i], tokens[j]);
+        }
+    }
+
+    /* Another plan never gets the ring's tokens */
+    other = cfg.plans[0];
+    other.length = 24;
+    ASSERT_NULL(random_prefill_pop(spec.prefill, &other, pool));
+    random_prefill_stats_get(0, &st);
+    ASSERT_EQUAL(st.mismatched, 1);
+    ASSERT_EQUAL(st.served, 8);
+
+    /* Child exit stops the producer and wipes the ring */
+    apr_pool_destroy(child);
+    random_prefill_stats_get(0, &st);
+    ASSERT_EQUAL(st.capacity, 0);
+}
+
+/*
+ * Test 42: Statistics - slots per spec, thread counters published on flush
+ */
+TEST(stats_table) {
+    int owner_a, owner_b, a, b, slots;
+    random_stats_counters *local;
+    random_stats_entry e;
+    apr_uint64_t t0, t1;
+
+    /* Off by default: no table, nothing to count into */
+    random_stats_registry_reset(pool);
+    random_stats_register("OFF", &owner_a);
+    ASSERT_EQUAL(random_stats_shm_init(pool, &slots), APR_SUCCESS);
+    ASSERT_EQUAL(slots, 0);
+    ASSERT_NULL(random_stats_thread());
+
+    random_stats_registry_reset(pool);
+    random_stats_set_enabled(1);
+    a = random_stats_register("TOKEN_A", &owner_a);
+    b = random_stats_register("TOKEN_B", &owner_b);
+    ASSERT_EQUAL(a, 1);
+    ASSERT_EQUAL(b, 2);
+    random_stats_label(&owner_a, "www.example.com");
+    ASSERT_EQUAL(random_stats_shm_init(pool, &slots), APR_SUCCESS);
+    ASSERT_EQUAL(slots, 3);
+    ASSERT_EQUAL(random_stats_count(), 3);
+    ASSERT_EQUAL(random_stats_register("LATE", &owner_a), 0);   /* .htaccess case */
+
+    local = random_stats_thread();
+    ASSERT_NOT_NULL(local);
+    local[a].generated += 3;
+    local[a].entropy_bytes += 48;
+    local[b].cache_hits += 2;
+    local[0].prefill_hits++;
+
+    /* Nothing is shared until the thread publishes */
+    random_stats_get(a, &e);
+    ASSERT_EQUAL(e.counters.generated, 0);
+    random_stats_flush_thread();
+    random_stats_get(a, &e);
+    ASSERT_STR_EQUAL(e.name, "TOKEN_A");
+    ASSERT_STR_EQUAL(e.server, "www.example.com");
+    ASSERT_EQUAL(e.counters.generated, 3);
+    ASSERT_EQUAL(e.counters.entropy_bytes, 48);
+    ASSERT_EQUAL(local[a].generated, 0);
+    random_stats_get(b, &e);
+    ASSERT_STR_EQUAL(e.server, "");
+    ASSERT_EQUAL(e.counters.cache_hits, 2);
+    random_stats_get(0, &e);
+    ASSERT_STR_EQUAL(e.name, "(other)");
+    ASSERT_EQUAL(e.counters.prefill_hits, 1);
+
+    t0 = random_stats_clock();
+    t1 = random_stats_clock();
+    ASSERT_TRUE(t1 >= t0);
+
+    random_stats_registry_reset(pool);
+    ASSERT_NULL(random_stats_thread());
+}
+
+/* Replace the contents of a key file */
+static void write_key_file(const char *path, const char *contents)
+{
+    FILE *f = fopen(path, "w");
+
+    if (f) {
+        fputs(contents, f);
+        fclose(f);
+    }
+}
+
+/*
+ * Test 43: Key file rotation - key ids in tokens, reload keeps retired ids valid until removed
+ */
+TEST(keyring_rotation) {
+    const random_mac_alg_t alg = RANDOM_MAC_HMAC_SHA256;
+    random_config cfg;
+    random_token_spec specs[2];
+    random_keyring *kr;
+    const random_key_table *table;
+    apr_pool_t *conf;
+    unsigned char bytes[16], blob[64];
+    apr_time_t now = apr_time_from_sec(1700000000);
+    char path[] = "/tmp/mod_random_keysXXXXXX";
+    char *text, *compact, *rotated;
+    const char *error = NULL;
+    int fd, id = -1;
+
+    fd = mkstemp(path);
+    ASSERT_TRUE(fd >= 0);
+    close(fd);
+    write_key_file(path, "1 first\n# comment\n\n2\tsecond  \n");
+
+    apr_pool_create(&conf, pool);
+    random_keyring_registry_reset(conf);
+    kr = random_keyring_open(conf, path, &error);
+    ASSERT_NOT_NULL(kr);
+    ASSERT_TRUE(random_keyring_open(conf, path, &error) == kr);
+    table = random_keyring_acquire(kr);
+    ASSERT_EQUAL(random_key_table_count(table), 2);
+    ASSERT_NOT_NULL(random_key_table_signing(table, &id));
+    ASSERT_EQUAL(id, 2);
+    ASSERT_NULL(random_key_table_find(table, 3));
+    random_keyring_release(kr);
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.length = RANDOM_LENGTH_UNSET;
+    cfg.format = RANDOM_FORMAT_UNSET;
+    cfg.include_timestamp = RANDOM_ENABLED_UNSET;
+    cfg.ttl_seconds = RANDOM_TTL_UNSET;
+    cfg.alphabet_grouping = RANDOM_GROUPING_UNSET;
+    cfg.expiry_seconds = 300;
+    cfg.encode_metadata = 1;
+    cfg.keyring = kr;
+    cfg.metadata_mac_length = RANDOM_COMPACT_MAC_DEFAULT;
+
+    memset(specs, 0, sizeof(specs));
+    specs[0].var_name = "TEXT";
+    specs[0].length = 16;
+    specs[0].format = RANDOM_FORMAT_HEX;
+    specs[0].include_timestamp = RANDOM_ENABLED_UNSET;
+    specs[0].ttl_seconds = RANDOM_TTL_UNSET;
+    cfg.token_specs = spec_array(pool, specs, 1);
+    random_plan_compile(pool, &cfg, NULL);
+    ASSERT_NULL(cfg.plans[0].hmac_key);
+
+    /* Text tokens name the signing key before the signature */
+    memset(bytes, 0x3c, sizeof(bytes));
+    text = apr_palloc(pool, cfg.plans[0].token_max);
+    random_plan_assemble(&cfg.plans[0], text, bytes, now);
+    ASSERT_NOT_NULL(strstr(text, ":k02."));
+    ASSERT_EQUAL(random_token_verify_keyring(kr, alg, text, NULL, NULL, 16, now), RANDOM_VERIFY_VALID);
+    ASSERT_EQUAL(random_token_verify_keyring(kr, alg, text, NULL, NULL, 16, now + apr_time_from_sec(301)),
+                 RANDOM_VERIFY_EXPIRED);
+    ASSERT_EQUAL(random_token_verify_keyring(kr, alg, NULL, NULL, NULL, 16, now), RANDOM_VERIFY_MISSING);
+
+    /* Compact tokens carry it in a version 2 header */
+    cfg.metadata_format = RANDOM_METADATA_COMPACT;
+    random_plan_compile(pool, &cfg, NULL);
+    compact = apr_palloc(pool, cfg.plans[0].token_max);
+    random_plan_assemble(&cfg.plans[0], compact, bytes, now);
+    ASSERT_TRUE(random_decode_base64url_into(blob, compact, strlen(compact)) > RANDOM_COMPACT_KEYED_HEADER_LEN);
+    ASSERT_EQUAL(blob[0], RANDOM_COMPACT_VERSION_KEYED);
+    ASSERT_EQUAL(blob[2], 2);
+    ASSERT_EQUAL(random_token_verify_keyring(kr, alg, compact, NULL, NULL, 16, now), RANDOM_VERIFY_VALID);
+
+    /* Rotate: key 3 signs, key 2 still verifies, key 1 is gone */
+    write_key_file(path, "2 second\n3 third\n");
+    ASSERT_EQUAL(random_keyring_reload(kr, pool, 1, &error), 1);
+    ASSERT_NULL(error);
+    cfg.metadata_format = RANDOM_METADATA_TEXT;
+    random_plan_compile(pool, &cfg, NULL);
+    rotated = apr_palloc(pool, cfg.plans[0].token_max);
+    random_plan_assemble(&cfg.plans[0], rotated, bytes, now);
+    ASSERT_NOT_NULL(strstr(rotated, ":k03."));
+    ASSERT_EQUAL(random_token_verify_keyring(kr, alg, rotated, NULL, NULL, 16, now), RANDOM_VERIFY_VALID);
+    ASSERT_EQUAL(random_token_verify_keyring(kr, alg, text, NULL, NULL, 16, now), RANDOM_VERIFY_VALID);
+    ASSERT_EQUAL(random_token_verify_keyring(kr, alg, compact, NULL, NULL, 16, now), RANDOM_VERIFY_VALID);
+
+    /* Pointing the token at another listed key breaks the signature */
+    rotated[strlen(rotated) - RANDOM_SIGNATURE_HEX_LEN - 2] = '2';
+    ASSERT_EQUAL(random_token_verify_keyring(kr, alg, rotated, NULL, NULL, 16, now), RANDOM_VERIFY_INVALID);
+
+    /* Retire key 2: what it signed is no longer valid */
+    write_key_file(path, "3 third\n");
+    ASSERT_EQUAL(random_keyring_reload(kr, pool, 1, &error), 1);
+    ASSERT_EQUAL(random_token_verify_keyring(kr, alg, text, NULL, NULL, 16, now), RANDOM_VERIFY_INVALID);
+    ASSERT_EQUAL(random_token_verify_keyring(kr, alg, compact, NULL, NULL, 16, now), RANDOM_VERIFY_INVALID);
+
+    /* A broken file is reported and the current keys stay */
+    write_key_file(path, "3 third\n300 out-of-range\n");
+    ASSERT_EQUAL(random_keyring_reload(kr, pool, 1, &error), -1);
+    ASSERT_NOT_NULL(error);
+    table = random_keyring_acquire(kr);
+    ASSERT_EQUAL(random_key_table_count(table), 1);
+    ASSERT_NOT_NULL(random_key_table_find(table, 3));
+    random_keyring_release(kr);
+    ASSERT_EQUAL(random_keyring_reload(kr, pool, 0, &error), 0);
+
+    apr_pool_destroy(conf);
+    unlink(path);
+}
+
+/*
+ * Test 44: Identifier formats - uuid4/uuid7/ulid layout, request time, per-thread ordering
+ */
+TEST(identifier_formats) {
+    static const char crockford[] = "0123456789ABCDEFGHJKMNPQRSTVWXYZ";
+    unsigned char zeros[RANDOM_ID_RAW_LEN], ones[RANDOM_ID_RAW_LEN];
+    char out[RANDOM_UUID_LEN + 1], prev[RANDOM_UUID_LEN + 1];
+    apr_time_t t = apr_time_from_msec(APR_INT64_C(1645557742000));
+    random_config cfg;
+    random_token_spec spec;
+    const random_token_plan *plan;
+    char *token;
+    int i;
+
+    memset(zeros, 0, sizeof(zeros));
+    memset(ones, 0xff, sizeof(ones));
+    ASSERT_EQUAL(random_raw_len(RANDOM_FORMAT_ULID, 64, NULL), (apr_size_t)RANDOM_ID_RAW_LEN);
+    ASSERT_EQUAL(random_encoded_max_len(RANDOM_FORMAT_UUID7, 64, NULL, 0), (apr_size_t)RANDOM_UUID_LEN);
+    ASSERT_NULL(random_time_encoder_for(RANDOM_FORMAT_UUID4));
+
+    /* Version and variant bits over whatever random bytes */
+    out[random_encode_uuid4_into(out, ones, 16, NULL, 0)] = '\0';
+    ASSERT_STR_EQUAL(out, "ffffffff-ffff-4fff-bfff-ffffffffffff");
+    out[random_encode_uuid4_into(out, zeros, 16, NULL, 0)] = '\0';
+    ASSERT_STR_EQUAL(out, "00000000-0000-4000-8000-000000000000");
+
+    /* Millisecond first: the ULID spec and RFC 9562 example times (thread clock moves forward) */
+    out[random_encode_ulid_at(out, zeros, apr_time_from_msec(APR_INT64_C(1469918176385)))] = '\0';
+    ASSERT_STR_EQUAL(out, "01ARYZ6S410000000000000000");
+    out[random_encode_uuid7_at(out, zeros, t)] = '\0';
+    ASSERT_STR_EQUAL(out, "017f22e2-79b0-7000-8000-000000000000");
+
+    /* Same millisecond, or a clock stepping back: the counter keeps the order */
+    out[random_encode_uuid7_at(out, zeros, t)] = '\0';
+    ASSERT_STR_EQUAL(out, "017f22e2-79b0-7001-8000-000000000000");
+    out[random_encode_uuid7_at(out, zeros, t - apr_time_from_sec(1))] = '\0';
+    ASSERT_STR_EQUAL(out, "017f22e2-79b0-7002-8000-000000000000");
+    strcpy(prev, out);
+    for (i = 0; i < 5000; i++) {
+        random_encode_uuid7_at(out, ones, t);
+        ASSERT_TRUE(memcmp(prev, out, RANDOM_UUID_LEN) < 0);
+        memcpy(prev, out, RANDOM_UUID_LEN);
+    }
+    ASSERT_TRUE(memcmp(out, "017f22e2-79b1", 13) == 0);   /* Counter overflow borrowed the next ms */
+
+    /* Pool API reads the clock */
+    token = random_generate_string_ex(pool, 16, RANDOM_FORMAT_UUID4, NULL, 0);
+    ASSERT_EQUAL(strlen(token), RANDOM_UUID_LEN);
+    ASSERT_TRUE(token[8] == '-' && token[13] == '-' && token[18] == '-' && token[23] == '-');
+    ASSERT_TRUE(token[14] == '4' && strchr("89ab", token[19]) != NULL);
+    token = random_generate_string_ex(pool, 16, RANDOM_FORMAT_ULID, NULL, 0);
+    ASSERT_EQUAL(strlen(token), RANDOM_ULID_LEN);
+    ASSERT_EQUAL(strspn(token, crockford), RANDOM_ULID_LEN);
+    ASSERT_TRUE(token[0] <= '7');
+
+    /* Plans stamp the request time given to the assembly */
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.length = RANDOM_LENGTH_UNSET;
+    cfg.format = RANDOM_FORMAT_UNSET;
+    cfg.include_timestamp = RANDOM_ENABLED_UNSET;
+    cfg.ttl_seconds = RANDOM_TTL_UNSET;
+    cfg.alphabet_grouping = RANDOM_GROUPING_UNSET;
+    memset(&spec, 0, sizeof(spec));
+    spec.var_name = "REQUEST_ID";
+    spec.length = 64;   /* Ignored */
+    spec.format = RANDOM_FORMAT_UUID7;
+    spec.include_timestamp = RANDOM_ENABLED_UNSET;
+    spec.ttl_seconds = RANDOM_TTL_UNSET;
+    spec.prefix = "req-";
+    cfg.token_specs = spec_array(pool, &spec, 1);
+    random_plan_compile(pool, &cfg, NULL);
+    plan = &cfg.plans[0];
+    ASSERT_EQUAL(plan->raw_length, (apr_size_t)RANDOM_ID_RAW_LEN);
+    ASSERT_NOT_NULL(plan->encode_at);
+    token = apr_palloc(pool, plan->token_max);
+    ASSERT_EQUAL(random_plan_assemble(plan, token, ones, apr_time_from_msec(APR_INT64_C(1900000000000))),
+                 strlen("req-") + RANDOM_UUID_LEN);
+    ASSERT_STR_EQUAL(token, "req-01ba60d3-3800-77ff-bfff-ffffffffffff");
+}
+
+/*
+ * Test 45: Allocation trace - totals, per-token shares, sampling and histograms
+ */
+TEST(alloc_trace) {
+    random_alloc_trace trace;
+    const char *a = "A", *b = "B";
+    const char *line;
+    char *p;
+    int i, sampled = 0;
+
+    memset(&trace, 0, sizeof(trace));
+
+    /* One shared slice split between two tokens, one copy for B alone */
+    p = random_alloc_palloc(&trace, NULL, pool, 96);
+    ASSERT_NOT_NULL(p);
+    random_alloc_share(&trace, a, 40);
+    random_alloc_share(&trace, b, 56);
+    random_alloc_record(&trace, b, 33, 1);
+    random_alloc_record(NULL, b, 1000, 1);   /* Untraced request: ignored */
+
+    ASSERT_EQUAL(trace.total.bytes, 129);
+    ASSERT_EQUAL(trace.total.allocs, 2);
+    ASSERT_EQUAL(trace.count, 2);
+    ASSERT_EQUAL(trace.tokens[0].bytes, 40);
+    ASSERT_EQUAL(trace.tokens[0].allocs, 0);
+    ASSERT_EQUAL(trace.tokens[1].bytes, 89);
+    ASSERT_EQUAL(trace.tokens[1].allocs, 1);
+
+    line = random_alloc_trace_format(pool, &trace);
+    ASSERT_STR_EQUAL(line, "129 bytes in 2 allocations; A 40/0 B 89/1");
+
+    /* Off: requests are counted but never sampled */
+    random_alloc_trace_set_sample(0);
+    ASSERT_TRUE(!random_alloc_trace_finish(&trace));
+
+    /* One request in 4 is logged */
+    random_alloc_trace_set_sample(4);
+    for (i = 0; i < 8; i++) {
+        sampled += random_alloc_trace_finish(&trace);
+    }
+    ASSERT_TRUE(sampled == 2);
+
+    /* 129 bytes land in [128, 256), 2 allocations in [2, 4) */
+    line = random_alloc_histograms_format(pool);
+    ASSERT_NOT_NULL(strstr(line, "bytes <256:"));
+    ASSERT_NOT_NULL(strstr(line, "allocations <4:"));
+
+    random_alloc_trace_set_sample(0);
+}
+
+/*
+ * Test 46: Thread scratch buffer - lent once at a time, wiped on release, pool fallback
+ */
+TEST(scratch_buffer) {
+    unsigned char *buf, *again;
+    char *token, *colon;
+    unsigned char digest[32];
+    int i;
+
+    ASSERT_EQUAL(random_thread_init(pool), APR_SUCCESS);
+
+    buf = random_scratch_acquire(100);
+    ASSERT_NOT_NULL(buf);
+    ASSERT_NULL(random_scratch_acquire(10));   /* Already lent */
+    memset(buf, 0xAA, 100);
+    random_scratch_release(buf, 100);
+    for (i = 0; i < 100; i++) {
+        ASSERT_EQUAL(buf[i], 0);
+    }
+
+    /* Reused, grown on demand, capped */
+    again = random_scratch_acquire(50);
+    ASSERT_TRUE(again == buf);
+    random_scratch_release(again, 50);
+    again = random_scratch_acquire(RANDOM_SCRATCH_MAX);
+    ASSERT_NOT_NULL(again);
+    random_scratch_release(again, RANDOM_SCRATCH_MAX);
+    ASSERT_NULL(random_scratch_acquire(RANDOM_SCRATCH_MAX + 1));
+
+    /* Pool API: raw bytes in scratch, released after every call */
+    for (i = 0; i < 3; i++) {
+        token = random_generate_string_ex(pool, 32, RANDOM_FORMAT_CUSTOM, "0123456789", 0);
+        ASSERT_NOT_NULL(token);
+        ASSERT_EQUAL(strspn(token, "0123456789"), strlen(token));
+    }
+    buf = random_scratch_acquire(16);
+    ASSERT_NOT_NULL(buf);
+    random_scratch_release(buf, 16);
+
+    /* Signed metadata: the MAC covers the result's own prefix */
+    token = random_encode_with_metadata(pool, "abc", 60, "secret");
+    colon = strrchr(token, ':');
+    ASSERT_NOT_NULL(colon);
+    ASSERT_EQUAL(strlen(colon + 1), 64);
+    random_hmac_sha256(pool, "secret", 6, token, (apr_size_t)(colon - token), digest);
+    ASSERT_STR_EQUAL(colon + 1, random_encode_hex(pool, digest, 32));
+    ASSERT_TRUE(strncmp(colon - 4, ":abc", 4) == 0);
+}
+
+/*
+ * Test 47: RandomAddToken arguments parsed without httpd (as tests/fuzz drives them)
+ */
+TEST(token_spec_parse) {
+    random_token_spec spec;
+    int prefill = -1;
+
+    ASSERT_NULL(random_token_spec_parse(pool, "CSRF length=32 format=hex header=X-CSRF "
+                                        "ttl=60 prefill=8 prefix=c_", &spec, &prefill));
+    ASSERT_STR_EQUAL(spec.var_name, "CSRF");
+    ASSERT_EQUAL(spec.length, 32);
+    ASSERT_EQUAL(spec.format, RANDOM_FORMAT_HEX);
+    ASSERT_STR_EQUAL(spec.header_name, "X-CSRF");
+    ASSERT_EQUAL(spec.output, RANDOM_OUTPUT_UNSET);
+    ASSERT_EQUAL(spec.ttl_seconds, 60);
+    ASSERT_STR_EQUAL(spec.prefix, "c_");
+    ASSERT_EQUAL(prefill, 8);
+    ASSERT_NULL(spec.cache);     /* Left to the directive handler */
+    ASSERT_NULL(spec.prefill);
+
+    /* Unset fields keep their sentinels */
+    ASSERT_NULL(random_token_spec_parse(pool, "\tID\t", &spec, &prefill));
+    ASSERT_STR_EQUAL(spec.var_name, "ID");
+    ASSERT_EQUAL(spec.length, RANDOM_LENGTH_UNSET);
+    ASSERT_EQUAL((int)spec.format, RANDOM_FORMAT_UNSET);
+    ASSERT_EQUAL(spec.include_timestamp, RANDOM_ENABLED_UNSET);
+    ASSERT_EQUAL(spec.eager, RANDOM_ENABLED_UNSET);
+    ASSERT_EQUAL(prefill, 0);
+
+    /* Every rejection is a directive error */
+    ASSERT_NOT_NULL(random_token_spec_parse(pool, NULL, &spec, &prefill));
+    ASSERT_NOT_NULL(random_token_spec_parse(pool, " ", &spec, &prefill));
+    ASSERT_NOT_NULL(random_token_spec_parse(pool, "T length=0", &spec, &prefill));
+    ASSERT_NOT_NULL(random_token_spec_parse(pool, "T length=16x", &spec, &prefill));
+    ASSERT_NOT_NULL(random_token_spec_parse(pool, "T format=base32", &spec, &prefill));
+    ASSERT_NOT_NULL(random_token_spec_parse(pool, "T header", &spec, &prefill));
+    ASSERT_NOT_NULL(random_token_spec_parse(pool, "T colour=red", &spec, &prefill));
+    ASSERT_NOT_NULL(random_token_spec_parse(pool, "T output=env header=X", &spec, &prefill));
+    ASSERT_TRUE(strncmp(random_token_spec_parse(pool, "T output=both", &spec, &prefill),
+                        "RandomAddToken: ", 16) == 0);
+}
+
+/* Compile spec alone in a context with the given RandomPrefix and signing key */
+static void variant_context(apr_pool_t *pool, random_config *cfg, random_token_spec *spec,
+                            const char *prefix, random_hmac_key *key)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->length = RANDOM_LENGTH_UNSET;
+    cfg->format = RANDOM_FORMAT_UNSET;
+    cfg->include_timestamp = RANDOM_ENABLED_UNSET;
+    cfg->ttl_seconds = RANDOM_TTL_UNSET;
+    cfg->alphabet_grouping = RANDOM_GROUPING_UNSET;
+    cfg->expiry_seconds = key ? 300 : RANDOM_EXPIRY_UNSET;
+    cfg->encode_metadata = key ? 1 : RANDOM_ENABLED_UNSET;
+    cfg->hmac_key = key;
+    cfg->signing_alg = RANDOM_MAC_ALG_UNSET;
+    cfg->metadata_format = RANDOM_METADATA_FORMAT_UNSET;
+    cfg->prefix = (char *)prefix;
+    cfg->token_specs = spec_array(pool, spec, 1);
+    random_plan_compile(pool, cfg, NULL);
+}
+
+/* A request of the plan's context: the cached token, else a fresh one cached */
+static const char *serve_cached(apr_pool_t *pool, const random_token_plan *plan, apr_time_t now)
+{
+    unsigned char bytes[RANDOM_RAW_MAX];
+    char *token;
+    int refresh;
+
+    token = random_cache_lookup(plan->cache, pool, now, plan->ttl_seconds, &refresh);
+    if (token) {
+        return token;
+    }
+    random_fill_bytes(bytes, plan->raw_length);
+    token = apr_palloc(pool, plan->token_max);
+    random_plan_assemble(plan, token, bytes, now);
+    if (refresh) {
+        random_cache_store(plan->cache, token, now);
+    }
+    return token;
+}
+
+/*
+ * Test 48: Identical RandomAddToken lines of one server share one spec
+ */
+TEST(spec_registry_dedup) {
+    random_token_spec spec, other;
+    random_token_spec *first, *again;
+    int server_a, server_b;
+    int prefill, created;
+
+    ASSERT_NULL(random_token_spec_parse(pool, "CSRF length=32 ttl=60 prefix=c_", &spec, &prefill));
+
+    /* Closed (before pre_config, or for .htaccess): nothing is shared */
+    random_spec_registry_close();
+    ASSERT_NULL(random_spec_intern(pool, &spec, prefill, &server_a, &created));
+    ASSERT_EQUAL(created, 0);
+
+    random_spec_registry_reset(pool);
+    first = random_spec_intern(pool, &spec, prefill, &server_a, &created);
+    ASSERT_NOT_NULL(first);
+    ASSERT_EQUAL(created, 1);
+    ASSERT_STR_EQUAL(first->var_name, "CSRF");
+    first->ttl_seconds = 7;      /* Stands for the cache the directive handler adds */
+
+    /* Same definition, parsed again: the registered spec */
+    ASSERT_NULL(random_token_spec_parse(pool, "CSRF  prefix=c_ ttl=60 length=32", &other, &prefill));
+    again = random_spec_intern(pool, &other, prefill, &server_a, &created);
+    ASSERT_TRUE(again == first);
+    ASSERT_EQUAL(created, 0);
+    ASSERT_EQUAL(again->ttl_seconds, 7);
+
+    /* Another server, field or prefill= count: a spec of its own */
+    ASSERT_TRUE(random_spec_intern(pool, &other, prefill, &server_b, &created) != first);
+    ASSERT_EQUAL(created, 1);
+    ASSERT_NULL(random_token_spec_parse(pool, "CSRF length=32 ttl=61 prefix=c_", &other, &prefill));
+    ASSERT_TRUE(random_spec_intern(pool, &other, prefill, &server_a, &created) != first);
+    ASSERT_NULL(random_token_spec_parse(pool, "CSRF length=32 ttl=60 prefix=c_ prefill=4", &other, &prefill));
+    ASSERT_TRUE(random_spec_intern(pool, &other, prefill, &server_a, &created) != first);
+    ASSERT_NULL(random_token_spec_parse(pool, "CSRF length=32 ttl=60 prefix=c_x", &other, &prefill));
+    ASSERT_TRUE(random_spec_intern(pool, &other, prefill, &server_a, &created) != first);
+    ASSERT_EQUAL(created, 1);
+
+    random_spec_registry_close();
+}
+
+/*
+ * Test 49: One interned line in sections that differ only in RandomPrefix or
+ * signing serves each section its own token
+ */
+TEST(spec_registry_sections) {
+    random_token_spec spec, *shared;
+    random_config plain, prefixed, signed_cfg, plain_again;
+    random_hmac_key *key = random_hmac_key_create(pool, "secret", 6);
+    apr_time_t now = apr_time_now();
+    const char *token, *prefixed_token, *signed_token;
+    int server, prefill, created;
+
+    random_cache_registry_reset(pool);
+    random_spec_registry_reset(pool);
+
+    /* "RandomAddToken SESSION ttl=60" in four sections of one server */
+    ASSERT_NULL(random_token_spec_parse(pool, "SESSION ttl=60", &spec, &prefill));
+    shared = random_spec_intern(pool, &spec, prefill, &server, &created);
+    ASSERT_EQUAL(created, 1);
+    shared->cache = random_cache_create(pool, shared->var_name);
+    ASSERT_TRUE(random_spec_intern(pool, &spec, prefill, &server, &created) == shared);
+    ASSERT_EQUAL(created, 0);
+
+    variant_context(pool, &plain, shared, NULL, NULL);
+    variant_context(pool, &prefixed, shared, "x_", NULL);
+    variant_context(pool, &signed_cfg, shared, NULL, key);
+    variant_context(pool, &plain_again, shared, NULL, NULL);
+
+    token = serve_cached(pool, &plain.plans[0], now);
+    prefixed_token = serve_cached(pool, &prefixed.plans[0], now);
+    signed_token = serve_cached(pool, &signed_cfg.plans[0], now);
+
+    /* Each section gets a token of its own settings */
+    ASSERT_TRUE(strcmp(token, prefixed_token) != 0);
+    ASSERT_TRUE(strcmp(token, signed_token) != 0);
+    ASSERT_TRUE(strncmp(prefixed_token, "x_", 2) == 0);
+    ASSERT_TRUE(strncmp(token, "x_", 2) != 0);
+    ASSERT_NULL(strchr(token, ':'));
+    ASSERT_EQUAL(random_token_verify(key, RANDOM_MAC_HMAC_SHA256, signed_token, NULL, NULL,
+                                     RANDOM_COMPACT_MAC_MIN, now), RANDOM_VERIFY_VALID);
+
+    /* Sections that resolve the same token share it */
+    ASSERT_STR_EQUAL(serve_cached(pool, &plain_again.plans[0], now), token);
+    ASSERT_STR_EQUAL(serve_cached(pool, &prefixed.plans[0], now), prefixed_token);
+    ASSERT_STR_EQUAL(serve_cached(pool, &signed_cfg.plans[0], now), signed_token);
+
+    random_spec_registry_close();
+    random_cache_registry_reset(pool);
+}
+
+/*
+ * Test 50: A ttl= spec merged into contexts with other defaults gets one cache per variant
+ */
+TEST(ttl_cache_plan_variants) {
+    random_token_spec spec;
+    random_config plain, prefixed, signed_cfg, again, late;
+    random_hmac_key *key = random_hmac_key_create(pool, "secret", 6);
+    apr_time_t now = apr_time_now();
+    int prefill, refresh, slots;
+
+    random_cache_registry_reset(pool);
+    ASSERT_NULL(random_token_spec_parse(pool, "T ttl=60", &spec, &prefill));
+    spec.cache = random_cache_create(pool, "T");
+
+    /* Reading the config: the first variant claims the spec's cache */
+    variant_context(pool, &plain, &spec, NULL, NULL);
+    variant_context(pool, &prefixed, &spec, "x_", NULL);
+    variant_context(pool, &signed_cfg, &spec, NULL, key);
+    variant_context(pool, &again, &spec, NULL, NULL);
+    ASSERT_TRUE(plain.plans[0].cache == spec.cache);
+    ASSERT_TRUE(prefixed.plans[0].cache != spec.cache);
+    ASSERT_TRUE(signed_cfg.plans[0].cache != spec.cache);
+    ASSERT_TRUE(signed_cfg.plans[0].cache != prefixed.plans[0].cache);
+    ASSERT_TRUE(again.plans[0].cache == spec.cache);
+    ASSERT_TRUE(prefixed.plans[0].cache->slot >= 0);   /* Gets a shm slot too */
+
+    /* One context's token is never served to another */
+    ASSERT_NULL(random_cache_lookup(plain.plans[0].cache, pool, now, 60, &refresh));
+    random_cache_store(plain.plans[0].cache, "plain-token", now);
+    ASSERT_STR_EQUAL(random_cache_lookup(again.plans[0].cache, pool, now, 60, &refresh),
+                     "plain-token");
+    ASSERT_NULL(random_cache_lookup(prefixed.plans[0].cache, pool, now, 60, &refresh));
+    ASSERT_NULL(random_cache_lookup(signed_cfg.plans[0].cache, pool, now, 60, &refresh));
+
+    /* After post_config: known variants still resolve, a new one is uncached */
+    ASSERT_EQUAL(random_cache_shm_init(pool, &slots), APR_SUCCESS);
+    variant_context(pool, &again, &spec, "x_", NULL);
+    ASSERT_TRUE(again.plans[0].cache == prefixed.plans[0].cache);
+    variant_context(pool, &late, &spec, "late_", NULL);
+    ASSERT_NULL(late.plans[0].cache);
+    ASSERT_EQUAL(late.plans[0].ttl_seconds, 60);
+
+    /* A cache created at request time (.htaccess) serves its only context */
+    spec.cache = random_cache_create(pool, "T");
+    variant_context(pool, &late, &spec, "late_", NULL);
+    ASSERT_TRUE(late.plans[0].cache == spec.cache);
+
+    random_cache_registry_reset(pool);
+}
+
+/*
+ * Test 51: A MAC OpenSSL cannot compute leaves no token, never a zero signature
+ */
+TEST(signing_failure) {
+    random_hmac_key *hkey = random_hmac_key_create(pool, "secret", 6);
+    random_config cfg;
+    random_token_spec spec;
+    random_token_plan broken;
+    unsigned char bytes[16];
+    apr_time_t now = apr_time_from_sec(1700000000);
+    char sig[RANDOM_SIGNATURE_MAX + 1], *token;
+    int fmt;
+
+    /* No MAC for an algorithm the key was not loaded for: nothing written */
+    memset(sig, 'x', sizeof(sig));
+    ASSERT_EQUAL(random_sign_into(sig, hkey, RANDOM_MAC_ALG_COUNT, "abc", 3), 0);
+    ASSERT_EQUAL(sig[0], 'x');
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.length = RANDOM_LENGTH_UNSET;
+    cfg.format = RANDOM_FORMAT_UNSET;
+    cfg.include_timestamp = RANDOM_ENABLED_UNSET;
+    cfg.ttl_seconds = RANDOM_TTL_UNSET;
+    cfg.alphabet_grouping = RANDOM_GROUPING_UNSET;
+    cfg.expiry_seconds = 300;
+    cfg.encode_metadata = 1;
+    cfg.signing_key = "secret";
+    cfg.hmac_key = hkey;
+    cfg.signing_alg = RANDOM_MAC_ALG_UNSET;
+    cfg.prefix = "p_";
+
+    ASSERT_NULL(random_token_spec_parse(pool, "SIGNED length=16", &spec, &fmt));
+    cfg.token_specs = spec_array(pool, &spec, 1);
+    memset(bytes, 0x5a, sizeof(bytes));
+
+    /* Text and compact formats: assembly reports 0 and leaves out empty */
+    for (fmt = RANDOM_METADATA_TEXT; fmt <= RANDOM_METADATA_COMPACT; fmt++) {
+        cfg.metadata_format = fmt;
+        random_plan_compile(pool, &cfg, NULL);
+        token = apr_palloc(pool, cfg.plans[0].token_max);
+        ASSERT_TRUE(random_plan_assemble(&cfg.plans[0], token, bytes, now) > 0);
+
+        broken = cfg.plans[0];
+        broken.mac_alg = RANDOM_MAC_ALG_COUNT;   /* As if OpenSSL failed */
+        memset(token, 'x', broken.token_max);
+        ASSERT_EQUAL(random_plan_assemble(&broken, token, bytes, now), 0);
+        ASSERT_STR_EQUAL(token, "");
+    }
+}
+
+/*
+ * Test 52: RandomValidateToken prefix=/suffix= verify tokens with their own affixes
+ */
+TEST(validate_token_affixes) {
+    random_config cfg;
+    random_token_spec spec;
+    apr_array_header_t *warnings = apr_array_make(pool, 2, sizeof(const char *));
+    unsigned char bytes[16];
+    apr_time_t now = apr_time_from_sec(1700000000);
+    char *token;
+    int prefill;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.length = RANDOM_LENGTH_UNSET;
+    cfg.format = RANDOM_FORMAT_UNSET;
+    cfg.include_timestamp = RANDOM_ENABLED_UNSET;
+    cfg.ttl_seconds = RANDOM_TTL_UNSET;
+    cfg.alphabet_grouping = RANDOM_GROUPING_UNSET;
+    cfg.expiry_seconds = 300;
+    cfg.encode_metadata = 1;
+    cfg.signing_key = "secret";
+    cfg.hmac_key = random_hmac_key_create(pool, "secret", 6);
+    cfg.signing_alg = RANDOM_MAC_ALG_UNSET;
+    cfg.prefix = "p_";
+    cfg.validate = 1;
+    cfg.validate_var = RANDOM_VALIDATE_VAR_DEFAULT;
+
+    ASSERT_NULL(random_token_spec_parse(pool, "TOK length=16 prefix=t_ suffix=.x", &spec, &prefill));
+    cfg.token_specs = spec_array(pool, &spec, 1);
+    random_plan_compile(pool, &cfg, NULL);
+    token = apr_palloc(pool, cfg.plans[0].token_max);
+    memset(bytes, 0x3c, sizeof(bytes));
+    ASSERT_TRUE(random_plan_assemble(&cfg.plans[0], token, bytes, now) > 0);
+
+    /* The context's RandomPrefix does not match the token's: warned at startup */
+    ASSERT_NULL(random_config_check(&cfg, warnings));
+    ASSERT_EQUAL(warnings->nelts, 1);
+    ASSERT_EQUAL(random_token_verify(cfg.hmac_key, RANDOM_MAC_HMAC_SHA256, token,
+                                     cfg.prefix, cfg.suffix, 16, now), RANDOM_VERIFY_INVALID);
+
+    /* prefix=/suffix= on RandomValidateToken strip the token's own affixes */
+    cfg.validate_prefix = "t_";
+    cfg.validate_suffix = ".x";
+    apr_array_clear(warnings);
+    ASSERT_NULL(random_config_check(&cfg, warnings));
+    ASSERT_EQUAL(warnings->nelts, 0);
+    ASSERT_EQUAL(random_token_verify(cfg.hmac_key, RANDOM_MAC_HMAC_SHA256, token,
+                                     cfg.validate_prefix, cfg.validate_suffix, 16, now),
+                 RANDOM_VERIFY_VALID);
+}
+
 /*
  * Main test runner
  */
@@ -510,12 +2225,34 @@ int main(void) {
     RUN_TEST(token_uniqueness);
     RUN_TEST(random_generation_different);
     RUN_TEST(large_token_generation);
+    RUN_TEST(entropy_buffer_refill);
+    RUN_TEST(entropy_buffer_tokens);
 
     /* Run cryptography tests */
     printf("\n=== Cryptography Tests ===\n");
     RUN_TEST(hmac_sha256_basic);
     RUN_TEST(hmac_sha256_consistency);
     RUN_TEST(hmac_sha256_different_keys);
+    RUN_TEST(hmac_keyed_context);
+    RUN_TEST(token_verify_signed);
+    RUN_TEST(token_compact_format);
+    RUN_TEST(signing_algorithms);
+    RUN_TEST(keyring_rotation);
+
+    /* Run cache tests */
+    printf("\n=== TTL Cache Tests ===\n");
+    RUN_TEST(ttl_cache_refresh);
+    RUN_TEST(ttl_cache_concurrent);
+    RUN_TEST(ttl_cache_shm_backend);
+    RUN_TEST(plan_compile_defaults);
+    RUN_TEST(plan_assemble_signed);
+    RUN_TEST(simd_encoders_match_scalar);
+    RUN_TEST(alphabet_compiled_kernels);
+    RUN_TEST(identifier_formats);
+    RUN_TEST(alloc_trace);
+    RUN_TEST(scratch_buffer);
+    RUN_TEST(prefill_ring);
+    RUN_TEST(stats_table);
 
     /* Run APR infrastructure tests */
     printf("\n=== APR Infrastructure Tests ===\n");
@@ -528,6 +2265,14 @@ int main(void) {
     printf("\n=== Validation Tests ===\n");
     RUN_TEST(constants_validation);
     RUN_TEST(format_enum_values);
+    RUN_TEST(plan_compile_lazy_order);
+    RUN_TEST(url_literal_patterns);
+    RUN_TEST(token_spec_parse);
+    RUN_TEST(spec_registry_dedup);
+    RUN_TEST(spec_registry_sections);
+    RUN_TEST(ttl_cache_plan_variants);
+    RUN_TEST(signing_failure);
+    RUN_TEST(validate_token_affixes);
 
     /* Cleanup */
     apr_pool_destroy(test_pool);